@@ -200,6 +200,28 @@ static inline void list_head_remove(struct list_head* list,
 	item->prev = item;
 }
 
+/**
+ * \brief Move all entries of a list before the specified head.
+ * \param list the list.
+ * \param other list whose entries are moved, it is empty after the call.
+ * \note entries keep their order and are added after the existing ones.
+ */
+static inline void list_head_splice_tail(struct list_head* list,
+		struct list_head* other)
+{
+	if(other->next == other)
+	{
+		return;
+	}
+
+	other->next->prev = list->prev;
+	list->prev->next = other->next;
+	other->prev->next = list;
+	list->prev = other->prev;
+	other->next = other;
+	other->prev = other;
+}
+
 /**
  * \brief Return whether or not the list is empty.
  * \param list the list.
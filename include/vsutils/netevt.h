@@ -54,6 +54,23 @@
  */
 #define NETEVT_STATE_OTHER 4
 
+/**
+ * \def NETEVT_STATE_EDGE
+ * \brief Edge-triggered flag, socket is only notified when its state changes.
+ *
+ * Socket has to be read or written until EAGAIN before waiting again. Poll and
+ * select methods fall back to level-triggered notifications.
+ */
+#define NETEVT_STATE_EDGE 8
+
+/**
+ * \def NETEVT_STATE_ONESHOT
+ * \brief One-shot flag, socket is disabled after one notification.
+ *
+ * Socket is notified again only after it is rearmed with netevt_set_socket.
+ */
+#define NETEVT_STATE_ONESHOT 16
+
 /**
  * \typedef netevt
  * \brief Opaque type to define network event manager.
@@ -96,6 +113,16 @@ struct netevt_event
   int state; /**< Event state. */
 };
 
+/**
+ * \struct netevt_event_ptr
+ * \brief Network event without copy of the socket.
+ */
+struct netevt_event_ptr
+{
+  struct netevt_socket* ptr; /**< Pointer from the network manager. */
+  int state; /**< Event state. */
+};
+
 /**
  * \brief Returns whether or not the method is supported.
  * \param method method to test if supported.
@@ -171,6 +198,20 @@ int netevt_remove_all_sockets(netevt obj);
 int netevt_wait(netevt obj, int timeout, struct netevt_event* events,
     size_t nb_events);
 
+/**
+ * \brief Wait for network events without copying the sockets.
+ *
+ * Backends fill the array directly, each event is only the socket pointer
+ * and its state. The pointer is valid until the socket is removed.
+ * \param obj network event manager.
+ * \param timeout timeout in second or -1 for infinite.
+ * \param events allocated array of netevt_event_ptr.
+ * \param nb_events number of elements in events array.
+ * \return 0 if timeout, number of elements notified if success and -1 if error.
+ */
+int netevt_wait_ptr(netevt obj, int timeout, struct netevt_event_ptr* events,
+    size_t nb_events);
+
 /**
  * \brief Get number of sockets registered in the manager.
  * \param obj network event manager.
@@ -187,6 +228,15 @@ size_t netevt_get_nb_sockets(netevt obj);
  */
 struct netevt_socket* netevt_get_sockets(netevt obj, size_t* sockets_nb);
 
+/**
+ * \brief Find a registered socket by its descriptor.
+ * \param obj network event manager.
+ * \param sock socket descriptor.
+ * \return netevt_socket or NULL if descriptor is not registered.
+ * \note Lookup is done in constant time with a table indexed by descriptor.
+ */
+struct netevt_socket* netevt_get_socket(netevt obj, int sock);
+
 /**
  * \brief Returns list of netevt_socket.
  * \param obj network event manager.
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file netevt_group.h
+ * \brief Group of network event managers, each one run by its own thread.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_NETEVT_GROUP_H
+#define VSUTILS_NETEVT_GROUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "netevt.h"
+#include "util_net.h"
+#include "thread_affinity.h"
+
+/**
+ * \def NETEVT_GROUP_ANY
+ * \brief Shard index to let the group choose a shard (round-robin).
+ */
+#define NETEVT_GROUP_ANY SIZE_MAX
+
+/**
+ * \typedef netevt_group
+ * \brief Opaque type for group of network event managers.
+ */
+typedef struct netevt_group* netevt_group;
+
+/**
+ * \struct netevt_group_handler
+ * \brief Functions called by the shard threads.
+ *
+ * A shard owns its network event manager, only its thread may add, modify or
+ * remove sockets in it, which is what the functions below do.
+ */
+struct netevt_group_handler
+{
+  /**
+   * \brief Called with a new socket (accepted or handed off) by the thread of
+   * the shard that owns it. It usually adds the socket to nevt or closes it.
+   */
+  void (*accept)(netevt nevt, size_t shard, int sock, void* arg);
+
+  /**
+   * \brief Called for each event of a socket added to nevt. It may remove the
+   * notified socket but not another one as events are handled by batch.
+   */
+  void (*event)(netevt nevt, size_t shard, struct netevt_socket* sock,
+      int state, void* arg);
+
+  void* arg; /**< Argument passed to the functions. */
+};
+
+/**
+ * \brief Create a new group of network event managers.
+ * \param method method used by the network event managers.
+ * \param nb_shards number of shards, i.e. managers and threads.
+ * \return valid group or NULL if failure.
+ */
+netevt_group netevt_group_new(enum netevt_method method, size_t nb_shards);
+
+/**
+ * \brief Delete a group, stop it if needed.
+ * \param obj pointer on group.
+ * \note Listening sockets are closed as well as sockets not yet handed to
+ * their shard, sockets added by the accept function are not.
+ */
+void netevt_group_free(netevt_group* obj);
+
+/**
+ * \brief Listen with one socket shared by the shards.
+ * \param obj group.
+ * \param sock listening socket, it is set non-blocking and owned by the group.
+ * \return 0 if success, -1 otherwise (errno is set to EBUSY if group is
+ * started).
+ * \note Shard 0 accepts connections and hands them off round-robin.
+ */
+int netevt_group_listen(netevt_group obj, int sock);
+
+/**
+ * \brief Listen with one SO_REUSEPORT socket per shard.
+ * \param obj group.
+ * \param af address family.
+ * \param addr address or FQDN name.
+ * \param port port to bind, not 0 since the shards have to share it.
+ * \param backlog maximum length of pending connections queue.
+ * \return 0 if success, -1 otherwise (errno is set to EINVAL if port is 0,
+ * EBUSY if group is started or ENOSYS if SO_REUSEPORT is not supported).
+ * \note The kernel balances connections between the listeners, each shard
+ * accepts its own connections without handoff.
+ */
+int netevt_group_listen_reuseport(netevt_group obj, enum address_family af,
+    const char* addr, uint16_t port, int backlog);
+
+/**
+ * \brief Start the shard threads.
+ * \param obj group.
+ * \param handler functions called by the shard threads, it is copied.
+ * \param affinity CPU affinity of the shard threads, NULL pins shard i to
+ * core (i % number of cores) if the system supports it.
+ * \return 0 if success, -1 otherwise (errno is set to EBUSY if group is
+ * already started or EINVAL if handler is NULL).
+ */
+int netevt_group_start(netevt_group obj,
+    const struct netevt_group_handler* handler,
+    const struct thread_affinity* affinity);
+
+/**
+ * \brief Stop the shard threads and wait for them.
+ * \param obj group.
+ * \return 0 if success, -1 otherwise.
+ * \warning Do not call it from a shard thread.
+ */
+int netevt_group_stop(netevt_group obj);
+
+/**
+ * \brief Hand a socket off to a shard.
+ * \param obj group.
+ * \param shard shard index or NETEVT_GROUP_ANY.
+ * \param sock socket descriptor, owned by the group until the accept function
+ * of the shard is called with it.
+ * \return index of the shard if success, -1 otherwise.
+ * \note Thread-safe, the shard thread is woken up through its wakeup
+ * descriptor.
+ */
+int netevt_group_handoff(netevt_group obj, size_t shard, int sock);
+
+/**
+ * \brief Get the number of shards.
+ * \param obj group.
+ * \return number of shards.
+ */
+size_t netevt_group_size(netevt_group obj);
+
+/**
+ * \brief Get the network event manager of a shard.
+ * \param obj group.
+ * \param shard shard index.
+ * \return network event manager or NULL if shard is not valid.
+ * \warning Only the shard thread may use it while group is started.
+ */
+netevt netevt_group_get(netevt_group obj, size_t shard);
+
+#endif /* VSUTILS_NETEVT_GROUP_H */
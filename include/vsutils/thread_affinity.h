@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file thread_affinity.h
+ * \brief CPU affinity of worker threads.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_THREAD_AFFINITY_H
+#define VSUTILS_THREAD_AFFINITY_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * \enum thread_affinity_policy
+ * \brief Placement policy of worker threads.
+ */
+enum thread_affinity_policy
+{
+  THREAD_AFFINITY_NONE = 0, /**< Workers run on any CPU. */
+  THREAD_AFFINITY_CPUS, /**< Worker i is pinned to cpus[i % nb_cpus]. */
+  THREAD_AFFINITY_NODES, /**< Worker i is pinned to all CPUs of NUMA node
+                           (i % number of nodes). */
+};
+
+/**
+ * \struct thread_affinity
+ * \brief CPU affinity of the workers of a thread pool or dispatcher.
+ *
+ * Workers are pinned when they are created so that the memory they first
+ * touch (stack, per-worker queues) is allocated on their NUMA node.
+ */
+struct thread_affinity
+{
+  enum thread_affinity_policy policy; /**< Placement policy. */
+  const unsigned int* cpus; /**< CPUs for THREAD_AFFINITY_CPUS. */
+  size_t nb_cpus; /**< Number of elements of cpus array. */
+};
+
+/**
+ * \brief Initialize an affinity that does not pin workers.
+ * \param obj affinity to initialize.
+ */
+void thread_affinity_init(struct thread_affinity* obj);
+
+/**
+ * \brief Set the CPU affinity of a worker in thread attributes.
+ * \param obj affinity.
+ * \param index index of the worker.
+ * \param attr thread attributes used to create the worker.
+ * \return 0 if success, -1 otherwise (errno is set to ENOSYS if the system
+ * cannot pin threads or EINVAL if affinity is not valid).
+ * \note Nothing is done for THREAD_AFFINITY_NONE or for
+ * THREAD_AFFINITY_NODES on a system with one node.
+ */
+int thread_affinity_attr_set(const struct thread_affinity* obj, size_t index,
+    pthread_attr_t* attr);
+
+/**
+ * \brief Pin the calling thread as a worker.
+ * \param obj affinity.
+ * \param index index of the worker.
+ * \return 0 if success, -1 otherwise (errno is set to ENOSYS if the system
+ * cannot pin threads or EINVAL if affinity is not valid).
+ */
+int thread_affinity_set(const struct thread_affinity* obj, size_t index);
+
+#endif /* VSUTILS_THREAD_AFFINITY_H */
@@ -26,6 +26,8 @@
 
 #include <stdint.h>
 #include "list.h"
+#include "thread_affinity.h"
+#include "thread_stats.h"
 
 /**
  * \typedef thread_dispatcher
@@ -62,8 +64,111 @@ struct thread_dispatcher_task
    * \brief For list management.
    */
   struct list_head list;
+
+  /**
+   * \brief Reserved for internal use.
+   */
+  unsigned int flags;
+
+  /**
+   * \brief Reserved for internal use.
+   */
+  uint64_t enqueued;
+
+  /**
+   * \brief Reserved for internal use.
+   */
+  uint32_t color;
+
+  /**
+   * \brief Reserved for internal use (link in the queue of a worker).
+   */
+  _Atomic(struct thread_dispatcher_task*) next;
+};
+
+/**
+ * \enum thread_dispatcher_spread
+ * \brief How thread_dispatcher_push_random() selects a worker.
+ */
+enum thread_dispatcher_spread
+{
+  THREAD_DISPATCHER_SPREAD_ROUND_ROBIN, /**< Round robin per producer. */
+  THREAD_DISPATCHER_SPREAD_TWO_CHOICES, /**< Shorter queue of two random. */
+  THREAD_DISPATCHER_SPREAD_LEAST_LOADED, /**< Shortest queue. */
 };
 
+/**
+ * \struct thread_dispatcher_config
+ * \brief Configuration of a thread dispatcher.
+ *
+ * Always initialize it with thread_dispatcher_config_init() before modifying
+ * the members you are interested in.\n
+ * An idle worker spins for up to spin microseconds, then yields the processor
+ * yield times before it parks. The spin time adapts to how often spinning
+ * finds a task and producers only wake parked workers.\n
+ * With the stats member set, workers measure busy and idle times and task
+ * latencies at the cost of about two clock reads per task, other counters
+ * are always maintained.\n
+ * The map function binds a color to a worker, it has to return a value
+ * lower than nb_threads and always the same one for a color. With the
+ * rebalance member set, a color that has no queued or running task is
+ * bound again on its next task: to its mapped worker, or to the least
+ * loaded one if the mapped worker has at least rebalance_threshold more
+ * queued tasks. Tasks of a color are then never queued on two workers at
+ * the same time, at the cost of a lookup in a striped table on each push
+ * and at the end of each task.\n
+ * A running task can yield with thread_dispatcher_yield() so that the tasks
+ * queued behind it run first. With the budget member set, a worker that has
+ * had queued tasks for longer than budget microseconds hands the colors of
+ * the tasks it has popped to idle workers, as long as these tasks are the
+ * only queued ones of their color. It uses the color table like rebalance
+ * but, without rebalance, only colors of a busy worker move.
+ */
+struct thread_dispatcher_config
+{
+  size_t nb_threads; /**< Number of worker threads. */
+  unsigned int spin; /**< Time (us) an idle worker spins before parking. */
+  unsigned int yield; /**< Yields of an idle worker before parking. */
+  struct thread_affinity affinity; /**< CPU affinity of the workers. */
+  int stats; /**< Whether or not workers measure times for statistics. */
+  size_t (*map)(uint32_t, size_t, void*); /**< Color to worker mapping. */
+  void* map_data; /**< Last argument of the map function. */
+  int rebalance; /**< Whether or not idle colors move to idle workers. */
+  size_t rebalance_threshold; /**< Queue depth gap to move a color. */
+  enum thread_dispatcher_spread spread; /**< Selection of push_random. */
+  unsigned int budget; /**< Busy time (us) before colors move, 0 never. */
+};
+
+/**
+ * \brief Map a color to a worker with a modulo (default mapping).
+ * \param color color of the task.
+ * \param nb number of workers.
+ * \param data unused.
+ * \return worker index.
+ */
+size_t thread_dispatcher_map_modulo(uint32_t color, size_t nb, void* data);
+
+/**
+ * \brief Map a color to a worker with a jump consistent hash.
+ *
+ * Colors are spread evenly even when they share a common stride with the
+ * number of workers, and only 1/nb of the colors move when a worker is
+ * added.
+ * \param color color of the task.
+ * \param nb number of workers.
+ * \param data unused.
+ * \return worker index.
+ */
+size_t thread_dispatcher_map_jump(uint32_t color, size_t nb, void* data);
+
+/**
+ * \brief Initialize a configuration with default values.
+ * \param config configuration to initialize.
+ * \param nb number of threads.
+ */
+void thread_dispatcher_config_init(struct thread_dispatcher_config* config,
+    size_t nb);
+
 /**
  * \brief Create a new thread dispatcher with "nb" worker thread.
  * \param nb number of threads to launch.
@@ -71,6 +176,17 @@ struct thread_dispatcher_task
  */
 thread_dispatcher thread_dispatcher_new(size_t nb);
 
+/**
+ * \brief Create a new thread dispatcher from a configuration.
+ * \param config configuration.
+ * \return new thread dispatcher or NULL if failure.
+ * \note Worker i is pinned according to the affinity policy when it is
+ * created, then allocates and initializes its own queue state so that it
+ * lives on the NUMA node of the worker.
+ */
+thread_dispatcher thread_dispatcher_new_config(
+    const struct thread_dispatcher_config* config);
+
 /**
  * \brief Delete a thread dispatcher.
  * \param obj pointer on thread_dispatcher.
@@ -93,6 +209,13 @@ int thread_dispatcher_stop(thread_dispatcher obj);
 
 /**
  * \brief Push a task to be dispatch to random thread.
+ *
+ * The worker is selected according to the spread member of the
+ * configuration. Producers only write their own selection state, queue
+ * depths are read without lock:
+ * - round robin costs nothing but ignores the load;
+ * - two choices reads two queue depths and avoids most hot spots;
+ * - least loaded reads every queue depth.
  * \param obj thread dispatcher.
  * \param task task to be pushed, task members will be copied so if task is
  * allocated, you can delete it after the call.
@@ -113,13 +236,89 @@ int thread_dispatcher_push_random(thread_dispatcher obj,
 int thread_dispatcher_push(thread_dispatcher obj,
     struct thread_dispatcher_task* task, uint32_t color);
 
+/**
+ * \brief Push several tasks at once.
+ *
+ * Tasks are pushed by chunks of 64, each target worker queue is updated
+ * once per chunk. Tasks with the same color keep their order.
+ * \param obj thread dispatcher.
+ * \param tasks array of tasks to be pushed, task members will be copied.
+ * \param colors array of colors, one for each task.
+ * \param n number of tasks.
+ * \return 0 if success, -1 on failure.
+ * \note On failure, the chunks before the failing one are already pushed.
+ */
+int thread_dispatcher_push_batch(thread_dispatcher obj,
+    struct thread_dispatcher_task* tasks, const uint32_t* colors, size_t n);
+
+/**
+ * \brief Push a task to specific thread determined by "color" without
+ * copying it.
+ * \param obj thread dispatcher.
+ * \param task task to be pushed. Its storage is owned by the caller and has
+ * to remain valid until a worker starts it, it is safe to release it from the
+ * run or cleanup function.
+ * \param color task with same "color" will never run concurrently.
+ * \return 0 if success, -1 on failure.
+ */
+int thread_dispatcher_push_task(thread_dispatcher obj,
+    struct thread_dispatcher_task* task, uint32_t color);
+
+/**
+ * \brief Yield the worker from a running task.
+ *
+ * Once the run function of the task returns, a continuation with the same
+ * data, cleanup function and color is pushed at the back of the queue of
+ * the worker, behind the tasks of other colors, and the cleanup function
+ * is deferred to the end of the continuation. Tasks of the color still
+ * never run concurrently.
+ * \param obj thread dispatcher.
+ * \param run run function of the continuation, NULL to run the same
+ * function again.
+ * \return 0 if success, -1 on failure (errno set to EPERM if not called
+ * from the run function of a task of obj).
+ * \note Calling it again from the same run function only replaces the run
+ * function of the continuation.
+ */
+int thread_dispatcher_yield(thread_dispatcher obj, void (*run)(void*));
+
+/**
+ * \brief Get a snapshot of the statistics of the workers.
+ *
+ * Times and latency histograms stay empty if the dispatcher has been created
+ * with the stats member of its configuration set to 0.
+ * \param obj thread dispatcher.
+ * \return snapshot to free with thread_stats_free() or NULL if failure.
+ */
+struct thread_stats* thread_dispatcher_stats(thread_dispatcher obj);
+
 /**
  * \brief Clean all tasks of the thread dispatcher.
  * \param obj thread dispatcher.
  * \return 0 if success, -1 otherwise.
- * \note Call only this function when thread dispatcher is stopped.
+ * \note Call only this function when thread dispatcher is stopped. Tasks
+ * pushed while it runs may be kept. Cleanup functions of the tasks are not
+ * called, see thread_dispatcher_drain().
  */
 int thread_dispatcher_clean(thread_dispatcher obj);
 
+/**
+ * \brief Drain the thread dispatcher before a shutdown.
+ *
+ * The dispatcher refuses tasks from threads other than its workers (push
+ * fails with errno set to ESHUTDOWN), waits for the queued and running
+ * tasks to finish, then stops. Tasks still queued at that time are
+ * discarded after their cleanup function has been called.
+ * thread_dispatcher_start() accepts tasks again.
+ * \param obj thread dispatcher.
+ * \param timeout maximum time (ms) to wait, -1 for infinite and 0 to only
+ * discard the queued tasks. The dispatcher does not wait if it is stopped.
+ * \return number of tasks that had not finished when the wait ended (0 if
+ * the dispatcher has been drained), -1 on failure.
+ * \note Tasks running when the timeout expires finish on their own, after
+ * the function has returned.
+ */
+int thread_dispatcher_drain(thread_dispatcher obj, int timeout);
+
 #endif /* VSUTILS_THREAD_DISPATCHER_H */
 
@@ -24,7 +24,12 @@
 #ifndef VSUTILS_THREAD_POOL_H
 #define VSUTILS_THREAD_POOL_H
 
+#include <stdint.h>
+#include <time.h>
+
 #include "list.h"
+#include "thread_affinity.h"
+#include "thread_stats.h"
 
 /**
  * \typedef thread_pool
@@ -32,6 +37,12 @@
  */
 typedef struct thread_pool* thread_pool;
 
+/**
+ * \typedef thread_pool_future
+ * \brief Opaque type for the completion handle of a task.
+ */
+typedef struct thread_pool_future* thread_pool_future;
+
 /**
  * \struct thread_pool_task
  * \brief Task for the thread pool.
@@ -47,8 +58,77 @@ struct thread_pool_task
   void (*run)(void*); /**< Run function. */
   void (*cleanup)(void*); /**< Cleanup function. */
   struct list_head list; /**< For list management. */
+  unsigned int flags; /**< Reserved for internal use. */
+  uint64_t enqueued; /**< Reserved for internal use. */
+};
+
+/**
+ * \enum thread_pool_queue
+ * \brief Queue backend used to store pending tasks.
+ */
+enum thread_pool_queue
+{
+  THREAD_POOL_QUEUE_LIST, /**< Unbounded list protected by a mutex. */
+  THREAD_POOL_QUEUE_RING, /**< Bounded lock-free ring of tasks. */
+  THREAD_POOL_QUEUE_STEAL /**< Per-worker deques with work-stealing. */
+};
+
+/**
+ * \enum thread_pool_priority
+ * \brief Priority class of a task.
+ */
+enum thread_pool_priority
+{
+  THREAD_POOL_PRIORITY_HIGH, /**< Latency-critical tasks. */
+  THREAD_POOL_PRIORITY_NORMAL, /**< Default class. */
+  THREAD_POOL_PRIORITY_BACKGROUND /**< Bulk tasks. */
 };
 
+/**
+ * \struct thread_pool_config
+ * \brief Configuration of a thread pool.
+ *
+ * Always initialize it with thread_pool_config_init() before modifying the
+ * members you are interested in.\n
+ * If max_threads is greater than nb_threads, the pool is elastic: it starts
+ * nb_threads workers and spawns new ones up to max_threads when no worker is
+ * idle and either spawn_depth tasks are pending or no task has been started
+ * for spawn_wait milliseconds. Extra workers exit once they have been idle
+ * for keepalive milliseconds.\n
+ * An idle worker spins for up to spin microseconds, then yields the processor
+ * yield times before it parks. The spin time adapts to how often spinning
+ * finds a task and producers only wake parked workers.\n
+ * With the stats member set, workers measure busy and idle times and task
+ * latencies at the cost of about two clock reads per task, other counters
+ * are always maintained.\n
+ * The affinity member pins worker of slot i (0 to max_threads - 1) according
+ * to its policy. With THREAD_POOL_QUEUE_STEAL, the deques of the nb_threads
+ * initial workers are allocated by the pinned workers themselves.
+ */
+struct thread_pool_config
+{
+  size_t nb_threads; /**< Number of worker threads (minimum if elastic). */
+  enum thread_pool_queue queue; /**< Queue backend. */
+  size_t ring_size; /**< Number of slots for THREAD_POOL_QUEUE_RING. */
+  size_t deque_size; /**< Slots per worker for THREAD_POOL_QUEUE_STEAL. */
+  size_t pop_batch; /**< Tasks a worker pops per lock (list, max 64). */
+  size_t max_threads; /**< Maximum number of worker threads. */
+  size_t spawn_depth; /**< Pending tasks that trigger a new worker. */
+  unsigned int spawn_wait; /**< Time (ms) without progress for new worker. */
+  unsigned int keepalive; /**< Time (ms) before an extra idle worker exits. */
+  unsigned int spin; /**< Time (us) an idle worker spins before parking. */
+  unsigned int yield; /**< Yields of an idle worker before parking. */
+  struct thread_affinity affinity; /**< CPU affinity of the workers. */
+  int stats; /**< Whether or not workers measure times for statistics. */
+};
+
+/**
+ * \brief Initialize a configuration with default values.
+ * \param config configuration to initialize.
+ * \param nb number of threads.
+ */
+void thread_pool_config_init(struct thread_pool_config* config, size_t nb);
+
 /**
  * \brief Create a new thread pool.
  * \param nb number of threads to launcher.
@@ -56,6 +136,20 @@ struct thread_pool_task
  */
 thread_pool thread_pool_new(size_t nb);
 
+/**
+ * \brief Create a new thread pool from a configuration.
+ * \param config configuration.
+ * \return new thread pool or NULL if failure.
+ * \note With THREAD_POOL_QUEUE_RING, the ring size is rounded up to a power
+ * of two and thread_pool_push() fails with errno set to EAGAIN when the ring
+ * is full.
+ * \note With THREAD_POOL_QUEUE_STEAL, tasks pushed from a task running in
+ * the pool go to the local deque of the current worker (or to the shared
+ * queue if the deque is full), other tasks go to the shared queue. Idle
+ * workers steal tasks from the other workers.
+ */
+thread_pool thread_pool_new_config(const struct thread_pool_config* config);
+
 /**
  * \brief Delete a thread pool.
  * \param obj pointer on thread_pool.
@@ -85,13 +179,208 @@ int thread_pool_stop(thread_pool obj);
  */
 int thread_pool_push(thread_pool obj, struct thread_pool_task* task);
 
+/**
+ * \brief Push a task to the thread pool with a priority and a deadline.
+ *
+ * Workers run tasks of higher classes first but a lower class is still
+ * served once in a while so that it does not starve. Within a class, tasks
+ * with a deadline run first, earliest deadline first, and a task whose
+ * deadline has expired runs before tasks of any class.
+ * \param obj thread pool.
+ * \param task task to be pushed, task members will be copied.
+ * \param priority priority class.
+ * \param deadline absolute deadline (CLOCK_MONOTONIC) or NULL if none.
+ * \return 0 if success, -1 on failure.
+ * \note thread_pool_push() and thread_pool_push_task() use the
+ * THREAD_POOL_PRIORITY_NORMAL class without deadline.
+ * \note With THREAD_POOL_QUEUE_STEAL, priorities apply to the shared queue,
+ * workers still run the tasks of their own deque first.
+ * \note With THREAD_POOL_QUEUE_RING, only THREAD_POOL_PRIORITY_NORMAL without
+ * deadline is supported, otherwise it fails with errno set to ENOTSUP.
+ */
+int thread_pool_push_priority(thread_pool obj, struct thread_pool_task* task,
+    enum thread_pool_priority priority, const struct timespec* deadline);
+
+/**
+ * \brief Push several tasks to the thread pool at once.
+ *
+ * The queue lock is taken once for the whole batch and only the needed
+ * number of parked workers are woken up.
+ * \param obj thread pool.
+ * \param tasks array of tasks to be pushed, task members will be copied.
+ * \param n number of tasks.
+ * \return number of tasks pushed (n if success), -1 if none was pushed.
+ * \note With THREAD_POOL_QUEUE_RING, less than n tasks may be pushed if the
+ * ring becomes full.
+ */
+int thread_pool_push_batch(thread_pool obj, struct thread_pool_task* tasks,
+    size_t n);
+
+/**
+ * \brief Push a task to the thread pool without copying it.
+ * \param obj thread pool.
+ * \param task task to be pushed. Its storage is owned by the caller and has
+ * to remain valid until a worker starts it, it is safe to release it from the
+ * run or cleanup function.
+ * \return 0 if success, -1 on failure.
+ * \note With THREAD_POOL_QUEUE_RING, task members are copied into the ring
+ * as with thread_pool_push().
+ */
+int thread_pool_push_task(thread_pool obj, struct thread_pool_task* task);
+
+/**
+ * \brief Push a task to the thread pool and get a handle to its completion.
+ *
+ * The task completes once its run and cleanup functions have returned. If the
+ * task is discarded by thread_pool_clean() or thread_pool_free() without
+ * being run, it completes as cancelled.
+ * \param obj thread pool.
+ * \param task task to be pushed, task members will be copied.
+ * \return completion handle or NULL if failure. It has to be released with
+ * thread_pool_future_free() before the thread pool is freed.
+ * \note Waiting on a completed future does not take any lock and completing
+ * a future nobody waits for does not issue any system call.
+ */
+thread_pool_future thread_pool_push_future(thread_pool obj,
+    struct thread_pool_task* task);
+
+/**
+ * \brief Wait for the completion of a task.
+ * \param obj completion handle.
+ * \return 0 if task has completed, -1 if it has been cancelled (errno is set
+ * to ECANCELED).
+ */
+int thread_pool_future_wait(thread_pool_future obj);
+
+/**
+ * \brief Wait for the completion of a task with a timeout.
+ * \param obj completion handle.
+ * \param timeout absolute timeout (CLOCK_REALTIME).
+ * \return 0 if task has completed, -1 if it has been cancelled (errno is set
+ * to ECANCELED) or timeout expired (errno is set to ETIMEDOUT).
+ */
+int thread_pool_future_timedwait(thread_pool_future obj,
+    const struct timespec* timeout);
+
+/**
+ * \brief Check if a task has completed without blocking.
+ * \param obj completion handle.
+ * \return 1 if task has completed, 0 if it is still pending, -1 if it has
+ * been cancelled (errno is set to ECANCELED).
+ */
+int thread_pool_future_poll(thread_pool_future obj);
+
+/**
+ * \brief Register a function to call when the task completes.
+ *
+ * The function is called by the worker that completes the task or directly
+ * by this function if the task has already completed. It is also called if
+ * the task is cancelled, thread_pool_future_poll() tells which case it is.
+ * \param obj completion handle.
+ * \param func function to call.
+ * \param data data passed to func.
+ * \return 0 if success, -1 if a function is already registered (errno is set
+ * to EBUSY).
+ * \note Only one function can be registered per future, concurrent calls are
+ * safe and all but one fail with EBUSY.
+ */
+int thread_pool_future_then(thread_pool_future obj, void (*func)(void*),
+    void* data);
+
+/**
+ * \brief Release a completion handle.
+ *
+ * The task is not cancelled, it is only not possible to wait for it anymore.
+ * \param obj pointer on completion handle.
+ */
+void thread_pool_future_free(thread_pool_future* obj);
+
+/**
+ * \brief Get a snapshot of the statistics of the workers.
+ *
+ * There is one element per worker slot (max_threads). Times and latency
+ * histograms stay empty if the pool has been created with the stats member
+ * of its configuration set to 0.
+ * \param obj thread pool.
+ * \return snapshot to free with thread_stats_free() or NULL if failure.
+ */
+struct thread_stats* thread_pool_stats(thread_pool obj);
+
 /**
  * \brief Clean tasks of the thread pool.
  * \param obj thread pool.
  * \return 0 if success, -1 otherwise.
- * \note Call only this function when thread dispatcher is stopped.
+ * \note Call only this function when thread dispatcher is stopped. Cleanup
+ * functions of the tasks are not called, see thread_pool_drain().
  */
 int thread_pool_clean(thread_pool obj);
 
+/**
+ * \brief Drain the thread pool before a shutdown.
+ *
+ * The pool refuses tasks from threads other than its workers (push fails
+ * with errno set to ESHUTDOWN), waits for the pending and running tasks to
+ * finish, then stops. Tasks still queued at that time are discarded after
+ * their cleanup function has been called, futures are cancelled.
+ * thread_pool_start() accepts tasks again.
+ * \param obj thread pool.
+ * \param timeout maximum time (ms) to wait, -1 for infinite and 0 to only
+ * discard the queued tasks. The pool does not wait if it is stopped.
+ * \return number of tasks that had not finished when the wait ended (0 if
+ * the pool has been drained), -1 on failure.
+ * \note Tasks running when the timeout expires finish on their own, after
+ * the function has returned.
+ */
+int thread_pool_drain(thread_pool obj, int timeout);
+
+/**
+ * \brief Run a loop body over a range of indexes in parallel.
+ *
+ * The range is split in chunks grabbed by the calling thread and by helper
+ * tasks pushed to the pool (one per worker at most, with a single batch
+ * push). A chunk is a fraction of the remaining range, never smaller than
+ * grain, so chunks get smaller toward the end of the loop to balance it.
+ * \param obj thread pool.
+ * \param begin first index.
+ * \param end end of the range (excluded).
+ * \param grain minimum number of indexes per chunk (0 means 1).
+ * \param fn loop body called with the bounds of a chunk (first index, end
+ * excluded) and ctx.
+ * \param ctx application context.
+ * \return 0 if success, -1 on failure (errno set to EINVAL).
+ * \note The function returns when all chunks are finished. The caller runs
+ * chunks instead of blocking so it can be called from a task of the pool,
+ * it runs the whole range if the pool is stopped or draining.
+ */
+int thread_pool_parallel_for(thread_pool obj, size_t begin, size_t end,
+    size_t grain, void (*fn)(size_t, size_t, void*), void* ctx);
+
+/**
+ * \brief Reduce a range of indexes in parallel.
+ *
+ * The range is split as with thread_pool_parallel_for(). Each participant
+ * accumulates its chunks in a private partial result initialized with a
+ * copy of result, partial results are then merged in result by the calling
+ * thread.
+ * \param obj thread pool.
+ * \param begin first index.
+ * \param end end of the range (excluded).
+ * \param grain minimum number of indexes per chunk (0 means 1).
+ * \param fn reduce body called with the bounds of a chunk, ctx and the
+ * partial result to update.
+ * \param join function that merges a partial result (second argument) in
+ * result (first argument), ctx is the third argument. It has to be
+ * associative and commutative.
+ * \param ctx application context.
+ * \param result identity value of the reduction when called, result when
+ * the function returns.
+ * \param size size of result.
+ * \return 0 if success, -1 on failure (errno set to EINVAL).
+ */
+int thread_pool_parallel_reduce(thread_pool obj, size_t begin, size_t end,
+    size_t grain, void (*fn)(size_t, size_t, void*, void*),
+    void (*join)(void*, const void*, void*), void* ctx, void* result,
+    size_t size);
+
 #endif /* VSUTILS_THREAD_POOL_H */
 
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file thread_stats.h
+ * \brief Statistics of thread pool and dispatcher workers.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_THREAD_STATS_H
+#define VSUTILS_THREAD_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \def THREAD_STATS_SUB_BUCKETS
+ * \brief Number of buckets per power of two of histograms.
+ */
+#define THREAD_STATS_SUB_BUCKETS 16
+
+/**
+ * \def THREAD_STATS_BUCKETS
+ * \brief Number of buckets of histograms.
+ *
+ * Values are recorded with a relative error under 1/16 up to 2^40 ns
+ * (about 18 minutes), greater values go to the last bucket.
+ */
+#define THREAD_STATS_BUCKETS (37 * THREAD_STATS_SUB_BUCKETS)
+
+/**
+ * \struct thread_stats_histogram
+ * \brief Log-linear (HDR-style) histogram of durations.
+ */
+struct thread_stats_histogram
+{
+  uint64_t count; /**< Number of values. */
+  uint64_t sum; /**< Sum of values (ns). */
+  uint64_t max; /**< Maximum value (ns). */
+  uint64_t buckets[THREAD_STATS_BUCKETS]; /**< Number of values by bucket. */
+};
+
+/**
+ * \struct thread_stats_worker
+ * \brief Statistics of a worker.
+ */
+struct thread_stats_worker
+{
+  uint64_t tasks; /**< Number of tasks run. */
+  uint64_t busy; /**< Time (ns) spent running tasks. */
+  uint64_t idle; /**< Time (ns) spent waiting for tasks. */
+  uint64_t steals; /**< Number of tasks stolen from other workers. */
+  uint64_t wakeups; /**< Number of wake ups after parking. */
+  uint64_t depth_max; /**< High-water mark of the queue depth. */
+  struct thread_stats_histogram wait; /**< Enqueue-to-start latency (ns). */
+  struct thread_stats_histogram run; /**< Run time (ns) of tasks. */
+};
+
+/**
+ * \struct thread_stats
+ * \brief Snapshot of the statistics of a thread pool or dispatcher.
+ *
+ * Counters of each worker are read without stopping it, so a snapshot is
+ * only consistent per counter.
+ */
+struct thread_stats
+{
+  struct thread_stats_worker total; /**< Sum (maximum for depth_max) of all
+                                      workers. */
+  size_t nb_workers; /**< Number of elements of workers array. */
+  struct thread_stats_worker workers[]; /**< Statistics of each worker. */
+};
+
+/**
+ * \brief Get a percentile of a histogram.
+ * \param obj histogram.
+ * \param percentile percentile (0 to 100).
+ * \return upper bound of the bucket where the percentile lies (ns), 0 if
+ * histogram is empty.
+ */
+uint64_t thread_stats_percentile(const struct thread_stats_histogram* obj,
+    double percentile);
+
+/**
+ * \brief Delete a snapshot.
+ * \param obj pointer on snapshot.
+ */
+void thread_stats_free(struct thread_stats** obj);
+
+#endif /* VSUTILS_THREAD_STATS_H */
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file timer_wheel.h
+ * \brief Hierarchical timing wheel for delayed and periodic tasks.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_TIMER_WHEEL_H
+#define VSUTILS_TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#include "list.h"
+#include "thread_pool.h"
+#include "thread_dispatcher.h"
+
+/**
+ * \typedef timer_wheel
+ * \brief Opaque type for timer wheel.
+ */
+typedef struct timer_wheel* timer_wheel;
+
+/**
+ * \struct timer_wheel_timer
+ * \brief Timer of the timer wheel.
+ *
+ * The storage is owned by the caller, the wheel only links it so adding and
+ * cancelling a timer never allocates.\n
+ * When the timer expires, data, run and cleanup are pushed as a task to pool
+ * if set, otherwise to dispatcher with color if set, otherwise run and
+ * cleanup are called directly by the thread that drives the wheel.\n
+ * The cleanup function (if not NULL) is executed after each run, or alone
+ * if the push fails (e.g. full ring or draining).\n
+ * The pool or dispatcher has to outlive the timer, stop the wheel before
+ * freeing them.
+ */
+struct timer_wheel_timer
+{
+  void* data; /**< Application data. */
+  void (*run)(void*); /**< Run function. */
+  void (*cleanup)(void*); /**< Cleanup function. */
+  thread_pool pool; /**< Thread pool that runs the timer or NULL. */
+  thread_dispatcher dispatcher; /**< Dispatcher that runs the timer or NULL. */
+  uint32_t color; /**< Color used with dispatcher. */
+  struct list_head list; /**< Reserved for internal use. */
+  uint64_t expire; /**< Reserved for internal use. */
+  uint64_t period; /**< Reserved for internal use. */
+  unsigned int slot; /**< Reserved for internal use. */
+};
+
+/**
+ * \brief Initialize a timer.
+ * \param timer timer to initialize.
+ * \param data application data.
+ * \param run run function.
+ * \param cleanup cleanup function, can be NULL.
+ * \note Target pool, dispatcher and color are reset, set them after the call
+ * if needed.
+ */
+void timer_wheel_timer_init(struct timer_wheel_timer* timer, void* data,
+    void (*run)(void*), void (*cleanup)(void*));
+
+/**
+ * \brief Create a new timer wheel.
+ *
+ * The wheel has a resolution of one millisecond and six levels of 64 slots,
+ * so delays up to 2^36 ms (about two years) are stored without overflow
+ * list, longer delays are truncated.
+ * \return timer wheel or NULL if failure.
+ */
+timer_wheel timer_wheel_new(void);
+
+/**
+ * \brief Delete a timer wheel.
+ * \param obj pointer on timer wheel.
+ * \note The timer thread is stopped if running. Pending timers are dropped
+ * without calling their cleanup function, their storage stays owned by the
+ * caller.
+ */
+void timer_wheel_free(timer_wheel* obj);
+
+/**
+ * \brief Start a thread that drives the timer wheel.
+ * \param obj timer wheel.
+ * \return 0 if success, -1 if failure.
+ * \note Do not start the thread if the wheel is driven by an event loop
+ * with timer_wheel_timeout() and timer_wheel_expire().
+ */
+int timer_wheel_start(timer_wheel obj);
+
+/**
+ * \brief Stop the thread that drives the timer wheel.
+ * \param obj timer wheel.
+ * \return 0 if success, -1 if failure.
+ */
+int timer_wheel_stop(timer_wheel obj);
+
+/**
+ * \brief Add a timer.
+ * \param obj timer wheel.
+ * \param timer timer to add. Its storage has to remain valid until it
+ * expires (for one-shot timer) or is cancelled.
+ * \param delay delay in milliseconds before the first expiration.
+ * \param period period in milliseconds for a periodic timer, 0 for a
+ * one-shot timer.
+ * \return 0 if success, -1 if failure (errno set to EBUSY if timer is
+ * already pending).
+ * \note Insertion is O(1), it can be called from any thread including from
+ * a timer run function.
+ */
+int timer_wheel_add(timer_wheel obj, struct timer_wheel_timer* timer,
+    unsigned int delay, unsigned int period);
+
+/**
+ * \brief Cancel a timer.
+ * \param obj timer wheel.
+ * \param timer timer to cancel.
+ * \return 0 if success, -1 if timer is not pending (errno set to ENOENT),
+ * i.e. it has already expired or is not added.
+ * \note Cancellation is O(1). An expired timer that is running or queued in
+ * a pool or dispatcher is not affected, a periodic timer is not rescheduled
+ * anymore.
+ */
+int timer_wheel_cancel(timer_wheel obj, struct timer_wheel_timer* timer);
+
+/**
+ * \brief Get the number of pending timers.
+ * \param obj timer wheel.
+ * \return number of pending timers.
+ */
+size_t timer_wheel_size(timer_wheel obj);
+
+/**
+ * \brief Get the time before the wheel needs to be advanced.
+ * \param obj timer wheel.
+ * \return number of milliseconds to wait before calling timer_wheel_expire()
+ * or -1 if no timer is pending.
+ * \note The value can be smaller than the delay of the next timer because
+ * timers of upper levels are cascaded every 64 ms at most.
+ */
+int timer_wheel_timeout(timer_wheel obj);
+
+/**
+ * \brief Advance the wheel up to current time and fire expired timers.
+ * \param obj timer wheel.
+ * \return number of expired timers.
+ * \note Used to drive the wheel from an event loop, for example:
+ * \code
+ * for(;;)
+ * {
+ *   int timeout = timer_wheel_timeout(wheel);
+ *   netevt_wait(evt, timeout == -1 ? -1 : (timeout + 999) / 1000, ...);
+ *   timer_wheel_expire(wheel);
+ * }
+ * \endcode
+ */
+size_t timer_wheel_expire(timer_wheel obj);
+
+#endif /* VSUTILS_TIMER_WHEEL_H */
@@ -152,6 +152,19 @@ typedef struct net_sfd_set sfd_set;
  */
 #define NET_SFD_CLR(fd, set) FD_CLR((fd), NET_SFD_CAST(set))
 
+/**
+ * \def NET_REUSE_ADDR
+ * \brief Allow socket to reuse transport address (SO_REUSEADDR).
+ */
+#define NET_REUSE_ADDR 1
+
+/**
+ * \def NET_REUSE_PORT
+ * \brief Allow several sockets to bind the same address and port, incoming
+ * connections are balanced between them by the kernel (SO_REUSEPORT).
+ */
+#define NET_REUSE_PORT 2
+
 /**
  * \brief Create and bind socket.
  * \param af address family.
@@ -159,8 +172,9 @@ typedef struct net_sfd_set sfd_set;
  * \param addr address or FQDN name.
  * \param port to bind.
  * \param v6only accept socket to accept both IPv4 and IPv6.
- * \param reuse allow socket to reuse transport address (SO_REUSE).
+ * \param reuse combination of NET_REUSE_* flags, 0 for none.
  * \return socket descriptor, -1 otherwise (check errno to know the reason).
+ * \note errno is set to ENOSYS if NET_REUSE_PORT is not supported.
  */
 int net_socket_create(enum address_family af, enum protocol_type protocol,
     const char* addr, uint16_t port, int v6only, int reuse);
@@ -184,6 +184,23 @@ void* sys_s_memset(void* src, int c, size_t len);
  */
 size_t sys_get_cores(void);
 
+/**
+ * \brief Returns number of NUMA nodes.
+ * \return number of NUMA nodes, 1 if system does not expose them.
+ */
+size_t sys_get_nodes(void);
+
+/**
+ * \brief Get the processors cores of a NUMA node.
+ * \param node NUMA node index.
+ * \param cores array that will be filled with core indexes.
+ * \param nb number of elements of cores array.
+ * \return number of cores of the node (that may be greater than nb) or -1 if
+ * failure (errno is set to ENOENT if system does not expose the node).
+ * \note Relies on Linux sysfs.
+ */
+int sys_get_node_cores(size_t node, unsigned int* cores, size_t nb);
+
 #ifdef __cplusplus
 }
 #endif
@@ -50,8 +50,50 @@ struct netevt
   struct netevt_impl impl; /**< Implementation specific (select, ...). */
   int (*impl_init)(struct netevt_impl*); /**< Initialize implementation. */
   int (*impl_destroy)(struct netevt_impl*); /**< Destroy implementation. */
+  struct netevt_socket** table; /**< Sockets indexed by descriptor. */
+  size_t table_size; /**< Number of elements of table. */
 };
 
+/**
+ * \def NETEVT_TABLE_SIZE
+ * \brief Initial number of elements of the descriptor table.
+ */
+#define NETEVT_TABLE_SIZE 64
+
+/**
+ * \brief Grow the descriptor table so that it can index a descriptor.
+ * \param obj network event manager.
+ * \param sock socket descriptor.
+ * \return 0 if success, -1 otherwise.
+ */
+static int netevt_table_reserve(netevt obj, int sock)
+{
+  struct netevt_socket** table = NULL;
+  size_t size = obj->table_size ? obj->table_size : NETEVT_TABLE_SIZE;
+
+  if((size_t)sock < obj->table_size)
+  {
+    return 0;
+  }
+
+  while(size <= (size_t)sock)
+  {
+    size *= 2;
+  }
+
+  table = realloc(obj->table, sizeof(struct netevt_socket*) * size);
+  if(!table)
+  {
+    return -1;
+  }
+
+  memset(table + obj->table_size, 0x00,
+      sizeof(struct netevt_socket*) * (size - obj->table_size));
+  obj->table = table;
+  obj->table_size = size;
+  return 0;
+}
+
 int netevt_is_method_supported(enum netevt_method method)
 {
 #ifdef __linux__
@@ -181,6 +223,7 @@ void netevt_free(netevt* obj)
 {
   netevt_remove_all_sockets(*obj);
   (*obj)->impl_destroy(&(*obj)->impl);
+  free((*obj)->table);
   free(*obj);
   *obj = NULL;
 }
@@ -190,6 +233,23 @@ int netevt_add_socket(netevt obj, int sock, int event_mask, void* data)
   struct netevt_socket* p = NULL;
   socklen_t addr_size = sizeof(struct sockaddr_storage);
 
+  if(sock < 0)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  if(netevt_table_reserve(obj, sock) != 0)
+  {
+    return -1;
+  }
+
+  if(obj->table[sock])
+  {
+    errno = EEXIST;
+    return -1;
+  }
+
   p = malloc(sizeof(struct netevt_socket));
 
   if(!p)
@@ -208,6 +268,7 @@ int netevt_add_socket(netevt obj, int sock, int event_mask, void* data)
   }
 
   list_head_add_tail(&obj->sockets, &p->list);
+  obj->table[sock] = p;
   obj->nb_sockets++;
 
   return 0;
@@ -215,22 +276,8 @@ int netevt_add_socket(netevt obj, int sock, int event_mask, void* data)
 
 int netevt_set_socket(netevt obj, int sock, int event_mask)
 {
-  struct list_head* pos = NULL;
-  struct list_head* tmp = NULL;
-  struct netevt_socket* s = NULL;
-
-  /* find the socket */
-  list_head_iterate_safe(&obj->sockets, pos, tmp)
-  {
-    s = list_head_get(pos, struct netevt_socket, list);
-    if(s->sock == sock)
-    {
-      break;
-    }
-    s = NULL;
-  }
-
-  return netevt_set_netevt_socket(obj, s, event_mask);
+  return netevt_set_netevt_socket(obj, netevt_get_socket(obj, sock),
+      event_mask);
 }
 
 int netevt_set_netevt_socket(netevt obj, struct netevt_socket* sock,
@@ -247,25 +294,13 @@ int netevt_set_netevt_socket(netevt obj, struct netevt_socket* sock,
 
 int netevt_remove_socket(netevt obj, int sock)
 {
-  struct list_head* pos = NULL;
-  struct list_head* tmp = NULL;
-  struct netevt_socket* s = NULL;
-
-  /* find the socket */
-  list_head_iterate_safe(&obj->sockets, pos, tmp)
-  {
-    s = list_head_get(pos, struct netevt_socket, list);
-    if(s->sock == sock)
-    {
-      break;
-    }
-    s = NULL;
-  }
+  struct netevt_socket* s = netevt_get_socket(obj, sock);
 
   if(s)
   {
     obj->impl.remove_socket(&obj->impl, obj, s);
     list_head_remove(&obj->sockets, &s->list);
+    obj->table[sock] = NULL;
     obj->nb_sockets--;
     free(s);
     return 0;
@@ -284,6 +319,7 @@ int netevt_remove_all_sockets(netevt obj)
   {
     struct netevt_socket* s = list_head_get(pos, struct netevt_socket, list);
     obj->impl.remove_socket(&obj->impl, obj, s);
+    obj->table[s->sock] = NULL;
     obj->nb_sockets--;
     free(s);
   }
@@ -295,10 +331,42 @@ int netevt_remove_all_sockets(netevt obj)
 
 int netevt_wait(netevt obj, int timeout, struct netevt_event* events,
     size_t events_nb)
+{
+  /* backends fill the array as lean events that are smaller than
+   * netevt_event, so they are expanded in place from the last one
+   */
+  struct netevt_event_ptr* ptrs = (struct netevt_event_ptr*)events;
+  int ret = obj->impl.wait(&obj->impl, obj, timeout, ptrs, events_nb);
+
+  for(int i = ret - 1 ; i >= 0 ; i--)
+  {
+    struct netevt_socket* s = ptrs[i].ptr;
+    int state = ptrs[i].state;
+
+    events[i].socket = *s;
+    events[i].ptr = s;
+    events[i].state = state;
+  }
+
+  return ret;
+}
+
+int netevt_wait_ptr(netevt obj, int timeout, struct netevt_event_ptr* events,
+    size_t events_nb)
 {
   return obj->impl.wait(&obj->impl, obj, timeout, events, events_nb);
 }
 
+struct netevt_socket* netevt_get_socket(netevt obj, int sock)
+{
+  if(sock < 0 || (size_t)sock >= obj->table_size)
+  {
+    return NULL;
+  }
+
+  return obj->table[sock];
+}
+
 size_t netevt_get_nb_sockets(netevt obj)
 {
   return obj->nb_sockets;
@@ -38,6 +38,12 @@
 #include "list.h"
 #include "util_net.h"
 
+/**
+ * \def NETEVT_EPOLL_EVENTS_SIZE
+ * \brief Initial number of elements of the events array.
+ */
+#define NETEVT_EPOLL_EVENTS_SIZE 64
+
 /**
  * \struct netevt_epoll
  * \brief Epoll network event implementation.
@@ -46,7 +52,9 @@ struct netevt_epoll
 {
   int nsock; /**< Current number of sockets. */
   int efd; /**< Epoll descriptor. */
-  struct epoll_event events[NET_SFD_SETSIZE]; /**< Array of epoll events. */
+  size_t events_size; /**< Number of elements of events array. */
+  struct epoll_event* events; /**< Array of epoll events, sized by the
+                                largest wait of the caller. */
 };
 
 /**
@@ -64,13 +72,23 @@ static struct netevt_epoll* netevt_epoll_new(void)
 
   memset(ret, 0x00, sizeof(struct netevt_epoll));
 
-  ret->efd = epoll_create(NET_SFD_SETSIZE);
+  /* size is only a hint, the number of descriptors is not limited */
+  ret->efd = epoll_create(NETEVT_EPOLL_EVENTS_SIZE);
   if(ret->efd == -1)
   {
     free(ret);
     return NULL;
   }
 
+  ret->events = malloc(sizeof(struct epoll_event) * NETEVT_EPOLL_EVENTS_SIZE);
+  if(!ret->events)
+  {
+    close(ret->efd);
+    free(ret);
+    return NULL;
+  }
+  ret->events_size = NETEVT_EPOLL_EVENTS_SIZE;
+
   ret->nsock = 0;
 
   return ret;
@@ -83,6 +101,7 @@ static struct netevt_epoll* netevt_epoll_new(void)
 static void netevt_epoll_free(struct netevt_epoll** obj)
 {
   close((*obj)->efd);
+  free((*obj)->events);
   free(*obj);
   *obj = NULL;
 }
@@ -92,12 +111,12 @@ static void netevt_epoll_free(struct netevt_epoll** obj)
  * \param impl network event implementation.
  * \param obj network event manager.
  * \param timeout timeout in second.
- * \param events allocated array of netevt_event.
+ * \param events allocated array of netevt_event_ptr.
  * \param events_nb number of elements in events array.
  * \return 0 if timeout, number of elements notified if success and -1 if error.
  */
 static int netevt_epoll_wait(struct netevt_impl* impl, netevt obj, int timeout,
-    struct netevt_event* events, size_t nb_events)
+    struct netevt_event_ptr* events, size_t nb_events)
 {
   int ret = 0;
   struct netevt_epoll* impl_epoll = impl->priv;
@@ -106,8 +125,27 @@ static int netevt_epoll_wait(struct netevt_impl* impl, netevt obj, int timeout,
 
   (void)obj;
 
-  ret = epoll_wait(impl_epoll->efd, impl_epoll->events, NET_SFD_SETSIZE,
-      timeout_ms);
+  if(nb_events > impl_epoll->events_size)
+  {
+    /* grow to the size of the caller array, keep the current one if there
+     * is no memory
+     */
+    struct epoll_event* evts = realloc(impl_epoll->events,
+        sizeof(struct epoll_event) * nb_events);
+
+    if(evts)
+    {
+      impl_epoll->events = evts;
+      impl_epoll->events_size = nb_events;
+    }
+  }
+
+  /* do not ask more events than the caller can receive, the others are
+   * reported by the next call
+   */
+  ret = epoll_wait(impl_epoll->efd, impl_epoll->events,
+      (int)(nb_events < impl_epoll->events_size ? nb_events :
+        impl_epoll->events_size), timeout_ms);
 
   if(ret == -1)
   {
@@ -142,7 +180,7 @@ static int netevt_epoll_wait(struct netevt_impl* impl, netevt obj, int timeout,
         uint32_t evt = 0;
         int state = 0;
 
-        if(nb > nb_events)
+        if(nb >= nb_events)
         {
           return (int)nb;
         }
@@ -170,8 +208,6 @@ static int netevt_epoll_wait(struct netevt_impl* impl, netevt obj, int timeout,
         {
           if(!already)
           {
-            events[nb].socket =
-              *((struct netevt_socket*)impl_epoll->events[i].data.ptr);
             events[nb].ptr =
               ((struct netevt_socket*)impl_epoll->events[i].data.ptr);
             events[nb].state = state;
@@ -189,6 +225,9 @@ static int netevt_epoll_wait(struct netevt_impl* impl, netevt obj, int timeout,
         nb++;
       }
     }
+
+    /* sockets with several states count once */
+    ret = (int)nb;
   }
 
   return ret;
@@ -211,11 +250,6 @@ static int netevt_epoll_add_socket(struct netevt_impl* impl, netevt obj,
 
   (void)obj;
 
-  if(sock->sock > NET_SFD_SETSIZE)
-  {
-    return -1;
-  }
-
   memset(&evt, 0x00, sizeof(struct epoll_event));
   evt.events = 0;
   evt.data.ptr = sock;
@@ -232,6 +266,14 @@ static int netevt_epoll_add_socket(struct netevt_impl* impl, netevt obj,
   {
     evt.events |= EPOLLPRI;
   }
+  if(event_mask & NETEVT_STATE_EDGE)
+  {
+    evt.events |= EPOLLET;
+  }
+  if(event_mask & NETEVT_STATE_ONESHOT)
+  {
+    evt.events |= EPOLLONESHOT;
+  }
 
   ret = epoll_ctl(impl_epoll->efd, EPOLL_CTL_ADD, sock->sock, &evt);
 
@@ -260,11 +302,6 @@ static int netevt_epoll_set_socket(struct netevt_impl* impl, netevt obj,
 
   (void)obj;
 
-  if(sock->sock > NET_SFD_SETSIZE)
-  {
-    return -1;
-  }
-
   memset(&evt, 0x00, sizeof(struct epoll_event));
   evt.events = 0;
   evt.data.ptr = sock;
@@ -281,6 +318,14 @@ static int netevt_epoll_set_socket(struct netevt_impl* impl, netevt obj,
   {
     evt.events |= EPOLLPRI;
   }
+  if(event_mask & NETEVT_STATE_EDGE)
+  {
+    evt.events |= EPOLLET;
+  }
+  if(event_mask & NETEVT_STATE_ONESHOT)
+  {
+    evt.events |= EPOLLONESHOT;
+  }
 
   ret = epoll_ctl(impl_epoll->efd, EPOLL_CTL_MOD, sock->sock, &evt);
 
@@ -302,11 +347,6 @@ static int netevt_epoll_remove_socket(struct netevt_impl* impl, netevt obj,
 
   (void)obj;
 
-  if(sock->sock > NET_SFD_SETSIZE)
-  {
-    return -1;
-  }
-
   epoll_ctl(impl_epoll->efd, EPOLL_CTL_DEL, sock->sock, NULL);
 
   return ret;
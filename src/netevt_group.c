@@ -0,0 +1,793 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file netevt_group.c
+ * \brief Group of network event managers, each one run by its own thread.
+ *
+ * Each shard has its own network event manager (hence its own epoll or
+ * kqueue descriptor) and thread. Other threads never touch a manager: they
+ * push sockets in the inbox of the shard and write in its wakeup pipe, the
+ * read side of which is monitored by the manager.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "netevt_group.h"
+#include "util_sys.h"
+
+/**
+ * \def NETEVT_GROUP_EVENTS
+ * \brief Maximum number of events (or accepted connections) per iteration.
+ */
+#define NETEVT_GROUP_EVENTS 64
+
+/**
+ * \def NETEVT_GROUP_INBOX_SIZE
+ * \brief Initial number of elements of the inbox arrays.
+ */
+#define NETEVT_GROUP_INBOX_SIZE 16
+
+/**
+ * \def NETEVT_GROUP_PAUSE
+ * \brief Time (s) a listener is not monitored when descriptors are lacking.
+ */
+#define NETEVT_GROUP_PAUSE 1
+
+/**
+ * \struct netevt_group_inbox
+ * \brief Array of sockets handed off to a shard.
+ */
+struct netevt_group_inbox
+{
+  int* socks; /**< Sockets. */
+  size_t nb; /**< Number of sockets. */
+  size_t size; /**< Number of elements of socks array. */
+};
+
+/**
+ * \struct netevt_group_shard
+ * \brief Shard of the group.
+ */
+struct netevt_group_shard
+{
+  struct netevt_group* group; /**< Group of the shard. */
+  size_t index; /**< Index of the shard. */
+  netevt nevt; /**< Network event manager of the shard. */
+  pthread_t thread; /**< Thread of the shard. */
+  int wakeup[2]; /**< Wakeup pipe, read side is monitored by nevt. */
+  int listener; /**< Listening socket monitored by nevt or -1. */
+  int reserve; /**< Descriptor released to drop connections when the
+                 process has no more descriptors, or -1. */
+  int paused; /**< If listener is not monitored since reserve is lacking. */
+  pthread_mutex_t mutex; /**< Mutex for the inbox. */
+  struct netevt_group_inbox inbox; /**< Sockets handed off to the shard. */
+  struct netevt_group_inbox spare; /**< Inbox swapped with the shard one. */
+};
+
+/**
+ * \struct netevt_group
+ * \brief Group of network event managers.
+ */
+struct netevt_group
+{
+  struct netevt_group_shard* shards; /**< Array of shards. */
+  size_t nb_shards; /**< Number of shards. */
+  struct netevt_group_handler handler; /**< Functions of shard threads. */
+  atomic_size_t next; /**< Next shard for round-robin. */
+  atomic_int run; /**< If shard threads have to run. */
+  int started; /**< If shard threads are started. */
+  int reuseport; /**< If each shard has its own listening socket. */
+};
+
+/**
+ * \brief Set a descriptor non-blocking.
+ * \param fd descriptor.
+ * \return 0 if success, -1 otherwise.
+ */
+static int netevt_group_nonblock(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+
+  if(flags == -1)
+  {
+    return -1;
+  }
+
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * \brief Initialize a shard.
+ * \param obj shard.
+ * \param group group of the shard.
+ * \param index index of the shard.
+ * \param method method of the network event manager.
+ * \return 0 if success, -1 otherwise.
+ */
+static int netevt_group_shard_init(struct netevt_group_shard* obj,
+    struct netevt_group* group, size_t index, enum netevt_method method)
+{
+  int err = 0;
+
+  memset(obj, 0x00, sizeof(struct netevt_group_shard));
+  obj->group = group;
+  obj->index = index;
+  obj->listener = -1;
+  obj->paused = 0;
+
+  obj->reserve = open("/dev/null", O_RDONLY);
+  if(obj->reserve == -1)
+  {
+    return -1;
+  }
+
+  if(pthread_mutex_init(&obj->mutex, NULL) != 0)
+  {
+    err = errno;
+    close(obj->reserve);
+    errno = err;
+    return -1;
+  }
+
+  obj->nevt = netevt_new(method);
+  if(!obj->nevt)
+  {
+    err = errno;
+    pthread_mutex_destroy(&obj->mutex);
+    close(obj->reserve);
+    errno = err;
+    return -1;
+  }
+
+  if(pipe(obj->wakeup) == -1)
+  {
+    err = errno;
+    netevt_free(&obj->nevt);
+    pthread_mutex_destroy(&obj->mutex);
+    close(obj->reserve);
+    errno = err;
+    return -1;
+  }
+
+  if(netevt_group_nonblock(obj->wakeup[0]) != 0 ||
+      netevt_group_nonblock(obj->wakeup[1]) != 0 ||
+      netevt_add_socket(obj->nevt, obj->wakeup[0], NETEVT_STATE_READ,
+        NULL) != 0)
+  {
+    err = errno;
+    close(obj->wakeup[0]);
+    close(obj->wakeup[1]);
+    netevt_free(&obj->nevt);
+    pthread_mutex_destroy(&obj->mutex);
+    close(obj->reserve);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Destroy a shard.
+ * \param obj shard.
+ */
+static void netevt_group_shard_destroy(struct netevt_group_shard* obj)
+{
+  /* sockets never delivered */
+  for(size_t i = 0 ; i < obj->inbox.nb ; i++)
+  {
+    close(obj->inbox.socks[i]);
+  }
+
+  netevt_free(&obj->nevt);
+
+  if(obj->listener != -1)
+  {
+    close(obj->listener);
+  }
+
+  if(obj->reserve != -1)
+  {
+    close(obj->reserve);
+  }
+
+  close(obj->wakeup[0]);
+  close(obj->wakeup[1]);
+  pthread_mutex_destroy(&obj->mutex);
+  free(obj->inbox.socks);
+  free(obj->spare.socks);
+}
+
+/**
+ * \brief Wake up the thread of a shard.
+ * \param obj shard.
+ */
+static void netevt_group_shard_wakeup(struct netevt_group_shard* obj)
+{
+  char c = 0;
+
+  /* a full pipe already wakes up the shard */
+  if(write(obj->wakeup[1], &c, 1) == -1)
+  {
+    return;
+  }
+}
+
+/**
+ * \brief Give a socket to the accept function.
+ * \param obj shard.
+ * \param sock socket descriptor.
+ */
+static void netevt_group_shard_deliver(struct netevt_group_shard* obj,
+    int sock)
+{
+  struct netevt_group* group = obj->group;
+
+  if(group->handler.accept)
+  {
+    group->handler.accept(obj->nevt, obj->index, sock, group->handler.arg);
+  }
+  else
+  {
+    close(sock);
+  }
+}
+
+/**
+ * \brief Push a socket in the inbox of a shard.
+ * \param obj shard.
+ * \param sock socket descriptor.
+ * \return 0 if success, -1 otherwise.
+ */
+static int netevt_group_shard_push(struct netevt_group_shard* obj, int sock)
+{
+  struct netevt_group_inbox* inbox = &obj->inbox;
+  int wake = 0;
+
+  pthread_mutex_lock(&obj->mutex);
+
+  if(inbox->nb == inbox->size)
+  {
+    size_t size = inbox->size ? inbox->size * 2 : NETEVT_GROUP_INBOX_SIZE;
+    int* socks = realloc(inbox->socks, sizeof(int) * size);
+
+    if(!socks)
+    {
+      pthread_mutex_unlock(&obj->mutex);
+      return -1;
+    }
+
+    inbox->socks = socks;
+    inbox->size = size;
+  }
+
+  inbox->socks[inbox->nb] = sock;
+  inbox->nb++;
+
+  /* the shard has not been woken up since it emptied the inbox */
+  wake = inbox->nb == 1;
+
+  pthread_mutex_unlock(&obj->mutex);
+
+  if(wake)
+  {
+    netevt_group_shard_wakeup(obj);
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Deliver the sockets of the inbox of a shard.
+ * \param obj shard.
+ * \note Called by the thread of the shard.
+ */
+static void netevt_group_shard_drain(struct netevt_group_shard* obj)
+{
+  struct netevt_group_inbox tmp;
+  char buf[64];
+
+  /* read the wakeups before taking the inbox so that no push is missed */
+  while(read(obj->wakeup[0], buf, sizeof(buf)) > 0)
+  {
+  }
+
+  pthread_mutex_lock(&obj->mutex);
+  tmp = obj->inbox;
+  obj->inbox = obj->spare;
+  obj->spare = tmp;
+  pthread_mutex_unlock(&obj->mutex);
+
+  /* inbox is unlocked so the accept function can hand sockets off */
+  for(size_t i = 0 ; i < obj->spare.nb ; i++)
+  {
+    netevt_group_shard_deliver(obj, obj->spare.socks[i]);
+  }
+  obj->spare.nb = 0;
+}
+
+/**
+ * \brief Accept the pending connections of the listening socket of a shard.
+ * \param obj shard.
+ * \note Called by the thread of the shard.
+ */
+static void netevt_group_shard_accept(struct netevt_group_shard* obj)
+{
+  struct netevt_group* group = obj->group;
+
+  /* bounded so that the other sockets of the shard are not starved */
+  for(unsigned int i = 0 ; i < NETEVT_GROUP_EVENTS ; i++)
+  {
+    size_t shard = obj->index;
+    int sock = accept(obj->listener, NULL, NULL);
+
+    if(sock == -1 && (errno == EMFILE || errno == ENFILE))
+    {
+      /* listener stays readable, drop the connection instead of spinning */
+      if(obj->reserve != -1)
+      {
+        close(obj->reserve);
+        sock = accept(obj->listener, NULL, NULL);
+        if(sock != -1)
+        {
+          close(sock);
+        }
+        obj->reserve = open("/dev/null", O_RDONLY);
+        continue;
+      }
+
+      /* no reserve, stop monitoring until it can be opened again */
+      if(netevt_remove_socket(obj->nevt, obj->listener) == 0)
+      {
+        obj->paused = 1;
+      }
+      break;
+    }
+    else if(sock == -1)
+    {
+      /* EAGAIN or an aborted connection */
+      break;
+    }
+
+    if(!group->reuseport)
+    {
+      shard = atomic_fetch_add(&group->next, 1) % group->nb_shards;
+    }
+
+    if(shard == obj->index)
+    {
+      netevt_group_shard_deliver(obj, sock);
+    }
+    else if(netevt_group_shard_push(&group->shards[shard], sock) != 0)
+    {
+      close(sock);
+    }
+  }
+}
+
+/**
+ * \brief Monitor again the listening socket of a paused shard if its
+ * reserve descriptor can be opened.
+ * \param obj shard.
+ * \note Called by the thread of the shard.
+ */
+static void netevt_group_shard_resume(struct netevt_group_shard* obj)
+{
+  if(obj->reserve == -1)
+  {
+    obj->reserve = open("/dev/null", O_RDONLY);
+  }
+
+  if(obj->reserve != -1 &&
+      netevt_add_socket(obj->nevt, obj->listener, NETEVT_STATE_READ,
+        NULL) == 0)
+  {
+    obj->paused = 0;
+  }
+}
+
+/**
+ * \brief Thread function of a shard.
+ * \param data shard.
+ * \return NULL.
+ */
+static void* netevt_group_thread(void* data)
+{
+  struct netevt_group_shard* obj = data;
+  struct netevt_group* group = obj->group;
+  struct netevt_event_ptr events[NETEVT_GROUP_EVENTS];
+
+  /* sockets handed off before start */
+  netevt_group_shard_drain(obj);
+
+  while(atomic_load(&group->run))
+  {
+    int timeout = obj->paused ? NETEVT_GROUP_PAUSE : -1;
+    int nb = netevt_wait_ptr(obj->nevt, timeout, events, NETEVT_GROUP_EVENTS);
+
+    if(nb == -1 && errno != EINTR)
+    {
+      break;
+    }
+
+    if(obj->paused)
+    {
+      netevt_group_shard_resume(obj);
+    }
+
+    for(int i = 0 ; i < nb ; i++)
+    {
+      struct netevt_socket* s = events[i].ptr;
+
+      if(s->sock == obj->wakeup[0])
+      {
+        netevt_group_shard_drain(obj);
+      }
+      else if(s->sock == obj->listener)
+      {
+        netevt_group_shard_accept(obj);
+      }
+      else if(group->handler.event)
+      {
+        group->handler.event(obj->nevt, obj->index, s, events[i].state,
+            group->handler.arg);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+netevt_group netevt_group_new(enum netevt_method method, size_t nb_shards)
+{
+  struct netevt_group* ret = NULL;
+  size_t nb = 0;
+
+  if(nb_shards == 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  ret = malloc(sizeof(struct netevt_group));
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  memset(ret, 0x00, sizeof(struct netevt_group));
+  ret->shards = malloc(sizeof(struct netevt_group_shard) * nb_shards);
+  if(!ret->shards)
+  {
+    free(ret);
+    return NULL;
+  }
+
+  for(nb = 0 ; nb < nb_shards ; nb++)
+  {
+    if(netevt_group_shard_init(&ret->shards[nb], ret, nb, method) != 0)
+    {
+      break;
+    }
+  }
+
+  if(nb != nb_shards)
+  {
+    int err = errno;
+
+    for(size_t i = 0 ; i < nb ; i++)
+    {
+      netevt_group_shard_destroy(&ret->shards[i]);
+    }
+    free(ret->shards);
+    free(ret);
+    errno = err;
+    return NULL;
+  }
+
+  ret->nb_shards = nb_shards;
+  atomic_init(&ret->next, 0);
+  atomic_init(&ret->run, 0);
+  ret->started = 0;
+  ret->reuseport = 0;
+
+  return ret;
+}
+
+void netevt_group_free(netevt_group* obj)
+{
+  netevt_group_stop(*obj);
+
+  for(size_t i = 0 ; i < (*obj)->nb_shards ; i++)
+  {
+    netevt_group_shard_destroy(&(*obj)->shards[i]);
+  }
+
+  free((*obj)->shards);
+  free(*obj);
+  *obj = NULL;
+}
+
+int netevt_group_listen(netevt_group obj, int sock)
+{
+  struct netevt_group_shard* shard = &obj->shards[0];
+
+  if(obj->started)
+  {
+    errno = EBUSY;
+    return -1;
+  }
+
+  if(shard->listener != -1)
+  {
+    errno = EEXIST;
+    return -1;
+  }
+
+  if(netevt_group_nonblock(sock) != 0 ||
+      netevt_add_socket(shard->nevt, sock, NETEVT_STATE_READ, NULL) != 0)
+  {
+    return -1;
+  }
+
+  shard->listener = sock;
+  obj->reuseport = 0;
+  return 0;
+}
+
+int netevt_group_listen_reuseport(netevt_group obj, enum address_family af,
+    const char* addr, uint16_t port, int backlog)
+{
+  size_t nb = 0;
+
+  /* each shard would bind its own ephemeral port, not one shared group */
+  if(port == 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(obj->started)
+  {
+    errno = EBUSY;
+    return -1;
+  }
+
+  for(size_t i = 0 ; i < obj->nb_shards ; i++)
+  {
+    if(obj->shards[i].listener != -1)
+    {
+      errno = EEXIST;
+      return -1;
+    }
+  }
+
+  for(nb = 0 ; nb < obj->nb_shards ; nb++)
+  {
+    struct netevt_group_shard* shard = &obj->shards[nb];
+    int sock = net_socket_create(af, NET_TCP, addr, port, 0,
+        NET_REUSE_ADDR | NET_REUSE_PORT);
+
+    if(sock == -1)
+    {
+      break;
+    }
+
+    if(listen(sock, backlog) == -1 || netevt_group_nonblock(sock) != 0 ||
+        netevt_add_socket(shard->nevt, sock, NETEVT_STATE_READ, NULL) != 0)
+    {
+      int err = errno;
+
+      close(sock);
+      errno = err;
+      break;
+    }
+
+    shard->listener = sock;
+  }
+
+  if(nb != obj->nb_shards)
+  {
+    int err = errno;
+
+    for(size_t i = 0 ; i < nb ; i++)
+    {
+      struct netevt_group_shard* shard = &obj->shards[i];
+
+      netevt_remove_socket(shard->nevt, shard->listener);
+      close(shard->listener);
+      shard->listener = -1;
+    }
+    errno = err;
+    return -1;
+  }
+
+  obj->reuseport = 1;
+  return 0;
+}
+
+int netevt_group_start(netevt_group obj,
+    const struct netevt_group_handler* handler,
+    const struct thread_affinity* affinity)
+{
+  struct thread_affinity pin;
+  unsigned int* cpus = NULL;
+  size_t nb = 0;
+  int err = 0;
+
+  if(obj->started)
+  {
+    errno = EBUSY;
+    return -1;
+  }
+
+  if(!handler)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(!affinity)
+  {
+    /* one core per shard, best effort */
+    size_t nb_cpus = sys_get_cores();
+
+    thread_affinity_init(&pin);
+    cpus = malloc(sizeof(unsigned int) * (nb_cpus ? nb_cpus : 1));
+    if(cpus && nb_cpus)
+    {
+      for(size_t i = 0 ; i < nb_cpus ; i++)
+      {
+        cpus[i] = (unsigned int)i;
+      }
+      pin.policy = THREAD_AFFINITY_CPUS;
+      pin.cpus = cpus;
+      pin.nb_cpus = nb_cpus;
+    }
+  }
+
+  obj->handler = *handler;
+  atomic_store(&obj->run, 1);
+
+  for(nb = 0 ; nb < obj->nb_shards ; nb++)
+  {
+    pthread_attr_t attr;
+    int ret = 0;
+
+    if(pthread_attr_init(&attr) != 0)
+    {
+      break;
+    }
+
+    if(affinity)
+    {
+      ret = thread_affinity_attr_set(affinity, nb, &attr);
+    }
+    else if(thread_affinity_attr_set(&pin, nb, &attr) != 0)
+    {
+      /* system cannot pin, run anywhere */
+      pthread_attr_destroy(&attr);
+      pthread_attr_init(&attr);
+    }
+
+    if(ret == 0)
+    {
+      ret = pthread_create(&obj->shards[nb].thread, &attr,
+          netevt_group_thread, &obj->shards[nb]);
+      if(ret != 0)
+      {
+        errno = ret;
+        ret = -1;
+      }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if(ret != 0)
+    {
+      break;
+    }
+  }
+
+  err = errno;
+  free(cpus);
+
+  if(nb != obj->nb_shards)
+  {
+    atomic_store(&obj->run, 0);
+    for(size_t i = 0 ; i < nb ; i++)
+    {
+      netevt_group_shard_wakeup(&obj->shards[i]);
+      pthread_join(obj->shards[i].thread, NULL);
+    }
+    errno = err;
+    return -1;
+  }
+
+  obj->started = 1;
+  return 0;
+}
+
+int netevt_group_stop(netevt_group obj)
+{
+  if(!obj->started)
+  {
+    return 0;
+  }
+
+  atomic_store(&obj->run, 0);
+
+  for(size_t i = 0 ; i < obj->nb_shards ; i++)
+  {
+    netevt_group_shard_wakeup(&obj->shards[i]);
+  }
+
+  for(size_t i = 0 ; i < obj->nb_shards ; i++)
+  {
+    pthread_join(obj->shards[i].thread, NULL);
+  }
+
+  obj->started = 0;
+  return 0;
+}
+
+int netevt_group_handoff(netevt_group obj, size_t shard, int sock)
+{
+  if(shard == NETEVT_GROUP_ANY)
+  {
+    shard = atomic_fetch_add(&obj->next, 1) % obj->nb_shards;
+  }
+  else if(shard >= obj->nb_shards)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(netevt_group_shard_push(&obj->shards[shard], sock) != 0)
+  {
+    return -1;
+  }
+
+  return (int)shard;
+}
+
+size_t netevt_group_size(netevt_group obj)
+{
+  return obj->nb_shards;
+}
+
+netevt netevt_group_get(netevt_group obj, size_t shard)
+{
+  if(shard >= obj->nb_shards)
+  {
+    return NULL;
+  }
+
+  return obj->shards[shard].nevt;
+}
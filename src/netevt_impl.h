@@ -20,7 +20,7 @@ struct netevt_impl
    * \brief Wait network events.
    */
   int (*wait)(struct netevt_impl* impl, netevt obj, int timeout,
-      struct netevt_event* events, size_t nb_events);
+      struct netevt_event_ptr* events, size_t nb_events);
 
   /**
    * \brief Add a socket.
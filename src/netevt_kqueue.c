@@ -77,8 +77,30 @@ struct netevt_kqueue
   unsigned int fds_next; /**< Next index in mntrs array. */
   struct kevent mntrs[NET_SFD_SETSIZE]; /**< Array of monitor events. */
   struct kevent trgrd[NET_SFD_SETSIZE]; /**< Array of triggered events. */
+  int changed; /**< If mntrs array has to be submitted on next wait. */
 };
 
+/**
+ * \brief Get kevent flags from an event mask.
+ * \param event_mask combination of NETEVT_STATE_* flag (read, write, ...).
+ * \return kevent flags.
+ */
+static int netevt_kqueue_flags(int event_mask)
+{
+  int flags = EV_ADD | EV_ENABLE;
+
+  if(event_mask & NETEVT_STATE_EDGE)
+  {
+    flags |= EV_CLEAR;
+  }
+  if(event_mask & NETEVT_STATE_ONESHOT)
+  {
+    flags |= EV_ONESHOT;
+  }
+
+  return flags;
+}
+
 /**
  * \brief Create a new network event implementation based on kqueue.
  * \return valid pointer if success, NULL otherwise.
@@ -122,12 +144,12 @@ static void netevt_kqueue_free(struct netevt_kqueue** obj)
  * \param impl network event implementation.
  * \param obj network event manager.
  * \param timeout timeout in second.
- * \param events allocated array of netevt_event.
+ * \param events allocated array of netevt_event_ptr.
  * \param events_nb number of elements in events array.
  * \return 0 if timeout, number of elements notified if success and -1 if error.
  */
 static int netevt_kqueue_wait(struct netevt_impl* impl, netevt obj, int timeout,
-    struct netevt_event* events, size_t nb_events)
+    struct netevt_event_ptr* events, size_t nb_events)
 {
   int ret = 0;
   struct netevt_kqueue* impl_kqueue = impl->priv;
@@ -142,8 +164,12 @@ static int netevt_kqueue_wait(struct netevt_impl* impl, netevt obj, int timeout,
     ts.tv_nsec = 0;
   }
 
-  ret = kevent(impl_kqueue->kq, impl_kqueue->mntrs, impl_kqueue->nsock,
-      impl_kqueue->trgrd, NET_SFD_SETSIZE,
+  /* submitting again the monitors would rearm one-shot and edge-triggered
+   * sockets so only do it when they are modified
+   */
+  ret = kevent(impl_kqueue->kq, impl_kqueue->mntrs,
+      impl_kqueue->changed ? impl_kqueue->nsock : 0, impl_kqueue->trgrd,
+      nb_events < NET_SFD_SETSIZE ? (int)nb_events : NET_SFD_SETSIZE,
       ((timeout != -1) ? &ts : NULL));
 
   if(ret == -1)
@@ -151,7 +177,10 @@ static int netevt_kqueue_wait(struct netevt_impl* impl, netevt obj, int timeout,
     /* error */
     return -1;
   }
-  else if(ret == 0)
+
+  impl_kqueue->changed = 0;
+
+  if(ret == 0)
   {
     /* timeout */
     return 0;
@@ -167,6 +196,19 @@ static int netevt_kqueue_wait(struct netevt_impl* impl, netevt obj, int timeout,
 
       /* TODO EV_EOF/EV_ERROR */
 
+      if(impl_kqueue->trgrd[i].flags & EV_ONESHOT)
+      {
+        /* kernel dropped the monitor, keep it disabled if submitted again */
+        for(unsigned int k = 0 ; k < impl_kqueue->fds_next ; k++)
+        {
+          if(impl_kqueue->mntrs[k].ident == impl_kqueue->trgrd[i].ident)
+          {
+            impl_kqueue->mntrs[k].flags = EV_ADD | EV_DISABLE;
+            break;
+          }
+        }
+      }
+
       /* 0 = check read state
        * 1 = check write state
        */
@@ -176,7 +218,7 @@ static int netevt_kqueue_wait(struct netevt_impl* impl, netevt obj, int timeout,
         int state = 0;
         int extra = 0;
 
-        if(nb > nb_events)
+        if(nb >= nb_events)
         {
           return (int)nb;
         }
@@ -205,10 +247,8 @@ static int netevt_kqueue_wait(struct netevt_impl* impl, netevt obj, int timeout,
         {
           if(!already)
           {
-            events[nb].socket =
-              *((struct netevt_socket*)GET_UDATA(impl_kqueue->trgrd[i].udata));
-            events[nb].ptr=
-		(struct netevt_socket*)GET_UDATA(impl_kqueue->trgrd[i].udata);
+            events[nb].ptr =
+              (struct netevt_socket*)GET_UDATA(impl_kqueue->trgrd[i].udata);
             events[nb].state = state;
           }
           else
@@ -224,6 +264,9 @@ static int netevt_kqueue_wait(struct netevt_impl* impl, netevt obj, int timeout,
         nb++;
       }
     }
+
+    /* sockets with several states count once */
+    ret = (int)nb;
   }
 
   return ret;
@@ -267,8 +310,9 @@ static int netevt_kqueue_add_socket(struct netevt_impl* impl, netevt obj,
   }
 
   EV_SET(&impl_kqueue->mntrs[impl_kqueue->fds_next], sock->sock, evt,
-      EV_ADD | EV_ENABLE, extra, 0, CAST_UDATA(sock));
+      netevt_kqueue_flags(event_mask), extra, 0, CAST_UDATA(sock));
   impl_kqueue->fds_next++;
+  impl_kqueue->changed = 1;
   impl_kqueue->nsock++;
 
   return ret;
@@ -312,7 +356,8 @@ static int netevt_kqueue_set_socket(struct netevt_impl* impl, netevt obj,
     if(impl_kqueue->mntrs[i].ident == (uintptr_t)sock->sock)
     {
       EV_SET(&impl_kqueue->mntrs[i], sock->sock, evt,
-          EV_ADD | EV_ENABLE, extra, 0, CAST_UDATA(sock));
+          netevt_kqueue_flags(event_mask), extra, 0, CAST_UDATA(sock));
+      impl_kqueue->changed = 1;
       ret = 0;
       break;
     }
@@ -23,6 +23,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include <time.h>
 
 #include <sys/time.h>
@@ -32,6 +34,19 @@
 #include "util_net.h"
 #include "netevt_poll.h"
 
+/**
+ * \def NETEVT_POLL_FDS_SIZE
+ * \brief Initial number of elements of the fds array.
+ */
+#define NETEVT_POLL_FDS_SIZE 64
+
+/**
+ * \def NETEVT_POLL_FD
+ * \brief Descriptor of a fds element, disabled ones are stored as ~fd so that
+ * poll ignores them (even for POLLHUP or POLLERR).
+ */
+#define NETEVT_POLL_FD(fd) ((fd) < 0 ? ~(fd) : (fd))
+
 /**
  * \struct netevt_poll
  * \brief Poll network event implementation.
@@ -40,9 +55,70 @@ struct netevt_poll
 {
   unsigned int nsock; /**< Current number of sockets. */
   unsigned int fds_next; /**< Next free index of fds array. */
-  struct pollfd fds[NET_SFD_SETSIZE]; /**< Poll structure to handle event. */
+  unsigned int fds_size; /**< Number of elements of fds array. */
+  struct pollfd* fds; /**< Poll structures to handle event, grows on need. */
+  char* oneshot; /**< One-shot flag of each element of fds array. */
+  unsigned int* index; /**< Index in fds array, indexed by descriptor. */
+  size_t index_size; /**< Number of elements of index array. */
 };
 
+/**
+ * \brief Grow the index array so that it can index a descriptor.
+ * \param obj poll implementation.
+ * \param sock socket descriptor.
+ * \return 0 if success, -1 otherwise.
+ */
+static int netevt_poll_index_reserve(struct netevt_poll* obj, int sock)
+{
+  unsigned int* index = NULL;
+  size_t size = obj->index_size ? obj->index_size : NETEVT_POLL_FDS_SIZE;
+
+  if((size_t)sock < obj->index_size)
+  {
+    return 0;
+  }
+
+  while(size <= (size_t)sock)
+  {
+    size *= 2;
+  }
+
+  index = realloc(obj->index, sizeof(unsigned int) * size);
+  if(!index)
+  {
+    return -1;
+  }
+
+  obj->index = index;
+  obj->index_size = size;
+  return 0;
+}
+
+/**
+ * \brief Convert an event mask to poll events.
+ * \param event_mask combination of NETEVT_STATE_* flag (read, write, ...).
+ * \return poll events.
+ */
+static short netevt_poll_events(int event_mask)
+{
+  short events = 0;
+
+  if(event_mask & NETEVT_STATE_READ)
+  {
+    events |= POLLIN;
+  }
+  if(event_mask & NETEVT_STATE_WRITE)
+  {
+    events |= POLLOUT;
+  }
+  if(event_mask & NETEVT_STATE_OTHER)
+  {
+    events |= POLLPRI;
+  }
+
+  return events;
+}
+
 /**
  * \brief Create a new network event implementation based on poll.
  * \return valid pointer if success, NULL otherwise.
@@ -57,8 +133,19 @@ static struct netevt_poll* netevt_poll_new(void)
   }
 
   memset(ret, 0x00, sizeof(struct netevt_poll));
+  ret->fds = malloc(sizeof(struct pollfd) * NETEVT_POLL_FDS_SIZE);
+  ret->oneshot = malloc(sizeof(char) * NETEVT_POLL_FDS_SIZE);
+  if(!ret->fds || !ret->oneshot)
+  {
+    free(ret->fds);
+    free(ret->oneshot);
+    free(ret);
+    return NULL;
+  }
+
   ret->nsock = 0;
   ret->fds_next = 0;
+  ret->fds_size = NETEVT_POLL_FDS_SIZE;
 
   return ret;
 }
@@ -69,6 +156,9 @@ static struct netevt_poll* netevt_poll_new(void)
  */
 static void netevt_poll_free(struct netevt_poll** obj)
 {
+  free((*obj)->index);
+  free((*obj)->oneshot);
+  free((*obj)->fds);
   free(*obj);
   *obj = NULL;
 }
@@ -78,16 +168,15 @@ static void netevt_poll_free(struct netevt_poll** obj)
  * \param impl network event implementation.
  * \param obj network event manager.
  * \param timeout timeout in second.
- * \param events allocated array of netevt_event.
+ * \param events allocated array of netevt_event_ptr.
  * \param nb_events number of elements in events array.
  * \return 0 if timeout, number of elements notified if success and -1 if error.
  */
 static int netevt_poll_wait(struct netevt_impl* impl, netevt obj, int timeout,
-    struct netevt_event* events, size_t nb_events)
+    struct netevt_event_ptr* events, size_t nb_events)
 {
   int ret = 0;
   struct netevt_poll* impl_poll = impl->priv;
-  struct list_head* sockets = netevt_get_sockets_list(obj);
   /* -1 is infinite */
   int timeout_ms = timeout != -1 ? timeout * 1000 : -1;
 
@@ -106,24 +195,21 @@ static int netevt_poll_wait(struct netevt_impl* impl, netevt obj, int timeout,
   else if(ret > 0)
   {
     /* at least one descriptor is ready for read, write or other */
-    struct list_head* pos = NULL;
-    struct list_head* tmp = NULL;
-    unsigned int idx = 0;
     size_t nb = 0;
 
-    list_head_iterate_safe(sockets, pos, tmp)
+    for(unsigned int idx = 0 ; idx < impl_poll->fds_next ; idx++)
     {
-      struct netevt_socket* s = list_head_get(pos, struct netevt_socket,
-          list);
+      struct netevt_socket* s = NULL;
       int already = 0;
 
       if(impl_poll->fds[idx].revents == 0)
       {
         /* no events to go the next */
-        idx++;
         continue;
       }
 
+      s = netevt_get_socket(obj, impl_poll->fds[idx].fd);
+
       /* 0 = check read state
        * 1 = check write state
        * 2 = check exception state
@@ -133,7 +219,7 @@ static int netevt_poll_wait(struct netevt_impl* impl, netevt obj, int timeout,
         int evt = 0;
         int state = 0;
 
-        if(nb > nb_events)
+        if(nb >= nb_events)
         {
           return (int)nb;
         }
@@ -161,7 +247,6 @@ static int netevt_poll_wait(struct netevt_impl* impl, netevt obj, int timeout,
         {
           if(!already)
           {
-            events[nb].socket = *s;
             events[nb].ptr = s;
             events[nb].state = state;
             already = 1;
@@ -175,10 +260,19 @@ static int netevt_poll_wait(struct netevt_impl* impl, netevt obj, int timeout,
 
       if(already)
       {
+        if(impl_poll->oneshot[idx])
+        {
+          /* disable socket until it is modified, events = 0 is not enough
+           * as poll always reports hang-up and errors
+           */
+          impl_poll->fds[idx].fd = ~impl_poll->fds[idx].fd;
+        }
         nb++;
       }
-      idx++;
     }
+
+    /* sockets with several states count once */
+    ret = (int)nb;
   }
 
   return ret;
@@ -201,27 +295,49 @@ static int netevt_poll_add_socket(struct netevt_impl* impl, netevt obj,
 
   (void)obj;
 
-  if(idx >= NET_SFD_SETSIZE)
+  if(netevt_poll_index_reserve(impl_poll, sock->sock) != 0)
   {
     return -1;
   }
 
-  impl_poll->fds[idx].fd = sock->sock;
-  impl_poll->fds[idx].events = 0;
-
-  if(event_mask & NETEVT_STATE_READ)
+  if(idx >= impl_poll->fds_size)
   {
-    impl_poll->fds[idx].events |= POLLIN;
-  }
-  if(event_mask & NETEVT_STATE_WRITE)
-  {
-    impl_poll->fds[idx].events |= POLLOUT;
-  }
-  if(event_mask & NETEVT_STATE_OTHER)
-  {
-    impl_poll->fds[idx].events |= POLLPRI;
+    /* double the arrays */
+    struct pollfd* fds = NULL;
+    char* oneshot = NULL;
+
+    if(impl_poll->fds_size > UINT_MAX / 2)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    fds = realloc(impl_poll->fds,
+        sizeof(struct pollfd) * impl_poll->fds_size * 2);
+    if(!fds)
+    {
+      return -1;
+    }
+
+    impl_poll->fds = fds;
+
+    oneshot = realloc(impl_poll->oneshot,
+        sizeof(char) * impl_poll->fds_size * 2);
+    if(!oneshot)
+    {
+      return -1;
+    }
+
+    impl_poll->oneshot = oneshot;
+    impl_poll->fds_size *= 2;
   }
 
+  impl_poll->fds[idx].fd = sock->sock;
+  impl_poll->fds[idx].events = netevt_poll_events(event_mask);
+  impl_poll->fds[idx].revents = 0;
+  impl_poll->oneshot[idx] = (event_mask & NETEVT_STATE_ONESHOT) != 0;
+  impl_poll->index[sock->sock] = idx;
+
   impl_poll->fds_next++;
   impl_poll->nsock++;
 
@@ -239,43 +355,30 @@ static int netevt_poll_add_socket(struct netevt_impl* impl, netevt obj,
 static int netevt_poll_set_socket(struct netevt_impl* impl, netevt obj,
     struct netevt_socket* sock, int event_mask)
 {
-  int ret = 0;
   struct netevt_poll* impl_poll = impl->priv;
-  unsigned int i = 0;
+  unsigned int idx = 0;
 
   (void)obj;
 
-  for(i = 0 ; i < NET_SFD_SETSIZE ; i++)
+  if((size_t)sock->sock >= impl_poll->index_size)
   {
-    if(impl_poll->fds[i].fd == sock->sock)
-    {
-      /* reset and modify the event mask */
-      impl_poll->fds[i].events = 0;
-
-      if(event_mask & NETEVT_STATE_READ)
-      {
-        impl_poll->fds[i].events |= POLLIN;
-      }
-      if(event_mask & NETEVT_STATE_WRITE)
-      {
-        impl_poll->fds[i].events |= POLLOUT;
-      }
-      if(event_mask & NETEVT_STATE_OTHER)
-      {
-        impl_poll->fds[i].events |= POLLPRI;
-      }
-      ret = 0;
-      break;
-    }
+    /* not found */
+    return -1;
   }
 
-  if(i == NET_SFD_SETSIZE)
+  idx = impl_poll->index[sock->sock];
+  if(idx >= impl_poll->fds_next ||
+      NETEVT_POLL_FD(impl_poll->fds[idx].fd) != sock->sock)
   {
     /* not found */
-    ret = -1;
+    return -1;
   }
 
-  return ret;
+  /* reset and modify the event mask, it rearms a one-shot socket */
+  impl_poll->fds[idx].fd = sock->sock;
+  impl_poll->fds[idx].events = netevt_poll_events(event_mask);
+  impl_poll->oneshot[idx] = (event_mask & NETEVT_STATE_ONESHOT) != 0;
+  return 0;
 }
 
 /**
@@ -288,42 +391,41 @@ static int netevt_poll_set_socket(struct netevt_impl* impl, netevt obj,
 static int netevt_poll_remove_socket(struct netevt_impl* impl, netevt obj,
     struct netevt_socket* sock)
 {
-  int ret = 0;
   struct netevt_poll* impl_poll = impl->priv;
-  unsigned int i = 0;
+  unsigned int idx = 0;
+  unsigned int last = 0;
 
   (void)obj;
 
-  for(i = 0 ; i < NET_SFD_SETSIZE ; i++)
+  if((size_t)sock->sock >= impl_poll->index_size)
   {
-    if(impl_poll->fds[i].fd == sock->sock)
-    {
-      impl_poll->fds[i].fd = -1;
-      impl_poll->fds[i].events = 0;
-      break;
-    }
+    /* not found */
+    return -1;
   }
 
-  if(i == NET_SFD_SETSIZE)
+  idx = impl_poll->index[sock->sock];
+  if(idx >= impl_poll->fds_next ||
+      NETEVT_POLL_FD(impl_poll->fds[idx].fd) != sock->sock)
   {
     /* not found */
     return -1;
   }
 
-  impl_poll->nsock--;
-  impl_poll->fds_next--;
-
-  if(i < (unsigned int)impl_poll->nsock)
+  /* move the last element in the hole so that array stays dense */
+  last = impl_poll->fds_next - 1;
+  if(idx != last)
   {
-    /* reorder array */
-    for(unsigned int j = i ; j < (unsigned int)impl_poll->nsock ; j++)
-    {
-      impl_poll->fds[j].fd = impl_poll->fds[j + 1].fd;
-      impl_poll->fds[j].events = impl_poll->fds[j + 1].events;
-    }
+    impl_poll->fds[idx] = impl_poll->fds[last];
+    impl_poll->oneshot[idx] = impl_poll->oneshot[last];
+    impl_poll->index[NETEVT_POLL_FD(impl_poll->fds[idx].fd)] = idx;
   }
 
-  return ret;
+  impl_poll->fds[last].fd = -1;
+  impl_poll->fds[last].events = 0;
+  impl_poll->nsock--;
+  impl_poll->fds_next--;
+
+  return 0;
 }
 
 int netevt_poll_init(struct netevt_impl* impl)
@@ -42,6 +42,7 @@ struct netevt_select
   sfd_set fdsr; /**< Read set. */
   sfd_set fdsw; /**< Write set. */
   sfd_set fdse; /**< Exception set. */
+  sfd_set fdso; /**< One-shot set. */
 };
 
 /**
@@ -60,6 +61,7 @@ static struct netevt_select* netevt_select_new(void)
   NET_SFD_ZERO(&ret->fdsr);
   NET_SFD_ZERO(&ret->fdsw);
   NET_SFD_ZERO(&ret->fdse);
+  NET_SFD_ZERO(&ret->fdso);
 
   return ret;
 }
@@ -79,12 +81,12 @@ static void netevt_select_free(struct netevt_select** obj)
  * \param impl network event implementation.
  * \param obj network event manager.
  * \param timeout timeout in second.
- * \param events allocated array of netevt_event.
+ * \param events allocated array of netevt_event_ptr.
  * \param nb_events number of elements in events array.
  * \return 0 if timeout, number of elements notified if success and -1 if error.
  */
 static int netevt_select_wait(struct netevt_impl* impl, netevt obj, int timeout,
-    struct netevt_event* events, size_t nb_events)
+    struct netevt_event_ptr* events, size_t nb_events)
 {
   int ret = 0;
   struct netevt_select* impl_select = impl->priv;
@@ -137,7 +139,7 @@ static int netevt_select_wait(struct netevt_impl* impl, netevt obj, int timeout,
         sfd_set* fds = NULL;
         int state = 0;
 
-        if(nb > nb_events)
+        if(nb >= nb_events)
         {
           return (int)nb;
         }
@@ -165,7 +167,6 @@ static int netevt_select_wait(struct netevt_impl* impl, netevt obj, int timeout,
         {
           if(!already)
           {
-            events[nb].socket = *s;
             events[nb].ptr = s;
             events[nb].state = state;
           }
@@ -179,10 +180,19 @@ static int netevt_select_wait(struct netevt_impl* impl, netevt obj, int timeout,
 
       if(already)
       {
+        if(NET_SFD_ISSET(s->sock, &impl_select->fdso))
+        {
+          /* disable socket until it is modified */
+          NET_SFD_CLR(s->sock, &impl_select->fdsr);
+          NET_SFD_CLR(s->sock, &impl_select->fdsw);
+          NET_SFD_CLR(s->sock, &impl_select->fdse);
+        }
         nb++;
       }
-
     }
+
+    /* sockets with several states count once */
+    ret = (int)nb;
   }
 
   return ret;
@@ -221,6 +231,10 @@ static int netevt_select_add_socket(struct netevt_impl* impl, netevt obj,
   {
     NET_SFD_SET(sock->sock, &impl_select->fdse);
   }
+  if(event_mask & NETEVT_STATE_ONESHOT)
+  {
+    NET_SFD_SET(sock->sock, &impl_select->fdso);
+  }
 
   return ret;
 }
@@ -244,6 +258,7 @@ static int netevt_select_set_socket(struct netevt_impl* impl, netevt obj,
   NET_SFD_CLR(sock->sock, &impl_select->fdsr);
   NET_SFD_CLR(sock->sock, &impl_select->fdsw);
   NET_SFD_CLR(sock->sock, &impl_select->fdse);
+  NET_SFD_CLR(sock->sock, &impl_select->fdso);
 
   if(event_mask & NETEVT_STATE_READ)
   {
@@ -257,6 +272,10 @@ static int netevt_select_set_socket(struct netevt_impl* impl, netevt obj,
   {
     NET_SFD_SET(sock->sock, &impl_select->fdse);
   }
+  if(event_mask & NETEVT_STATE_ONESHOT)
+  {
+    NET_SFD_SET(sock->sock, &impl_select->fdso);
+  }
 
   return ret;
 }
@@ -284,6 +303,7 @@ static int netevt_select_remove_socket(struct netevt_impl* impl, netevt obj,
   NET_SFD_CLR(sock->sock, &impl_select->fdsr);
   NET_SFD_CLR(sock->sock, &impl_select->fdsw);
   NET_SFD_CLR(sock->sock, &impl_select->fdse);
+  NET_SFD_CLR(sock->sock, &impl_select->fdso);
 
   return ret;
 }
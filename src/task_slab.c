@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file task_slab.c
+ * \brief Fixed size node allocator for thread pool and dispatcher tasks.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "task_slab.h"
+
+/**
+ * \def TASK_SLAB_BATCH
+ * \brief Number of nodes moved at once between a cache and the shared list.
+ */
+#define TASK_SLAB_BATCH 32
+
+/**
+ * \struct task_slab_node
+ * \brief Free node header.
+ */
+struct task_slab_node
+{
+  struct task_slab_node* next; /**< Next free node. */
+};
+
+/**
+ * \union task_slab_chunk
+ * \brief Header of an allocated chunk, nodes follow it.
+ */
+union task_slab_chunk
+{
+  union task_slab_chunk* next; /**< Next chunk. */
+  long double align_ld; /**< Keep nodes suitably aligned. */
+  void* align_ptr; /**< Keep nodes suitably aligned. */
+};
+
+/**
+ * \struct task_slab
+ * \brief Slab allocator.
+ */
+struct task_slab
+{
+  pthread_mutex_t mutex; /**< Mutex to protect free list and chunks. */
+  struct task_slab_node* free_list; /**< Shared free list. */
+  union task_slab_chunk* chunks; /**< List of chunks. */
+  size_t node_size; /**< Size of one node. */
+  size_t chunk_nodes; /**< Number of nodes per chunk. */
+};
+
+/**
+ * \brief Allocate a new chunk and add its nodes to the free list.
+ * \param obj slab allocator.
+ * \return 0 if success, -1 otherwise.
+ * \note mutex has to be locked.
+ */
+static int task_slab_grow(struct task_slab* obj)
+{
+  union task_slab_chunk* chunk = NULL;
+  char* nodes = NULL;
+
+  chunk = malloc(sizeof(union task_slab_chunk) +
+      obj->node_size * obj->chunk_nodes);
+  if(!chunk)
+  {
+    return -1;
+  }
+
+  chunk->next = obj->chunks;
+  obj->chunks = chunk;
+  nodes = (char*)(chunk + 1);
+
+  for(size_t i = 0 ; i < obj->chunk_nodes ; i++)
+  {
+    struct task_slab_node* node =
+      (struct task_slab_node*)(nodes + i * obj->node_size);
+
+    node->next = obj->free_list;
+    obj->free_list = node;
+  }
+
+  return 0;
+}
+
+struct task_slab* task_slab_new(size_t node_size, size_t chunk_nodes)
+{
+  struct task_slab* ret = NULL;
+
+  ret = malloc(sizeof(struct task_slab));
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  if(pthread_mutex_init(&ret->mutex, NULL) != 0)
+  {
+    free(ret);
+    return NULL;
+  }
+
+  /* keep nodes aligned as the chunk header */
+  if(node_size < sizeof(struct task_slab_node))
+  {
+    node_size = sizeof(struct task_slab_node);
+  }
+  node_size = (node_size + sizeof(union task_slab_chunk) - 1) /
+    sizeof(union task_slab_chunk) * sizeof(union task_slab_chunk);
+
+  ret->free_list = NULL;
+  ret->chunks = NULL;
+  ret->node_size = node_size;
+  ret->chunk_nodes = chunk_nodes ? chunk_nodes : 1;
+
+  return ret;
+}
+
+void task_slab_free(struct task_slab** obj)
+{
+  union task_slab_chunk* chunk = (*obj)->chunks;
+
+  while(chunk)
+  {
+    union task_slab_chunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  pthread_mutex_destroy(&(*obj)->mutex);
+  free(*obj);
+  *obj = NULL;
+}
+
+void* task_slab_alloc(struct task_slab* obj, struct task_slab_cache* cache)
+{
+  struct task_slab_node* node = NULL;
+
+  if(cache && cache->head)
+  {
+    node = cache->head;
+    cache->head = node->next;
+    cache->nb--;
+    return node;
+  }
+
+  if(pthread_mutex_lock(&obj->mutex) != 0)
+  {
+    return NULL;
+  }
+
+  if(!obj->free_list && task_slab_grow(obj) != 0)
+  {
+    pthread_mutex_unlock(&obj->mutex);
+    return NULL;
+  }
+
+  node = obj->free_list;
+  obj->free_list = node->next;
+
+  if(cache)
+  {
+    /* refill the cache while we hold the lock */
+    while(obj->free_list && cache->nb < TASK_SLAB_BATCH)
+    {
+      struct task_slab_node* n = obj->free_list;
+
+      obj->free_list = n->next;
+      n->next = cache->head;
+      cache->head = n;
+      cache->nb++;
+    }
+  }
+  pthread_mutex_unlock(&obj->mutex);
+
+  return node;
+}
+
+size_t task_slab_alloc_batch(struct task_slab* obj,
+    struct task_slab_cache* cache, void** nodes, size_t nb)
+{
+  size_t ret = 0;
+
+  while(cache && cache->head && ret < nb)
+  {
+    struct task_slab_node* node = cache->head;
+
+    cache->head = node->next;
+    cache->nb--;
+    nodes[ret++] = node;
+  }
+
+  if(ret == nb || pthread_mutex_lock(&obj->mutex) != 0)
+  {
+    return ret;
+  }
+
+  while(ret < nb)
+  {
+    struct task_slab_node* node = NULL;
+
+    if(!obj->free_list && task_slab_grow(obj) != 0)
+    {
+      break;
+    }
+
+    node = obj->free_list;
+    obj->free_list = node->next;
+    nodes[ret++] = node;
+  }
+  pthread_mutex_unlock(&obj->mutex);
+
+  return ret;
+}
+
+void task_slab_release(struct task_slab* obj, struct task_slab_cache* cache,
+    void* node)
+{
+  struct task_slab_node* n = node;
+
+  if(cache)
+  {
+    n->next = cache->head;
+    cache->head = n;
+    cache->nb++;
+
+    if(cache->nb < 2 * TASK_SLAB_BATCH)
+    {
+      return;
+    }
+
+    /* give back a batch to the shared list */
+    if(pthread_mutex_lock(&obj->mutex) == 0)
+    {
+      for(size_t i = 0 ; i < TASK_SLAB_BATCH ; i++)
+      {
+        n = cache->head;
+        cache->head = n->next;
+        cache->nb--;
+        n->next = obj->free_list;
+        obj->free_list = n;
+      }
+      pthread_mutex_unlock(&obj->mutex);
+    }
+    return;
+  }
+
+  if(pthread_mutex_lock(&obj->mutex) == 0)
+  {
+    n->next = obj->free_list;
+    obj->free_list = n;
+    pthread_mutex_unlock(&obj->mutex);
+  }
+}
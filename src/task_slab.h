@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file task_slab.h
+ * \brief Fixed size node allocator for thread pool and dispatcher tasks.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_TASK_SLAB_H
+#define VSUTILS_TASK_SLAB_H
+
+#include <stddef.h>
+
+/**
+ * \struct task_slab
+ * \brief Opaque slab allocator.
+ *
+ * Nodes are carved from chunks allocated on demand and never returned to
+ * the system before task_slab_free(). Free nodes are kept in a shared free
+ * list and in per-thread caches that are moved to/from the shared list in
+ * batches.
+ */
+struct task_slab;
+
+/**
+ * \struct task_slab_cache
+ * \brief Per-thread cache of free nodes.
+ *
+ * A cache must only be used by one thread at a time. Initialize it with
+ * zeros.
+ */
+struct task_slab_cache
+{
+  void* head; /**< First free node. */
+  size_t nb; /**< Number of free nodes. */
+};
+
+/**
+ * \brief Create a new slab allocator.
+ * \param node_size size of one node.
+ * \param chunk_nodes number of nodes allocated at once when empty.
+ * \return new slab allocator or NULL if failure.
+ */
+struct task_slab* task_slab_new(size_t node_size, size_t chunk_nodes);
+
+/**
+ * \brief Delete a slab allocator and all its nodes.
+ * \param obj pointer on slab allocator.
+ */
+void task_slab_free(struct task_slab** obj);
+
+/**
+ * \brief Allocate a node.
+ * \param obj slab allocator.
+ * \param cache cache of the calling thread or NULL to use shared list.
+ * \return node or NULL if failure.
+ */
+void* task_slab_alloc(struct task_slab* obj, struct task_slab_cache* cache);
+
+/**
+ * \brief Allocate several nodes, taking the shared lock at most once.
+ * \param obj slab allocator.
+ * \param cache cache of the calling thread or NULL to use shared list.
+ * \param nodes array that will be filled with nodes.
+ * \param nb number of nodes to allocate.
+ * \return number of nodes allocated, less than nb if memory is exhausted.
+ */
+size_t task_slab_alloc_batch(struct task_slab* obj,
+    struct task_slab_cache* cache, void** nodes, size_t nb);
+
+/**
+ * \brief Release a node.
+ * \param obj slab allocator.
+ * \param cache cache of the calling thread or NULL to use shared list.
+ * \param node node to release.
+ */
+void task_slab_release(struct task_slab* obj, struct task_slab_cache* cache,
+    void* node);
+
+#endif /* VSUTILS_TASK_SLAB_H */
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file thread_affinity.c
+ * \brief CPU affinity of worker threads.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifdef __linux__
+/* cpu_set_t and pthread_*affinity_np() */
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "thread_affinity.h"
+#include "util_sys.h"
+
+void thread_affinity_init(struct thread_affinity* obj)
+{
+  obj->policy = THREAD_AFFINITY_NONE;
+  obj->cpus = NULL;
+  obj->nb_cpus = 0;
+}
+
+#ifdef __linux__
+
+/**
+ * \brief Compute the CPU set of a worker.
+ * \param obj affinity.
+ * \param index index of the worker.
+ * \param set CPU set that will be filled.
+ * \return 1 if worker has to be pinned, 0 if not and -1 if affinity is not
+ * valid.
+ */
+static int thread_affinity_cpuset(const struct thread_affinity* obj,
+    size_t index, cpu_set_t* set)
+{
+  CPU_ZERO(set);
+
+  if(obj->policy == THREAD_AFFINITY_NONE)
+  {
+    return 0;
+  }
+  else if(obj->policy == THREAD_AFFINITY_CPUS)
+  {
+    unsigned int cpu = 0;
+
+    if(!obj->cpus || obj->nb_cpus == 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+    cpu = obj->cpus[index % obj->nb_cpus];
+    if(cpu >= CPU_SETSIZE)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+    CPU_SET(cpu, set);
+    return 1;
+  }
+  else if(obj->policy == THREAD_AFFINITY_NODES)
+  {
+    unsigned int cores[CPU_SETSIZE];
+    size_t nodes = sys_get_nodes();
+    int nb = 0;
+
+    if(nodes <= 1)
+    {
+      /* whole system is one node */
+      return 0;
+    }
+
+    nb = sys_get_node_cores(index % nodes, cores, CPU_SETSIZE);
+    if(nb <= 0)
+    {
+      /* node without CPU */
+      return 0;
+    }
+
+    for(int i = 0 ; i < nb && i < CPU_SETSIZE ; i++)
+    {
+      CPU_SET(cores[i], set);
+    }
+    return 1;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+int thread_affinity_attr_set(const struct thread_affinity* obj, size_t index,
+    pthread_attr_t* attr)
+{
+  cpu_set_t set;
+  int ret = thread_affinity_cpuset(obj, index, &set);
+
+  if(ret <= 0)
+  {
+    return ret;
+  }
+
+  ret = pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set);
+  if(ret != 0)
+  {
+    errno = ret;
+    return -1;
+  }
+
+  return 0;
+}
+
+int thread_affinity_set(const struct thread_affinity* obj, size_t index)
+{
+  cpu_set_t set;
+  int ret = thread_affinity_cpuset(obj, index, &set);
+
+  if(ret <= 0)
+  {
+    return ret;
+  }
+
+  ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+  if(ret != 0)
+  {
+    errno = ret;
+    return -1;
+  }
+
+  return 0;
+}
+
+#else
+
+int thread_affinity_attr_set(const struct thread_affinity* obj, size_t index,
+    pthread_attr_t* attr)
+{
+  (void)index;
+  (void)attr;
+
+  if(obj->policy == THREAD_AFFINITY_NONE)
+  {
+    return 0;
+  }
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int thread_affinity_set(const struct thread_affinity* obj, size_t index)
+{
+  (void)index;
+
+  if(obj->policy == THREAD_AFFINITY_NONE)
+  {
+    return 0;
+  }
+
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif /* __linux__ */
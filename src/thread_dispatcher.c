@@ -22,17 +22,80 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <signal.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #include <sys/time.h>
 #include <time.h>
 #include <pthread.h>
 
 #include "thread_dispatcher.h"
+#include "task_slab.h"
+#include "thread_dispatcher_color.h"
+#include "thread_dispatcher_inbox.h"
+#include "worker_wait.h"
+#include "worker_stats.h"
+
+/**
+ * \def THREAD_DISPATCHER_SLAB_NODES
+ * \brief Number of task nodes allocated at once by the slab.
+ */
+#define THREAD_DISPATCHER_SLAB_NODES 256
+
+/**
+ * \def THREAD_DISPATCHER_TASK_SLAB
+ * \brief Task flag set when the node storage belongs to the dispatcher slab.
+ */
+#define THREAD_DISPATCHER_TASK_SLAB 1
+
+/**
+ * \def THREAD_DISPATCHER_TASK_COLOR
+ * \brief Task flag set when the task is accounted in the color table.
+ */
+#define THREAD_DISPATCHER_TASK_COLOR 2
+
+/**
+ * \def THREAD_DISPATCHER_POP_BATCH
+ * \brief Maximum number of tasks a worker pops at once.
+ */
+#define THREAD_DISPATCHER_POP_BATCH 16
+
+/**
+ * \def THREAD_DISPATCHER_PUSH_BATCH
+ * \brief Number of task nodes allocated at once by batch push.
+ */
+#define THREAD_DISPATCHER_PUSH_BATCH 64
+
+/**
+ * \def THREAD_DISPATCHER_SPIN
+ * \brief Default maximum time (us) an idle worker spins before parking.
+ */
+#define THREAD_DISPATCHER_SPIN 50
+
+/**
+ * \def THREAD_DISPATCHER_YIELD
+ * \brief Default number of yields of an idle worker before parking.
+ */
+#define THREAD_DISPATCHER_YIELD 4
+
+/**
+ * \def THREAD_DISPATCHER_REBALANCE
+ * \brief Default queue depth gap for a color to move to another worker.
+ */
+#define THREAD_DISPATCHER_REBALANCE 4
+
+/**
+ * \def THREAD_DISPATCHER_CACHE_LINE
+ * \brief Cache line size, workers and their fields written by producers are
+ * aligned on it.
+ */
+#define THREAD_DISPATCHER_CACHE_LINE 64
 
 /**
  * \struct thread_dispatcher.
@@ -51,29 +114,64 @@ struct thread_dispatcher
   pthread_mutex_t mutex_start;
 
   /**
-   * \brief Condition to notify the start.
+   * \brief Condition to notify the start, the stop and the end of a drain.
    */
   pthread_cond_t cond_start;
 
   /**
-   * \brief RW mutex to protect run state.
+   * \brief Status of the dispatcher (1 run, 0 stop, -1 quit).
+   */
+  atomic_int run;
+
+  /**
+   * \brief Whether or not only workers can push tasks.
+   */
+  atomic_int draining;
+
+  /**
+   * \brief Array of threads worker, each allocated by its own thread.
+   */
+  struct thread_worker** threads;
+
+  /**
+   * \brief Allocator of task nodes.
+   */
+  struct task_slab* slab;
+
+  /**
+   * \brief Whether or not workers measure times.
+   */
+  int stats;
+
+  /**
+   * \brief Color to worker mapping.
+   */
+  size_t (*map)(uint32_t, size_t, void*);
+
+  /**
+   * \brief Last argument of the map function.
+   */
+  void* map_data;
+
+  /**
+   * \brief Active colors, NULL if rebalancing is disabled.
    */
-  pthread_rwlock_t mutex_run;
+  struct thread_dispatcher_color* colors;
 
   /**
-   * \brief Status of the dispatcher.
+   * \brief Queue depth gap for a color to move to another worker.
    */
-  int run;
+  size_t rebalance_threshold;
 
   /**
-   * \brief Next thread number for "random" thread selection.
+   * \brief How thread_dispatcher_push_random() selects a worker.
    */
-  uint32_t next_select;
+  enum thread_dispatcher_spread spread;
 
   /**
-   * \brief Array of threads worker.
+   * \brief Busy time (ns) before a worker hands colors to idle workers.
    */
-  struct thread_worker* threads;
+  uint64_t budget;
 };
 
 /**
@@ -81,420 +179,1356 @@ struct thread_dispatcher
  */
 struct thread_worker
 {
+  /* written at creation or by the worker only */
+
   /**
    * \brief Thread identifier.
    */
-  pthread_t id;
+  _Alignas(THREAD_DISPATCHER_CACHE_LINE) pthread_t id;
 
   /**
-   * \brief Mutex to protect the queue.
+   * \brief Dispatcher parent.
    */
-  pthread_mutex_t mutex_tasks;
+  struct thread_dispatcher* dispatcher;
 
   /**
-   * \brief Condition to notify a task ready to process.
+   * \brief Index in the array of workers.
    */
-  pthread_cond_t cond_tasks;
+  size_t index;
 
   /**
-   * \brief Dispatcher parent.
+   * \brief Cache of free task nodes.
    */
-  struct thread_dispatcher* dispatcher;
+  struct task_slab_cache cache;
+
+  /**
+   * \brief Adaptive wait when there is no task.
+   */
+  struct worker_wait wait;
+
+  /**
+   * \brief Whether or not the worker pops from its queue.
+   */
+  atomic_int popping;
+
+  /**
+   * \brief Task being run, NULL outside of run functions.
+   */
+  struct thread_dispatcher_task* running;
 
   /**
-   * \brief List of tasks.
+   * \brief Continuation of the running task, NULL if it does not yield.
    */
-  struct list_head tasks;
+  struct thread_dispatcher_task* yield;
+
+  /**
+   * \brief Start (ns) of the period with queued tasks, 0 if none.
+   */
+  _Atomic uint64_t slice;
+
+  /* written by producers, then by the worker */
+
+  /**
+   * \brief Number of queued or running tasks, counted before they are
+   * pushed.
+   */
+  _Alignas(THREAD_DISPATCHER_CACHE_LINE) atomic_size_t nb_tasks;
+
+  /**
+   * \brief Whether or not the worker is about to wait or waits on
+   * cond_tasks, producers that reset it have to signal cond_tasks.
+   */
+  atomic_int parked;
+
+  /**
+   * \brief Queue of tasks, its producer end shares the cache line of the
+   * fields above and its consumer end is padded.
+   */
+  struct thread_dispatcher_inbox inbox;
+
+  /**
+   * \brief Mutex to park the worker.
+   */
+  pthread_mutex_t mutex_tasks;
+
+  /**
+   * \brief Condition to wake up the parked worker.
+   */
+  pthread_cond_t cond_tasks;
+
+  /**
+   * \brief Statistics, padded.
+   */
+  struct worker_stats stats;
 };
 
 /**
- * \brief Atomically get run state.
+ * \var thread_dispatcher_current
+ * \brief Worker running the current thread (NULL if not a worker).
+ */
+static _Thread_local struct thread_worker* thread_dispatcher_current = NULL;
+
+/**
+ * \struct thread_dispatcher_producer
+ * \brief Worker selection state of a producer thread.
+ */
+struct thread_dispatcher_producer
+{
+  uint32_t next; /**< Next worker for round robin. */
+  uint32_t rand; /**< Xorshift state, 0 until the thread first pushes. */
+};
+
+/**
+ * \var thread_dispatcher_self
+ * \brief Worker selection state of the current thread.
+ */
+static _Thread_local struct thread_dispatcher_producer
+  thread_dispatcher_self = {0, 0};
+
+/**
+ * \var thread_dispatcher_producers
+ * \brief Number of threads that have used thread_dispatcher_push_random().
+ */
+static atomic_uint thread_dispatcher_producers = 0;
+
+/**
+ * \brief Allocate a task node from the slab of the dispatcher.
+ * \param obj thread dispatcher.
+ * \return node or NULL if failure.
+ * \note Workers of the dispatcher use their own cache of nodes.
+ */
+static struct thread_dispatcher_task* thread_dispatcher_node_alloc(
+    struct thread_dispatcher* obj)
+{
+  struct thread_worker* worker = thread_dispatcher_current;
+
+  return task_slab_alloc(obj->slab,
+      (worker && worker->dispatcher == obj) ? &worker->cache : NULL);
+}
+
+/**
+ * \brief Release a task node once it has been popped.
  * \param obj thread dispatcher.
- * \return run state or -99 if failure.
+ * \param t node, nothing is done if its storage is owned by the caller of
+ * thread_dispatcher_push_task().
  */
-static int thread_dispatcher_get_run(struct thread_dispatcher* obj)
+static void thread_dispatcher_node_release(struct thread_dispatcher* obj,
+    struct thread_dispatcher_task* t)
 {
-  if(pthread_rwlock_rdlock(&obj->mutex_run) == 0)
+  struct thread_worker* worker = thread_dispatcher_current;
+
+  if(!(t->flags & THREAD_DISPATCHER_TASK_SLAB))
   {
-    int run = obj->run;
-    pthread_rwlock_unlock(&obj->mutex_run);
-    return run;
+    return;
   }
 
-  return -99;
+  task_slab_release(obj->slab,
+      (worker && worker->dispatcher == obj) ? &worker->cache : NULL, t);
+}
+
+/**
+ * \brief Atomically get run state.
+ * \param obj thread dispatcher.
+ * \return run state.
+ * \note Acquire load, pairs with the release store of
+ * thread_dispatcher_set_run.
+ */
+static inline int thread_dispatcher_get_run(struct thread_dispatcher* obj)
+{
+  return atomic_load_explicit(&obj->run, memory_order_acquire);
 }
 
 /**
  * \brief Atomically set run state.
  * \param obj thread dispatcher.
- * \param run run state to set or -1 if failure.
+ * \param run run state to set.
+ * \note Sequentially consistent, a worker that announces it pops either
+ * sees the new state or is seen by thread_dispatcher_clean().
+ */
+static inline void thread_dispatcher_set_run(struct thread_dispatcher* obj,
+    int run)
+{
+  atomic_store_explicit(&obj->run, run, memory_order_seq_cst);
+}
+
+/**
+ * \brief Returns whether or not the dispatcher accepts new tasks.
+ * \param obj thread dispatcher.
+ * \return 0 if it accepts them, -1 if it is draining and the caller is not
+ * one of its workers (errno is set to ESHUTDOWN).
  */
-static int thread_dispatcher_set_run(struct thread_dispatcher* obj, int run)
+static inline int thread_dispatcher_accept(struct thread_dispatcher* obj)
 {
-  if(pthread_rwlock_wrlock(&obj->mutex_run) == 0)
+  struct thread_worker* worker = thread_dispatcher_current;
+
+  if(atomic_load_explicit(&obj->draining, memory_order_relaxed) &&
+      !(worker && worker->dispatcher == obj))
   {
-    obj->run = run;
-    pthread_rwlock_unlock(&obj->mutex_run);
-    return 0;
+    errno = ESHUTDOWN;
+    return -1;
   }
 
-  return -1;
+  return 0;
 }
 
 /**
- * \brief Initialize a thread worker.
+ * \brief Create a thread worker.
  * \param dispatcher thread dispatcher.
- * \param worker worker to initialize.
- * \return 0 if success, -1 otherwise.
+ * \param index index of the worker.
+ * \return valid pointer if success, NULL otherwise.
+ * \note Called by the worker thread itself so that the memory it first
+ * touches is local to its node.
  */
-static int thread_worker_init(struct thread_dispatcher* dispatcher,
-    struct thread_worker* worker)
+static struct thread_worker* thread_worker_new(
+    struct thread_dispatcher* dispatcher, size_t index)
 {
-  assert(worker);
+  struct thread_worker* worker = NULL;
+
+  /* the size is a multiple of the cache line */
+  worker = aligned_alloc(THREAD_DISPATCHER_CACHE_LINE,
+      sizeof(struct thread_worker));
+  if(!worker)
+  {
+    return NULL;
+  }
 
-  list_head_init(&worker->tasks);
+  thread_dispatcher_inbox_init(&worker->inbox);
   if(pthread_mutex_init(&worker->mutex_tasks, NULL) != 0)
   {
-    return -1;
+    free(worker);
+    return NULL;
   }
 
   if(pthread_cond_init(&worker->cond_tasks, NULL) != 0)
   {
     pthread_mutex_destroy(&worker->mutex_tasks);
-    return -1;
+    free(worker);
+    return NULL;
   }
+  worker->id = pthread_self();
   worker->dispatcher = dispatcher;
-  return 0;
+  worker->index = index;
+  worker->cache.head = NULL;
+  worker->cache.nb = 0;
+  atomic_init(&worker->nb_tasks, 0);
+  atomic_init(&worker->parked, 0);
+  atomic_init(&worker->popping, 0);
+  worker->running = NULL;
+  worker->yield = NULL;
+  atomic_init(&worker->slice, 0);
+  worker_stats_init(&worker->stats);
+  return worker;
 }
 
 /**
- * \brief Destroy a valid thread worker.
+ * \brief Destroy and free a valid thread worker.
  * \param worker worker to destroy.
  */
 static void thread_worker_destroy(struct thread_worker* worker)
 {
-  struct list_head* pos = NULL;
-  struct list_head* tmp = NULL;
+  struct thread_dispatcher_task* t = NULL;
 
   assert(worker);
 
   /* cleanup worker tasks queue */
-  list_head_iterate_safe(&worker->tasks, pos, tmp)
+  while((t = thread_dispatcher_inbox_pop(&worker->inbox)))
   {
-    struct thread_dispatcher_task* t = list_head_get(pos,
-        struct thread_dispatcher_task, list);
-    list_head_remove(&worker->tasks, &t->list);
-    free(t);
+    thread_dispatcher_node_release(worker->dispatcher, t);
   }
 
   pthread_mutex_destroy(&worker->mutex_tasks);
   pthread_cond_destroy(&worker->cond_tasks);
+  free(worker);
 }
 
 /**
- * \brief Pop the first task to process for the thread worker.
+ * \brief Wake up a worker if it is parked.
  * \param worker thread worker.
- * \param task task that will be popped, it will be filled with data from the
- * manager.
- * \return 0 if success, -1 on failure (thread dispatcher wants to exit).
- * \note This function is blocking until a task is available.
+ * \note Call it after the push so that the worker cannot miss the task.
  */
-static int thread_worker_pop(struct thread_worker* worker,
-  struct thread_dispatcher_task* task)
+static void thread_worker_wake(struct thread_worker* worker)
 {
-  struct thread_dispatcher_task* t = NULL;
-  int ret = -1;
-
-  assert(worker && task);
-
-  if(pthread_mutex_lock(&worker->mutex_tasks) == 0)
+  if(atomic_load_explicit(&worker->parked, memory_order_seq_cst) &&
+      atomic_exchange_explicit(&worker->parked, 0, memory_order_seq_cst))
   {
-    struct list_head* pos = NULL;
-    int run = thread_dispatcher_get_run(worker->dispatcher);
-
-    /* if arrived after condition signaled */
-    if(run <= 0)
+    if(pthread_mutex_lock(&worker->mutex_tasks) == 0)
     {
+      pthread_cond_signal(&worker->cond_tasks);
       pthread_mutex_unlock(&worker->mutex_tasks);
-      return run;
     }
+  }
+}
 
-    while(list_head_is_empty(&worker->tasks))
-    {
-      /* wait for a task */
-      pthread_cond_wait(&worker->cond_tasks, &worker->mutex_tasks);
+/**
+ * \brief Account the end of tasks popped by a worker.
+ * \param worker thread worker.
+ * \param nb number of tasks.
+ * \note The last task of the dispatcher wakes up thread_dispatcher_drain().
+ */
+static void thread_worker_finish(struct thread_worker* worker, size_t nb)
+{
+  struct thread_dispatcher* dispatcher = worker->dispatcher;
 
-      run = thread_dispatcher_get_run(worker->dispatcher);
+  /* pairs with the draining store and nb_tasks loads of the drain */
+  if(atomic_fetch_sub_explicit(&worker->nb_tasks, nb,
+        memory_order_seq_cst) == nb &&
+      atomic_load_explicit(&dispatcher->draining, memory_order_seq_cst) &&
+      pthread_mutex_lock(&dispatcher->mutex_start) == 0)
+  {
+    pthread_cond_broadcast(&dispatcher->cond_start);
+    pthread_mutex_unlock(&dispatcher->mutex_start);
+  }
+}
 
-      /* condition signaled or spurious wake up, check if stop/exit */
-      if(run <= 0)
-      {
-        pthread_mutex_unlock(&worker->mutex_tasks);
-        return -1;
-      }
-    }
+/**
+ * \brief Returns whether or not an idle worker has to stop waiting.
+ * \param data thread worker.
+ * \return 1 if a task is pending or the dispatcher is not running, 0
+ * otherwise.
+ */
+static int thread_worker_ready(void* data)
+{
+  struct thread_worker* worker = data;
 
-    pos = worker->tasks.next;
-    t = list_head_get(pos, struct thread_dispatcher_task, list);
-    ret = 0;
+  return !thread_dispatcher_inbox_is_empty(&worker->inbox) ||
+    atomic_load_explicit(&worker->dispatcher->run, memory_order_seq_cst) != 1;
+}
 
-    /* fill task with thread_dispatcher_task data from list */
-    task->data = t->data;
-    task->run = t->run;
-    task->cleanup = t->cleanup;
+/**
+ * \brief Park a worker until a producer wakes it up.
+ * \param worker thread worker.
+ */
+static void thread_worker_park(struct thread_worker* worker)
+{
+  /* announce then check again, pairs with thread_worker_wake() */
+  atomic_store_explicit(&worker->parked, 1, memory_order_seq_cst);
 
-    /* remove task from list */
-    list_head_remove(&worker->tasks, &t->list);
-    pthread_mutex_unlock(&worker->mutex_tasks);
+  if(thread_worker_ready(worker))
+  {
+    atomic_store_explicit(&worker->parked, 0, memory_order_relaxed);
+    return;
   }
 
-  if(ret == 0)
+  if(pthread_mutex_lock(&worker->mutex_tasks) != 0)
   {
-    free(t);
+    atomic_store_explicit(&worker->parked, 0, memory_order_relaxed);
+    sched_yield();
+    return;
   }
 
-  return ret;
+  while(atomic_load_explicit(&worker->parked, memory_order_relaxed))
+  {
+    pthread_cond_wait(&worker->cond_tasks, &worker->mutex_tasks);
+  }
+  pthread_mutex_unlock(&worker->mutex_tasks);
+  worker_stats_add(&worker->stats.wakeups, 1);
 }
 
 /**
- * \brief Worker thread function that wait for a task to execute.
- * \param data the thread dispatcher.
- * \return NULL.
+ * \brief Pop the first tasks to process for the thread worker.
+ * \param worker thread worker.
+ * \param tasks array that will be filled with popped tasks, in queue order.
+ * \param max maximum number of tasks to pop.
+ * \return number of tasks popped if success, -1 on failure (thread
+ * dispatcher wants to stop or exit).
+ * \note This function is blocking until a task is available.
  */
-static void* thr_worker(void* data)
+static int thread_worker_pop(struct thread_worker* worker,
+  struct thread_dispatcher_task* tasks, size_t max)
 {
-  struct thread_worker* worker = (struct thread_worker*)data;
-  struct thread_dispatcher* dispatcher = NULL;
-  int run = 0;
-
-  assert(worker);
-
-  dispatcher = worker->dispatcher;
+  int ret = 0;
 
-  /*
-   * block signals because this worker thread will not do signal handler
-   * management
-   */
-  sigset_t mask;
-  sigfillset(&mask);
-  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  assert(worker && tasks);
 
-  while(run >= 0)
+  for(;;)
   {
-    struct thread_dispatcher_task task;
+    struct thread_dispatcher_task* t = NULL;
 
-    memset(&task, 0x00, sizeof(struct thread_dispatcher_task));
-    run = thread_dispatcher_get_run(dispatcher);
-
-    if(run == 0)
+    /* announce then check run state, pairs with thread_dispatcher_clean() */
+    atomic_store_explicit(&worker->popping, 1, memory_order_seq_cst);
+    if(atomic_load_explicit(&worker->dispatcher->run,
+          memory_order_seq_cst) <= 0)
     {
-      /* stop case */
-      if(pthread_mutex_lock(&dispatcher->mutex_start) == 0)
-      {
-        while(run == 0)
-        {
-          /* wait for start */
-          pthread_cond_wait(&dispatcher->cond_start, &dispatcher->mutex_start);
-
-          run = thread_dispatcher_get_run(dispatcher);
-        }
-        pthread_mutex_unlock(&dispatcher->mutex_start);
-      }
-      else
-      {
-        /* problem locking mutex? */
-        sched_yield();
-      }
-
-      continue;
+      atomic_store_explicit(&worker->popping, 0, memory_order_release);
+      return -1;
     }
-    else if(run == -1)
+
+    while((size_t)ret < max &&
+        (t = thread_dispatcher_inbox_pop(&worker->inbox)))
     {
-      /* free case */
-      break;
+      /* fill task with thread_dispatcher_task data from queue */
+      tasks[ret].data = t->data;
+      tasks[ret].run = t->run;
+      tasks[ret].cleanup = t->cleanup;
+      tasks[ret].enqueued = t->enqueued;
+      tasks[ret].color = t->color;
+      tasks[ret].flags = t->flags;
+      ret++;
+
+      thread_dispatcher_node_release(worker->dispatcher, t);
     }
-    else if(run < 0)
+    atomic_store_explicit(&worker->popping, 0, memory_order_release);
+
+    if(ret > 0)
     {
-      /* probably pthread_rwlock_rdlock has failed due to too many calls */
-      sched_yield();
+      /* popped tasks are accounted until they finish */
+      worker_stats_max(&worker->stats.depth_max,
+          atomic_load_explicit(&worker->nb_tasks, memory_order_relaxed));
+      return ret;
     }
-    else
+
+    /* spin then yield before paying a sleep/wake cycle */
+    if(!worker_wait_spin(&worker->wait, thread_worker_ready, worker))
     {
-      /* running case */
-      /* get a task for the queue */
-      if(thread_worker_pop(worker, &task) == 0)
-      {
-        /* process task then cleanup */
-        task.run(task.data);
-        task.cleanup(task.data);
-      }
+      thread_worker_park(worker);
     }
   }
+}
 
-  return NULL;
+/**
+ * \brief Enqueue a node in a worker.
+ * \param obj thread dispatcher.
+ * \param t node to be pushed.
+ * \param selected worker index.
+ */
+static void thread_dispatcher_push_worker(thread_dispatcher obj,
+    struct thread_dispatcher_task* t, size_t selected)
+{
+  struct thread_worker* worker = obj->threads[selected];
+
+  t->enqueued = obj->stats ? worker_stats_now() : 0;
+
+  /* counted first so that the worker never sees more tasks than counted */
+  atomic_fetch_add_explicit(&worker->nb_tasks, 1, memory_order_relaxed);
+  thread_dispatcher_inbox_push(&worker->inbox, t, t);
+
+  /* notify the worker if it is parked, a spinning one finds the task
+   * without syscall
+   */
+  thread_worker_wake(worker);
 }
 
-thread_dispatcher thread_dispatcher_new(size_t nb)
+/**
+ * \struct thread_dispatcher_chain
+ * \brief Chain of task nodes to enqueue in a worker.
+ */
+struct thread_dispatcher_chain
 {
-  struct thread_dispatcher* ret = NULL;
+  struct thread_worker* worker; /**< Worker. */
+  struct thread_dispatcher_task* first; /**< First node. */
+  struct thread_dispatcher_task* last; /**< Last node. */
+  size_t nb; /**< Number of nodes. */
+};
 
-  assert(nb);
+/**
+ * \brief Enqueue a chain of task nodes in its worker.
+ * \param data chain.
+ * \note The worker is not woken up.
+ */
+static void thread_dispatcher_chain_push(void* data)
+{
+  struct thread_dispatcher_chain* chain = data;
 
-  ret = malloc(sizeof(struct thread_dispatcher) +
-      (sizeof(struct thread_worker) * nb));
-  if(!ret)
+  atomic_fetch_add_explicit(&chain->worker->nb_tasks, chain->nb,
+      memory_order_relaxed);
+  thread_dispatcher_inbox_push(&chain->worker->inbox, chain->first,
+      chain->last);
+}
+
+/**
+ * \brief Find an idle worker.
+ * \param obj thread dispatcher.
+ * \param self index of the calling worker.
+ * \return index of a worker without queued tasks, self if none.
+ */
+static size_t thread_dispatcher_idle(struct thread_dispatcher* obj,
+    size_t self)
+{
+  for(size_t i = 1 ; i < obj->nb_threads ; i++)
   {
-    return NULL;
+    struct thread_worker* worker = obj->threads[(self + i) % obj->nb_threads];
+
+    if(atomic_load_explicit(&worker->nb_tasks, memory_order_relaxed) == 0 &&
+        atomic_load_explicit(&worker->slice, memory_order_relaxed) == 0)
+    {
+      return (self + i) % obj->nb_threads;
+    }
   }
 
-  ret->run = 0;
-  ret->nb_threads = 0;
-  ret->threads = (struct thread_worker*)(((char*)ret) +
-      sizeof(struct thread_dispatcher));
+  return self;
+}
+
+/**
+ * \brief Hand colors of popped tasks to idle workers.
+ *
+ * A color moves only if all its queued tasks are in the popped ones, the
+ * color table then sends its next tasks to the new worker.
+ * \param worker thread worker.
+ * \param tasks popped tasks that have not started, the run member of the
+ * moved ones is set to NULL.
+ * \param nb number of tasks, at most THREAD_DISPATCHER_POP_BATCH.
+ */
+static void thread_worker_migrate(struct thread_worker* worker,
+    struct thread_dispatcher_task* tasks, size_t nb)
+{
+  struct thread_dispatcher* dispatcher = worker->dispatcher;
+  size_t self = worker->index;
+  uint32_t done = 0;
+
+  assert(nb <= THREAD_DISPATCHER_POP_BATCH);
+
+  for(size_t i = 0 ; i < nb ; i++)
+  {
+    void* nodes[THREAD_DISPATCHER_POP_BATCH];
+    struct thread_dispatcher_chain chain;
+    uint32_t color = tasks[i].color;
+    uint32_t same = 0;
+    size_t target = 0;
+    size_t n = 0;
+
+    if((done & (1u << i)) || !tasks[i].run ||
+        !(tasks[i].flags & THREAD_DISPATCHER_TASK_COLOR))
+    {
+      continue;
+    }
+
+    for(size_t j = i ; j < nb ; j++)
+    {
+      if(tasks[j].run && (tasks[j].flags & THREAD_DISPATCHER_TASK_COLOR) &&
+          tasks[j].color == color)
+      {
+        same |= 1u << j;
+        n++;
+      }
+    }
+    done |= same;
+
+    target = thread_dispatcher_idle(dispatcher, self);
+    if(target == self)
+    {
+      return;
+    }
+
+    chain.nb = task_slab_alloc_batch(dispatcher->slab, &worker->cache, nodes,
+        n);
+    if(chain.nb != n)
+    {
+      for(size_t j = 0 ; j < chain.nb ; j++)
+      {
+        task_slab_release(dispatcher->slab, &worker->cache, nodes[j]);
+      }
+      return;
+    }
+
+    chain.worker = dispatcher->threads[target];
+    chain.first = NULL;
+    chain.last = NULL;
+    n = 0;
+    for(size_t j = i ; j < nb ; j++)
+    {
+      struct thread_dispatcher_task* t = NULL;
+
+      if(!(same & (1u << j)))
+      {
+        continue;
+      }
+
+      t = nodes[n++];
+      t->data = tasks[j].data;
+      t->run = tasks[j].run;
+      t->cleanup = tasks[j].cleanup;
+      t->flags = THREAD_DISPATCHER_TASK_SLAB | THREAD_DISPATCHER_TASK_COLOR;
+      t->enqueued = tasks[j].enqueued;
+      t->color = color;
+      atomic_store_explicit(&t->next, NULL, memory_order_relaxed);
+
+      if(chain.last)
+      {
+        atomic_store_explicit(&chain.last->next, t, memory_order_relaxed);
+      }
+      else
+      {
+        chain.first = t;
+      }
+      chain.last = t;
+    }
+
+    if(thread_dispatcher_color_migrate(dispatcher->colors, color, chain.nb,
+          target, thread_dispatcher_chain_push, &chain) != 0)
+    {
+      /* other tasks of the color are queued or about to be */
+      for(size_t j = 0 ; j < chain.nb ; j++)
+      {
+        task_slab_release(dispatcher->slab, &worker->cache, nodes[j]);
+      }
+      continue;
+    }
+    thread_worker_wake(chain.worker);
+
+    for(size_t j = i ; j < nb ; j++)
+    {
+      if(same & (1u << j))
+      {
+        tasks[j].run = NULL;
+      }
+    }
+  }
+}
+
+/**
+ * \struct thread_worker_start
+ * \brief Parameters of a worker thread until it has created its worker.
+ */
+struct thread_worker_start
+{
+  struct thread_dispatcher* dispatcher; /**< Thread dispatcher. */
+  size_t index; /**< Index of the worker. */
+  unsigned int spin; /**< Time (us) an idle worker spins before parking. */
+  unsigned int yield; /**< Yields of an idle worker before parking. */
+  int ready; /**< 0 until the worker is created, 1 if success, -1 if not. */
+};
+
+/**
+ * \brief Wait until a new worker thread has created its worker.
+ * \param obj thread dispatcher.
+ * \param start parameters of the worker thread.
+ * \return 0 if success, -1 if worker thread has failed and exited.
+ */
+static int thread_worker_ready_start(struct thread_dispatcher* obj,
+    struct thread_worker_start* start)
+{
+  int ready = 0;
+
+  if(pthread_mutex_lock(&obj->mutex_start) != 0)
+  {
+    return -1;
+  }
+
+  while(start->ready == 0)
+  {
+    pthread_cond_wait(&obj->cond_start, &obj->mutex_start);
+  }
+  ready = start->ready;
+  pthread_mutex_unlock(&obj->mutex_start);
+
+  return ready == 1 ? 0 : -1;
+}
+
+/**
+ * \brief Worker thread function that wait for a task to execute.
+ * \param data parameters of the worker thread, only valid until it is ready.
+ * \return NULL.
+ */
+static void* thr_worker(void* data)
+{
+  struct thread_worker_start* params = (struct thread_worker_start*)data;
+  struct thread_worker* worker = NULL;
+  struct thread_dispatcher* dispatcher = NULL;
+  int run = 0;
+  uint64_t now = 0;
+
+  assert(params);
+
+  /* allocated once pinned so that the queue state is on the worker node */
+  dispatcher = params->dispatcher;
+  worker = thread_worker_new(dispatcher, params->index);
+  if(worker)
+  {
+    worker_wait_init(&worker->wait, params->spin, params->yield);
+    dispatcher->threads[params->index] = worker;
+  }
+
+  if(pthread_mutex_lock(&dispatcher->mutex_start) == 0)
+  {
+    params->ready = worker ? 1 : -1;
+    pthread_cond_broadcast(&dispatcher->cond_start);
+    pthread_mutex_unlock(&dispatcher->mutex_start);
+  }
+
+  if(!worker)
+  {
+    return NULL;
+  }
+  thread_dispatcher_current = worker;
+
+  /*
+   * block signals because this worker thread will not do signal handler
+   * management
+   */
+  sigset_t mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  while(run >= 0)
+  {
+    struct thread_dispatcher_task tasks[THREAD_DISPATCHER_POP_BATCH];
+    int nb = 0;
+    int ran = 0;
+
+    run = thread_dispatcher_get_run(dispatcher);
+
+    if(run == 0)
+    {
+      /* stop case */
+      if(pthread_mutex_lock(&dispatcher->mutex_start) == 0)
+      {
+        /* start may have been broadcast since run was read */
+        run = thread_dispatcher_get_run(dispatcher);
+        while(run == 0)
+        {
+          /* wait for start */
+          pthread_cond_wait(&dispatcher->cond_start, &dispatcher->mutex_start);
+
+          run = thread_dispatcher_get_run(dispatcher);
+        }
+        pthread_mutex_unlock(&dispatcher->mutex_start);
+      }
+      else
+      {
+        /* problem locking mutex? */
+        sched_yield();
+      }
+
+      /* time spent stopped is not idle time */
+      now = 0;
+      atomic_store_explicit(&worker->slice, 0, memory_order_relaxed);
+      continue;
+    }
+    else if(run < 0)
+    {
+      /* free case */
+      break;
+    }
+    else
+    {
+      /* running case */
+      if(dispatcher->stats && now == 0)
+      {
+        /* otherwise the end of the last task */
+        now = worker_stats_now();
+      }
+
+      /* get tasks from the queue */
+      nb = thread_worker_pop(worker, tasks, THREAD_DISPATCHER_POP_BATCH);
+
+      if(nb > 0 && dispatcher->stats)
+      {
+        uint64_t start = worker_stats_now();
+
+        worker_stats_add(&worker->stats.idle, start - now);
+        now = start;
+      }
+
+      if(nb > 0 && dispatcher->budget &&
+          atomic_load_explicit(&worker->slice, memory_order_relaxed) == 0)
+      {
+        atomic_store_explicit(&worker->slice,
+            dispatcher->stats ? now : worker_stats_now(),
+            memory_order_relaxed);
+      }
+
+      /* process tasks then cleanup, in queue order */
+      for(int i = 0 ; i < nb ; i++)
+      {
+        if(!tasks[i].run)
+        {
+          /* moved to an idle worker */
+          continue;
+        }
+
+        if(dispatcher->budget && i + 1 < nb)
+        {
+          uint64_t t = dispatcher->stats ? now : worker_stats_now();
+
+          if(t - atomic_load_explicit(&worker->slice, memory_order_relaxed) >=
+              dispatcher->budget)
+          {
+            thread_worker_migrate(worker, tasks + i + 1, (size_t)(nb - i - 1));
+            atomic_store_explicit(&worker->slice, t, memory_order_relaxed);
+          }
+        }
+
+        ran++;
+        worker->running = &tasks[i];
+        tasks[i].run(tasks[i].data);
+        worker->running = NULL;
+
+        if(worker->yield)
+        {
+          /* the continuation keeps the color accounting of the task */
+          thread_dispatcher_push_worker(dispatcher, worker->yield,
+              worker->index);
+          worker->yield = NULL;
+        }
+        else
+        {
+          tasks[i].cleanup(tasks[i].data);
+
+          if(tasks[i].flags & THREAD_DISPATCHER_TASK_COLOR)
+          {
+            /* the color may now move to another worker */
+            thread_dispatcher_color_release(dispatcher->colors,
+                tasks[i].color);
+          }
+        }
+
+        if(dispatcher->stats)
+        {
+          /* end of a task is the start of the next one */
+          uint64_t end = worker_stats_now();
+
+          if(tasks[i].enqueued && now >= tasks[i].enqueued)
+          {
+            worker_stats_record(&worker->stats.wait,
+                now - tasks[i].enqueued);
+          }
+          worker_stats_record(&worker->stats.run, end - now);
+          worker_stats_add(&worker->stats.busy, end - now);
+          now = end;
+        }
+      }
+
+      if(nb > 0)
+      {
+        worker_stats_add(&worker->stats.tasks, (uint64_t)ran);
+        thread_worker_finish(worker, (size_t)nb);
+
+        if(dispatcher->budget &&
+            atomic_load_explicit(&worker->nb_tasks, memory_order_relaxed) == 0)
+        {
+          /* queue went empty, next tasks start a new period */
+          atomic_store_explicit(&worker->slice, 0, memory_order_relaxed);
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
+
+void thread_dispatcher_config_init(struct thread_dispatcher_config* config,
+    size_t nb)
+{
+  config->nb_threads = nb;
+  config->spin = THREAD_DISPATCHER_SPIN;
+  config->yield = THREAD_DISPATCHER_YIELD;
+  thread_affinity_init(&config->affinity);
+  config->stats = 1;
+  config->map = thread_dispatcher_map_modulo;
+  config->map_data = NULL;
+  config->rebalance = 0;
+  config->rebalance_threshold = THREAD_DISPATCHER_REBALANCE;
+  config->spread = THREAD_DISPATCHER_SPREAD_ROUND_ROBIN;
+  config->budget = 0;
+}
+
+size_t thread_dispatcher_map_modulo(uint32_t color, size_t nb, void* data)
+{
+  (void)data;
+
+  return color % nb;
+}
+
+size_t thread_dispatcher_map_jump(uint32_t color, size_t nb, void* data)
+{
+  /* Lamping and Veach, "A Fast, Minimal Memory, Consistent Hash
+   * Algorithm"
+   */
+  uint64_t key = color;
+  int64_t b = -1;
+  int64_t j = 0;
+
+  (void)data;
+
+  while(j < (int64_t)nb)
+  {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = (int64_t)((double)(b + 1) *
+        ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+  }
+
+  return (size_t)b;
+}
+
+thread_dispatcher thread_dispatcher_new(size_t nb)
+{
+  struct thread_dispatcher_config config;
+
+  thread_dispatcher_config_init(&config, nb);
+  return thread_dispatcher_new_config(&config);
+}
+
+thread_dispatcher thread_dispatcher_new_config(
+    const struct thread_dispatcher_config* config)
+{
+  struct thread_dispatcher* ret = NULL;
+  size_t nb = config->nb_threads;
+
+  assert(nb);
+
+  ret = malloc(sizeof(struct thread_dispatcher));
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  /* workers allocate themselves once started */
+  ret->threads = calloc(nb, sizeof(struct thread_worker*));
+  if(!ret->threads)
+  {
+    free(ret);
+    return NULL;
+  }
+
+  atomic_init(&ret->run, 0);
+  atomic_init(&ret->draining, 0);
+  ret->nb_threads = 0;
+  ret->stats = config->stats;
+  ret->map = config->map ? config->map : thread_dispatcher_map_modulo;
+  ret->map_data = config->map_data;
+  ret->colors = NULL;
+  /* without rebalance, an idle color stays on its mapped worker */
+  ret->rebalance_threshold = config->rebalance ? config->rebalance_threshold :
+    SIZE_MAX;
+  ret->spread = config->spread;
+  ret->budget = (uint64_t)config->budget * 1000;
+
+  ret->slab = task_slab_new(sizeof(struct thread_dispatcher_task),
+      THREAD_DISPATCHER_SLAB_NODES);
+  if(!ret->slab)
+  {
+    free(ret->threads);
+    free(ret);
+    return NULL;
+  }
+
+  if(config->rebalance || config->budget)
+  {
+    ret->colors = thread_dispatcher_color_new();
+    if(!ret->colors)
+    {
+      task_slab_free(&ret->slab);
+      free(ret->threads);
+      free(ret);
+      return NULL;
+    }
+  }
 
   if(pthread_mutex_init(&ret->mutex_start, NULL) != 0)
   {
+    if(ret->colors)
+    {
+      thread_dispatcher_color_free(&ret->colors);
+    }
+    task_slab_free(&ret->slab);
+    free(ret->threads);
     free(ret);
     return NULL;
   }
 
   if(pthread_cond_init(&ret->cond_start, NULL) != 0)
   {
-    pthread_mutex_destroy(&ret->mutex_start);
-    free(ret);
-    return NULL;
+    pthread_mutex_destroy(&ret->mutex_start);
+    if(ret->colors)
+    {
+      thread_dispatcher_color_free(&ret->colors);
+    }
+    task_slab_free(&ret->slab);
+    free(ret->threads);
+    free(ret);
+    return NULL;
+  }
+
+  for(size_t i = 0 ; i < nb ; i++)
+  {
+    struct thread_worker_start start;
+    pthread_attr_t attr;
+    pthread_t id;
+    int err = 0;
+
+    if(pthread_attr_init(&attr) != 0)
+    {
+      break;
+    }
+
+    if(thread_affinity_attr_set(&config->affinity, i, &attr) != 0)
+    {
+      pthread_attr_destroy(&attr);
+      break;
+    }
+
+    start.dispatcher = ret;
+    start.index = i;
+    start.spin = config->spin;
+    start.yield = config->yield;
+    start.ready = 0;
+
+    err = pthread_create(&id, &attr, thr_worker, &start);
+    pthread_attr_destroy(&attr);
+
+    if(err != 0)
+    {
+      break;
+    }
+
+    /* start is on this stack, wait until the thread is done with it */
+    if(thread_worker_ready_start(ret, &start) != 0)
+    {
+      pthread_join(id, NULL);
+      break;
+    }
+    ret->nb_threads++;
+  }
+
+  if(ret->nb_threads != nb)
+  {
+    thread_dispatcher_set_run(ret, -1);
+
+    /* error creating all threads, cancel the created ones */
+    for(size_t i = 0 ; i < ret->nb_threads ; i++)
+    {
+      if(pthread_mutex_lock(&ret->mutex_start) == 0)
+      {
+        /* tell the threads that they have to quit */
+        pthread_cond_broadcast(&ret->cond_start);
+        pthread_mutex_unlock(&ret->mutex_start);
+
+        /* join the threads and destroy private thread worker stuff */
+        pthread_join(ret->threads[i]->id, NULL);
+      }
+      else
+      {
+        pthread_cancel(ret->threads[i]->id);
+      }
+
+      thread_worker_destroy(ret->threads[i]);
+    }
+
+    pthread_mutex_destroy(&ret->mutex_start);
+    pthread_cond_destroy(&ret->cond_start);
+    if(ret->colors)
+    {
+      thread_dispatcher_color_free(&ret->colors);
+    }
+    task_slab_free(&ret->slab);
+    free(ret->threads);
+    free(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+void thread_dispatcher_free(thread_dispatcher* obj)
+{
+  assert(obj);
+
+  if(pthread_mutex_lock(&(*obj)->mutex_start) == 0)
+  {
+    /* tell the threads that they have to quit */
+    thread_dispatcher_set_run(*obj, -1);
+
+    pthread_cond_broadcast(&(*obj)->cond_start);
+    pthread_mutex_unlock(&(*obj)->mutex_start);
+  }
+
+  /* wait for the threads */
+  for(size_t i = 0 ; i < (*obj)->nb_threads ; i++)
+  {
+    struct thread_worker* worker = (*obj)->threads[i];
+
+    /*
+     * unblock worker waiting for tasks
+     * worker will then check for run variable and exit
+     */
+    thread_worker_wake(worker);
+    pthread_join(worker->id, NULL);
+
+    thread_worker_destroy(worker);
+  }
+
+  /* do not care about success or failure of these calls */
+  pthread_mutex_destroy(&(*obj)->mutex_start);
+  pthread_cond_destroy(&(*obj)->cond_start);
+  if((*obj)->colors)
+  {
+    thread_dispatcher_color_free(&(*obj)->colors);
+  }
+  task_slab_free(&(*obj)->slab);
+
+  free((*obj)->threads);
+  free(*obj);
+  *obj = NULL;
+}
+
+/**
+ * \brief Choose the worker of a color that becomes active.
+ * \param data thread dispatcher.
+ * \param color color of the task.
+ * \return mapped worker, or the least loaded one if the mapped worker has
+ * at least rebalance_threshold more queued tasks.
+ */
+static size_t thread_dispatcher_balance(void* data, uint32_t color)
+{
+  struct thread_dispatcher* obj = data;
+  size_t selected = obj->map(color, obj->nb_threads, obj->map_data);
+  size_t depth = 0;
+  size_t best = selected;
+  size_t best_depth = 0;
+
+  assert(selected < obj->nb_threads);
+
+  depth = atomic_load_explicit(&obj->threads[selected]->nb_tasks,
+      memory_order_relaxed);
+  if(depth < obj->rebalance_threshold)
+  {
+    return selected;
+  }
+
+  best_depth = depth;
+  for(size_t i = 0 ; i < obj->nb_threads ; i++)
+  {
+    size_t d = atomic_load_explicit(&obj->threads[i]->nb_tasks,
+        memory_order_relaxed);
+
+    if(d < best_depth)
+    {
+      best = i;
+      best_depth = d;
+    }
+  }
+
+  return (depth - best_depth >= obj->rebalance_threshold) ? best : selected;
+}
+
+/**
+ * \brief Select the worker of a task.
+ * \param obj thread dispatcher.
+ * \param color color of the task.
+ * \param selected will be filled with the worker index.
+ * \return 0 if success, -1 on failure.
+ * \note When rebalancing, the task is accounted to its color until
+ * thread_dispatcher_color_release() is called.
+ */
+static inline int thread_dispatcher_select(struct thread_dispatcher* obj,
+    uint32_t color, size_t* selected)
+{
+  if(obj->colors)
+  {
+    return thread_dispatcher_color_acquire(obj->colors, color,
+        thread_dispatcher_balance, obj, selected);
+  }
+
+  *selected = obj->map(color, obj->nb_threads, obj->map_data);
+  assert(*selected < obj->nb_threads);
+  return 0;
+}
+
+/**
+ * \brief Discard a node that will not run.
+ * \param obj thread dispatcher.
+ * \param t node.
+ * \param cleanup whether or not to call the cleanup function of the task.
+ */
+static void thread_dispatcher_node_discard(struct thread_dispatcher* obj,
+    struct thread_dispatcher_task* t, int cleanup)
+{
+  void (*func)(void*) = t->cleanup;
+  void* data = t->data;
+  unsigned int flags = t->flags;
+  uint32_t color = t->color;
+
+  /* caller may free its own node from the cleanup function */
+  thread_dispatcher_node_release(obj, t);
+
+  if(cleanup)
+  {
+    func(data);
+  }
+
+  if(flags & THREAD_DISPATCHER_TASK_COLOR)
+  {
+    thread_dispatcher_color_release(obj->colors, color);
+  }
+}
+
+/**
+ * \brief Enqueue a node in the worker selected by color.
+ * \param obj thread dispatcher.
+ * \param t node to be pushed.
+ * \param color color of the task.
+ * \return 0 if success, -1 on failure.
+ */
+static int thread_dispatcher_push_node(thread_dispatcher obj,
+    struct thread_dispatcher_task* t, uint32_t color)
+{
+  size_t selected = 0;
+
+  t->color = color;
+
+  /* select the thread to dispatch task */
+  if(thread_dispatcher_select(obj, color, &selected) != 0)
+  {
+    return -1;
   }
 
-  if(pthread_rwlock_init(&ret->mutex_run, NULL) != 0)
+  if(obj->colors)
   {
-    pthread_cond_destroy(&ret->cond_start);
-    pthread_mutex_destroy(&ret->mutex_start);
-    free(ret);
-    return NULL;
+    t->flags |= THREAD_DISPATCHER_TASK_COLOR;
   }
 
-  ret->next_select = 0;
-
-  for(size_t i = 0 ; i < nb ; i++)
-  {
-    struct thread_worker* worker = &ret->threads[i];
+  thread_dispatcher_push_worker(obj, t, selected);
+  return 0;
+}
 
-    if(thread_worker_init(ret, worker) != 0)
-    {
-      break;
-    }
-    else if(pthread_create(&worker->id, NULL, thr_worker, worker) != 0)
-    {
-      thread_worker_destroy(worker);
-      break;
-    }
-    else
-    {
-      ret->nb_threads++;
-    }
-  }
+/**
+ * \brief Get the worker selection state of the current thread.
+ * \return worker selection state.
+ * \note Each producer thread gets its own seed on first use so that
+ * producers do not select the same workers in lockstep.
+ */
+static inline struct thread_dispatcher_producer*
+thread_dispatcher_producer_get(void)
+{
+  struct thread_dispatcher_producer* producer = &thread_dispatcher_self;
 
-  if(ret->nb_threads != nb)
+  if(producer->rand == 0)
   {
-    thread_dispatcher_set_run(ret, -1);
+    uint32_t seed = atomic_fetch_add_explicit(&thread_dispatcher_producers, 1,
+        memory_order_relaxed) + 1;
 
-    /* error creating all threads, cancel the created ones */
-    for(size_t i = 0 ; i < ret->nb_threads ; i++)
-    {
-      if(pthread_mutex_lock(&ret->mutex_start) == 0)
-      {
-        /* tell the threads that they have to quit */
-        pthread_cond_broadcast(&ret->cond_start);
-        pthread_mutex_unlock(&ret->mutex_start);
+    producer->rand = (seed * 0x9e3779b9u) | 1;
+    producer->next = producer->rand >> 16;
+  }
 
-        /* join the threads and destroy private thread worker stuff */
-        pthread_join(ret->threads[i].id, NULL);
-      }
-      else
-      {
-        pthread_cancel(ret->threads[i].id);
-      }
+  return producer;
+}
 
-      thread_worker_destroy(&ret->threads[i]);
-    }
+/**
+ * \brief Get the next pseudo-random number of a producer (xorshift32).
+ * \param producer worker selection state.
+ * \return pseudo-random number.
+ */
+static inline uint32_t thread_dispatcher_producer_rand(
+    struct thread_dispatcher_producer* producer)
+{
+  uint32_t x = producer->rand;
 
-    pthread_mutex_destroy(&ret->mutex_start);
-    pthread_cond_destroy(&ret->cond_start);
-    free(ret);
-    return NULL;
-  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  producer->rand = x;
+  return x;
+}
 
-  return ret;
+/**
+ * \brief Get the queue depth of a worker.
+ * \param obj thread dispatcher.
+ * \param i worker index.
+ * \return number of queued tasks, only a snapshot.
+ */
+static inline size_t thread_dispatcher_depth(struct thread_dispatcher* obj,
+    size_t i)
+{
+  return atomic_load_explicit(&obj->threads[i]->nb_tasks,
+      memory_order_relaxed);
 }
 
-void thread_dispatcher_free(thread_dispatcher* obj)
+/**
+ * \brief Select a worker for a task without color.
+ * \param obj thread dispatcher.
+ * \return worker index.
+ * \note Only state of the calling thread is written.
+ */
+static size_t thread_dispatcher_select_random(struct thread_dispatcher* obj)
 {
-  assert(obj);
+  struct thread_dispatcher_producer* producer =
+    thread_dispatcher_producer_get();
+  size_t nb = obj->nb_threads;
+  size_t a = 0;
+  size_t b = 0;
 
-  if(pthread_mutex_lock(&(*obj)->mutex_start) == 0)
+  if(nb == 1)
   {
-    /* tell the threads that they have to quit */
-    thread_dispatcher_set_run(*obj, -1);
-
-    pthread_cond_broadcast(&(*obj)->cond_start);
-    pthread_mutex_unlock(&(*obj)->mutex_start);
+    return 0;
   }
 
-  /* wait for the threads */
-  for(size_t i = 0 ; i < (*obj)->nb_threads ; i++)
+  switch(obj->spread)
   {
-    struct thread_worker* worker = &(*obj)->threads[i];
-
-    if(pthread_mutex_lock(&worker->mutex_tasks) == 0)
+    case THREAD_DISPATCHER_SPREAD_TWO_CHOICES:
+      a = thread_dispatcher_producer_rand(producer) % nb;
+      b = thread_dispatcher_producer_rand(producer) % nb;
+      return thread_dispatcher_depth(obj, b) < thread_dispatcher_depth(obj, a) ?
+        b : a;
+    case THREAD_DISPATCHER_SPREAD_LEAST_LOADED:
     {
-      /*
-       * unblock worker waiting for tasks
-       * worker will then check for run variable and exit
-       */
-      pthread_cond_signal(&worker->cond_tasks);;
-      pthread_mutex_unlock(&worker->mutex_tasks);
+      /* start from a rotating worker so that ties do not all go to one */
+      size_t best_depth = 0;
 
-      pthread_join(worker->id, NULL);
-    }
-    else
-    {
-      pthread_cancel(worker->id);
-    }
+      a = producer->next++ % nb;
+      b = a;
+      best_depth = thread_dispatcher_depth(obj, a);
+      for(size_t i = 1 ; i < nb && best_depth > 0 ; i++)
+      {
+        size_t w = (a + i) % nb;
+        size_t d = thread_dispatcher_depth(obj, w);
 
-    thread_worker_destroy(worker);
+        if(d < best_depth)
+        {
+          b = w;
+          best_depth = d;
+        }
+      }
+      return b;
+    }
+    case THREAD_DISPATCHER_SPREAD_ROUND_ROBIN:
+    default:
+      return producer->next++ % nb;
   }
-
-  /* do not care about success or failure of these calls */
-  pthread_mutex_destroy(&(*obj)->mutex_start);
-  pthread_cond_destroy(&(*obj)->cond_start);
-
-  free(*obj);
-  *obj = NULL;
 }
 
 int thread_dispatcher_push_random(thread_dispatcher obj,
     struct thread_dispatcher_task* task)
 {
-  uint32_t color = 0;
+  struct thread_dispatcher_task* t = NULL;
 
   assert(obj && task);
 
-  color = obj->next_select;
-  obj->next_select++;
+  if(thread_dispatcher_accept(obj) != 0)
+  {
+    return -1;
+  }
+
+  t = thread_dispatcher_node_alloc(obj);
+  if(!t)
+  {
+    return -1;
+  }
+
+  t->data = task->data;
+  t->run = task->run;
+  t->cleanup = task->cleanup;
+  t->flags = THREAD_DISPATCHER_TASK_SLAB;
+  t->color = 0;
 
-  return thread_dispatcher_push(obj, task, color);
+  thread_dispatcher_push_worker(obj, t, thread_dispatcher_select_random(obj));
+  return 0;
 }
 
 int thread_dispatcher_push(thread_dispatcher obj,
     struct thread_dispatcher_task* task, uint32_t color)
 {
   struct thread_dispatcher_task* t = NULL;
-  struct thread_worker* worker = NULL;
-  size_t selected = 0;
 
   assert(obj && task);
 
-  t = malloc(sizeof(struct thread_dispatcher_task));
+  if(thread_dispatcher_accept(obj) != 0)
+  {
+    return -1;
+  }
+
+  t = thread_dispatcher_node_alloc(obj);
   if(!t)
   {
     return -1;
@@ -503,52 +1537,252 @@ int thread_dispatcher_push(thread_dispatcher obj,
   t->data = task->data;
   t->run = task->run;
   t->cleanup = task->cleanup;
-  list_head_init(&t->list);
+  t->flags = THREAD_DISPATCHER_TASK_SLAB;
 
-  /* select the thread to dispatch task */
-  selected = color % obj->nb_threads;
+  if(thread_dispatcher_push_node(obj, t, color) != 0)
+  {
+    thread_dispatcher_node_release(obj, t);
+    return -1;
+  }
+
+  return 0;
+}
+
+int thread_dispatcher_push_task(thread_dispatcher obj,
+    struct thread_dispatcher_task* task, uint32_t color)
+{
+  assert(obj && task);
+
+  if(thread_dispatcher_accept(obj) != 0)
+  {
+    return -1;
+  }
 
-  worker = &obj->threads[selected];
+  task->flags = 0;
 
-  /* enqueue in the selected thread worker queue */
-  if(pthread_mutex_lock(&worker->mutex_tasks) == 0)
+  return thread_dispatcher_push_node(obj, task, color);
+}
+
+int thread_dispatcher_push_batch(thread_dispatcher obj,
+    struct thread_dispatcher_task* tasks, const uint32_t* colors, size_t n)
+{
+  struct thread_worker* current = thread_dispatcher_current;
+  struct task_slab_cache* cache = NULL;
+  uint64_t now = 0;
+
+  assert(obj && tasks && colors);
+
+  if(thread_dispatcher_accept(obj) != 0)
+  {
+    return -1;
+  }
+
+  if(obj->stats)
+  {
+    now = worker_stats_now();
+  }
+
+  if(current && current->dispatcher == obj)
   {
-    int first = list_head_is_empty(&worker->tasks);
-    list_head_add_tail(&worker->tasks, &t->list);
+    cache = &current->cache;
+  }
+
+  /* copy tasks in nodes allocated by chunk, sort and push them by worker */
+  for(size_t i = 0 ; i < n ; i += THREAD_DISPATCHER_PUSH_BATCH)
+  {
+    /* a chunk cannot target more workers than it has tasks */
+    struct thread_dispatcher_chain chains[THREAD_DISPATCHER_PUSH_BATCH];
+    void* nodes[THREAD_DISPATCHER_PUSH_BATCH];
+    size_t nb = (n - i) < THREAD_DISPATCHER_PUSH_BATCH ? (n - i) :
+      THREAD_DISPATCHER_PUSH_BATCH;
+    size_t allocated = task_slab_alloc_batch(obj->slab, cache, nodes, nb);
+    size_t nb_chains = 0;
+    size_t j = 0;
+
+    for(j = 0 ; j < allocated ; j++)
+    {
+      struct thread_dispatcher_task* t = nodes[j];
+      struct thread_dispatcher_chain* chain = NULL;
+      size_t selected = 0;
+
+      if(thread_dispatcher_select(obj, colors[i + j], &selected) != 0)
+      {
+        break;
+      }
+
+      t->data = tasks[i + j].data;
+      t->run = tasks[i + j].run;
+      t->cleanup = tasks[i + j].cleanup;
+      t->flags = THREAD_DISPATCHER_TASK_SLAB |
+        (obj->colors ? THREAD_DISPATCHER_TASK_COLOR : 0);
+      t->enqueued = now;
+      t->color = colors[i + j];
+      atomic_store_explicit(&t->next, NULL, memory_order_relaxed);
+
+      for(size_t c = 0 ; c < nb_chains ; c++)
+      {
+        if(chains[c].worker == obj->threads[selected])
+        {
+          chain = &chains[c];
+          break;
+        }
+      }
+
+      if(!chain)
+      {
+        chain = &chains[nb_chains++];
+        chain->worker = obj->threads[selected];
+        chain->first = NULL;
+        chain->last = NULL;
+        chain->nb = 0;
+      }
+
+      /* chain of the worker, in push order */
+      if(chain->last)
+      {
+        atomic_store_explicit(&chain->last->next, t, memory_order_relaxed);
+      }
+      else
+      {
+        chain->first = t;
+      }
+      chain->last = t;
+      chain->nb++;
+    }
 
-    /* notify one of worker threads that wait about a task */
-    if(first)
+    if(j != nb)
     {
-      if(pthread_cond_signal(&worker->cond_tasks) != 0)
+      for(size_t k = j ; k < allocated ; k++)
+      {
+        task_slab_release(obj->slab, cache, nodes[k]);
+      }
+
+      for(size_t c = 0 ; c < nb_chains ; c++)
       {
-        /* it should happen only if cond_tasks is
-         * not initialized
-         */
-        pthread_mutex_unlock(&worker->mutex_tasks);
-        return -1;
+        struct thread_dispatcher_task* t = chains[c].first;
+
+        while(t)
+        {
+          struct thread_dispatcher_task* next = atomic_load_explicit(
+              &t->next, memory_order_relaxed);
+
+          thread_dispatcher_node_discard(obj, t, 0);
+          t = next;
+        }
       }
+      return -1;
+    }
+
+    /* one exchange per target worker */
+    for(size_t c = 0 ; c < nb_chains ; c++)
+    {
+      thread_dispatcher_chain_push(&chains[c]);
+
+      /* only one consumer per queue */
+      thread_worker_wake(chains[c].worker);
     }
-    pthread_mutex_unlock(&worker->mutex_tasks);
   }
-  else
+
+  return 0;
+}
+
+int thread_dispatcher_yield(thread_dispatcher obj, void (*run)(void*))
+{
+  struct thread_worker* worker = thread_dispatcher_current;
+  struct thread_dispatcher_task* t = NULL;
+
+  assert(obj);
+
+  if(!worker || worker->dispatcher != obj || !worker->running)
   {
-    free(t);
+    errno = EPERM;
     return -1;
   }
 
+  t = worker->yield;
+  if(!t)
+  {
+    t = thread_dispatcher_node_alloc(obj);
+    if(!t)
+    {
+      return -1;
+    }
+
+    t->data = worker->running->data;
+    t->cleanup = worker->running->cleanup;
+    t->color = worker->running->color;
+    t->flags = THREAD_DISPATCHER_TASK_SLAB |
+      (worker->running->flags & THREAD_DISPATCHER_TASK_COLOR);
+    worker->yield = t;
+  }
+  t->run = run ? run : worker->running->run;
+
   return 0;
 }
 
+struct thread_stats* thread_dispatcher_stats(thread_dispatcher obj)
+{
+  assert(obj);
+
+  return worker_stats_snapshot_array((void* const*)obj->threads,
+      offsetof(struct thread_worker, stats), obj->nb_threads);
+}
+
+/**
+ * \brief Discard the queued tasks of a stopped dispatcher.
+ * \param obj thread dispatcher.
+ * \param cleanup whether or not to call the cleanup function of the tasks.
+ */
+static void thread_dispatcher_discard(thread_dispatcher obj, int cleanup)
+{
+  for(size_t i = 0 ; i < obj->nb_threads ; i++)
+  {
+    struct thread_worker* worker = obj->threads[i];
+    struct thread_dispatcher_task* t = NULL;
+    size_t max = 0;
+    size_t nb = 0;
+
+    /* a worker that started to pop before the stop finishes its batch,
+     * the next one sees the stop state
+     */
+    while(atomic_load_explicit(&worker->popping, memory_order_seq_cst))
+    {
+      sched_yield();
+    }
+
+    /* tasks pushed from now on are kept, so that producers cannot make the
+     * clean last forever
+     */
+    max = atomic_load_explicit(&worker->nb_tasks, memory_order_relaxed);
+
+    while(nb < max && !thread_dispatcher_inbox_is_empty(&worker->inbox))
+    {
+      t = thread_dispatcher_inbox_pop(&worker->inbox);
+      if(!t)
+      {
+        /* wait for the producer to link its task */
+        sched_yield();
+        continue;
+      }
+
+      thread_dispatcher_node_discard(obj, t, cleanup);
+      nb++;
+    }
+
+    if(nb > 0)
+    {
+      thread_worker_finish(worker, nb);
+    }
+  }
+}
+
 int thread_dispatcher_clean(thread_dispatcher obj)
 {
-  struct list_head* pos = NULL;
-  struct list_head* tmp = NULL;
   int run = 0;
-  int ret = 0;
 
   assert(obj);
 
-  run = thread_dispatcher_get_run(obj);
+  run = atomic_load_explicit(&obj->run, memory_order_seq_cst);
 
   /* do not clean while running or destroyed */
   if(run != 0)
@@ -556,31 +1790,82 @@ int thread_dispatcher_clean(thread_dispatcher obj)
     return -1;
   }
 
+  thread_dispatcher_discard(obj, 0);
+  return 0;
+}
+
+/**
+ * \brief Get the number of queued or running tasks.
+ * \param obj thread dispatcher.
+ * \return number of tasks.
+ */
+static size_t thread_dispatcher_pending(struct thread_dispatcher* obj)
+{
+  size_t ret = 0;
+
   for(size_t i = 0 ; i < obj->nb_threads ; i++)
   {
-    struct thread_worker* worker = &obj->threads[i];
+    ret += atomic_load_explicit(&obj->threads[i]->nb_tasks,
+        memory_order_seq_cst);
+  }
 
-    if(pthread_mutex_lock(&worker->mutex_tasks) == 0)
+  return ret;
+}
+
+int thread_dispatcher_drain(thread_dispatcher obj, int timeout)
+{
+  struct timespec ts;
+  size_t remaining = 0;
+  int err = 0;
+
+  assert(obj);
+
+  if(timeout > 0)
+  {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if(ts.tv_nsec >= 1000000000)
     {
-      list_head_iterate_safe(&worker->tasks, pos, tmp)
-      {
-        struct thread_dispatcher_task* t = list_head_get(pos,
-            struct thread_dispatcher_task, list);
-        list_head_remove(&worker->tasks, &t->list);
-        free(t);
-      }
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+  }
 
-      pthread_cond_broadcast(&worker->cond_tasks);
-      pthread_mutex_unlock(&worker->mutex_tasks);
+  if(pthread_mutex_lock(&obj->mutex_start) != 0)
+  {
+    return -1;
+  }
+
+  /* refuse new tasks then wait for the last one, pairs with
+   * thread_worker_finish()
+   */
+  atomic_store_explicit(&obj->draining, 1, memory_order_seq_cst);
+
+  while(timeout != 0 && err != ETIMEDOUT &&
+      thread_dispatcher_get_run(obj) == 1 && thread_dispatcher_pending(obj) > 0)
+  {
+    if(timeout < 0)
+    {
+      err = pthread_cond_wait(&obj->cond_start, &obj->mutex_start);
     }
     else
     {
-      /* mark as not all threads are clean */
-      ret = -1;
+      err = pthread_cond_timedwait(&obj->cond_start, &obj->mutex_start, &ts);
     }
   }
 
-  return ret;
+  remaining = thread_dispatcher_pending(obj);
+  thread_dispatcher_set_run(obj, 0);
+  pthread_cond_broadcast(&obj->cond_start);
+  pthread_mutex_unlock(&obj->mutex_start);
+
+  if(remaining > 0)
+  {
+    thread_dispatcher_discard(obj, 1);
+  }
+
+  return remaining > INT_MAX ? INT_MAX : (int)remaining;
 }
 
 int thread_dispatcher_start(thread_dispatcher obj)
@@ -589,6 +1874,7 @@ int thread_dispatcher_start(thread_dispatcher obj)
 
   if(pthread_mutex_lock(&obj->mutex_start) == 0)
   {
+    atomic_store_explicit(&obj->draining, 0, memory_order_relaxed);
     thread_dispatcher_set_run(obj, 1);
     pthread_cond_broadcast(&obj->cond_start);
     pthread_mutex_unlock(&obj->mutex_start);
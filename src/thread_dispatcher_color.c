@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file thread_dispatcher_color.c
+ * \brief Table of the active colors of a thread dispatcher.
+ *
+ * Colors are spread over lock stripes, each stripe having its own hash
+ * buckets and free list of entries so that producers of different colors
+ * rarely contend.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "list.h"
+#include "thread_dispatcher_color.h"
+
+/**
+ * \def THREAD_DISPATCHER_COLOR_LOCKS
+ * \brief Number of lock stripes, power of two.
+ */
+#define THREAD_DISPATCHER_COLOR_LOCKS 64
+
+/**
+ * \def THREAD_DISPATCHER_COLOR_BUCKETS
+ * \brief Number of hash buckets per stripe, power of two.
+ */
+#define THREAD_DISPATCHER_COLOR_BUCKETS 64
+
+/**
+ * \struct thread_dispatcher_color_entry
+ * \brief Active color.
+ */
+struct thread_dispatcher_color_entry
+{
+  struct list_head list; /**< For list management. */
+  uint32_t color; /**< Color. */
+  size_t worker; /**< Worker the color is bound to. */
+  size_t pending; /**< Number of queued or running tasks. */
+};
+
+/**
+ * \struct thread_dispatcher_color_stripe
+ * \brief Lock stripe.
+ */
+struct thread_dispatcher_color_stripe
+{
+  pthread_mutex_t mutex; /**< Mutex to protect the stripe. */
+  struct list_head free; /**< Unused entries. */
+  struct list_head buckets[THREAD_DISPATCHER_COLOR_BUCKETS]; /**< Buckets. */
+};
+
+/**
+ * \struct thread_dispatcher_color
+ * \brief Table of active colors.
+ */
+struct thread_dispatcher_color
+{
+  /**
+   * \brief Lock stripes.
+   */
+  struct thread_dispatcher_color_stripe stripes[THREAD_DISPATCHER_COLOR_LOCKS];
+};
+
+/**
+ * \brief Mix the bits of a color.
+ * \param color color.
+ * \return hash of the color.
+ */
+static inline uint32_t thread_dispatcher_color_hash(uint32_t color)
+{
+  color ^= color >> 16;
+  color *= 0x7feb352d;
+  color ^= color >> 15;
+  color *= 0x846ca68b;
+  color ^= color >> 16;
+  return color;
+}
+
+/**
+ * \brief Free all entries of a list.
+ * \param head list of entries.
+ */
+static void thread_dispatcher_color_list_free(struct list_head* head)
+{
+  struct list_head* pos = NULL;
+  struct list_head* tmp = NULL;
+
+  list_head_iterate_safe(head, pos, tmp)
+  {
+    struct thread_dispatcher_color_entry* e = list_head_get(pos,
+        struct thread_dispatcher_color_entry, list);
+
+    list_head_remove(head, &e->list);
+    free(e);
+  }
+}
+
+/**
+ * \brief Find an active color.
+ * \param bucket bucket of the color.
+ * \param color color.
+ * \return entry or NULL if the color is not active.
+ */
+static struct thread_dispatcher_color_entry* thread_dispatcher_color_find(
+    struct list_head* bucket, uint32_t color)
+{
+  struct list_head* pos = NULL;
+  struct list_head* tmp = NULL;
+
+  list_head_iterate_safe(bucket, pos, tmp)
+  {
+    struct thread_dispatcher_color_entry* e = list_head_get(pos,
+        struct thread_dispatcher_color_entry, list);
+
+    if(e->color == color)
+    {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+struct thread_dispatcher_color* thread_dispatcher_color_new(void)
+{
+  struct thread_dispatcher_color* ret = NULL;
+  size_t i = 0;
+
+  ret = malloc(sizeof(struct thread_dispatcher_color));
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  for(i = 0 ; i < THREAD_DISPATCHER_COLOR_LOCKS ; i++)
+  {
+    struct thread_dispatcher_color_stripe* stripe = &ret->stripes[i];
+
+    if(pthread_mutex_init(&stripe->mutex, NULL) != 0)
+    {
+      break;
+    }
+
+    list_head_init(&stripe->free);
+    for(size_t j = 0 ; j < THREAD_DISPATCHER_COLOR_BUCKETS ; j++)
+    {
+      list_head_init(&stripe->buckets[j]);
+    }
+  }
+
+  if(i != THREAD_DISPATCHER_COLOR_LOCKS)
+  {
+    while(i > 0)
+    {
+      i--;
+      pthread_mutex_destroy(&ret->stripes[i].mutex);
+    }
+    free(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+void thread_dispatcher_color_free(struct thread_dispatcher_color** obj)
+{
+  for(size_t i = 0 ; i < THREAD_DISPATCHER_COLOR_LOCKS ; i++)
+  {
+    struct thread_dispatcher_color_stripe* stripe = &(*obj)->stripes[i];
+
+    for(size_t j = 0 ; j < THREAD_DISPATCHER_COLOR_BUCKETS ; j++)
+    {
+      thread_dispatcher_color_list_free(&stripe->buckets[j]);
+    }
+    thread_dispatcher_color_list_free(&stripe->free);
+    pthread_mutex_destroy(&stripe->mutex);
+  }
+
+  free(*obj);
+  *obj = NULL;
+}
+
+int thread_dispatcher_color_acquire(struct thread_dispatcher_color* obj,
+    uint32_t color, size_t (*select)(void*, uint32_t), void* data,
+    size_t* worker)
+{
+  uint32_t hash = thread_dispatcher_color_hash(color);
+  struct thread_dispatcher_color_stripe* stripe =
+    &obj->stripes[hash & (THREAD_DISPATCHER_COLOR_LOCKS - 1)];
+  struct list_head* bucket = &stripe->buckets[(hash >> 16) &
+    (THREAD_DISPATCHER_COLOR_BUCKETS - 1)];
+  struct thread_dispatcher_color_entry* e = NULL;
+  int err = 0;
+
+  err = pthread_mutex_lock(&stripe->mutex);
+  if(err != 0)
+  {
+    errno = err;
+    return -1;
+  }
+
+  e = thread_dispatcher_color_find(bucket, color);
+  if(!e)
+  {
+    /* color becomes active, it can be bound to any worker */
+    if(!list_head_is_empty(&stripe->free))
+    {
+      e = list_head_get(stripe->free.next,
+          struct thread_dispatcher_color_entry, list);
+      list_head_remove(&stripe->free, &e->list);
+    }
+    else
+    {
+      e = malloc(sizeof(struct thread_dispatcher_color_entry));
+      if(!e)
+      {
+        pthread_mutex_unlock(&stripe->mutex);
+        errno = ENOMEM;
+        return -1;
+      }
+    }
+
+    e->color = color;
+    e->worker = select(data, color);
+    e->pending = 0;
+    list_head_add_tail(bucket, &e->list);
+  }
+
+  e->pending++;
+  *worker = e->worker;
+  pthread_mutex_unlock(&stripe->mutex);
+
+  return 0;
+}
+
+void thread_dispatcher_color_release(struct thread_dispatcher_color* obj,
+    uint32_t color)
+{
+  uint32_t hash = thread_dispatcher_color_hash(color);
+  struct thread_dispatcher_color_stripe* stripe =
+    &obj->stripes[hash & (THREAD_DISPATCHER_COLOR_LOCKS - 1)];
+  struct list_head* bucket = &stripe->buckets[(hash >> 16) &
+    (THREAD_DISPATCHER_COLOR_BUCKETS - 1)];
+  struct thread_dispatcher_color_entry* e = NULL;
+
+  if(pthread_mutex_lock(&stripe->mutex) != 0)
+  {
+    return;
+  }
+
+  e = thread_dispatcher_color_find(bucket, color);
+  assert(e && e->pending > 0);
+
+  if(e && --e->pending == 0)
+  {
+    /* no more task, the color may move on its next task */
+    list_head_remove(bucket, &e->list);
+    list_head_add_tail(&stripe->free, &e->list);
+  }
+  pthread_mutex_unlock(&stripe->mutex);
+}
+
+int thread_dispatcher_color_migrate(struct thread_dispatcher_color* obj,
+    uint32_t color, size_t nb, size_t worker, void (*move)(void*),
+    void* data)
+{
+  uint32_t hash = thread_dispatcher_color_hash(color);
+  struct thread_dispatcher_color_stripe* stripe =
+    &obj->stripes[hash & (THREAD_DISPATCHER_COLOR_LOCKS - 1)];
+  struct list_head* bucket = &stripe->buckets[(hash >> 16) &
+    (THREAD_DISPATCHER_COLOR_BUCKETS - 1)];
+  struct thread_dispatcher_color_entry* e = NULL;
+  int ret = -1;
+
+  if(pthread_mutex_lock(&stripe->mutex) != 0)
+  {
+    return -1;
+  }
+
+  e = thread_dispatcher_color_find(bucket, color);
+  if(e && e->pending == nb)
+  {
+    /* producers of the color wait for the lock, then use the new worker */
+    e->worker = worker;
+    move(data);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&stripe->mutex);
+
+  return ret;
+}
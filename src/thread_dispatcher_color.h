@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file thread_dispatcher_color.h
+ * \brief Table of the active colors of a thread dispatcher.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_THREAD_DISPATCHER_COLOR_H
+#define VSUTILS_THREAD_DISPATCHER_COLOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \struct thread_dispatcher_color
+ * \brief Opaque table of active colors.
+ *
+ * A color is active while it has queued or running tasks. The table keeps
+ * the worker an active color is bound to, so all its tasks go to the same
+ * worker. Once a color has no task anymore it is forgotten and its next
+ * task may be bound to another worker.
+ */
+struct thread_dispatcher_color;
+
+/**
+ * \brief Create a new color table.
+ * \return new color table or NULL if failure.
+ */
+struct thread_dispatcher_color* thread_dispatcher_color_new(void);
+
+/**
+ * \brief Delete a color table.
+ * \param obj pointer on color table.
+ */
+void thread_dispatcher_color_free(struct thread_dispatcher_color** obj);
+
+/**
+ * \brief Account a new task of a color and get its worker.
+ * \param obj color table.
+ * \param color color of the task.
+ * \param select function called to choose the worker if the color is not
+ * active, it is called with the table lock of the color held.
+ * \param data argument of select function.
+ * \param worker will be filled with the worker of the color.
+ * \return 0 if success, -1 if failure (errno is set).
+ */
+int thread_dispatcher_color_acquire(struct thread_dispatcher_color* obj,
+    uint32_t color, size_t (*select)(void*, uint32_t), void* data,
+    size_t* worker);
+
+/**
+ * \brief Account the end of a task of a color.
+ * \param obj color table.
+ * \param color color of the task.
+ * \note Call it once the cleanup function of the task has returned or once
+ * the task has been discarded.
+ */
+void thread_dispatcher_color_release(struct thread_dispatcher_color* obj,
+    uint32_t color);
+
+/**
+ * \brief Bind an active color to another worker.
+ * \param obj color table.
+ * \param color color.
+ * \param nb number of tasks of the color held by the caller.
+ * \param worker new worker of the color.
+ * \param move function that enqueues the held tasks in the new worker, it
+ * is called with the table lock of the color held so that these tasks
+ * precede the next ones of the color.
+ * \param data argument of move function.
+ * \return 0 if success, -1 if the color has other queued or running tasks
+ * or if failure.
+ */
+int thread_dispatcher_color_migrate(struct thread_dispatcher_color* obj,
+    uint32_t color, size_t nb, size_t worker, void (*move)(void*),
+    void* data);
+
+#endif /* VSUTILS_THREAD_DISPATCHER_COLOR_H */
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file thread_dispatcher_inbox.c
+ * \brief Lock-free multi-producer/single-consumer queue of dispatcher tasks.
+ *
+ * Implementation follows the intrusive MPSC node-based queue of Dmitry
+ * Vyukov: producers swap the tail then link the previous task to the new
+ * one, the consumer follows the links from the head. A stub task is pushed
+ * back when the queue would otherwise become empty.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "thread_dispatcher_inbox.h"
+
+void thread_dispatcher_inbox_init(struct thread_dispatcher_inbox* obj)
+{
+  atomic_init(&obj->stub.next, NULL);
+  atomic_init(&obj->tail, &obj->stub);
+  atomic_init(&obj->head, &obj->stub);
+}
+
+void thread_dispatcher_inbox_push(struct thread_dispatcher_inbox* obj,
+    struct thread_dispatcher_task* first, struct thread_dispatcher_task* last)
+{
+  struct thread_dispatcher_task* prev = NULL;
+
+  atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
+
+  /* sequentially consistent so that a parking consumer cannot miss it */
+  prev = atomic_exchange_explicit(&obj->tail, last, memory_order_seq_cst);
+
+  /* until this store the consumer cannot go past prev */
+  atomic_store_explicit(&prev->next, first, memory_order_release);
+}
+
+struct thread_dispatcher_task* thread_dispatcher_inbox_pop(
+    struct thread_dispatcher_inbox* obj)
+{
+  struct thread_dispatcher_task* head = atomic_load_explicit(&obj->head,
+      memory_order_relaxed);
+  struct thread_dispatcher_task* next = atomic_load_explicit(&head->next,
+      memory_order_acquire);
+  struct thread_dispatcher_task* tail = NULL;
+
+  if(head == &obj->stub)
+  {
+    if(!next)
+    {
+      /* empty */
+      return NULL;
+    }
+
+    /* skip the stub */
+    atomic_store_explicit(&obj->head, next, memory_order_relaxed);
+    head = next;
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+  }
+
+  if(next)
+  {
+    atomic_store_explicit(&obj->head, next, memory_order_relaxed);
+    return head;
+  }
+
+  tail = atomic_load_explicit(&obj->tail, memory_order_acquire);
+  if(tail != head)
+  {
+    /* a producer has swapped the tail but not linked its task yet */
+    return NULL;
+  }
+
+  /* head is the last task, put the stub behind it to detach it */
+  thread_dispatcher_inbox_push(obj, &obj->stub, &obj->stub);
+
+  next = atomic_load_explicit(&head->next, memory_order_acquire);
+  if(next)
+  {
+    atomic_store_explicit(&obj->head, next, memory_order_relaxed);
+    return head;
+  }
+
+  return NULL;
+}
+
+int thread_dispatcher_inbox_is_empty(struct thread_dispatcher_inbox* obj)
+{
+  return atomic_load_explicit(&obj->head, memory_order_relaxed) ==
+    &obj->stub &&
+    atomic_load_explicit(&obj->tail, memory_order_seq_cst) == &obj->stub;
+}
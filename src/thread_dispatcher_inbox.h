@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file thread_dispatcher_inbox.h
+ * \brief Lock-free multi-producer/single-consumer queue of dispatcher tasks.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_THREAD_DISPATCHER_INBOX_H
+#define VSUTILS_THREAD_DISPATCHER_INBOX_H
+
+#include <stdatomic.h>
+
+#include "thread_dispatcher.h"
+
+/**
+ * \def THREAD_DISPATCHER_INBOX_PAD
+ * \brief Padding size to keep producer and consumer ends on separate cache
+ * lines.
+ */
+#define THREAD_DISPATCHER_INBOX_PAD 64
+
+/**
+ * \struct thread_dispatcher_inbox
+ * \brief Intrusive unbounded MPSC queue, tasks are linked by their next
+ * member.
+ *
+ * Any thread can push, only one thread at a time can pop. Tasks pushed by
+ * one producer are popped in push order.
+ */
+struct thread_dispatcher_inbox
+{
+  /**
+   * \brief Last pushed task, written by producers.
+   */
+  _Atomic(struct thread_dispatcher_task*) tail;
+
+  /**
+   * \brief Padding.
+   */
+  char pad[THREAD_DISPATCHER_INBOX_PAD -
+    sizeof(_Atomic(struct thread_dispatcher_task*))];
+
+  /**
+   * \brief Next task to pop, only written by the consumer.
+   */
+  _Atomic(struct thread_dispatcher_task*) head;
+
+  /**
+   * \brief Stub task that keeps the queue non-empty.
+   */
+  struct thread_dispatcher_task stub;
+};
+
+/**
+ * \brief Initialize an empty queue.
+ * \param obj queue.
+ */
+void thread_dispatcher_inbox_init(struct thread_dispatcher_inbox* obj);
+
+/**
+ * \brief Enqueue a chain of tasks.
+ * \param obj queue.
+ * \param first first task of the chain.
+ * \param last last task of the chain, tasks from first to last have to be
+ * linked by their next member.
+ * \note Lock-free and wait-free, can be called concurrently by several
+ * threads.
+ */
+void thread_dispatcher_inbox_push(struct thread_dispatcher_inbox* obj,
+    struct thread_dispatcher_task* first, struct thread_dispatcher_task* last);
+
+/**
+ * \brief Dequeue the oldest task.
+ * \param obj queue.
+ * \return task or NULL if the queue is empty or if the oldest task is
+ * being pushed.
+ * \note Only one thread at a time can call it. Once returned the task is
+ * not referenced by the queue anymore.
+ */
+struct thread_dispatcher_task* thread_dispatcher_inbox_pop(
+    struct thread_dispatcher_inbox* obj);
+
+/**
+ * \brief Returns whether or not the queue is empty.
+ * \param obj queue.
+ * \return 1 if empty, 0 otherwise.
+ * \note The result is exact only for the consumer, for other threads it is
+ * a hint. A push in progress makes the queue non-empty even if
+ * thread_dispatcher_inbox_pop() cannot return it yet.
+ */
+int thread_dispatcher_inbox_is_empty(struct thread_dispatcher_inbox* obj);
+
+#endif /* VSUTILS_THREAD_DISPATCHER_INBOX_H */
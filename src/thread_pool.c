@@ -24,14 +24,256 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <signal.h>
 #include <errno.h>
 
 #include <sys/time.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "thread_pool.h"
+#include "thread_pool_ring.h"
+#include "thread_pool_deque.h"
+#include "thread_pool_prio.h"
+#include "task_slab.h"
+#include "worker_wait.h"
+#include "worker_stats.h"
+
+/**
+ * \def THREAD_POOL_RING_SIZE
+ * \brief Default number of slots for ring queue.
+ */
+#define THREAD_POOL_RING_SIZE 4096
+
+/**
+ * \def THREAD_POOL_DEQUE_SIZE
+ * \brief Default number of slots for per-worker deque.
+ */
+#define THREAD_POOL_DEQUE_SIZE 1024
+
+/**
+ * \def THREAD_POOL_SLAB_NODES
+ * \brief Number of task nodes allocated at once by the slab.
+ */
+#define THREAD_POOL_SLAB_NODES 256
+
+/**
+ * \def THREAD_POOL_POP_BATCH_MAX
+ * \brief Maximum number of tasks a worker pops at once.
+ */
+#define THREAD_POOL_POP_BATCH_MAX 64
+
+/**
+ * \def THREAD_POOL_PUSH_BATCH
+ * \brief Number of task nodes allocated at once by batch push.
+ */
+#define THREAD_POOL_PUSH_BATCH 64
+
+/**
+ * \def THREAD_POOL_TASK_SLAB
+ * \brief Task flag set when the node storage belongs to the pool slab.
+ */
+#define THREAD_POOL_TASK_SLAB 1
+
+/**
+ * \def THREAD_POOL_SPAWN_DEPTH
+ * \brief Default number of pending tasks that trigger a new worker.
+ */
+#define THREAD_POOL_SPAWN_DEPTH 16
+
+/**
+ * \def THREAD_POOL_SPAWN_WAIT
+ * \brief Default time (ms) without progress that triggers a new worker.
+ */
+#define THREAD_POOL_SPAWN_WAIT 10
+
+/**
+ * \def THREAD_POOL_KEEPALIVE
+ * \brief Default time (ms) before an extra idle worker exits.
+ */
+#define THREAD_POOL_KEEPALIVE 60000
+
+/**
+ * \def THREAD_POOL_SPIN
+ * \brief Default maximum time (us) an idle worker spins before parking.
+ */
+#define THREAD_POOL_SPIN 50
+
+/**
+ * \def THREAD_POOL_YIELD
+ * \brief Default number of yields of an idle worker before parking.
+ */
+#define THREAD_POOL_YIELD 4
+
+/**
+ * \def THREAD_POOL_WORKER_NONE
+ * \brief Worker slot without thread.
+ */
+#define THREAD_POOL_WORKER_NONE 0
+
+/**
+ * \def THREAD_POOL_WORKER_RUNNING
+ * \brief Worker slot with a running thread.
+ */
+#define THREAD_POOL_WORKER_RUNNING 1
+
+/**
+ * \def THREAD_POOL_WORKER_RETIRED
+ * \brief Worker slot whose thread has exited and has to be joined.
+ */
+#define THREAD_POOL_WORKER_RETIRED 2
+
+/**
+ * \def THREAD_POOL_FUTURE_DONE
+ * \brief Future state flag set when the task has completed.
+ */
+#define THREAD_POOL_FUTURE_DONE 1
+
+/**
+ * \def THREAD_POOL_FUTURE_CANCEL
+ * \brief Future state flag set when the task has been discarded.
+ */
+#define THREAD_POOL_FUTURE_CANCEL 2
+
+/**
+ * \def THREAD_POOL_FUTURE_WAIT
+ * \brief Future state flag set when a thread may wait for completion.
+ */
+#define THREAD_POOL_FUTURE_WAIT 4
+
+/**
+ * \def THREAD_POOL_FUTURE_THEN
+ * \brief Future state flag set when a continuation is registered.
+ */
+#define THREAD_POOL_FUTURE_THEN 8
+
+/**
+ * \def THREAD_POOL_FUTURE_CLAIM
+ * \brief Future state flag set when a continuation is being registered.
+ */
+#define THREAD_POOL_FUTURE_CLAIM 16
+
+/**
+ * \def THREAD_POOL_FUTURE_FINISHED
+ * \brief Future state flags set once the task will not run anymore.
+ */
+#define THREAD_POOL_FUTURE_FINISHED \
+  (THREAD_POOL_FUTURE_DONE | THREAD_POOL_FUTURE_CANCEL)
+
+/**
+ * \def THREAD_POOL_PARK_NB
+ * \brief Number of waiting places shared by all futures.
+ */
+#define THREAD_POOL_PARK_NB 8
+
+/**
+ * \struct thread_pool_worker
+ * \brief Worker of the thread pool.
+ */
+struct thread_pool_worker
+{
+  pthread_t id; /**< Thread identifier. */
+  struct thread_pool* pool; /**< Thread pool parent. */
+  struct thread_pool_deque* deque; /**< Deque for THREAD_POOL_QUEUE_STEAL. */
+  uint32_t seed; /**< Seed to select victims. */
+  struct task_slab_cache cache; /**< Cache of free task nodes. */
+  struct task_slab_cache future_cache; /**< Cache of free futures. */
+  atomic_int state; /**< THREAD_POOL_WORKER_* state of the slot. */
+  pthread_attr_t attr; /**< Attributes (CPU affinity) of the thread. */
+  int ready; /**< Deque allocation status (1 ok, -1 failure, 0 pending). */
+  struct worker_wait wait; /**< Adaptive wait when there is no task. */
+  struct worker_stats stats; /**< Statistics. */
+};
+
+/**
+ * \struct thread_pool_future
+ * \brief Completion handle of a task.
+ */
+struct thread_pool_future
+{
+  struct thread_pool_task task; /**< Task pushed to the pool. */
+  struct thread_pool* pool; /**< Thread pool parent. */
+  void* data; /**< Application data. */
+  void (*run)(void*); /**< Application run function. */
+  void (*cleanup)(void*); /**< Application cleanup function. */
+  void (*then)(void*); /**< Continuation function. */
+  void* then_data; /**< Data of the continuation function. */
+  atomic_uint state; /**< Combination of THREAD_POOL_FUTURE_* flags. */
+  atomic_uint ref; /**< References owned by the pool and the application. */
+};
+
+/**
+ * \struct thread_pool_park
+ * \brief Waiting place for futures.
+ *
+ * Futures do not have their own mutex and condition, waiters block on the
+ * place selected by the address of the future.
+ */
+struct thread_pool_park
+{
+  pthread_mutex_t mutex; /**< Mutex to protect the condition. */
+  pthread_cond_t cond; /**< Condition to notify completions. */
+};
+
+/**
+ * \def THREAD_POOL_PARK_INIT
+ * \brief Static initializer of a waiting place.
+ */
+#define THREAD_POOL_PARK_INIT {PTHREAD_MUTEX_INITIALIZER, \
+  PTHREAD_COND_INITIALIZER}
+
+/**
+ * \var thread_pool_parks
+ * \brief Waiting places of futures.
+ */
+static struct thread_pool_park thread_pool_parks[THREAD_POOL_PARK_NB] =
+{
+  THREAD_POOL_PARK_INIT, THREAD_POOL_PARK_INIT, THREAD_POOL_PARK_INIT,
+  THREAD_POOL_PARK_INIT, THREAD_POOL_PARK_INIT, THREAD_POOL_PARK_INIT,
+  THREAD_POOL_PARK_INIT, THREAD_POOL_PARK_INIT
+};
+
+/**
+ * \brief Get the waiting place of a future.
+ * \param obj future.
+ * \return waiting place.
+ */
+static inline struct thread_pool_park* thread_pool_future_park(
+    struct thread_pool_future* obj)
+{
+  return &thread_pool_parks[((uintptr_t)obj /
+      sizeof(struct thread_pool_future)) % THREAD_POOL_PARK_NB];
+}
+
+/**
+ * \struct thread_pool_parallel
+ * \brief Shared state of a parallel for or reduce.
+ *
+ * Participants grab chunks of the range until it is exhausted. The state is
+ * referenced by the caller and by each helper task so that helpers started
+ * after the end of the loop only find an empty range.
+ */
+struct thread_pool_parallel
+{
+  atomic_size_t next; /**< First index not grabbed yet. */
+  size_t end; /**< End of the range (excluded). */
+  size_t grain; /**< Minimum chunk size. */
+  size_t split; /**< Remaining range is split in this number of chunks. */
+  void (*fn)(size_t, size_t, void*); /**< Loop body. */
+  void (*reduce)(size_t, size_t, void*, void*); /**< Reduce body. */
+  void* ctx; /**< Application context. */
+  const void* identity; /**< Initial value of partial results. */
+  size_t size; /**< Size of a partial result. */
+  size_t stride; /**< Aligned size of a partial result. */
+  atomic_size_t nb_partials; /**< Number of partial results used. */
+  atomic_size_t active; /**< Participants that may run a chunk. */
+  atomic_size_t refs; /**< Reference counter. */
+  max_align_t partials[]; /**< Partial results of the participants. */
+};
 
 /**
  * \struct thread_pool.
@@ -39,426 +281,2417 @@
  */
 struct thread_pool
 {
-  struct list_head tasks; /**< List of tasks. */
+  struct thread_pool_prio tasks; /**< Pending tasks by priority class. */
   pthread_mutex_t mutex_tasks; /**< Mutex to protect tasks list. */
   pthread_cond_t cond_tasks; /**< Condition for push/pop tasks. */
   pthread_mutex_t mutex_start; /**< Mutex to protect the start condition. */
-  pthread_cond_t cond_start; /**< Condition to notify the start. */
-  pthread_rwlock_t mutex_run; /**< RW mutex to protect run state. */
-  int run; /**< Status of the pool. */
-  size_t nb_threads; /**< Number of threads. */
-  pthread_t* threads; /**< Array of worker threads. */
+  pthread_cond_t cond_start; /**< Condition to notify the start, the stop
+                               and the end of a drain. */
+  atomic_int run; /**< Status of the pool (1 run, 0 stop, -1 quit). */
+  atomic_int draining; /**< Whether or not only workers can push tasks. */
+  atomic_size_t nb_pending; /**< Tasks pushed and not finished yet. */
+  size_t nb_threads; /**< Number of worker slots (maximum threads). */
+  size_t min_threads; /**< Minimum number of threads. */
+  atomic_size_t nb_running; /**< Number of running threads. */
+  size_t spawn_depth; /**< Pending tasks that trigger a new worker. */
+  unsigned int spawn_wait; /**< Time (ms) without progress for new worker. */
+  unsigned int keepalive; /**< Time (ms) before an extra worker exits. */
+  _Atomic uint64_t last_pop; /**< Time (ms) of the last pop if elastic. */
+  atomic_int spawning; /**< Whether or not a thread spawns a worker. */
+  struct thread_pool_worker* workers; /**< Array of worker threads. */
+  enum thread_pool_queue queue; /**< Queue backend. */
+  struct thread_pool_ring* ring; /**< Ring for THREAD_POOL_QUEUE_RING. */
+  size_t deque_size; /**< Slots per worker for THREAD_POOL_QUEUE_STEAL. */
+  atomic_uint idle; /**< Number of workers parked on cond_tasks. */
+  atomic_size_t nb_shared; /**< Tasks in list (list and steal queues). */
+  struct task_slab* slab; /**< Allocator of task nodes. */
+  struct task_slab* future_slab; /**< Allocator of futures. */
+  size_t pop_batch; /**< Maximum tasks popped at once by a worker. */
+  int stats; /**< Whether or not workers measure times. */
 };
 
+/**
+ * \var thread_pool_current
+ * \brief Worker running the current thread (NULL if not a worker).
+ */
+static _Thread_local struct thread_pool_worker* thread_pool_current = NULL;
+
 /**
  * \brief Atomically get run state.
  * \param obj thread pool.
- * \return run state or -99 if failure.
+ * \return run state.
+ * \note Acquire load, pairs with the release store of thread_pool_set_run.
+ */
+static inline int thread_pool_get_run(struct thread_pool* obj)
+{
+  return atomic_load_explicit(&obj->run, memory_order_acquire);
+}
+
+/**
+ * \brief Atomically set run state.
+ * \param obj thread pool.
+ * \param run run state to set.
+ */
+static inline void thread_pool_set_run(struct thread_pool* obj, int run)
+{
+  atomic_store_explicit(&obj->run, run, memory_order_release);
+}
+
+/**
+ * \brief Account tasks about to be pushed.
+ * \param obj thread pool.
+ * \param nb number of tasks.
+ * \return 0 if success, -1 if the pool is draining and the caller is not one
+ * of its workers (errno is set to ESHUTDOWN).
  */
-static int thread_pool_get_run(struct thread_pool* obj)
+static int thread_pool_accept(struct thread_pool* obj, size_t nb)
 {
-  if(pthread_rwlock_rdlock(&obj->mutex_run) == 0)
+  struct thread_pool_worker* worker = thread_pool_current;
+
+  if(atomic_load_explicit(&obj->draining, memory_order_relaxed) &&
+      !(worker && worker->pool == obj))
   {
-    int run = obj->run;
-    pthread_rwlock_unlock(&obj->mutex_run);
-    return run;
+    errno = ESHUTDOWN;
+    return -1;
   }
 
-  return -99;
+  atomic_fetch_add_explicit(&obj->nb_pending, nb, memory_order_relaxed);
+  return 0;
 }
 
 /**
- * \brief Atomically set run state.
+ * \brief Account tasks that are finished, discarded or not pushed.
  * \param obj thread pool.
- * \param run run state to set or -1 if failure.
+ * \param nb number of tasks.
+ * \note The last one wakes up thread_pool_drain().
  */
-static int thread_pool_set_run(struct thread_pool* obj, int run)
+static void thread_pool_finish(struct thread_pool* obj, size_t nb)
 {
-  if(pthread_rwlock_wrlock(&obj->mutex_run) == 0)
+  /* pairs with the draining store and nb_pending load of the drain */
+  if(atomic_fetch_sub_explicit(&obj->nb_pending, nb,
+        memory_order_seq_cst) == nb &&
+      atomic_load_explicit(&obj->draining, memory_order_seq_cst) &&
+      pthread_mutex_lock(&obj->mutex_start) == 0)
   {
-    obj->run = run;
-    pthread_rwlock_unlock(&obj->mutex_run);
-    return 0;
+    pthread_cond_broadcast(&obj->cond_start);
+    pthread_mutex_unlock(&obj->mutex_start);
   }
+}
 
-  return -1;
+/**
+ * \brief Allocate a task node from the slab of the pool.
+ * \param obj thread pool.
+ * \return node or NULL if failure.
+ * \note Workers of the pool use their own cache of nodes.
+ */
+static struct thread_pool_task* thread_pool_node_alloc(struct thread_pool* obj)
+{
+  struct thread_pool_worker* worker = thread_pool_current;
+
+  return task_slab_alloc(obj->slab,
+      (worker && worker->pool == obj) ? &worker->cache : NULL);
 }
 
 /**
- * \brief Pop the first task of the thread pool.
+ * \brief Release a task node once it has been popped.
  * \param obj thread pool.
+ * \param t node, nothing is done if its storage is owned by the caller of
+ * thread_pool_push_task().
+ */
+static void thread_pool_node_release(struct thread_pool* obj,
+    struct thread_pool_task* t)
+{
+  struct thread_pool_worker* worker = thread_pool_current;
+
+  if(!(t->flags & THREAD_POOL_TASK_SLAB))
+  {
+    return;
+  }
+
+  task_slab_release(obj->slab,
+      (worker && worker->pool == obj) ? &worker->cache : NULL, t);
+}
+
+/**
+ * \brief Returns whether or not the number of workers can change.
+ * \param obj thread pool.
+ * \return 1 if pool is elastic, 0 otherwise.
+ */
+static inline int thread_pool_is_elastic(struct thread_pool* obj)
+{
+  return obj->min_threads < obj->nb_threads;
+}
+
+/**
+ * \brief Get monotonic time.
+ * \return time in milliseconds.
+ */
+static uint64_t thread_pool_now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Wait for a task to be pushed.
+ * \param worker worker.
+ * \return 0 if woken up, ETIMEDOUT if keepalive has expired.
+ * \note mutex_tasks has to be locked. Only workers of elastic pools wait
+ * with a timeout.
+ */
+static int thread_pool_wait_task(struct thread_pool_worker* worker)
+{
+  struct thread_pool* obj = worker->pool;
+  struct timespec ts;
+
+  worker_stats_add(&worker->stats.wakeups, 1);
+
+  if(!thread_pool_is_elastic(obj))
+  {
+    pthread_cond_wait(&obj->cond_tasks, &obj->mutex_tasks);
+    return 0;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += obj->keepalive / 1000;
+  ts.tv_nsec += (long)(obj->keepalive % 1000) * 1000000;
+  if(ts.tv_nsec >= 1000000000)
+  {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+
+  return pthread_cond_timedwait(&obj->cond_tasks, &obj->mutex_tasks,
+      &ts) == ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+/**
+ * \brief Retire a worker that has been idle for keepalive.
+ * \param worker worker.
+ * \return 0 if worker has to exit, -1 if it is needed to keep the minimum
+ * number of threads.
+ * \note mutex_tasks has to be locked.
+ */
+static int thread_pool_retire(struct thread_pool_worker* worker)
+{
+  struct thread_pool* obj = worker->pool;
+
+  if(atomic_load(&obj->nb_running) <= obj->min_threads)
+  {
+    return -1;
+  }
+
+  atomic_fetch_sub(&obj->nb_running, 1);
+  atomic_store(&worker->state, THREAD_POOL_WORKER_RETIRED);
+  return 0;
+}
+
+/**
+ * \brief Returns whether or not an idle worker has to stop waiting in ring
+ * mode.
+ * \param data thread pool.
+ * \return 1 if a task is pending or the pool is not running, 0 otherwise.
+ */
+static int thread_pool_ring_ready(void* data)
+{
+  struct thread_pool* obj = data;
+
+  return thread_pool_ring_size(obj->ring) > 0 ||
+    thread_pool_get_run(obj) != 1;
+}
+
+/**
+ * \brief Pop the first task of the ring queue.
+ * \param worker worker that pops.
  * \param task task that will be popped, it will be filled with data from the
  * manager.
  * \return 0 if success, -1 on failure.
- * \note This function is blocking until a task is available.
+ * \note This function is blocking until a task is available. The mutex and
+ * condition are only used when the ring is empty.
  */
-static int thread_pool_pop(thread_pool obj, struct thread_pool_task* task)
+static int thread_pool_pop_ring(struct thread_pool_worker* worker,
+    struct thread_pool_task* task)
 {
-  struct thread_pool_task* t = NULL;
-  int ret = -1;
+  struct thread_pool* obj = worker->pool;
 
-  if(pthread_mutex_lock(&obj->mutex_tasks) == 0)
+  for(;;)
   {
-    struct list_head* pos = NULL;
-    int run = thread_pool_get_run(obj);
+    int err = 0;
 
-    if(run <= 0)
+    if(thread_pool_ring_pop(obj->ring, task) == 0)
+    {
+      worker_stats_max(&worker->stats.depth_max,
+          thread_pool_ring_size(obj->ring) + 1);
+      return 0;
+    }
+
+    if(thread_pool_get_run(obj) <= 0)
     {
-      pthread_mutex_unlock(&obj->mutex_tasks);
       return -1;
     }
 
-    while(list_head_is_empty(&obj->tasks))
+    /* spin then yield before paying a sleep/wake cycle */
+    if(worker_wait_spin(&worker->wait, thread_pool_ring_ready, obj))
     {
-      /* wait for a task */
-      pthread_cond_wait(&obj->cond_tasks, &obj->mutex_tasks);
+      continue;
+    }
 
-      /* condition signaled or spurious wake up, check if stop/exit */
-      run = thread_pool_get_run(obj);
-      if(run <= 0)
-      {
-        pthread_mutex_unlock(&obj->mutex_tasks);
-        return -1;
-      }
+    if(pthread_mutex_lock(&obj->mutex_tasks) != 0)
+    {
+      return -1;
     }
 
-    pos = obj->tasks.next;
-    t = list_head_get(pos, struct thread_pool_task, list);
-    ret = 0;
+    /* announce we are about to park then check again so that a producer
+     * either sees us or we see its task
+     */
+    atomic_fetch_add(&obj->idle, 1);
 
-    /* fill task with thread_pool_task data from list */
-    task->data = t->data;
-    task->run = t->run;
-    task->cleanup = t->cleanup;
+    if(thread_pool_ring_pop(obj->ring, task) == 0)
+    {
+      atomic_fetch_sub(&obj->idle, 1);
+      pthread_mutex_unlock(&obj->mutex_tasks);
+      return 0;
+    }
+
+    if(thread_pool_get_run(obj) <= 0)
+    {
+      atomic_fetch_sub(&obj->idle, 1);
+      pthread_mutex_unlock(&obj->mutex_tasks);
+      return -1;
+    }
 
-    /* remove task from list */
-    list_head_remove(&obj->tasks, &t->list);
+    /* wait for a task */
+    err = thread_pool_wait_task(worker);
+    atomic_fetch_sub(&obj->idle, 1);
+
+    if(err == ETIMEDOUT && thread_pool_ring_size(obj->ring) == 0 &&
+        thread_pool_retire(worker) == 0)
+    {
+      pthread_mutex_unlock(&obj->mutex_tasks);
+      return -1;
+    }
     pthread_mutex_unlock(&obj->mutex_tasks);
   }
-  else
+}
+
+/**
+ * \brief Returns whether or not a task is pending somewhere for stealing
+ * workers.
+ * \param obj thread pool.
+ * \return 1 if a task is pending, 0 otherwise.
+ * \note mutex_tasks has to be locked.
+ */
+static int thread_pool_steal_has_task(thread_pool obj)
+{
+  if(!thread_pool_prio_is_empty(&obj->tasks))
   {
-    return -1;
+    return 1;
   }
 
-  if(ret == 0)
+  for(size_t i = 0 ; i < obj->nb_threads ; i++)
   {
-    free(t);
+    if(!thread_pool_deque_is_empty(obj->workers[i].deque))
+    {
+      return 1;
+    }
   }
 
-  return ret;
+  return 0;
 }
 
 /**
- * \brief Worker thread function that wait for a task to execute.
- * \param data the thread pool.
- * \return NULL.
+ * \brief Returns whether or not an idle worker has to stop waiting in
+ * work-stealing mode.
+ * \param data worker.
+ * \return 1 if a task is pending or the pool is not running, 0 otherwise.
  */
-static void* thr_worker(void* data)
+static int thread_pool_steal_ready(void* data)
 {
-  struct thread_pool* pool = data;
-  int run = 0;
+  struct thread_pool_worker* worker = data;
+  struct thread_pool* obj = worker->pool;
 
-  if(!data)
+  if(atomic_load_explicit(&obj->nb_shared, memory_order_relaxed) > 0 ||
+      thread_pool_get_run(obj) != 1)
   {
-    return NULL;
+    return 1;
   }
 
-  while(run >= 0)
+  for(size_t i = 0 ; i < obj->nb_threads ; i++)
   {
-    struct thread_pool_task task;
+    if(!thread_pool_deque_is_empty(obj->workers[i].deque))
+    {
+      return 1;
+    }
+  }
 
-    run = thread_pool_get_run(pool);
+  return 0;
+}
 
-    if(run == 0)
+/**
+ * \brief Find a task for a worker: its own deque first, then the shared
+ * queue and finally the deques of other workers.
+ * \param worker worker.
+ * \return task or NULL if none found.
+ */
+static struct thread_pool_task* thread_pool_steal_find(
+    struct thread_pool_worker* worker)
+{
+  struct thread_pool* obj = worker->pool;
+  struct thread_pool_task* t = thread_pool_deque_take(worker->deque);
+  size_t start = 0;
+
+  if(t)
+  {
+    return t;
+  }
+
+  if(atomic_load_explicit(&obj->nb_shared, memory_order_relaxed) > 0 &&
+      pthread_mutex_lock(&obj->mutex_tasks) == 0)
+  {
+    t = thread_pool_prio_pop(&obj->tasks);
+    if(t)
     {
-      /* stop case */
-      if(pthread_mutex_lock(&pool->mutex_start) == 0)
-      {
-        while(run == 0)
-        {
-          pthread_cond_wait(&pool->cond_start, &pool->mutex_start);
-          run = thread_pool_get_run(pool);
-        }
-        pthread_mutex_unlock(&pool->mutex_start);
-      }
-      else
-      {
-        /* problem locking mutex? */
+      atomic_fetch_sub_explicit(&obj->nb_shared, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&obj->mutex_tasks);
+
+    if(t)
+    {
+      return t;
+    }
+  }
+
+  /* xorshift to pick the first victim */
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 17;
+  worker->seed ^= worker->seed << 5;
+  start = worker->seed % obj->nb_threads;
+
+  for(size_t i = 0 ; i < obj->nb_threads ; i++)
+  {
+    struct thread_pool_worker* victim =
+      &obj->workers[(start + i) % obj->nb_threads];
+
+    if(victim == worker)
+    {
+      continue;
+    }
+
+    t = thread_pool_deque_steal(victim->deque);
+    if(t)
+    {
+      worker_stats_add(&worker->stats.steals, 1);
+      return t;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * \brief Pop a task for a worker in work-stealing mode.
+ * \param worker worker.
+ * \param task task that will be popped, it will be filled with data from the
+ * manager.
+ * \return 0 if success, -1 on failure.
+ * \note This function is blocking until a task is available.
+ */
+static int thread_pool_pop_steal(struct thread_pool_worker* worker,
+    struct thread_pool_task* task)
+{
+  struct thread_pool* obj = worker->pool;
+
+  for(;;)
+  {
+    struct thread_pool_task* t = thread_pool_steal_find(worker);
+    int err = 0;
+
+    if(t)
+    {
+      task->data = t->data;
+      task->run = t->run;
+      task->cleanup = t->cleanup;
+      task->enqueued = t->enqueued;
+      thread_pool_node_release(obj, t);
+      worker_stats_max(&worker->stats.depth_max, 1 +
+          thread_pool_deque_size(worker->deque) +
+          atomic_load_explicit(&obj->nb_shared, memory_order_relaxed));
+      return 0;
+    }
+
+    if(thread_pool_get_run(obj) <= 0)
+    {
+      return -1;
+    }
+
+    /* spin then yield before paying a sleep/wake cycle */
+    if(worker_wait_spin(&worker->wait, thread_pool_steal_ready, worker))
+    {
+      continue;
+    }
+
+    if(pthread_mutex_lock(&obj->mutex_tasks) != 0)
+    {
+      return -1;
+    }
+
+    /* announce we are about to park then check again so that a producer
+     * either sees us or we see its task
+     */
+    atomic_fetch_add(&obj->idle, 1);
+
+    if(thread_pool_steal_has_task(obj))
+    {
+      atomic_fetch_sub(&obj->idle, 1);
+      pthread_mutex_unlock(&obj->mutex_tasks);
+      continue;
+    }
+
+    if(thread_pool_get_run(obj) <= 0)
+    {
+      atomic_fetch_sub(&obj->idle, 1);
+      pthread_mutex_unlock(&obj->mutex_tasks);
+      return -1;
+    }
+
+    /* wait for a task */
+    err = thread_pool_wait_task(worker);
+    atomic_fetch_sub(&obj->idle, 1);
+
+    if(err == ETIMEDOUT && !thread_pool_steal_has_task(obj) &&
+        thread_pool_retire(worker) == 0)
+    {
+      pthread_mutex_unlock(&obj->mutex_tasks);
+      return -1;
+    }
+    pthread_mutex_unlock(&obj->mutex_tasks);
+  }
+}
+
+/**
+ * \brief Returns whether or not an idle worker has to stop waiting in list
+ * mode.
+ * \param data thread pool.
+ * \return 1 if a task is pending or the pool is not running, 0 otherwise.
+ */
+static int thread_pool_list_ready(void* data)
+{
+  struct thread_pool* obj = data;
+
+  return atomic_load_explicit(&obj->nb_shared, memory_order_relaxed) > 0 ||
+    thread_pool_get_run(obj) != 1;
+}
+
+/**
+ * \brief Pop the first tasks of the thread pool.
+ * \param worker worker that pops.
+ * \param tasks array that will be filled with popped tasks.
+ * \param max maximum number of tasks to pop.
+ * \return number of tasks popped if success, -1 on failure.
+ * \note This function is blocking until a task is available. Only the list
+ * queue pops more than one task per call.
+ */
+static int thread_pool_pop(struct thread_pool_worker* worker,
+    struct thread_pool_task* tasks, size_t max)
+{
+  struct thread_pool* obj = worker->pool;
+  struct list_head popped;
+  struct list_head* pos = NULL;
+  struct list_head* tmp = NULL;
+  int ret = 0;
+  int run = 0;
+
+  if(obj->queue == THREAD_POOL_QUEUE_RING)
+  {
+    return thread_pool_pop_ring(worker, tasks) == 0 ? 1 : -1;
+  }
+  else if(obj->queue == THREAD_POOL_QUEUE_STEAL)
+  {
+    return thread_pool_pop_steal(worker, tasks) == 0 ? 1 : -1;
+  }
+
+  if(atomic_load_explicit(&obj->nb_shared, memory_order_relaxed) == 0)
+  {
+    /* spin then yield before paying a sleep/wake cycle */
+    worker_wait_spin(&worker->wait, thread_pool_list_ready, obj);
+  }
+
+  if(pthread_mutex_lock(&obj->mutex_tasks) != 0)
+  {
+    return -1;
+  }
+
+  run = thread_pool_get_run(obj);
+
+  if(run <= 0)
+  {
+    pthread_mutex_unlock(&obj->mutex_tasks);
+    return -1;
+  }
+
+  while(thread_pool_prio_is_empty(&obj->tasks))
+  {
+    int err = 0;
+
+    /* wait for a task */
+    atomic_fetch_add_explicit(&obj->idle, 1, memory_order_relaxed);
+    err = thread_pool_wait_task(worker);
+    atomic_fetch_sub_explicit(&obj->idle, 1, memory_order_relaxed);
+
+    /* condition signaled or spurious wake up, check if stop/exit */
+    run = thread_pool_get_run(obj);
+    if(run <= 0 || (err == ETIMEDOUT &&
+          thread_pool_prio_is_empty(&obj->tasks) &&
+          thread_pool_retire(worker) == 0))
+    {
+      pthread_mutex_unlock(&obj->mutex_tasks);
+      return -1;
+    }
+  }
+
+  list_head_init(&popped);
+  worker_stats_max(&worker->stats.depth_max, obj->tasks.nb);
+
+  while((size_t)ret < max)
+  {
+    struct thread_pool_task* t = thread_pool_prio_pop(&obj->tasks);
+
+    if(!t)
+    {
+      break;
+    }
+
+    /* fill task with thread_pool_task data from list */
+    tasks[ret].data = t->data;
+    tasks[ret].run = t->run;
+    tasks[ret].cleanup = t->cleanup;
+    tasks[ret].enqueued = t->enqueued;
+    ret++;
+
+    /* nodes are released once unlocked */
+    list_head_add_tail(&popped, &t->list);
+  }
+  atomic_fetch_sub_explicit(&obj->nb_shared, (size_t)ret,
+      memory_order_relaxed);
+  pthread_mutex_unlock(&obj->mutex_tasks);
+
+  list_head_iterate_safe(&popped, pos, tmp)
+  {
+    thread_pool_node_release(obj,
+        list_head_get(pos, struct thread_pool_task, list));
+  }
+
+  return ret;
+}
+
+static void* thr_worker(void* data);
+
+/**
+ * \brief Get the number of pending tasks.
+ * \param obj thread pool.
+ * \return number of pending tasks.
+ * \note Lock-free, the queues are only sampled.
+ */
+static size_t thread_pool_depth(struct thread_pool* obj)
+{
+  size_t ret = atomic_load_explicit(&obj->nb_shared, memory_order_relaxed);
+
+  if(obj->ring)
+  {
+    ret += thread_pool_ring_size(obj->ring);
+  }
+
+  for(size_t i = 0 ; i < obj->nb_threads ; i++)
+  {
+    if(obj->workers[i].deque)
+    {
+      ret += thread_pool_deque_size(obj->workers[i].deque);
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Spawn a worker if the pool is elastic and its running workers do not
+ * keep up with the pushed tasks.
+ * \param obj thread pool.
+ */
+static void thread_pool_grow(struct thread_pool* obj)
+{
+  struct thread_pool_worker* worker = NULL;
+  size_t depth = 0;
+
+  /* fixed size, stopped, idle workers or maximum reached: nothing to do */
+  if(!thread_pool_is_elastic(obj) || thread_pool_get_run(obj) != 1 ||
+      atomic_load_explicit(&obj->idle, memory_order_relaxed) > 0 ||
+      atomic_load_explicit(&obj->nb_running, memory_order_relaxed) >=
+      obj->nb_threads)
+  {
+    return;
+  }
+
+  /* sampled without lock, producers must not serialize here */
+  depth = thread_pool_depth(obj);
+
+  if(depth == 0 || (depth < obj->spawn_depth && thread_pool_now_ms() -
+       atomic_load_explicit(&obj->last_pop, memory_order_relaxed) <
+       obj->spawn_wait))
+  {
+    return;
+  }
+
+  /* one spawn at a time, the others give up instead of waiting for it */
+  if(atomic_exchange_explicit(&obj->spawning, 1, memory_order_acquire) != 0)
+  {
+    return;
+  }
+
+  if(thread_pool_get_run(obj) == 1 &&
+      atomic_load(&obj->nb_running) < obj->nb_threads)
+  {
+    for(size_t i = 0 ; i < obj->nb_threads ; i++)
+    {
+      if(atomic_load(&obj->workers[i].state) != THREAD_POOL_WORKER_RUNNING)
+      {
+        worker = &obj->workers[i];
+        break;
+      }
+    }
+  }
+
+  if(worker)
+  {
+    if(atomic_load(&worker->state) == THREAD_POOL_WORKER_RETIRED)
+    {
+      /* thread has already left its loop */
+      pthread_join(worker->id, NULL);
+    }
+
+    atomic_store(&worker->state, THREAD_POOL_WORKER_RUNNING);
+    if(pthread_create(&worker->id, &worker->attr, thr_worker, worker) == 0)
+    {
+      atomic_fetch_add(&obj->nb_running, 1);
+    }
+    else
+    {
+      atomic_store(&worker->state, THREAD_POOL_WORKER_NONE);
+    }
+  }
+
+  atomic_store_explicit(&obj->spawning, 0, memory_order_release);
+}
+
+/**
+ * \brief Worker thread function that wait for a task to execute.
+ * \param data the thread pool worker.
+ * \return NULL.
+ */
+static void* thr_worker(void* data)
+{
+  struct thread_pool_worker* worker = data;
+  struct thread_pool* pool = NULL;
+  int run = 0;
+  uint64_t now = 0;
+
+  if(!data)
+  {
+    return NULL;
+  }
+
+  pool = worker->pool;
+  thread_pool_current = worker;
+
+  if(pool->queue == THREAD_POOL_QUEUE_STEAL && !worker->deque)
+  {
+    /*
+     * initial worker allocates its deque itself, once pinned, so that the
+     * memory is first touched (and placed) on its NUMA node
+     */
+    worker->deque = thread_pool_deque_new(pool->deque_size);
+
+    if(pthread_mutex_lock(&pool->mutex_start) == 0)
+    {
+      worker->ready = worker->deque ? 1 : -1;
+      pthread_cond_broadcast(&pool->cond_start);
+      pthread_mutex_unlock(&pool->mutex_start);
+    }
+
+    if(!worker->deque)
+    {
+      return NULL;
+    }
+  }
+
+  while(run >= 0)
+  {
+    struct thread_pool_task tasks[THREAD_POOL_POP_BATCH_MAX];
+    int nb = 0;
+
+    run = thread_pool_get_run(pool);
+
+    if(run == 0)
+    {
+      /* stop case */
+      if(pthread_mutex_lock(&pool->mutex_start) == 0)
+      {
+        /* start may have been broadcast since run was read */
+        run = thread_pool_get_run(pool);
+        while(run == 0)
+        {
+          pthread_cond_wait(&pool->cond_start, &pool->mutex_start);
+          run = thread_pool_get_run(pool);
+        }
+        pthread_mutex_unlock(&pool->mutex_start);
+      }
+      else
+      {
+        /* problem locking mutex? */
         sched_yield();
       }
 
-      continue;
-    }
-    else if(run == -1)
-    {
-      /* free case */
-      break;
-    }
-    else if(run < 0)
+      /* time spent stopped is not idle time */
+      now = 0;
+      continue;
+    }
+    else if(run < 0)
+    {
+      /* free case */
+      break;
+    }
+    else
+    {
+      /* running case */
+      if(pool->stats && now == 0)
+      {
+        /* otherwise the end of the last task */
+        now = worker_stats_now();
+      }
+
+      nb = thread_pool_pop(worker, tasks, pool->pop_batch);
+
+      if(atomic_load_explicit(&worker->state, memory_order_relaxed) ==
+          THREAD_POOL_WORKER_RETIRED)
+      {
+        /* idle for too long in elastic pool */
+        break;
+      }
+
+      if(nb > 0 && thread_pool_is_elastic(pool))
+      {
+        atomic_store_explicit(&pool->last_pop, thread_pool_now_ms(),
+            memory_order_relaxed);
+
+        /* tasks may have been pushed faster than parked workers woke up */
+        thread_pool_grow(pool);
+      }
+
+      if(nb > 0 && pool->stats)
+      {
+        uint64_t start = worker_stats_now();
+
+        worker_stats_add(&worker->stats.idle, start - now);
+        now = start;
+      }
+
+      /* process tasks then cleanup */
+      for(int i = 0 ; i < nb ; i++)
+      {
+        tasks[i].run(tasks[i].data);
+        tasks[i].cleanup(tasks[i].data);
+
+        if(pool->stats)
+        {
+          /* end of a task is the start of the next one */
+          uint64_t end = worker_stats_now();
+
+          if(tasks[i].enqueued && now >= tasks[i].enqueued)
+          {
+            worker_stats_record(&worker->stats.wait,
+                now - tasks[i].enqueued);
+          }
+          worker_stats_record(&worker->stats.run, end - now);
+          worker_stats_add(&worker->stats.busy, end - now);
+          now = end;
+        }
+      }
+
+      if(nb > 0)
+      {
+        worker_stats_add(&worker->stats.tasks, (uint64_t)nb);
+        thread_pool_finish(pool, (size_t)nb);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * \brief Create the task node allocator and the lock-free queues required
+ * by the queue backend.
+ * \param obj thread pool.
+ * \param config configuration.
+ * \return 0 if success, -1 otherwise.
+ */
+static int thread_pool_queues_new(struct thread_pool* obj,
+    const struct thread_pool_config* config)
+{
+  obj->slab = task_slab_new(sizeof(struct thread_pool_prio_node),
+      THREAD_POOL_SLAB_NODES);
+  if(!obj->slab)
+  {
+    return -1;
+  }
+
+  obj->future_slab = task_slab_new(sizeof(struct thread_pool_future),
+      THREAD_POOL_SLAB_NODES);
+  if(!obj->future_slab)
+  {
+    task_slab_free(&obj->slab);
+    return -1;
+  }
+
+  if(obj->queue == THREAD_POOL_QUEUE_RING)
+  {
+    obj->ring = thread_pool_ring_new(config->ring_size);
+    if(!obj->ring)
+    {
+      task_slab_free(&obj->future_slab);
+      task_slab_free(&obj->slab);
+      return -1;
+    }
+  }
+  else if(obj->queue == THREAD_POOL_QUEUE_STEAL)
+  {
+    /* deques of initial workers are allocated by the workers */
+    for(size_t i = obj->min_threads ; i < obj->nb_threads ; i++)
+    {
+      obj->workers[i].deque = thread_pool_deque_new(config->deque_size);
+      if(!obj->workers[i].deque)
+      {
+        for(size_t j = obj->min_threads ; j < i ; j++)
+        {
+          thread_pool_deque_free(&obj->workers[j].deque);
+        }
+        task_slab_free(&obj->future_slab);
+        task_slab_free(&obj->slab);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Free the lock-free queues and the task node allocator of the
+ * thread pool.
+ * \param obj thread pool.
+ * \param nb number of workers.
+ * \note Remaining tasks have to be cleaned before.
+ */
+static void thread_pool_queues_free(struct thread_pool* obj, size_t nb)
+{
+  task_slab_free(&obj->slab);
+  task_slab_free(&obj->future_slab);
+
+  if(obj->ring)
+  {
+    thread_pool_ring_free(&obj->ring);
+  }
+
+  for(size_t i = 0 ; i < nb ; i++)
+  {
+    if(obj->workers[i].deque)
+    {
+      thread_pool_deque_free(&obj->workers[i].deque);
+    }
+  }
+}
+
+/**
+ * \brief Wait until a new worker has allocated its deque.
+ * \param obj thread pool.
+ * \param worker worker.
+ * \return 0 if success, -1 if worker has failed and exited.
+ */
+static int thread_pool_worker_ready(struct thread_pool* obj,
+    struct thread_pool_worker* worker)
+{
+  int ready = 0;
+
+  if(pthread_mutex_lock(&obj->mutex_start) != 0)
+  {
+    return -1;
+  }
+
+  while(worker->ready == 0)
+  {
+    pthread_cond_wait(&obj->cond_start, &obj->mutex_start);
+  }
+  ready = worker->ready;
+  pthread_mutex_unlock(&obj->mutex_start);
+
+  return ready == 1 ? 0 : -1;
+}
+
+void thread_pool_config_init(struct thread_pool_config* config, size_t nb)
+{
+  config->nb_threads = nb;
+  config->queue = THREAD_POOL_QUEUE_LIST;
+  config->ring_size = THREAD_POOL_RING_SIZE;
+  config->deque_size = THREAD_POOL_DEQUE_SIZE;
+  config->pop_batch = 1;
+  config->max_threads = nb;
+  config->spawn_depth = THREAD_POOL_SPAWN_DEPTH;
+  config->spawn_wait = THREAD_POOL_SPAWN_WAIT;
+  config->keepalive = THREAD_POOL_KEEPALIVE;
+  config->spin = THREAD_POOL_SPIN;
+  config->yield = THREAD_POOL_YIELD;
+  thread_affinity_init(&config->affinity);
+  config->stats = 1;
+}
+
+thread_pool thread_pool_new(size_t nb)
+{
+  struct thread_pool_config config;
+
+  thread_pool_config_init(&config, nb);
+  return thread_pool_new_config(&config);
+}
+
+thread_pool thread_pool_new_config(const struct thread_pool_config* config)
+{
+  struct thread_pool* ret = NULL;
+  pthread_mutexattr_t mutexattr;
+  size_t nb = config->nb_threads;
+  size_t created = 0;
+  size_t attrs = 0;
+
+  if(nb == 0)
+  {
+    return NULL;
+  }
+
+  /* slots are reserved for the maximum number of threads */
+  if(config->max_threads > nb)
+  {
+    nb = config->max_threads;
+  }
+
+  ret = malloc(sizeof(struct thread_pool) +
+      (sizeof(struct thread_pool_worker) * nb));
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  atomic_init(&ret->run, 0);
+  atomic_init(&ret->draining, 0);
+  atomic_init(&ret->nb_pending, 0);
+  thread_pool_prio_init(&ret->tasks);
+  /* memory is already reserved for workers member */
+  ret->workers = (struct thread_pool_worker*)(((char*)ret) +
+      sizeof(struct thread_pool));
+  memset(ret->workers, 0x00, sizeof(struct thread_pool_worker) * nb);
+  ret->nb_threads = nb;
+  ret->min_threads = config->nb_threads;
+  atomic_init(&ret->nb_running, 0);
+  ret->spawn_depth = config->spawn_depth;
+  ret->spawn_wait = config->spawn_wait;
+  ret->keepalive = config->keepalive;
+  atomic_init(&ret->last_pop, thread_pool_now_ms());
+  atomic_init(&ret->spawning, 0);
+  ret->queue = config->queue;
+  ret->ring = NULL;
+  ret->deque_size = config->deque_size;
+  atomic_init(&ret->idle, 0);
+  atomic_init(&ret->nb_shared, 0);
+  ret->pop_batch = config->pop_batch;
+  ret->stats = config->stats;
+
+  if(ret->pop_batch == 0)
+  {
+    ret->pop_batch = 1;
+  }
+  else if(ret->pop_batch > THREAD_POOL_POP_BATCH_MAX)
+  {
+    ret->pop_batch = THREAD_POOL_POP_BATCH_MAX;
+  }
+
+  if((pthread_mutexattr_init(&mutexattr) != 0) ||
+      (pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_NORMAL)))
+  {
+    free(ret);
+    return NULL;
+  }
+
+  if(pthread_mutex_init(&ret->mutex_tasks, &mutexattr) != 0)
+  {
+    pthread_mutexattr_destroy(&mutexattr);
+    free(ret);
+    return NULL;
+  }
+
+  pthread_mutexattr_destroy(&mutexattr);
+
+  if(pthread_cond_init(&ret->cond_tasks, NULL) != 0)
+  {
+    pthread_mutex_destroy(&ret->mutex_tasks);
+    free(ret);
+    return NULL;
+  }
+
+  if(pthread_mutex_init(&ret->mutex_start, NULL) != 0)
+  {
+    pthread_mutex_destroy(&ret->mutex_tasks);
+    pthread_cond_destroy(&ret->cond_tasks);
+    free(ret);
+    return NULL;
+  }
+
+  if(pthread_cond_init(&ret->cond_start, NULL) != 0)
+  {
+    pthread_mutex_destroy(&ret->mutex_tasks);
+    pthread_cond_destroy(&ret->cond_tasks);
+    pthread_mutex_destroy(&ret->mutex_start);
+    free(ret);
+    return NULL;
+  }
+
+  if(thread_pool_queues_new(ret, config) != 0)
+  {
+    pthread_mutex_destroy(&ret->mutex_tasks);
+    pthread_cond_destroy(&ret->cond_tasks);
+    pthread_mutex_destroy(&ret->mutex_start);
+    pthread_cond_destroy(&ret->cond_start);
+    free(ret);
+    return NULL;
+  }
+
+  for(size_t i = 0 ; i < nb ; i++)
+  {
+    struct thread_pool_worker* worker = &ret->workers[i];
+
+    worker->pool = ret;
+    worker->seed = (uint32_t)i + 1;
+    atomic_init(&worker->state, THREAD_POOL_WORKER_NONE);
+    worker_wait_init(&worker->wait, config->spin, config->yield);
+    worker_stats_init(&worker->stats);
+
+    if(pthread_attr_init(&worker->attr) != 0)
+    {
+      break;
+    }
+    attrs++;
+
+    if(thread_affinity_attr_set(&config->affinity, i, &worker->attr) != 0)
+    {
+      break;
+    }
+
+    if(i >= ret->min_threads)
+    {
+      /* spawned on demand */
+      continue;
+    }
+
+    atomic_store(&worker->state, THREAD_POOL_WORKER_RUNNING);
+    if(pthread_create(&worker->id, &worker->attr, thr_worker, worker) != 0)
+    {
+      break;
+    }
+
+    created++;
+
+    if(ret->queue == THREAD_POOL_QUEUE_STEAL &&
+        thread_pool_worker_ready(ret, worker) != 0)
+    {
+      break;
+    }
+  }
+
+  atomic_store(&ret->nb_running, created);
+
+  if(attrs != nb || created != ret->min_threads ||
+      (created && ret->queue == THREAD_POOL_QUEUE_STEAL &&
+       !ret->workers[created - 1].deque))
+  {
+    thread_pool_set_run(ret, -1);
+
+    /* error creating right number of threads, cancel the created ones */
+    for(size_t i = 0 ; i < created ; i++)
+    {
+      if(pthread_mutex_lock(&ret->mutex_start) == 0)
+      {
+        /* tell the threads that they have to quit */
+        pthread_cond_broadcast(&ret->cond_start);
+        pthread_mutex_unlock(&ret->mutex_start);
+        pthread_join(ret->workers[i].id, NULL);
+      }
+      else
+      {
+        pthread_cancel(ret->workers[i].id);
+      }
+    }
+
+    for(size_t i = 0 ; i < attrs ; i++)
+    {
+      pthread_attr_destroy(&ret->workers[i].attr);
+    }
+
+    pthread_mutex_destroy(&ret->mutex_tasks);
+    pthread_cond_destroy(&ret->cond_tasks);
+    pthread_mutex_destroy(&ret->mutex_start);
+    pthread_cond_destroy(&ret->cond_start);
+    thread_pool_queues_free(ret, nb);
+    free(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+void thread_pool_free(thread_pool* obj)
+{
+  thread_pool_set_run(*obj, -1);
+
+  /* unblock threads waiting tasks */
+  if(pthread_mutex_lock(&(*obj)->mutex_tasks) == 0)
+  {
+    /* tell the threads that they have to quit */
+    pthread_cond_broadcast(&(*obj)->cond_tasks);
+    pthread_mutex_unlock(&(*obj)->mutex_tasks);
+  }
+
+  /* unblock threads in stop state */
+  if(pthread_mutex_lock(&(*obj)->mutex_start) == 0)
+  {
+    /* tell the threads that they have to quit */
+    pthread_cond_broadcast(&(*obj)->cond_start);
+    pthread_mutex_unlock(&(*obj)->mutex_start);
+  }
+
+  /* wait for a spawn in progress, later ones see the pool is not running */
+  while(atomic_exchange_explicit(&(*obj)->spawning, 1,
+        memory_order_acquire) != 0)
+  {
+    sched_yield();
+  }
+
+  /* wait for the threads, including the retired ones */
+  for(size_t i = 0 ; i < (*obj)->nb_threads ; i++)
+  {
+    if(atomic_load(&(*obj)->workers[i].state) != THREAD_POOL_WORKER_NONE)
+    {
+      pthread_join((*obj)->workers[i].id, NULL);
+    }
+  }
+
+  /* cleanup the rest of tasks if any */
+  thread_pool_clean(*obj);
+
+  /* do not care about success or failure of these calls */
+  pthread_mutex_destroy(&(*obj)->mutex_tasks);
+  pthread_cond_destroy(&(*obj)->cond_tasks);
+  pthread_mutex_destroy(&(*obj)->mutex_start);
+  pthread_cond_destroy(&(*obj)->cond_start);
+
+  thread_pool_queues_free(*obj, (*obj)->nb_threads);
+
+  for(size_t i = 0 ; i < (*obj)->nb_threads ; i++)
+  {
+    pthread_attr_destroy(&(*obj)->workers[i].attr);
+  }
+
+  free(*obj);
+  *obj = NULL;
+}
+
+/**
+ * \brief Push a task to the ring queue.
+ * \param obj thread pool.
+ * \param task task to be pushed.
+ * \return 0 if success, -1 on failure (errno is set to EAGAIN if full).
+ */
+static int thread_pool_push_ring(thread_pool obj,
+    struct thread_pool_task* task)
+{
+  struct thread_pool_task t;
+
+  if(thread_pool_accept(obj, 1) != 0)
+  {
+    return -1;
+  }
+
+  t.data = task->data;
+  t.run = task->run;
+  t.cleanup = task->cleanup;
+  t.enqueued = obj->stats ? worker_stats_now() : 0;
+
+  if(thread_pool_ring_push(obj->ring, &t) != 0)
+  {
+    thread_pool_finish(obj, 1);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  /* pairs with the idle increment of parking workers */
+  atomic_thread_fence(memory_order_seq_cst);
+
+  /* only pay the condition signal when a worker is parked */
+  if(atomic_load_explicit(&obj->idle, memory_order_relaxed) > 0)
+  {
+    if(pthread_mutex_lock(&obj->mutex_tasks) == 0)
+    {
+      pthread_cond_signal(&obj->cond_tasks);
+      pthread_mutex_unlock(&obj->mutex_tasks);
+    }
+  }
+  else
+  {
+    thread_pool_grow(obj);
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Queue a node in the priority queue.
+ * \param obj thread pool.
+ * \param t node to be queued.
+ * \param priority priority class.
+ * \param deadline 1 if t is a thread_pool_prio_node with a deadline set, 0
+ * otherwise.
+ * \note mutex_tasks has to be locked.
+ */
+static void thread_pool_enqueue(thread_pool obj, struct thread_pool_task* t,
+    enum thread_pool_priority priority, int deadline)
+{
+  if(deadline)
+  {
+    thread_pool_prio_push_deadline(&obj->tasks,
+        (struct thread_pool_prio_node*)t, priority);
+  }
+  else
+  {
+    thread_pool_prio_push(&obj->tasks, t, priority);
+  }
+}
+
+/**
+ * \brief Push a node in work-stealing mode.
+ * \param obj thread pool.
+ * \param t node to be pushed.
+ * \param priority priority class.
+ * \param deadline 1 if t has a deadline, 0 otherwise.
+ * \return 0 if success, -1 on failure.
+ */
+static int thread_pool_push_steal(thread_pool obj, struct thread_pool_task* t,
+    enum thread_pool_priority priority, int deadline)
+{
+  struct thread_pool_worker* worker = thread_pool_current;
+
+  /* pushed from one of our workers: keep it local unless prioritized */
+  if(worker && worker->pool == obj &&
+      priority == THREAD_POOL_PRIORITY_NORMAL && !deadline &&
+      thread_pool_deque_push(worker->deque, t) == 0)
+  {
+    /* pairs with the idle increment of parking workers */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(atomic_load_explicit(&obj->idle, memory_order_relaxed) > 0 &&
+        pthread_mutex_lock(&obj->mutex_tasks) == 0)
+    {
+      pthread_cond_signal(&obj->cond_tasks);
+      pthread_mutex_unlock(&obj->mutex_tasks);
+    }
+    return 0;
+  }
+
+  if(pthread_mutex_lock(&obj->mutex_tasks) != 0)
+  {
+    return -1;
+  }
+
+  thread_pool_enqueue(obj, t, priority, deadline);
+  atomic_fetch_add_explicit(&obj->nb_shared, 1, memory_order_relaxed);
+
+  if(atomic_load_explicit(&obj->idle, memory_order_relaxed) > 0)
+  {
+    pthread_cond_signal(&obj->cond_tasks);
+  }
+  pthread_mutex_unlock(&obj->mutex_tasks);
+
+  return 0;
+}
+
+/**
+ * \brief Push a node to the list or the work-stealing queues.
+ * \param obj thread pool.
+ * \param t node to be pushed.
+ * \param priority priority class.
+ * \param deadline 1 if t has a deadline, 0 otherwise.
+ * \return 0 if success, -1 on failure.
+ */
+static int thread_pool_push_node(thread_pool obj, struct thread_pool_task* t,
+    enum thread_pool_priority priority, int deadline)
+{
+  if(thread_pool_accept(obj, 1) != 0)
+  {
+    return -1;
+  }
+
+  t->enqueued = obj->stats ? worker_stats_now() : 0;
+
+  if(obj->queue == THREAD_POOL_QUEUE_STEAL)
+  {
+    if(thread_pool_push_steal(obj, t, priority, deadline) != 0)
+    {
+      thread_pool_finish(obj, 1);
+      return -1;
+    }
+
+    thread_pool_grow(obj);
+    return 0;
+  }
+
+  if(pthread_mutex_lock(&obj->mutex_tasks) == 0)
+  {
+    thread_pool_enqueue(obj, t, priority, deadline);
+
+    /* notify one of parked worker threads, spinning ones find the task
+     * without syscall
+     */
+    if(atomic_load_explicit(&obj->idle, memory_order_relaxed) > 0)
+    {
+      if(pthread_cond_signal(&obj->cond_tasks) != 0)
+      {
+        /* it should happen only if cond_tasks is
+         * not initialized
+         */
+        thread_pool_prio_remove(&obj->tasks, t);
+        pthread_mutex_unlock(&obj->mutex_tasks);
+        thread_pool_finish(obj, 1);
+        return -1;
+      }
+    }
+    atomic_fetch_add_explicit(&obj->nb_shared, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&obj->mutex_tasks);
+  }
+  else
+  {
+    thread_pool_finish(obj, 1);
+    return -1;
+  }
+
+  thread_pool_grow(obj);
+  return 0;
+}
+
+int thread_pool_push(thread_pool obj, struct thread_pool_task* task)
+{
+  return thread_pool_push_priority(obj, task, THREAD_POOL_PRIORITY_NORMAL,
+      NULL);
+}
+
+int thread_pool_push_priority(thread_pool obj, struct thread_pool_task* task,
+    enum thread_pool_priority priority, const struct timespec* deadline)
+{
+  struct thread_pool_task* t = NULL;
+
+  if(obj->queue == THREAD_POOL_QUEUE_RING)
+  {
+    if(priority != THREAD_POOL_PRIORITY_NORMAL || deadline)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+    return thread_pool_push_ring(obj, task);
+  }
+
+  if(priority > THREAD_POOL_PRIORITY_BACKGROUND)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  t = thread_pool_node_alloc(obj);
+  if(!t)
+  {
+    return -1;
+  }
+
+  t->data = task->data;
+  t->run = task->run;
+  t->cleanup = task->cleanup;
+  t->flags = THREAD_POOL_TASK_SLAB;
+  list_head_init(&t->list);
+
+  if(deadline)
+  {
+    ((struct thread_pool_prio_node*)t)->deadline = *deadline;
+  }
+
+  if(thread_pool_push_node(obj, t, priority, deadline != NULL) != 0)
+  {
+    thread_pool_node_release(obj, t);
+    return -1;
+  }
+
+  return 0;
+}
+
+int thread_pool_push_task(thread_pool obj, struct thread_pool_task* task)
+{
+  if(obj->queue == THREAD_POOL_QUEUE_RING)
+  {
+    return thread_pool_push_ring(obj, task);
+  }
+
+  task->flags = 0;
+  list_head_init(&task->list);
+
+  return thread_pool_push_node(obj, task, THREAD_POOL_PRIORITY_NORMAL, 0);
+}
+
+/**
+ * \brief Wake up parked workers.
+ * \param obj thread pool.
+ * \param nb number of new tasks.
+ * \note mutex_tasks has to be locked.
+ */
+static void thread_pool_wake(thread_pool obj, size_t nb)
+{
+  size_t idle = atomic_load(&obj->idle);
+
+  if(idle == 0)
+  {
+    /* nobody is parked */
+    return;
+  }
+
+  if(nb >= idle)
+  {
+    pthread_cond_broadcast(&obj->cond_tasks);
+    return;
+  }
+
+  for(size_t i = 0 ; i < nb ; i++)
+  {
+    pthread_cond_signal(&obj->cond_tasks);
+  }
+}
+
+/**
+ * \brief Push several tasks to the ring queue.
+ * \param obj thread pool.
+ * \param tasks array of tasks.
+ * \param n number of tasks.
+ * \return number of tasks pushed, -1 if none (errno is set to EAGAIN if
+ * full).
+ */
+static int thread_pool_push_ring_batch(thread_pool obj,
+    struct thread_pool_task* tasks, size_t n)
+{
+  size_t nb = 0;
+  uint64_t now = obj->stats ? worker_stats_now() : 0;
+
+  if(thread_pool_accept(obj, n) != 0)
+  {
+    return -1;
+  }
+
+  while(nb < n)
+  {
+    struct thread_pool_task t;
+
+    t.data = tasks[nb].data;
+    t.run = tasks[nb].run;
+    t.cleanup = tasks[nb].cleanup;
+    t.enqueued = now;
+
+    if(thread_pool_ring_push(obj->ring, &t) != 0)
+    {
+      break;
+    }
+    nb++;
+  }
+
+  if(nb < n)
+  {
+    thread_pool_finish(obj, n - nb);
+  }
+
+  if(nb == 0 && n > 0)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  /* pairs with the idle increment of parking workers */
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if(atomic_load_explicit(&obj->idle, memory_order_relaxed) > 0 &&
+      pthread_mutex_lock(&obj->mutex_tasks) == 0)
+  {
+    thread_pool_wake(obj, nb);
+    pthread_mutex_unlock(&obj->mutex_tasks);
+  }
+  thread_pool_grow(obj);
+
+  return (int)nb;
+}
+
+int thread_pool_push_batch(thread_pool obj, struct thread_pool_task* tasks,
+    size_t n)
+{
+  struct thread_pool_worker* worker = thread_pool_current;
+  struct list_head batch;
+  struct list_head* pos = NULL;
+  struct list_head* tmp = NULL;
+  size_t local = 0;
+  uint64_t now = 0;
+
+  if(obj->queue == THREAD_POOL_QUEUE_RING)
+  {
+    return thread_pool_push_ring_batch(obj, tasks, n);
+  }
+
+  if(obj->stats)
+  {
+    now = worker_stats_now();
+  }
+
+  list_head_init(&batch);
+
+  /* copy tasks in nodes allocated by chunk */
+  for(size_t i = 0 ; i < n ; i += THREAD_POOL_PUSH_BATCH)
+  {
+    void* nodes[THREAD_POOL_PUSH_BATCH];
+    size_t nb = (n - i) < THREAD_POOL_PUSH_BATCH ? (n - i) :
+      THREAD_POOL_PUSH_BATCH;
+    size_t allocated = task_slab_alloc_batch(obj->slab,
+        (worker && worker->pool == obj) ? &worker->cache : NULL, nodes, nb);
+
+    for(size_t j = 0 ; j < allocated ; j++)
+    {
+      struct thread_pool_task* t = nodes[j];
+
+      t->data = tasks[i + j].data;
+      t->run = tasks[i + j].run;
+      t->cleanup = tasks[i + j].cleanup;
+      t->flags = THREAD_POOL_TASK_SLAB;
+      t->enqueued = now;
+      list_head_add_tail(&batch, &t->list);
+    }
+
+    if(allocated != nb)
+    {
+      list_head_iterate_safe(&batch, pos, tmp)
+      {
+        thread_pool_node_release(obj,
+            list_head_get(pos, struct thread_pool_task, list));
+      }
+      return -1;
+    }
+  }
+
+  if(thread_pool_accept(obj, n) != 0)
+  {
+    list_head_iterate_safe(&batch, pos, tmp)
+    {
+      thread_pool_node_release(obj,
+          list_head_get(pos, struct thread_pool_task, list));
+    }
+    return -1;
+  }
+
+  if(obj->queue == THREAD_POOL_QUEUE_STEAL && worker && worker->pool == obj)
+  {
+    /* pushed from one of our workers: keep as many as possible local */
+    list_head_iterate_safe(&batch, pos, tmp)
+    {
+      struct thread_pool_task* t = list_head_get(pos, struct thread_pool_task,
+          list);
+
+      list_head_remove(&batch, &t->list);
+      if(thread_pool_deque_push(worker->deque, t) != 0)
+      {
+        list_head_add(&batch, &t->list);
+        break;
+      }
+      local++;
+    }
+
+    /* pairs with the idle increment of parking workers */
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+
+  if(local == n &&
+      atomic_load_explicit(&obj->idle, memory_order_relaxed) == 0)
+  {
+    thread_pool_grow(obj);
+    return (int)n;
+  }
+
+  if(pthread_mutex_lock(&obj->mutex_tasks) != 0)
+  {
+    /* tasks already in the deque are found by workers once they wake up */
+    list_head_iterate_safe(&batch, pos, tmp)
+    {
+      thread_pool_node_release(obj,
+          list_head_get(pos, struct thread_pool_task, list));
+    }
+    thread_pool_finish(obj, n - local);
+    return local ? (int)local : -1;
+  }
+
+  atomic_fetch_add_explicit(&obj->nb_shared, n - local,
+      memory_order_relaxed);
+  thread_pool_prio_splice(&obj->tasks, &batch, n - local,
+      THREAD_POOL_PRIORITY_NORMAL);
+  thread_pool_wake(obj, n);
+  pthread_mutex_unlock(&obj->mutex_tasks);
+
+  thread_pool_grow(obj);
+  return (int)n;
+}
+
+/**
+ * \brief Release a reference on a future.
+ * \param obj future, it is given back to the slab of the pool with the last
+ * reference.
+ */
+static void thread_pool_future_unref(struct thread_pool_future* obj)
+{
+  if(atomic_fetch_sub_explicit(&obj->ref, 1, memory_order_acq_rel) == 1)
+  {
+    struct thread_pool* pool = obj->pool;
+    struct thread_pool_worker* worker = thread_pool_current;
+
+    task_slab_release(pool->future_slab,
+        (worker && worker->pool == pool) ? &worker->future_cache : NULL, obj);
+  }
+}
+
+/**
+ * \brief Complete a future, wake up its waiters and call its continuation.
+ * \param obj future.
+ * \param result THREAD_POOL_FUTURE_DONE or THREAD_POOL_FUTURE_CANCEL.
+ * \note The reference owned by the pool is released.
+ */
+static void thread_pool_future_complete(struct thread_pool_future* obj,
+    unsigned int result)
+{
+  unsigned int state = atomic_fetch_or_explicit(&obj->state, result,
+      memory_order_acq_rel);
+
+  /* nobody blocks on the future, no need to signal it */
+  if(state & THREAD_POOL_FUTURE_WAIT)
+  {
+    struct thread_pool_park* park = thread_pool_future_park(obj);
+
+    if(pthread_mutex_lock(&park->mutex) == 0)
+    {
+      pthread_cond_broadcast(&park->cond);
+      pthread_mutex_unlock(&park->mutex);
+    }
+  }
+
+  if(state & THREAD_POOL_FUTURE_THEN)
+  {
+    obj->then(obj->then_data);
+  }
+
+  thread_pool_future_unref(obj);
+}
+
+/**
+ * \brief Run function of tasks pushed with thread_pool_push_future().
+ * \param data the future.
+ */
+static void thread_pool_future_run(void* data)
+{
+  struct thread_pool_future* obj = data;
+
+  obj->run(obj->data);
+}
+
+/**
+ * \brief Cleanup function of tasks pushed with thread_pool_push_future().
+ * \param data the future.
+ */
+static void thread_pool_future_cleanup(void* data)
+{
+  struct thread_pool_future* obj = data;
+
+  if(obj->cleanup)
+  {
+    obj->cleanup(obj->data);
+  }
+
+  thread_pool_future_complete(obj, THREAD_POOL_FUTURE_DONE);
+}
+
+/**
+ * \brief Release a reference on a parallel loop.
+ * \param data parallel loop.
+ */
+static void thread_pool_parallel_release(void* data)
+{
+  struct thread_pool_parallel* job = data;
+
+  if(atomic_fetch_sub(&job->refs, 1) == 1)
+  {
+    free(job);
+  }
+}
+
+/**
+ * \brief Discard a task that will not be run.
+ * \param obj thread pool.
+ * \param t task, its node is released and if it belongs to a future, the
+ * future is cancelled.
+ * \param cleanup whether or not to call the cleanup function of the task.
+ */
+static void thread_pool_task_discard(struct thread_pool* obj,
+    struct thread_pool_task* t, int cleanup)
+{
+  if(t->run == thread_pool_future_run)
+  {
+    struct thread_pool_future* future = t->data;
+
+    if(cleanup && future->cleanup)
+    {
+      future->cleanup(future->data);
+    }
+
+    /* node is embedded in the future */
+    thread_pool_future_complete(future, THREAD_POOL_FUTURE_CANCEL);
+  }
+  else
+  {
+    void (*func)(void*) = t->cleanup;
+    void* data = t->data;
+
+    /* caller may free its own node from the cleanup function */
+    thread_pool_node_release(obj, t);
+
+    /* helpers of parallel loops always release their reference */
+    if((cleanup || func == thread_pool_parallel_release) && func)
+    {
+      func(data);
+    }
+  }
+
+  thread_pool_finish(obj, 1);
+}
+
+/**
+ * \brief Get result of a completed future.
+ * \param state state of the future.
+ * \return 0 if task has completed, -1 if it has been cancelled.
+ */
+static int thread_pool_future_result(unsigned int state)
+{
+  if(state & THREAD_POOL_FUTURE_CANCEL)
+  {
+    errno = ECANCELED;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Wait for a future to complete.
+ * \param obj future.
+ * \param timeout absolute timeout or NULL for infinite.
+ * \return 0 if task has completed, -1 otherwise.
+ */
+static int thread_pool_future_block(struct thread_pool_future* obj,
+    const struct timespec* timeout)
+{
+  struct thread_pool_park* park = NULL;
+  unsigned int state = atomic_load_explicit(&obj->state,
+      memory_order_acquire);
+
+  if(state & THREAD_POOL_FUTURE_FINISHED)
+  {
+    return thread_pool_future_result(state);
+  }
+
+  park = thread_pool_future_park(obj);
+
+  if(pthread_mutex_lock(&park->mutex) != 0)
+  {
+    return -1;
+  }
+
+  /* completion either happened before or will see the flag and signal */
+  state = atomic_fetch_or_explicit(&obj->state, THREAD_POOL_FUTURE_WAIT,
+      memory_order_acq_rel);
+
+  while(!(state & THREAD_POOL_FUTURE_FINISHED))
+  {
+    int err = 0;
+
+    if(timeout)
+    {
+      err = pthread_cond_timedwait(&park->cond, &park->mutex, timeout);
+    }
+    else
+    {
+      err = pthread_cond_wait(&park->cond, &park->mutex);
+    }
+
+    state = atomic_load_explicit(&obj->state, memory_order_acquire);
+
+    if(err != 0 && !(state & THREAD_POOL_FUTURE_FINISHED))
+    {
+      pthread_mutex_unlock(&park->mutex);
+      errno = err;
+      return -1;
+    }
+  }
+  pthread_mutex_unlock(&park->mutex);
+
+  return thread_pool_future_result(state);
+}
+
+thread_pool_future thread_pool_push_future(thread_pool obj,
+    struct thread_pool_task* task)
+{
+  struct thread_pool_worker* worker = thread_pool_current;
+  struct task_slab_cache* cache = (worker && worker->pool == obj) ?
+    &worker->future_cache : NULL;
+  struct thread_pool_future* ret = task_slab_alloc(obj->future_slab, cache);
+
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  ret->pool = obj;
+  ret->data = task->data;
+  ret->run = task->run;
+  ret->cleanup = task->cleanup;
+  ret->then = NULL;
+  ret->then_data = NULL;
+  atomic_init(&ret->state, 0);
+  /* one for the pool and one for the application */
+  atomic_init(&ret->ref, 2);
+
+  ret->task.data = ret;
+  ret->task.run = thread_pool_future_run;
+  ret->task.cleanup = thread_pool_future_cleanup;
+
+  if(thread_pool_push_task(obj, &ret->task) != 0)
+  {
+    task_slab_release(obj->future_slab, cache, ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+int thread_pool_future_wait(thread_pool_future obj)
+{
+  return thread_pool_future_block(obj, NULL);
+}
+
+int thread_pool_future_timedwait(thread_pool_future obj,
+    const struct timespec* timeout)
+{
+  return thread_pool_future_block(obj, timeout);
+}
+
+int thread_pool_future_poll(thread_pool_future obj)
+{
+  unsigned int state = atomic_load_explicit(&obj->state,
+      memory_order_acquire);
+
+  if(!(state & THREAD_POOL_FUTURE_FINISHED))
+  {
+    return 0;
+  }
+
+  return thread_pool_future_result(state) == 0 ? 1 : -1;
+}
+
+int thread_pool_future_then(thread_pool_future obj, void (*func)(void*),
+    void* data)
+{
+  unsigned int state = atomic_fetch_or_explicit(&obj->state,
+      THREAD_POOL_FUTURE_CLAIM, memory_order_acquire);
+
+  /* first caller owns then and then_data */
+  if(state & THREAD_POOL_FUTURE_CLAIM)
+  {
+    errno = EBUSY;
+    return -1;
+  }
+
+  obj->then = func;
+  obj->then_data = data;
+
+  /* publish the continuation, the worker calls it if not yet completed */
+  state = atomic_fetch_or_explicit(&obj->state, THREAD_POOL_FUTURE_THEN,
+      memory_order_acq_rel);
+
+  if(state & THREAD_POOL_FUTURE_FINISHED)
+  {
+    func(data);
+  }
+
+  return 0;
+}
+
+void thread_pool_future_free(thread_pool_future* obj)
+{
+  thread_pool_future_unref(*obj);
+  *obj = NULL;
+}
+
+struct thread_stats* thread_pool_stats(thread_pool obj)
+{
+  return worker_stats_snapshot(&obj->workers[0].stats,
+      sizeof(struct thread_pool_worker), obj->nb_threads);
+}
+
+/**
+ * \brief Discard the pending tasks of a stopped thread pool.
+ * \param obj thread pool.
+ * \param cleanup whether or not to call the cleanup function of the tasks.
+ * \return 0 if success, -1 otherwise.
+ */
+static int thread_pool_discard(thread_pool obj, int cleanup)
+{
+  struct list_head discarded;
+  struct list_head* pos = NULL;
+  struct list_head* tmp = NULL;
+
+  list_head_init(&discarded);
+
+  if(pthread_mutex_lock(&obj->mutex_tasks) != 0)
+  {
+    return -1;
+  }
+
+  thread_pool_prio_clear(&obj->tasks, &discarded);
+  atomic_store(&obj->nb_shared, 0);
+  pthread_cond_broadcast(&obj->cond_tasks);
+  pthread_mutex_unlock(&obj->mutex_tasks);
+
+  /* cancelled futures may call continuations, do it without lock held */
+  list_head_iterate_safe(&discarded, pos, tmp)
+  {
+    struct thread_pool_task* t = list_head_get(pos,
+        struct thread_pool_task, list);
+    list_head_remove(&discarded, &t->list);
+    thread_pool_task_discard(obj, t, cleanup);
+  }
+
+  for(size_t i = 0 ; i < obj->nb_threads ; i++)
+  {
+    struct thread_pool_task* t = NULL;
+
+    if(!obj->workers[i].deque)
     {
-      /* probably pthread_rwlock_rdlock has failed due to too many calls */
-      sched_yield();
+      continue;
     }
-    else
+
+    while((t = thread_pool_deque_steal(obj->workers[i].deque)) ||
+        !thread_pool_deque_is_empty(obj->workers[i].deque))
     {
-      /* running case */
-      if(thread_pool_pop(pool, &task) == 0)
-      {
-        /* process task then cleanup */
-        task.run(task.data);
-        task.cleanup(task.data);
-      }
-      else
+      if(t)
       {
-        /* timeout */
+        thread_pool_task_discard(obj, t, cleanup);
       }
     }
   }
 
-  return NULL;
-}
+  if(obj->ring)
+  {
+    struct thread_pool_task t;
 
-thread_pool thread_pool_new(size_t nb)
-{
-  struct thread_pool* ret = NULL;
-  pthread_mutexattr_t mutexattr;
+    /* ring slots are copies, there is no node to release */
+    t.flags = 0;
 
-  if(nb == 0)
-  {
-    return NULL;
+    /* discard tasks */
+    while(thread_pool_ring_pop(obj->ring, &t) == 0)
+    {
+      thread_pool_task_discard(obj, &t, cleanup);
+    }
   }
 
-  ret = malloc(sizeof(struct thread_pool) + (sizeof(pthread_t) * nb));
-  if(!ret)
+  return 0;
+}
+
+int thread_pool_clean(thread_pool obj)
+{
+  /* do not clean while running */
+  if(thread_pool_get_run(obj) == 1)
   {
-    return NULL;
+    return -1;
   }
 
-  ret->run = 0;
-  list_head_init(&ret->tasks);
-  /* memory is already reserved for threads member */
-  ret->threads = (pthread_t*)(((char*)ret) + sizeof(struct thread_pool));
-  memset(ret->threads, 0x00, sizeof(pthread_t));
-  ret->nb_threads = 0;
+  return thread_pool_discard(obj, 0);
+}
 
-  if((pthread_mutexattr_init(&mutexattr) != 0) ||
-      (pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_NORMAL)))
+int thread_pool_drain(thread_pool obj, int timeout)
+{
+  struct timespec ts;
+  size_t remaining = 0;
+  int err = 0;
+
+  if(timeout > 0)
   {
-    free(ret);
-    return NULL;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if(ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
   }
 
-  if(pthread_mutex_init(&ret->mutex_tasks, &mutexattr) != 0)
+  if(pthread_mutex_lock(&obj->mutex_start) != 0)
   {
-    pthread_mutexattr_destroy(&mutexattr);
-    free(ret);
-    return NULL;
+    return -1;
   }
 
-  pthread_mutexattr_destroy(&mutexattr);
+  /* refuse new tasks then wait for the last one, pairs with
+   * thread_pool_finish()
+   */
+  atomic_store_explicit(&obj->draining, 1, memory_order_seq_cst);
 
-  if(pthread_cond_init(&ret->cond_tasks, NULL) != 0)
+  while(timeout != 0 && err != ETIMEDOUT && thread_pool_get_run(obj) == 1 &&
+      atomic_load_explicit(&obj->nb_pending, memory_order_seq_cst) > 0)
   {
-    pthread_mutex_destroy(&ret->mutex_tasks);
-    free(ret);
-    return NULL;
+    if(timeout < 0)
+    {
+      err = pthread_cond_wait(&obj->cond_start, &obj->mutex_start);
+    }
+    else
+    {
+      err = pthread_cond_timedwait(&obj->cond_start, &obj->mutex_start, &ts);
+    }
   }
 
-  if(pthread_rwlock_init(&ret->mutex_run, NULL) != 0)
-  {
-    pthread_cond_destroy(&ret->cond_start);
-    pthread_mutex_destroy(&ret->mutex_start);
-    free(ret);
-    return NULL;
-  }
+  remaining = atomic_load_explicit(&obj->nb_pending, memory_order_seq_cst);
+  thread_pool_set_run(obj, 0);
+  pthread_cond_broadcast(&obj->cond_start);
+  pthread_mutex_unlock(&obj->mutex_start);
 
-  if(pthread_mutex_init(&ret->mutex_start, NULL) != 0)
+  if(remaining > 0 && thread_pool_discard(obj, 1) != 0)
   {
-    pthread_mutex_destroy(&ret->mutex_tasks);
-    pthread_cond_destroy(&ret->cond_tasks);
-    free(ret);
-    return NULL;
+    return -1;
   }
 
-  if(pthread_cond_init(&ret->cond_start, NULL) != 0)
+  return remaining > INT_MAX ? INT_MAX : (int)remaining;
+}
+
+int thread_pool_start(thread_pool obj)
+{
+  if(pthread_mutex_lock(&obj->mutex_start) == 0)
   {
-    pthread_mutex_destroy(&ret->mutex_tasks);
-    pthread_cond_destroy(&ret->cond_tasks);
-    pthread_mutex_destroy(&ret->mutex_start);
-    free(ret);
-    return NULL;
+    atomic_store_explicit(&obj->draining, 0, memory_order_relaxed);
+    thread_pool_set_run(obj, 1);
+    pthread_cond_broadcast(&obj->cond_start);
+    pthread_mutex_unlock(&obj->mutex_start);
+    return 0;
   }
+  return -1;
+}
 
-  for(size_t i = 0 ; i < nb ; i++)
+int thread_pool_stop(thread_pool obj)
+{
+  if(pthread_mutex_lock(&obj->mutex_start) == 0)
   {
-    if(pthread_create(&ret->threads[i], NULL, thr_worker, ret) != 0)
-    {
-      break;
-    }
-    else
-    {
-      ret->nb_threads++;
-    }
+    thread_pool_set_run(obj, 0);
+    pthread_cond_broadcast(&obj->cond_start);
+    pthread_mutex_unlock(&obj->mutex_start);
+    return 0;
   }
+  return -1;
+}
+
+
+/**
+ * \brief Grab the next chunk of a parallel loop.
+ *
+ * Chunks are a fraction of the remaining range (not lower than the grain)
+ * so that participants first take large chunks then smaller ones to
+ * balance the end of the loop.
+ * \param job parallel loop.
+ * \param first first index of the chunk.
+ * \param last end of the chunk (excluded).
+ * \return 1 if a chunk has been grabbed, 0 if range is exhausted.
+ */
+static int thread_pool_parallel_grab(struct thread_pool_parallel* job,
+    size_t* first, size_t* last)
+{
+  size_t cur = atomic_load_explicit(&job->next, memory_order_relaxed);
+  size_t chunk = 0;
 
-  if(ret->nb_threads != nb)
+  do
   {
-    thread_pool_set_run(ret, -1);
+    size_t remaining = job->end - cur;
 
-    /* error creating right number of threads, cancel the created ones */
-    for(size_t i = 0 ; i < ret->nb_threads ; i++)
+    if(remaining == 0)
     {
-      if(pthread_mutex_lock(&ret->mutex_start) == 0)
-      {
-        /* tell the threads that they have to quit */
-        pthread_cond_broadcast(&ret->cond_start);
-        pthread_mutex_unlock(&ret->mutex_start);
-        pthread_join(ret->threads[i], NULL);
-      }
-      else
-      {
-        pthread_cancel(ret->threads[i]);
-      }
+      return 0;
     }
 
-    pthread_mutex_destroy(&ret->mutex_tasks);
-    pthread_cond_destroy(&ret->cond_tasks);
-    pthread_mutex_destroy(&ret->mutex_start);
-    pthread_cond_destroy(&ret->cond_start);
-    free(ret);
-    return NULL;
+    chunk = remaining / job->split;
+    chunk = chunk < job->grain ? job->grain : chunk;
+    chunk = chunk > remaining ? remaining : chunk;
   }
+  while(!atomic_compare_exchange_weak_explicit(&job->next, &cur,
+        cur + chunk, memory_order_relaxed, memory_order_relaxed));
 
-  return ret;
+  *first = cur;
+  *last = cur + chunk;
+  return 1;
 }
 
-void thread_pool_free(thread_pool* obj)
+/**
+ * \brief Get the waiting place of a parallel loop.
+ * \param job parallel loop.
+ * \return waiting place.
+ */
+static inline struct thread_pool_park* thread_pool_parallel_park(
+    struct thread_pool_parallel* job)
 {
-  thread_pool_set_run(*obj, -1);
+  return &thread_pool_parks[((uintptr_t)job /
+      sizeof(struct thread_pool_parallel)) % THREAD_POOL_PARK_NB];
+}
 
-  /* unblock threads waiting tasks */
-  if(pthread_mutex_lock(&(*obj)->mutex_tasks) == 0)
-  {
-    /* tell the threads that they have to quit */
-    pthread_cond_broadcast(&(*obj)->cond_tasks);
-    pthread_mutex_unlock(&(*obj)->mutex_tasks);
-  }
+/**
+ * \brief Whether or not all chunks of a parallel loop are finished.
+ * \param job parallel loop.
+ * \return 1 if finished, 0 otherwise.
+ */
+static inline int thread_pool_parallel_finished(
+    struct thread_pool_parallel* job)
+{
+  return atomic_load(&job->active) == 0 &&
+    atomic_load_explicit(&job->next, memory_order_relaxed) == job->end;
+}
 
-  /* unblock threads in stop state */
-  if(pthread_mutex_lock(&(*obj)->mutex_start) == 0)
-  {
-    /* tell the threads that they have to quit */
-    pthread_cond_broadcast(&(*obj)->cond_start);
-    pthread_mutex_unlock(&(*obj)->mutex_start);
-  }
+/**
+ * \brief Run chunks of a parallel loop until range is exhausted.
+ * \param job parallel loop.
+ */
+static void thread_pool_parallel_run(struct thread_pool_parallel* job)
+{
+  void* partial = NULL;
+  size_t first = 0;
+  size_t last = 0;
 
-  /* wait for the threads */
-  for(size_t i = 0 ; i < (*obj)->nb_threads ; i++)
+  /* registered before grabbing so that the caller waits for our chunks */
+  atomic_fetch_add(&job->active, 1);
+
+  while(thread_pool_parallel_grab(job, &first, &last))
   {
-    pthread_join((*obj)->threads[i], NULL);
+    if(job->fn)
+    {
+      job->fn(first, last, job->ctx);
+      continue;
+    }
+
+    if(!partial)
+    {
+      size_t idx = atomic_fetch_add_explicit(&job->nb_partials, 1,
+          memory_order_relaxed);
+
+      partial = (char*)job->partials + idx * job->stride;
+      memcpy(partial, job->identity, job->size);
+    }
+    job->reduce(first, last, job->ctx, partial);
   }
 
-  /* cleanup the rest of tasks if any */
-  thread_pool_clean(*obj);
+  if(atomic_fetch_sub(&job->active, 1) == 1 &&
+      thread_pool_parallel_finished(job))
+  {
+    struct thread_pool_park* park = thread_pool_parallel_park(job);
 
-  /* do not care about success or failure of these calls */
-  pthread_mutex_destroy(&(*obj)->mutex_tasks);
-  pthread_cond_destroy(&(*obj)->cond_tasks);
-  pthread_mutex_destroy(&(*obj)->mutex_start);
-  pthread_cond_destroy(&(*obj)->cond_start);
+    pthread_mutex_lock(&park->mutex);
+    pthread_cond_broadcast(&park->cond);
+    pthread_mutex_unlock(&park->mutex);
+  }
+}
 
-  free(*obj);
-  *obj = NULL;
+/**
+ * \brief Run function of helper tasks.
+ * \param data parallel loop.
+ */
+static void thread_pool_parallel_task(void* data)
+{
+  thread_pool_parallel_run(data);
 }
 
-int thread_pool_push(thread_pool obj, struct thread_pool_task* task)
+/**
+ * \brief Run a parallel for or reduce.
+ * \param obj thread pool.
+ * \param begin first index.
+ * \param end end of the range (excluded).
+ * \param grain minimum chunk size.
+ * \param fn loop body or NULL for reduce.
+ * \param reduce reduce body or NULL for loop.
+ * \param join function that merges partial results.
+ * \param ctx application context.
+ * \param result result of reduce.
+ * \param size size of result.
+ * \return 0 if success, -1 otherwise.
+ */
+static int thread_pool_parallel(thread_pool obj, size_t begin, size_t end,
+    size_t grain, void (*fn)(size_t, size_t, void*),
+    void (*reduce)(size_t, size_t, void*, void*),
+    void (*join)(void*, const void*, void*), void* ctx, void* result,
+    size_t size)
 {
-  struct thread_pool_task* t = NULL;
+  struct thread_pool_parallel* job = NULL;
+  struct thread_pool_park* park = NULL;
+  size_t stride = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) *
+    sizeof(max_align_t);
+  size_t nb = 0;
+  size_t pushed = 0;
 
-  t = malloc(sizeof(struct thread_pool_task));
-  if(!t)
+  if(begin > end)
   {
+    errno = EINVAL;
     return -1;
   }
 
-  t->data = task->data;
-  t->run = task->run;
-  t->cleanup = task->cleanup;
-  list_head_init(&t->list);
-
-  if(pthread_mutex_lock(&obj->mutex_tasks) == 0)
+  else if(begin == end)
   {
-    int first = list_head_is_empty(&obj->tasks);
-    list_head_add_tail(&obj->tasks, &t->list);
+    return 0;
+  }
 
-    /* notify one of worker threads that wait about a task */
-    if(first)
+  /* one helper per worker at most and per chunk besides the first one */
+  grain = grain ? grain : 1;
+  nb = (end - begin - 1) / grain;
+  nb = nb < obj->min_threads ? nb : obj->min_threads;
+
+  /* single chunk or no memory: the caller runs the whole range */
+  if(nb == 0 || !(job = malloc(sizeof(struct thread_pool_parallel) +
+          stride * (nb + 1))))
+  {
+    if(fn)
     {
-      if(pthread_cond_signal(&obj->cond_tasks) != 0)
-      {
-        /* it should happen only if cond_tasks is
-         * not initialized
-         */
-        pthread_mutex_unlock(&obj->mutex_tasks);
-        return -1;
-      }
+      fn(begin, end, ctx);
     }
-    pthread_mutex_unlock(&obj->mutex_tasks);
+    else
+    {
+      reduce(begin, end, ctx, result);
+    }
+    return 0;
   }
-  return 0;
-}
 
-int thread_pool_clean(thread_pool obj)
-{
-  int run = thread_pool_get_run(obj);
+  atomic_init(&job->next, begin);
+  job->end = end;
+  job->grain = grain;
+  job->split = 2 * (nb + 1);
+  job->fn = fn;
+  job->reduce = reduce;
+  job->ctx = ctx;
+  job->identity = result;
+  job->size = size;
+  job->stride = stride;
+  atomic_init(&job->nb_partials, 0);
+  atomic_init(&job->active, 0);
+  atomic_init(&job->refs, nb + 1);
 
-  /* do not clean while running */
-  if(run == 1)
+  /* helpers hold a reference released by their cleanup, even if they are
+   * discarded
+   */
+  while(pushed < nb)
   {
-    return -1;
+    struct thread_pool_task tasks[THREAD_POOL_PUSH_BATCH];
+    size_t n = (nb - pushed) < THREAD_POOL_PUSH_BATCH ? (nb - pushed) :
+      THREAD_POOL_PUSH_BATCH;
+    int ret = 0;
+
+    for(size_t i = 0 ; i < n ; i++)
+    {
+      tasks[i].data = job;
+      tasks[i].run = thread_pool_parallel_task;
+      tasks[i].cleanup = thread_pool_parallel_release;
+    }
+
+    ret = thread_pool_push_batch(obj, tasks, n);
+    pushed += ret > 0 ? (size_t)ret : 0;
+    if(ret != (int)n)
+    {
+      break;
+    }
   }
 
-  if(pthread_mutex_lock(&obj->mutex_tasks) == 0)
+  for(size_t i = pushed ; i < nb ; i++)
   {
-    struct list_head* pos = NULL;
-    struct list_head* tmp = NULL;
+    thread_pool_parallel_release(job);
+  }
 
-    list_head_iterate_safe(&obj->tasks, pos, tmp)
+  /* the caller participates then waits for the chunks of the helpers */
+  thread_pool_parallel_run(job);
+
+  if(!thread_pool_parallel_finished(job))
+  {
+    park = thread_pool_parallel_park(job);
+    pthread_mutex_lock(&park->mutex);
+    while(!thread_pool_parallel_finished(job))
     {
-      struct thread_pool_task* t = list_head_get(pos,
-          struct thread_pool_task, list);
-      list_head_remove(&obj->tasks, &t->list);
-      free(t);
+      pthread_cond_wait(&park->cond, &park->mutex);
     }
+    pthread_mutex_unlock(&park->mutex);
+  }
 
-    pthread_cond_broadcast(&obj->cond_tasks);
-    pthread_mutex_unlock(&obj->mutex_tasks);
+  if(reduce)
+  {
+    size_t nb_partials = atomic_load_explicit(&job->nb_partials,
+        memory_order_relaxed);
+
+    for(size_t i = 0 ; i < nb_partials ; i++)
+    {
+      join(result, (char*)job->partials + i * stride, ctx);
+    }
   }
 
+  thread_pool_parallel_release(job);
   return 0;
 }
 
-int thread_pool_start(thread_pool obj)
+int thread_pool_parallel_for(thread_pool obj, size_t begin, size_t end,
+    size_t grain, void (*fn)(size_t, size_t, void*), void* ctx)
 {
-  if(pthread_mutex_lock(&obj->mutex_start) == 0)
+  if(!fn)
   {
-    thread_pool_set_run(obj, 1);
-    pthread_cond_broadcast(&obj->cond_start);
-    pthread_mutex_unlock(&obj->mutex_start);
-    return 0;
+    errno = EINVAL;
+    return -1;
   }
-  return -1;
+
+  return thread_pool_parallel(obj, begin, end, grain, fn, NULL, NULL, ctx,
+      NULL, 0);
 }
 
-int thread_pool_stop(thread_pool obj)
+int thread_pool_parallel_reduce(thread_pool obj, size_t begin, size_t end,
+    size_t grain, void (*fn)(size_t, size_t, void*, void*),
+    void (*join)(void*, const void*, void*), void* ctx, void* result,
+    size_t size)
 {
-  if(pthread_mutex_lock(&obj->mutex_start) == 0)
+  if(!fn || !join || !result)
   {
-    thread_pool_set_run(obj, 0);
-    pthread_cond_broadcast(&obj->cond_start);
-    pthread_mutex_unlock(&obj->mutex_start);
-    return 0;
+    errno = EINVAL;
+    return -1;
   }
-  return -1;
-}
 
+  return thread_pool_parallel(obj, begin, end, grain, NULL, fn, join, ctx,
+      result, size);
+}
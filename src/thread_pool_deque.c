@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file thread_pool_deque.c
+ * \brief Chase-Lev work-stealing deque of thread pool tasks.
+ *
+ * Implementation follows "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le, Pop, Cohen, Zappa Nardelli) with a fixed size buffer.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "thread_pool_deque.h"
+
+/**
+ * \def THREAD_POOL_DEQUE_PAD
+ * \brief Padding size to keep top and bottom on separate cache lines.
+ */
+#define THREAD_POOL_DEQUE_PAD 64
+
+/**
+ * \struct thread_pool_deque
+ * \brief Bounded work-stealing deque.
+ */
+struct thread_pool_deque
+{
+  _Atomic int64_t top; /**< Steal side, modified by thieves. */
+  char pad0[THREAD_POOL_DEQUE_PAD - sizeof(int64_t)]; /**< Padding. */
+  _Atomic int64_t bottom; /**< Owner side. */
+  char pad1[THREAD_POOL_DEQUE_PAD - sizeof(int64_t)]; /**< Padding. */
+  int64_t mask; /**< Number of slots minus one. */
+  _Atomic(struct thread_pool_task*)* slots; /**< Array of slots. */
+};
+
+struct thread_pool_deque* thread_pool_deque_new(size_t size)
+{
+  struct thread_pool_deque* ret = NULL;
+  size_t nb = 2;
+
+  /* the power of two above would not fit */
+  if(size > SIZE_MAX / 2 + 1)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* round up to a power of two */
+  while(nb < size)
+  {
+    nb <<= 1;
+  }
+
+  if(nb > SIZE_MAX / sizeof(_Atomic(struct thread_pool_task*)))
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  ret = malloc(sizeof(struct thread_pool_deque));
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  ret->slots = malloc(sizeof(*ret->slots) * nb);
+  if(!ret->slots)
+  {
+    free(ret);
+    return NULL;
+  }
+
+  for(size_t i = 0 ; i < nb ; i++)
+  {
+    atomic_init(&ret->slots[i], NULL);
+  }
+
+  ret->mask = (int64_t)nb - 1;
+  atomic_init(&ret->top, 0);
+  atomic_init(&ret->bottom, 0);
+
+  return ret;
+}
+
+void thread_pool_deque_free(struct thread_pool_deque** obj)
+{
+  free((*obj)->slots);
+  free(*obj);
+  *obj = NULL;
+}
+
+int thread_pool_deque_push(struct thread_pool_deque* obj,
+    struct thread_pool_task* task)
+{
+  int64_t b = atomic_load_explicit(&obj->bottom, memory_order_relaxed);
+  int64_t t = atomic_load_explicit(&obj->top, memory_order_acquire);
+
+  if(b - t > obj->mask)
+  {
+    /* full */
+    return -1;
+  }
+
+  atomic_store_explicit(&obj->slots[b & obj->mask], task,
+      memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&obj->bottom, b + 1, memory_order_relaxed);
+  return 0;
+}
+
+struct thread_pool_task* thread_pool_deque_take(struct thread_pool_deque* obj)
+{
+  struct thread_pool_task* ret = NULL;
+  int64_t b = atomic_load_explicit(&obj->bottom, memory_order_relaxed) - 1;
+  int64_t t = 0;
+
+  atomic_store_explicit(&obj->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  t = atomic_load_explicit(&obj->top, memory_order_relaxed);
+
+  if(t <= b)
+  {
+    ret = atomic_load_explicit(&obj->slots[b & obj->mask],
+        memory_order_relaxed);
+
+    if(t == b)
+    {
+      /* last element, race against thieves */
+      if(!atomic_compare_exchange_strong_explicit(&obj->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+      {
+        ret = NULL;
+      }
+      atomic_store_explicit(&obj->bottom, b + 1, memory_order_relaxed);
+    }
+  }
+  else
+  {
+    /* empty */
+    atomic_store_explicit(&obj->bottom, b + 1, memory_order_relaxed);
+  }
+
+  return ret;
+}
+
+struct thread_pool_task* thread_pool_deque_steal(
+    struct thread_pool_deque* obj)
+{
+  struct thread_pool_task* ret = NULL;
+  int64_t t = atomic_load_explicit(&obj->top, memory_order_acquire);
+  int64_t b = 0;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  b = atomic_load_explicit(&obj->bottom, memory_order_acquire);
+
+  if(t < b)
+  {
+    ret = atomic_load_explicit(&obj->slots[t & obj->mask],
+        memory_order_relaxed);
+
+    if(!atomic_compare_exchange_strong_explicit(&obj->top, &t, t + 1,
+          memory_order_seq_cst, memory_order_relaxed))
+    {
+      /* lost the race against owner or another thief */
+      ret = NULL;
+    }
+  }
+
+  return ret;
+}
+
+int thread_pool_deque_is_empty(struct thread_pool_deque* obj)
+{
+  int64_t b = atomic_load_explicit(&obj->bottom, memory_order_seq_cst);
+  int64_t t = atomic_load_explicit(&obj->top, memory_order_seq_cst);
+
+  return b <= t;
+}
+
+size_t thread_pool_deque_size(struct thread_pool_deque* obj)
+{
+  int64_t b = atomic_load_explicit(&obj->bottom, memory_order_relaxed);
+  int64_t t = atomic_load_explicit(&obj->top, memory_order_relaxed);
+
+  return b > t ? (size_t)(b - t) : 0;
+}
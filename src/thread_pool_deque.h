@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file thread_pool_deque.h
+ * \brief Chase-Lev work-stealing deque of thread pool tasks.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_THREAD_POOL_DEQUE_H
+#define VSUTILS_THREAD_POOL_DEQUE_H
+
+#include "thread_pool.h"
+
+/**
+ * \struct thread_pool_deque
+ * \brief Opaque bounded work-stealing deque.
+ *
+ * Only the owner thread can push and take at the bottom, any other thread
+ * can steal at the top.
+ */
+struct thread_pool_deque;
+
+/**
+ * \brief Create a new deque.
+ * \param size number of slots, rounded up to the next power of two.
+ * \return new deque or NULL if failure (EINVAL if size is too big, ENOMEM
+ * if memory is lacking).
+ */
+struct thread_pool_deque* thread_pool_deque_new(size_t size);
+
+/**
+ * \brief Delete a deque.
+ * \param obj pointer on deque.
+ * \note Remaining tasks are not freed.
+ */
+void thread_pool_deque_free(struct thread_pool_deque** obj);
+
+/**
+ * \brief Push a task at the bottom of the deque.
+ * \param obj deque.
+ * \param task task to push.
+ * \return 0 if success, -1 if deque is full.
+ * \note Only the owner thread can call this function.
+ */
+int thread_pool_deque_push(struct thread_pool_deque* obj,
+    struct thread_pool_task* task);
+
+/**
+ * \brief Take the task at the bottom of the deque (last pushed).
+ * \param obj deque.
+ * \return task or NULL if empty.
+ * \note Only the owner thread can call this function.
+ */
+struct thread_pool_task* thread_pool_deque_take(struct thread_pool_deque* obj);
+
+/**
+ * \brief Steal the task at the top of the deque (first pushed).
+ * \param obj deque.
+ * \return task or NULL if empty or if another thread won the race.
+ */
+struct thread_pool_task* thread_pool_deque_steal(
+    struct thread_pool_deque* obj);
+
+/**
+ * \brief Returns whether or not the deque looks empty.
+ * \param obj deque.
+ * \return 1 if empty, 0 otherwise.
+ * \note The result is only a snapshot as other threads may modify the deque.
+ */
+int thread_pool_deque_is_empty(struct thread_pool_deque* obj);
+
+/**
+ * \brief Get the number of tasks in the deque.
+ * \param obj deque.
+ * \return number of tasks.
+ * \note The result is only a snapshot as other threads may modify the deque.
+ */
+size_t thread_pool_deque_size(struct thread_pool_deque* obj);
+
+#endif /* VSUTILS_THREAD_POOL_DEQUE_H */
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file thread_pool_prio.c
+ * \brief Priority classes of pending thread pool tasks.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdlib.h>
+
+#include "thread_pool_prio.h"
+
+/**
+ * \def THREAD_POOL_PRIO_STARVATION
+ * \brief Number of pops a non-empty class can be skipped before it is
+ * served.
+ */
+#define THREAD_POOL_PRIO_STARVATION 16
+
+/**
+ * \brief Compare two timespec.
+ * \param a first time.
+ * \param b second time.
+ * \return negative value if a < b, 0 if equal, positive value if a > b.
+ */
+static int thread_pool_prio_cmp(const struct timespec* a,
+    const struct timespec* b)
+{
+  if(a->tv_sec != b->tv_sec)
+  {
+    return a->tv_sec < b->tv_sec ? -1 : 1;
+  }
+
+  return (a->tv_nsec > b->tv_nsec) - (a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * \brief Returns whether or not a class has tasks.
+ * \param obj priority queue.
+ * \param c class.
+ * \return 1 if class has tasks, 0 otherwise.
+ */
+static int thread_pool_prio_has(struct thread_pool_prio* obj, size_t c)
+{
+  return !list_head_is_empty(&obj->edf[c]) ||
+    !list_head_is_empty(&obj->fifo[c]);
+}
+
+void thread_pool_prio_init(struct thread_pool_prio* obj)
+{
+  for(size_t i = 0 ; i < THREAD_POOL_PRIO_NB ; i++)
+  {
+    list_head_init(&obj->edf[i]);
+    list_head_init(&obj->fifo[i]);
+    obj->starve[i] = 0;
+  }
+
+  obj->nb = 0;
+  obj->nb_deadline = 0;
+}
+
+void thread_pool_prio_push(struct thread_pool_prio* obj,
+    struct thread_pool_task* t, enum thread_pool_priority priority)
+{
+  list_head_add_tail(&obj->fifo[priority], &t->list);
+  obj->nb++;
+}
+
+void thread_pool_prio_push_deadline(struct thread_pool_prio* obj,
+    struct thread_pool_prio_node* node, enum thread_pool_priority priority)
+{
+  struct list_head* pos = obj->edf[priority].prev;
+
+  /* deadlines mostly come in order, search the place from the end */
+  while(pos != &obj->edf[priority])
+  {
+    struct thread_pool_prio_node* n = list_head_get(pos,
+        struct thread_pool_prio_node, task.list);
+
+    if(thread_pool_prio_cmp(&n->deadline, &node->deadline) <= 0)
+    {
+      break;
+    }
+    pos = pos->prev;
+  }
+
+  node->task.flags |= THREAD_POOL_PRIO_DEADLINE;
+  list_head_add(pos, &node->task.list);
+  obj->nb++;
+  obj->nb_deadline++;
+}
+
+void thread_pool_prio_splice(struct thread_pool_prio* obj,
+    struct list_head* list, size_t nb, enum thread_pool_priority priority)
+{
+  list_head_splice_tail(&obj->fifo[priority], list);
+  obj->nb += nb;
+}
+
+void thread_pool_prio_remove(struct thread_pool_prio* obj,
+    struct thread_pool_task* t)
+{
+  list_head_remove(NULL, &t->list);
+  obj->nb--;
+
+  if(t->flags & THREAD_POOL_PRIO_DEADLINE)
+  {
+    t->flags &= ~THREAD_POOL_PRIO_DEADLINE;
+    obj->nb_deadline--;
+  }
+}
+
+struct thread_pool_task* thread_pool_prio_pop(struct thread_pool_prio* obj)
+{
+  struct list_head* list = NULL;
+  struct thread_pool_task* t = NULL;
+  size_t c = THREAD_POOL_PRIO_NB;
+
+  if(obj->nb == 0)
+  {
+    return NULL;
+  }
+
+  /* expired deadlines go first whatever their class */
+  if(obj->nb_deadline > 0)
+  {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for(size_t i = 0 ; i < THREAD_POOL_PRIO_NB ; i++)
+    {
+      struct thread_pool_prio_node* n = NULL;
+
+      if(list_head_is_empty(&obj->edf[i]))
+      {
+        continue;
+      }
+
+      n = list_head_get(obj->edf[i].next, struct thread_pool_prio_node,
+          task.list);
+      if(thread_pool_prio_cmp(&n->deadline, &now) <= 0)
+      {
+        c = i;
+        break;
+      }
+    }
+  }
+
+  /* starvation protection, lowest class first */
+  for(size_t i = THREAD_POOL_PRIO_NB - 1 ; c == THREAD_POOL_PRIO_NB && i > 0 ;
+      i--)
+  {
+    if(obj->starve[i] >= THREAD_POOL_PRIO_STARVATION &&
+        thread_pool_prio_has(obj, i))
+    {
+      c = i;
+    }
+  }
+
+  for(size_t i = 0 ; c == THREAD_POOL_PRIO_NB && i < THREAD_POOL_PRIO_NB ;
+      i++)
+  {
+    if(thread_pool_prio_has(obj, i))
+    {
+      c = i;
+    }
+  }
+
+  /* account lower classes that are skipped */
+  obj->starve[c] = 0;
+  for(size_t i = c + 1 ; i < THREAD_POOL_PRIO_NB ; i++)
+  {
+    if(thread_pool_prio_has(obj, i))
+    {
+      obj->starve[i]++;
+    }
+  }
+
+  list = list_head_is_empty(&obj->edf[c]) ? &obj->fifo[c] : &obj->edf[c];
+  t = list_head_get(list->next, struct thread_pool_task, list);
+  thread_pool_prio_remove(obj, t);
+
+  return t;
+}
+
+void thread_pool_prio_clear(struct thread_pool_prio* obj,
+    struct list_head* list)
+{
+  for(size_t i = 0 ; i < THREAD_POOL_PRIO_NB ; i++)
+  {
+    struct list_head* pos = NULL;
+
+    list_head_iterate(&obj->edf[i], pos)
+    {
+      struct thread_pool_task* t = list_head_get(pos, struct thread_pool_task,
+          list);
+      t->flags &= ~THREAD_POOL_PRIO_DEADLINE;
+    }
+
+    list_head_splice_tail(list, &obj->edf[i]);
+    list_head_splice_tail(list, &obj->fifo[i]);
+    obj->starve[i] = 0;
+  }
+
+  obj->nb = 0;
+  obj->nb_deadline = 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file thread_pool_prio.h
+ * \brief Priority classes of pending thread pool tasks.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_THREAD_POOL_PRIO_H
+#define VSUTILS_THREAD_POOL_PRIO_H
+
+#include <time.h>
+
+#include "thread_pool.h"
+
+/**
+ * \def THREAD_POOL_PRIO_NB
+ * \brief Number of priority classes.
+ */
+#define THREAD_POOL_PRIO_NB 3
+
+/**
+ * \def THREAD_POOL_PRIO_DEADLINE
+ * \brief Task flag set while a node is queued with a deadline.
+ */
+#define THREAD_POOL_PRIO_DEADLINE 2
+
+/**
+ * \struct thread_pool_prio_node
+ * \brief Task node that can be queued with a deadline.
+ */
+struct thread_pool_prio_node
+{
+  struct thread_pool_task task; /**< Task. */
+  struct timespec deadline; /**< Absolute deadline (CLOCK_MONOTONIC). */
+};
+
+/**
+ * \struct thread_pool_prio
+ * \brief Pending tasks sorted by priority class.
+ *
+ * Each class has a list of tasks with a deadline, sorted by deadline, and a
+ * FIFO list of tasks without deadline. The structure is not thread-safe.
+ */
+struct thread_pool_prio
+{
+  struct list_head edf[THREAD_POOL_PRIO_NB]; /**< Tasks with deadline. */
+  struct list_head fifo[THREAD_POOL_PRIO_NB]; /**< Tasks without deadline. */
+  unsigned int starve[THREAD_POOL_PRIO_NB]; /**< Pops that skipped class. */
+  size_t nb; /**< Number of tasks. */
+  size_t nb_deadline; /**< Number of tasks with deadline. */
+};
+
+/**
+ * \brief Initialize the priority queue.
+ * \param obj priority queue.
+ */
+void thread_pool_prio_init(struct thread_pool_prio* obj);
+
+/**
+ * \brief Queue a task without deadline.
+ * \param obj priority queue.
+ * \param t task node.
+ * \param priority priority class.
+ */
+void thread_pool_prio_push(struct thread_pool_prio* obj,
+    struct thread_pool_task* t, enum thread_pool_priority priority);
+
+/**
+ * \brief Queue a task with a deadline.
+ * \param obj priority queue.
+ * \param node task node, its deadline member has to be set.
+ * \param priority priority class.
+ */
+void thread_pool_prio_push_deadline(struct thread_pool_prio* obj,
+    struct thread_pool_prio_node* node, enum thread_pool_priority priority);
+
+/**
+ * \brief Queue a list of tasks without deadline.
+ * \param obj priority queue.
+ * \param list list of task nodes, it is empty after the call.
+ * \param nb number of tasks in list.
+ * \param priority priority class.
+ */
+void thread_pool_prio_splice(struct thread_pool_prio* obj,
+    struct list_head* list, size_t nb, enum thread_pool_priority priority);
+
+/**
+ * \brief Remove a queued task.
+ * \param obj priority queue.
+ * \param t task node.
+ */
+void thread_pool_prio_remove(struct thread_pool_prio* obj,
+    struct thread_pool_task* t);
+
+/**
+ * \brief Dequeue the next task to run.
+ *
+ * Tasks whose deadline has expired go first, then the highest class that
+ * has tasks. A lower class that has been skipped too many times in a row is
+ * served once so that it does not starve. Within a class, tasks with a
+ * deadline go first (earliest deadline first).
+ * \param obj priority queue.
+ * \return task node or NULL if empty.
+ */
+struct thread_pool_task* thread_pool_prio_pop(struct thread_pool_prio* obj);
+
+/**
+ * \brief Move all queued tasks to a list.
+ * \param obj priority queue.
+ * \param list list that receives task nodes.
+ */
+void thread_pool_prio_clear(struct thread_pool_prio* obj,
+    struct list_head* list);
+
+/**
+ * \brief Returns whether or not the priority queue is empty.
+ * \param obj priority queue.
+ * \return 1 if empty, 0 otherwise.
+ */
+static inline int thread_pool_prio_is_empty(struct thread_pool_prio* obj)
+{
+  return obj->nb == 0;
+}
+
+#endif /* VSUTILS_THREAD_POOL_PRIO_H */
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file thread_pool_ring.c
+ * \brief Bounded lock-free MPMC ring buffer of thread pool tasks.
+ *
+ * Implementation follows the bounded MPMC queue of Dmitry Vyukov: each slot
+ * has a sequence number that tells producers and consumers whether the slot
+ * is ready to be written or read for a given position.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "thread_pool_ring.h"
+
+/**
+ * \def THREAD_POOL_RING_PAD
+ * \brief Padding size to keep producer and consumer positions on separate
+ * cache lines.
+ */
+#define THREAD_POOL_RING_PAD 64
+
+/**
+ * \struct thread_pool_ring_slot
+ * \brief Slot of the ring.
+ */
+struct thread_pool_ring_slot
+{
+  atomic_size_t seq; /**< Sequence number of the slot. */
+  void* data; /**< Application data. */
+  void (*run)(void*); /**< Run function. */
+  void (*cleanup)(void*); /**< Cleanup function. */
+  uint64_t enqueued; /**< Time of the push. */
+};
+
+/**
+ * \struct thread_pool_ring
+ * \brief Bounded multi-producer/multi-consumer ring.
+ */
+struct thread_pool_ring
+{
+  char pad0[THREAD_POOL_RING_PAD]; /**< Padding. */
+  atomic_size_t enqueue_pos; /**< Next position to write. */
+  char pad1[THREAD_POOL_RING_PAD - sizeof(atomic_size_t)]; /**< Padding. */
+  atomic_size_t dequeue_pos; /**< Next position to read. */
+  char pad2[THREAD_POOL_RING_PAD - sizeof(atomic_size_t)]; /**< Padding. */
+  size_t mask; /**< Number of slots minus one. */
+  struct thread_pool_ring_slot* slots; /**< Array of slots. */
+};
+
+struct thread_pool_ring* thread_pool_ring_new(size_t size)
+{
+  struct thread_pool_ring* ret = NULL;
+  size_t nb = 2;
+
+  /* the power of two above would not fit */
+  if(size > SIZE_MAX / 2 + 1)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* round up to a power of two */
+  while(nb < size)
+  {
+    nb <<= 1;
+  }
+
+  if(nb > SIZE_MAX / sizeof(struct thread_pool_ring_slot))
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  ret = malloc(sizeof(struct thread_pool_ring));
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  ret->slots = malloc(sizeof(struct thread_pool_ring_slot) * nb);
+  if(!ret->slots)
+  {
+    free(ret);
+    return NULL;
+  }
+
+  for(size_t i = 0 ; i < nb ; i++)
+  {
+    atomic_init(&ret->slots[i].seq, i);
+  }
+
+  ret->mask = nb - 1;
+  atomic_init(&ret->enqueue_pos, 0);
+  atomic_init(&ret->dequeue_pos, 0);
+
+  return ret;
+}
+
+void thread_pool_ring_free(struct thread_pool_ring** obj)
+{
+  free((*obj)->slots);
+  free(*obj);
+  *obj = NULL;
+}
+
+int thread_pool_ring_push(struct thread_pool_ring* obj,
+    const struct thread_pool_task* task)
+{
+  struct thread_pool_ring_slot* slot = NULL;
+  size_t pos = atomic_load_explicit(&obj->enqueue_pos, memory_order_relaxed);
+
+  for(;;)
+  {
+    size_t seq = 0;
+    intptr_t diff = 0;
+
+    slot = &obj->slots[pos & obj->mask];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (intptr_t)seq - (intptr_t)pos;
+
+    if(diff == 0)
+    {
+      /* slot is free for this position, try to reserve it */
+      if(atomic_compare_exchange_weak_explicit(&obj->enqueue_pos, &pos,
+            pos + 1, memory_order_relaxed, memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if(diff < 0)
+    {
+      /* full */
+      return -1;
+    }
+    else
+    {
+      /* another producer took it */
+      pos = atomic_load_explicit(&obj->enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  slot->data = task->data;
+  slot->run = task->run;
+  slot->cleanup = task->cleanup;
+  slot->enqueued = task->enqueued;
+
+  /* publish the slot to consumers */
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  return 0;
+}
+
+int thread_pool_ring_pop(struct thread_pool_ring* obj,
+    struct thread_pool_task* task)
+{
+  struct thread_pool_ring_slot* slot = NULL;
+  size_t pos = atomic_load_explicit(&obj->dequeue_pos, memory_order_relaxed);
+
+  for(;;)
+  {
+    size_t seq = 0;
+    intptr_t diff = 0;
+
+    slot = &obj->slots[pos & obj->mask];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+    if(diff == 0)
+    {
+      /* slot is filled for this position, try to reserve it */
+      if(atomic_compare_exchange_weak_explicit(&obj->dequeue_pos, &pos,
+            pos + 1, memory_order_relaxed, memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if(diff < 0)
+    {
+      /* empty */
+      return -1;
+    }
+    else
+    {
+      /* another consumer took it */
+      pos = atomic_load_explicit(&obj->dequeue_pos, memory_order_relaxed);
+    }
+  }
+
+  task->data = slot->data;
+  task->run = slot->run;
+  task->cleanup = slot->cleanup;
+  task->enqueued = slot->enqueued;
+
+  /* give the slot back to producers for the next lap */
+  atomic_store_explicit(&slot->seq, pos + obj->mask + 1,
+      memory_order_release);
+  return 0;
+}
+
+size_t thread_pool_ring_size(struct thread_pool_ring* obj)
+{
+  size_t dequeue = atomic_load_explicit(&obj->dequeue_pos,
+      memory_order_relaxed);
+  size_t enqueue = atomic_load_explicit(&obj->enqueue_pos,
+      memory_order_relaxed);
+
+  return enqueue > dequeue ? enqueue - dequeue : 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file thread_pool_ring.h
+ * \brief Bounded lock-free MPMC ring buffer of thread pool tasks.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_THREAD_POOL_RING_H
+#define VSUTILS_THREAD_POOL_RING_H
+
+#include "thread_pool.h"
+
+/**
+ * \struct thread_pool_ring
+ * \brief Opaque bounded multi-producer/multi-consumer ring.
+ */
+struct thread_pool_ring;
+
+/**
+ * \brief Create a new ring.
+ * \param size number of slots, rounded up to the next power of two.
+ * \return new ring or NULL if failure (EINVAL if size is too big, ENOMEM
+ * if memory is lacking).
+ */
+struct thread_pool_ring* thread_pool_ring_new(size_t size);
+
+/**
+ * \brief Delete a ring.
+ * \param obj pointer on ring.
+ */
+void thread_pool_ring_free(struct thread_pool_ring** obj);
+
+/**
+ * \brief Enqueue a copy of a task.
+ * \param obj ring.
+ * \param task task to copy (data, run, cleanup and enqueued members).
+ * \return 0 if success, -1 if ring is full.
+ * \note Lock-free, can be called concurrently by several threads.
+ */
+int thread_pool_ring_push(struct thread_pool_ring* obj,
+    const struct thread_pool_task* task);
+
+/**
+ * \brief Dequeue the oldest task.
+ * \param obj ring.
+ * \param task task that will be filled with the dequeued one.
+ * \return 0 if success, -1 if ring is empty.
+ * \note Lock-free, can be called concurrently by several threads.
+ */
+int thread_pool_ring_pop(struct thread_pool_ring* obj,
+    struct thread_pool_task* task);
+
+/**
+ * \brief Get the number of tasks in the ring.
+ * \param obj ring.
+ * \return number of tasks.
+ * \note The result is only a snapshot as other threads may modify the ring.
+ */
+size_t thread_pool_ring_size(struct thread_pool_ring* obj);
+
+#endif /* VSUTILS_THREAD_POOL_RING_H */
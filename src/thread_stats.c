@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file thread_stats.c
+ * \brief Statistics of thread pool and dispatcher workers.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdlib.h>
+
+#include "thread_stats.h"
+
+/**
+ * \brief Get the greatest value of a bucket.
+ * \param bucket index of the bucket.
+ * \return greatest value (ns).
+ */
+static uint64_t thread_stats_bucket_max(size_t bucket)
+{
+  size_t shift = 0;
+  uint64_t first = 0;
+
+  if(bucket < THREAD_STATS_SUB_BUCKETS)
+  {
+    return (uint64_t)bucket;
+  }
+
+  /* bucket covers [first, first + 2^shift[ */
+  shift = bucket / THREAD_STATS_SUB_BUCKETS - 1;
+  first = (uint64_t)(THREAD_STATS_SUB_BUCKETS +
+      bucket % THREAD_STATS_SUB_BUCKETS) << shift;
+
+  return first + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t thread_stats_percentile(const struct thread_stats_histogram* obj,
+    double percentile)
+{
+  uint64_t rank = 0;
+  uint64_t nb = 0;
+
+  if(obj->count == 0)
+  {
+    return 0;
+  }
+
+  if(percentile < 0.0)
+  {
+    percentile = 0.0;
+  }
+  else if(percentile > 100.0)
+  {
+    percentile = 100.0;
+  }
+
+  /* number of values at or below the percentile, at least one */
+  rank = (uint64_t)(percentile / 100.0 * (double)obj->count + 0.5);
+  if(rank == 0)
+  {
+    rank = 1;
+  }
+
+  for(size_t i = 0 ; i < THREAD_STATS_BUCKETS ; i++)
+  {
+    nb += obj->buckets[i];
+
+    if(nb >= rank)
+    {
+      uint64_t ret = thread_stats_bucket_max(i);
+
+      /* do not report more than what has been recorded */
+      return ret < obj->max ? ret : obj->max;
+    }
+  }
+
+  return obj->max;
+}
+
+void thread_stats_free(struct thread_stats** obj)
+{
+  free(*obj);
+  *obj = NULL;
+}
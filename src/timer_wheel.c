@@ -0,0 +1,733 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file timer_wheel.c
+ * \brief Hierarchical timing wheel for delayed and periodic tasks.
+ *
+ * Timers are hashed in levels of 64 slots: level 0 has one slot per
+ * millisecond, each slot of level n covers 64^n milliseconds. Adding or
+ * cancelling a timer is a list operation. When level 0 wraps, the current
+ * slot of the upper levels is cascaded, i.e. its timers are re-hashed in the
+ * lower levels. A bitmap of the non-empty slots of each level allows to skip
+ * idle milliseconds.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "timer_wheel.h"
+#include "worker_stats.h"
+
+/**
+ * \def TIMER_WHEEL_BITS
+ * \brief Number of bits of time handled by each level.
+ */
+#define TIMER_WHEEL_BITS 6
+
+/**
+ * \def TIMER_WHEEL_SLOTS
+ * \brief Number of slots per level.
+ */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+/**
+ * \def TIMER_WHEEL_MASK
+ * \brief Mask to get slot index.
+ */
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/**
+ * \def TIMER_WHEEL_LEVELS
+ * \brief Number of levels.
+ */
+#define TIMER_WHEEL_LEVELS 6
+
+/**
+ * \def TIMER_WHEEL_MAX
+ * \brief Maximum delay in milliseconds.
+ */
+#define TIMER_WHEEL_MAX \
+  (((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+/**
+ * \def TIMER_WHEEL_NONE
+ * \brief Slot value of a timer that is not pending.
+ */
+#define TIMER_WHEEL_NONE UINT_MAX
+
+/**
+ * \def TIMER_WHEEL_EXPIRED
+ * \brief Slot value of an expired timer not yet fired.
+ */
+#define TIMER_WHEEL_EXPIRED (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+
+/**
+ * \def TIMER_WHEEL_BATCH
+ * \brief Maximum number of timers fired per lock.
+ */
+#define TIMER_WHEEL_BATCH 64
+
+/**
+ * \def TIMER_WHEEL_COND_CLOCK
+ * \brief Clock of the timer thread deadlines. It is the monotonic clock of
+ * the ticks so that a wall-clock step neither stalls nor fires timers early,
+ * except on macOS which lacks pthread_condattr_setclock().
+ */
+#ifdef __APPLE__
+#define TIMER_WHEEL_COND_CLOCK CLOCK_REALTIME
+#else
+#define TIMER_WHEEL_COND_CLOCK CLOCK_MONOTONIC
+#endif
+
+/**
+ * \struct timer_wheel_fire
+ * \brief Copy of an expired timer.
+ */
+struct timer_wheel_fire
+{
+  void* data; /**< Application data. */
+  void (*run)(void*); /**< Run function. */
+  void (*cleanup)(void*); /**< Cleanup function. */
+  thread_pool pool; /**< Target thread pool. */
+  thread_dispatcher dispatcher; /**< Target thread dispatcher. */
+  uint32_t color; /**< Target color. */
+};
+
+/**
+ * \struct timer_wheel
+ * \brief Timer wheel.
+ */
+struct timer_wheel
+{
+  pthread_mutex_t mutex; /**< Mutex for the wheel. */
+  pthread_cond_t cond; /**< Condition to wake up the timer thread. */
+  pthread_t thread; /**< Timer thread. */
+  int started; /**< If timer thread is started. */
+  int run; /**< If timer thread has to run. */
+  uint64_t origin; /**< Creation time in milliseconds. */
+  uint64_t now; /**< Last processed tick. */
+  uint64_t wake; /**< Tick the timer thread waits for. */
+  size_t nb_timers; /**< Number of pending timers. */
+  uint64_t occupied[TIMER_WHEEL_LEVELS]; /**< Bitmaps of non-empty slots. */
+  struct list_head slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; /**< Slots. */
+};
+
+/**
+ * \brief Get the index of the least significant bit set.
+ * \param value non-zero value.
+ * \return index of the bit.
+ */
+static inline unsigned int timer_wheel_lsb(uint64_t value)
+{
+#if defined(__GNUC__)
+  return (unsigned int)__builtin_ctzll(value);
+#else
+  unsigned int ret = 0;
+
+  while(!(value & 1))
+  {
+    value >>= 1;
+    ret++;
+  }
+  return ret;
+#endif
+}
+
+/**
+ * \brief Cleanup function that does nothing.
+ * \param data unused.
+ */
+static void timer_wheel_noop(void* data)
+{
+  (void)data;
+}
+
+/**
+ * \brief Get the current tick.
+ * \param obj timer wheel.
+ * \return milliseconds since the creation of the wheel.
+ */
+static uint64_t timer_wheel_clock(timer_wheel obj)
+{
+  return worker_stats_now() / 1000000 - obj->origin;
+}
+
+/**
+ * \brief Hash a timer in the wheel.
+ * \param obj timer wheel.
+ * \param timer timer, its expire member is not lower than current tick.
+ * \note Wheel lock has to be held.
+ */
+static void timer_wheel_insert(timer_wheel obj,
+    struct timer_wheel_timer* timer)
+{
+  uint64_t delta = timer->expire - obj->now;
+  unsigned int level = 0;
+  unsigned int idx = 0;
+
+  if(delta > TIMER_WHEEL_MAX)
+  {
+    delta = TIMER_WHEEL_MAX;
+    timer->expire = obj->now + delta;
+  }
+
+  while(level < TIMER_WHEEL_LEVELS - 1 &&
+      delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+  {
+    level++;
+  }
+
+  idx = (timer->expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  list_head_add_tail(&obj->slots[level][idx], &timer->list);
+  obj->occupied[level] |= (uint64_t)1 << idx;
+  timer->slot = level * TIMER_WHEEL_SLOTS + idx;
+}
+
+/**
+ * \brief Re-hash the timers of the current slot of upper levels.
+ * \param obj timer wheel.
+ * \note Wheel lock has to be held and current tick is a multiple of 64.
+ */
+static void timer_wheel_cascade(timer_wheel obj)
+{
+  unsigned int level = 1;
+
+  /* level n is cascaded each 64^n ticks, from the upper one */
+  while(level + 1 < TIMER_WHEEL_LEVELS && (obj->now &
+        (((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) - 1)) == 0)
+  {
+    level++;
+  }
+
+  for(; level > 0 ; level--)
+  {
+    unsigned int idx = (obj->now >> (TIMER_WHEEL_BITS * level)) &
+      TIMER_WHEEL_MASK;
+    struct list_head* slot = &obj->slots[level][idx];
+    struct list_head tmp;
+    struct list_head* pos = NULL;
+    struct list_head* n = NULL;
+
+    if(!(obj->occupied[level] & ((uint64_t)1 << idx)))
+    {
+      continue;
+    }
+
+    list_head_init(&tmp);
+    list_head_splice_tail(&tmp, slot);
+    obj->occupied[level] &= ~((uint64_t)1 << idx);
+
+    list_head_iterate_safe(&tmp, pos, n)
+    {
+      struct timer_wheel_timer* timer = list_head_get(pos,
+          struct timer_wheel_timer, list);
+
+      list_head_remove(&tmp, &timer->list);
+      timer_wheel_insert(obj, timer);
+    }
+  }
+}
+
+/**
+ * \brief Get the next tick that needs processing.
+ * \param obj timer wheel.
+ * \return next tick with expired timers or cascade, UINT64_MAX if no timer is
+ * pending.
+ * \note Wheel lock has to be held.
+ */
+static uint64_t timer_wheel_next(timer_wheel obj)
+{
+  unsigned int idx = obj->now & TIMER_WHEEL_MASK;
+  uint64_t mask = 0;
+
+  if(obj->nb_timers == 0)
+  {
+    return UINT64_MAX;
+  }
+
+  /* slots up to the current one belong to the next round */
+  if(idx < TIMER_WHEEL_MASK)
+  {
+    mask = obj->occupied[0] & (~(uint64_t)0 << (idx + 1));
+  }
+
+  if(mask)
+  {
+    return (obj->now & ~(uint64_t)TIMER_WHEEL_MASK) +
+      timer_wheel_lsb(mask);
+  }
+  return (obj->now | TIMER_WHEEL_MASK) + 1;
+}
+
+/**
+ * \brief Advance the wheel to the next tick to process.
+ * \param obj timer wheel.
+ * \param target tick to reach.
+ * \param expired list that receives the expired timers.
+ * \return 1 if wheel was advanced to a tick before target, 0 if target is
+ * reached.
+ * \note Wheel lock has to be held.
+ */
+static int timer_wheel_step(timer_wheel obj, uint64_t target,
+    struct list_head* expired)
+{
+  uint64_t next = timer_wheel_next(obj);
+  unsigned int idx = 0;
+  struct list_head* slot = NULL;
+  struct list_head* pos = NULL;
+
+  if(next > target)
+  {
+    /* nothing to do until target */
+    if(obj->now < target)
+    {
+      obj->now = target;
+    }
+    return 0;
+  }
+
+  obj->now = next;
+  if((next & TIMER_WHEEL_MASK) == 0)
+  {
+    timer_wheel_cascade(obj);
+  }
+
+  idx = next & TIMER_WHEEL_MASK;
+  if(!(obj->occupied[0] & ((uint64_t)1 << idx)))
+  {
+    return 1;
+  }
+
+  slot = &obj->slots[0][idx];
+  list_head_iterate(slot, pos)
+  {
+    struct timer_wheel_timer* timer = list_head_get(pos,
+        struct timer_wheel_timer, list);
+
+    timer->slot = TIMER_WHEEL_EXPIRED;
+  }
+  list_head_splice_tail(expired, slot);
+  obj->occupied[0] &= ~((uint64_t)1 << idx);
+  return 1;
+}
+
+/**
+ * \brief Run an expired timer.
+ * \param fire copy of the timer.
+ */
+static void timer_wheel_fire(struct timer_wheel_fire* fire)
+{
+  if(fire->pool)
+  {
+    struct thread_pool_task task;
+
+    memset(&task, 0x00, sizeof(struct thread_pool_task));
+    task.data = fire->data;
+    task.run = fire->run;
+    task.cleanup = fire->cleanup;
+    if(thread_pool_push(fire->pool, &task) == 0)
+    {
+      return;
+    }
+  }
+  else if(fire->dispatcher)
+  {
+    struct thread_dispatcher_task task;
+
+    memset(&task, 0x00, sizeof(struct thread_dispatcher_task));
+    task.data = fire->data;
+    task.run = fire->run;
+    task.cleanup = fire->cleanup;
+    if(thread_dispatcher_push(fire->dispatcher, &task, fire->color) == 0)
+    {
+      return;
+    }
+  }
+  else
+  {
+    fire->run(fire->data);
+  }
+
+  /* ran inline or dropped */
+  fire->cleanup(fire->data);
+}
+
+/**
+ * \brief Thread function that drives the wheel.
+ * \param data timer wheel.
+ * \return NULL.
+ */
+static void* timer_wheel_thread(void* data)
+{
+  timer_wheel obj = data;
+
+  pthread_mutex_lock(&obj->mutex);
+  while(obj->run)
+  {
+    uint64_t next = timer_wheel_next(obj);
+    uint64_t now = timer_wheel_clock(obj);
+
+    if(next == UINT64_MAX)
+    {
+      obj->wake = UINT64_MAX;
+      pthread_cond_wait(&obj->cond, &obj->mutex);
+    }
+    else if(next > now)
+    {
+      struct timespec ts;
+      uint64_t ms = next - now;
+
+      obj->wake = next;
+      clock_gettime(TIMER_WHEEL_COND_CLOCK, &ts);
+      ts.tv_sec += ms / 1000;
+      ts.tv_nsec += (ms % 1000) * 1000000;
+      if(ts.tv_nsec >= 1000000000)
+      {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&obj->cond, &obj->mutex, &ts);
+    }
+    else
+    {
+      /* no wake up needed while expiring */
+      obj->wake = 0;
+      pthread_mutex_unlock(&obj->mutex);
+      timer_wheel_expire(obj);
+      pthread_mutex_lock(&obj->mutex);
+    }
+  }
+  pthread_mutex_unlock(&obj->mutex);
+  return NULL;
+}
+
+void timer_wheel_timer_init(struct timer_wheel_timer* timer, void* data,
+    void (*run)(void*), void (*cleanup)(void*))
+{
+  memset(timer, 0x00, sizeof(struct timer_wheel_timer));
+  timer->data = data;
+  timer->run = run;
+  timer->cleanup = cleanup;
+  timer->slot = TIMER_WHEEL_NONE;
+  list_head_init(&timer->list);
+}
+
+timer_wheel timer_wheel_new(void)
+{
+  timer_wheel ret = NULL;
+  pthread_condattr_t attr;
+
+  ret = malloc(sizeof(struct timer_wheel));
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  if(pthread_mutex_init(&ret->mutex, NULL) != 0)
+  {
+    free(ret);
+    return NULL;
+  }
+
+  if(pthread_condattr_init(&attr) != 0)
+  {
+    pthread_mutex_destroy(&ret->mutex);
+    free(ret);
+    return NULL;
+  }
+
+#ifndef __APPLE__
+  if(pthread_condattr_setclock(&attr, TIMER_WHEEL_COND_CLOCK) != 0)
+  {
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_destroy(&ret->mutex);
+    free(ret);
+    return NULL;
+  }
+#endif
+
+  if(pthread_cond_init(&ret->cond, &attr) != 0)
+  {
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_destroy(&ret->mutex);
+    free(ret);
+    return NULL;
+  }
+  pthread_condattr_destroy(&attr);
+
+  for(unsigned int i = 0 ; i < TIMER_WHEEL_LEVELS ; i++)
+  {
+    for(unsigned int j = 0 ; j < TIMER_WHEEL_SLOTS ; j++)
+    {
+      list_head_init(&ret->slots[i][j]);
+    }
+    ret->occupied[i] = 0;
+  }
+
+  ret->started = 0;
+  ret->run = 0;
+  ret->origin = worker_stats_now() / 1000000;
+  ret->now = 0;
+  ret->wake = UINT64_MAX;
+  ret->nb_timers = 0;
+  return ret;
+}
+
+void timer_wheel_free(timer_wheel* obj)
+{
+  timer_wheel_stop(*obj);
+  pthread_cond_destroy(&(*obj)->cond);
+  pthread_mutex_destroy(&(*obj)->mutex);
+  free(*obj);
+  *obj = NULL;
+}
+
+int timer_wheel_start(timer_wheel obj)
+{
+  int ret = 0;
+
+  if(pthread_mutex_lock(&obj->mutex) != 0)
+  {
+    return -1;
+  }
+
+  if(obj->started)
+  {
+    pthread_mutex_unlock(&obj->mutex);
+    errno = EBUSY;
+    return -1;
+  }
+
+  obj->run = 1;
+  ret = pthread_create(&obj->thread, NULL, timer_wheel_thread, obj);
+  if(ret != 0)
+  {
+    obj->run = 0;
+    pthread_mutex_unlock(&obj->mutex);
+    errno = ret;
+    return -1;
+  }
+  obj->started = 1;
+  pthread_mutex_unlock(&obj->mutex);
+  return 0;
+}
+
+int timer_wheel_stop(timer_wheel obj)
+{
+  if(pthread_mutex_lock(&obj->mutex) != 0)
+  {
+    return -1;
+  }
+
+  if(!obj->started)
+  {
+    pthread_mutex_unlock(&obj->mutex);
+    return 0;
+  }
+
+  obj->run = 0;
+  obj->started = 0;
+  pthread_cond_signal(&obj->cond);
+  pthread_mutex_unlock(&obj->mutex);
+  pthread_join(obj->thread, NULL);
+  return 0;
+}
+
+int timer_wheel_add(timer_wheel obj, struct timer_wheel_timer* timer,
+    unsigned int delay, unsigned int period)
+{
+  if(pthread_mutex_lock(&obj->mutex) != 0)
+  {
+    return -1;
+  }
+
+  if(timer->slot != TIMER_WHEEL_NONE)
+  {
+    pthread_mutex_unlock(&obj->mutex);
+    errno = EBUSY;
+    return -1;
+  }
+
+  timer->expire = timer_wheel_clock(obj) + delay;
+  timer->period = period;
+
+  /* current tick is already processed */
+  if(timer->expire <= obj->now)
+  {
+    timer->expire = obj->now + 1;
+  }
+
+  timer_wheel_insert(obj, timer);
+  obj->nb_timers++;
+
+  if(timer->expire < obj->wake)
+  {
+    obj->wake = timer->expire;
+    pthread_cond_signal(&obj->cond);
+  }
+  pthread_mutex_unlock(&obj->mutex);
+  return 0;
+}
+
+int timer_wheel_cancel(timer_wheel obj, struct timer_wheel_timer* timer)
+{
+  if(pthread_mutex_lock(&obj->mutex) != 0)
+  {
+    return -1;
+  }
+
+  if(timer->slot == TIMER_WHEEL_NONE)
+  {
+    pthread_mutex_unlock(&obj->mutex);
+    errno = ENOENT;
+    return -1;
+  }
+
+  /* an expired timer not yet fired is in the list of timer_wheel_expire() */
+  list_head_remove(NULL, &timer->list);
+  if(timer->slot != TIMER_WHEEL_EXPIRED)
+  {
+    unsigned int level = timer->slot / TIMER_WHEEL_SLOTS;
+    unsigned int idx = timer->slot % TIMER_WHEEL_SLOTS;
+
+    if(list_head_is_empty(&obj->slots[level][idx]))
+    {
+      obj->occupied[level] &= ~((uint64_t)1 << idx);
+    }
+  }
+
+  timer->slot = TIMER_WHEEL_NONE;
+  obj->nb_timers--;
+  pthread_mutex_unlock(&obj->mutex);
+  return 0;
+}
+
+size_t timer_wheel_size(timer_wheel obj)
+{
+  size_t ret = 0;
+
+  pthread_mutex_lock(&obj->mutex);
+  ret = obj->nb_timers;
+  pthread_mutex_unlock(&obj->mutex);
+  return ret;
+}
+
+int timer_wheel_timeout(timer_wheel obj)
+{
+  uint64_t next = 0;
+  uint64_t now = 0;
+
+  pthread_mutex_lock(&obj->mutex);
+  next = timer_wheel_next(obj);
+  now = timer_wheel_clock(obj);
+  pthread_mutex_unlock(&obj->mutex);
+
+  if(next == UINT64_MAX)
+  {
+    return -1;
+  }
+  else if(next <= now)
+  {
+    return 0;
+  }
+  return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+size_t timer_wheel_expire(timer_wheel obj)
+{
+  struct timer_wheel_fire fires[TIMER_WHEEL_BATCH];
+  struct list_head expired;
+  uint64_t target = 0;
+  size_t ret = 0;
+
+  list_head_init(&expired);
+
+  pthread_mutex_lock(&obj->mutex);
+  target = timer_wheel_clock(obj);
+
+  for(;;)
+  {
+    size_t nb = 0;
+
+    while(nb < TIMER_WHEEL_BATCH)
+    {
+      struct timer_wheel_timer* timer = NULL;
+
+      if(list_head_is_empty(&expired))
+      {
+        if(!timer_wheel_step(obj, target, &expired))
+        {
+          break;
+        }
+        continue;
+      }
+
+      timer = list_head_get(expired.next, struct timer_wheel_timer, list);
+      list_head_remove(&expired, &timer->list);
+
+      fires[nb].data = timer->data;
+      fires[nb].run = timer->run;
+      fires[nb].cleanup = timer->cleanup ? timer->cleanup : timer_wheel_noop;
+      fires[nb].pool = timer->pool;
+      fires[nb].dispatcher = timer->dispatcher;
+      fires[nb].color = timer->color;
+      nb++;
+
+      if(timer->period)
+      {
+        /* skip missed periods rather than firing them in burst */
+        timer->expire += timer->period;
+        if(timer->expire <= target)
+        {
+          timer->expire += ((target - timer->expire) / timer->period + 1) *
+            timer->period;
+        }
+        timer_wheel_insert(obj, timer);
+      }
+      else
+      {
+        timer->slot = TIMER_WHEEL_NONE;
+        obj->nb_timers--;
+      }
+    }
+
+    if(nb == 0)
+    {
+      break;
+    }
+
+    /* timers may be added or cancelled from run functions */
+    pthread_mutex_unlock(&obj->mutex);
+    for(size_t i = 0 ; i < nb ; i++)
+    {
+      timer_wheel_fire(&fires[i]);
+    }
+    ret += nb;
+    pthread_mutex_lock(&obj->mutex);
+  }
+
+  pthread_mutex_unlock(&obj->mutex);
+  return ret;
+}
@@ -132,6 +132,14 @@ int net_socket_create(enum address_family af, enum protocol_type protocol,
   struct addrinfo* res = NULL;
   char service[8];
 
+#ifndef SO_REUSEPORT
+  if(reuse & NET_REUSE_PORT)
+  {
+    errno = ENOSYS;
+    return -1;
+  }
+#endif
+
   snprintf(service, sizeof(service), "%u", port);
   service[sizeof(service)-1] = 0x00;
 
@@ -156,11 +164,21 @@ int net_socket_create(enum address_family af, enum protocol_type protocol,
       continue;
     }
 
-    if(reuse)
+    if(reuse & NET_REUSE_ADDR)
     {
       setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
     }
 
+#ifdef SO_REUSEPORT
+    if((reuse & NET_REUSE_PORT) &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(int)) == -1)
+    {
+      close(sock);
+      sock = -1;
+      continue;
+    }
+#endif
+
     /* accept IPv6 and IPv4 on the same socket */
     on = v6only ? 1 : 0;
     setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(int));
@@ -53,6 +53,12 @@
  */
 #define SYS_UNKNOWN_ERROR "Unknown error!"
 
+/**
+ * \def SYS_NODE_PATH
+ * \brief Directory where Linux exposes NUMA nodes.
+ */
+#define SYS_NODE_PATH "/sys/devices/system/node"
+
 #ifdef __cplusplus
 extern "C"
 { /* } */
@@ -396,6 +402,75 @@ size_t sys_get_cores(void)
   return (size_t)nb;
 }
 
+size_t sys_get_nodes(void)
+{
+  char path[64];
+  size_t nb = 0;
+
+  for(;;)
+  {
+    snprintf(path, sizeof(path), SYS_NODE_PATH "/node%zu", nb);
+    if(access(path, F_OK) != 0)
+    {
+      break;
+    }
+    nb++;
+  }
+
+  /* no NUMA information, whole system is one node */
+  return nb ? nb : 1;
+}
+
+int sys_get_node_cores(size_t node, unsigned int* cores, size_t nb)
+{
+  char path[64];
+  FILE* f = NULL;
+  int ret = 0;
+  unsigned int first = 0;
+  unsigned int last = 0;
+  int c = 0;
+
+  snprintf(path, sizeof(path), SYS_NODE_PATH "/node%zu/cpulist", node);
+  f = fopen(path, "r");
+  if(!f)
+  {
+    return -1;
+  }
+
+  /* list of ranges such as "0-3,8-11" */
+  while(fscanf(f, "%u", &first) == 1)
+  {
+    last = first;
+
+    c = fgetc(f);
+    if(c == '-')
+    {
+      if(fscanf(f, "%u", &last) != 1)
+      {
+        break;
+      }
+      c = fgetc(f);
+    }
+
+    for(unsigned int i = first ; i <= last && ret < INT_MAX ; i++)
+    {
+      if((size_t)ret < nb)
+      {
+        cores[ret] = i;
+      }
+      ret++;
+    }
+
+    if(c != ',')
+    {
+      break;
+    }
+  }
+
+  fclose(f);
+  return ret;
+}
+
 #ifdef __cplusplus
 }
 #endif
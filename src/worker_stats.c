@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file worker_stats.c
+ * \brief Per-worker statistics of thread pool and dispatcher.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "worker_stats.h"
+
+/**
+ * \def WORKER_STATS_SUB_BITS
+ * \brief Number of bits of THREAD_STATS_SUB_BUCKETS.
+ */
+#define WORKER_STATS_SUB_BITS 4
+
+/**
+ * \brief Get the index of the most significant bit set.
+ * \param value non-zero value.
+ * \return index of the bit.
+ */
+static inline unsigned int worker_stats_msb(uint64_t value)
+{
+#if defined(__GNUC__)
+  return 63 - (unsigned int)__builtin_clzll(value);
+#else
+  unsigned int ret = 0;
+
+  while(value >>= 1)
+  {
+    ret++;
+  }
+  return ret;
+#endif
+}
+
+/**
+ * \brief Get the bucket of a value.
+ * \param value value.
+ * \return index of the bucket.
+ */
+static size_t worker_stats_bucket(uint64_t value)
+{
+  unsigned int msb = 0;
+  size_t ret = 0;
+
+  if(value < THREAD_STATS_SUB_BUCKETS)
+  {
+    /* one bucket per value */
+    return (size_t)value;
+  }
+
+  /* power of two then the next bits below the most significant one */
+  msb = worker_stats_msb(value);
+  ret = (size_t)(msb - WORKER_STATS_SUB_BITS + 1) * THREAD_STATS_SUB_BUCKETS +
+    ((value >> (msb - WORKER_STATS_SUB_BITS)) & (THREAD_STATS_SUB_BUCKETS - 1));
+
+  return ret < THREAD_STATS_BUCKETS ? ret : THREAD_STATS_BUCKETS - 1;
+}
+
+uint64_t worker_stats_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * \brief Initialize a histogram to zero.
+ * \param obj histogram.
+ */
+static void worker_stats_histogram_init(struct worker_stats_histogram* obj)
+{
+  atomic_init(&obj->count, 0);
+  atomic_init(&obj->sum, 0);
+  atomic_init(&obj->max, 0);
+
+  for(size_t i = 0 ; i < THREAD_STATS_BUCKETS ; i++)
+  {
+    atomic_init(&obj->buckets[i], 0);
+  }
+}
+
+void worker_stats_init(struct worker_stats* obj)
+{
+  atomic_init(&obj->tasks, 0);
+  atomic_init(&obj->busy, 0);
+  atomic_init(&obj->idle, 0);
+  atomic_init(&obj->steals, 0);
+  atomic_init(&obj->wakeups, 0);
+  atomic_init(&obj->depth_max, 0);
+  worker_stats_histogram_init(&obj->wait);
+  worker_stats_histogram_init(&obj->run);
+}
+
+void worker_stats_record(struct worker_stats_histogram* obj, uint64_t value)
+{
+  worker_stats_add(&obj->buckets[worker_stats_bucket(value)], 1);
+  worker_stats_add(&obj->count, 1);
+  worker_stats_add(&obj->sum, value);
+  worker_stats_max(&obj->max, value);
+}
+
+/**
+ * \brief Read a histogram.
+ * \param obj histogram.
+ * \param stats histogram that will be filled.
+ */
+static void worker_stats_histogram_read(struct worker_stats_histogram* obj,
+    struct thread_stats_histogram* stats)
+{
+  stats->count = atomic_load_explicit(&obj->count, memory_order_relaxed);
+  stats->sum = atomic_load_explicit(&obj->sum, memory_order_relaxed);
+  stats->max = atomic_load_explicit(&obj->max, memory_order_relaxed);
+
+  for(size_t i = 0 ; i < THREAD_STATS_BUCKETS ; i++)
+  {
+    stats->buckets[i] = atomic_load_explicit(&obj->buckets[i],
+        memory_order_relaxed);
+  }
+}
+
+void worker_stats_read(struct worker_stats* obj,
+    struct thread_stats_worker* stats)
+{
+  stats->tasks = atomic_load_explicit(&obj->tasks, memory_order_relaxed);
+  stats->busy = atomic_load_explicit(&obj->busy, memory_order_relaxed);
+  stats->idle = atomic_load_explicit(&obj->idle, memory_order_relaxed);
+  stats->steals = atomic_load_explicit(&obj->steals, memory_order_relaxed);
+  stats->wakeups = atomic_load_explicit(&obj->wakeups, memory_order_relaxed);
+  stats->depth_max = atomic_load_explicit(&obj->depth_max,
+      memory_order_relaxed);
+  worker_stats_histogram_read(&obj->wait, &stats->wait);
+  worker_stats_histogram_read(&obj->run, &stats->run);
+}
+
+/**
+ * \brief Add a histogram to another.
+ * \param total histogram to add to.
+ * \param stats histogram to add.
+ */
+static void worker_stats_histogram_sum(struct thread_stats_histogram* total,
+    const struct thread_stats_histogram* stats)
+{
+  total->count += stats->count;
+  total->sum += stats->sum;
+  total->max = stats->max > total->max ? stats->max : total->max;
+
+  for(size_t i = 0 ; i < THREAD_STATS_BUCKETS ; i++)
+  {
+    total->buckets[i] += stats->buckets[i];
+  }
+}
+
+/**
+ * \brief Allocate an empty snapshot.
+ * \param nb number of workers.
+ * \return snapshot or NULL if failure.
+ */
+static struct thread_stats* worker_stats_snapshot_new(size_t nb)
+{
+  struct thread_stats* ret = malloc(sizeof(struct thread_stats) +
+      sizeof(struct thread_stats_worker) * nb);
+
+  if(!ret)
+  {
+    return NULL;
+  }
+
+  memset(&ret->total, 0x00, sizeof(struct thread_stats_worker));
+  ret->nb_workers = nb;
+  return ret;
+}
+
+/**
+ * \brief Read the counters of a worker in a snapshot.
+ * \param obj snapshot.
+ * \param i index of the worker.
+ * \param worker counters of the worker.
+ */
+static void worker_stats_snapshot_read(struct thread_stats* obj, size_t i,
+    struct worker_stats* worker)
+{
+  struct thread_stats_worker* total = &obj->total;
+  struct thread_stats_worker* stats = &obj->workers[i];
+
+  worker_stats_read(worker, stats);
+
+  total->tasks += stats->tasks;
+  total->busy += stats->busy;
+  total->idle += stats->idle;
+  total->steals += stats->steals;
+  total->wakeups += stats->wakeups;
+  total->depth_max = stats->depth_max > total->depth_max ?
+    stats->depth_max : total->depth_max;
+  worker_stats_histogram_sum(&total->wait, &stats->wait);
+  worker_stats_histogram_sum(&total->run, &stats->run);
+}
+
+struct thread_stats* worker_stats_snapshot(struct worker_stats* workers,
+    size_t stride, size_t nb)
+{
+  struct thread_stats* ret = worker_stats_snapshot_new(nb);
+
+  for(size_t i = 0 ; ret && i < nb ; i++)
+  {
+    worker_stats_snapshot_read(ret, i,
+        (struct worker_stats*)((char*)workers + i * stride));
+  }
+
+  return ret;
+}
+
+struct thread_stats* worker_stats_snapshot_array(void* const* workers,
+    size_t offset, size_t nb)
+{
+  struct thread_stats* ret = worker_stats_snapshot_new(nb);
+
+  for(size_t i = 0 ; ret && i < nb ; i++)
+  {
+    worker_stats_snapshot_read(ret, i,
+        (struct worker_stats*)((char*)workers[i] + offset));
+  }
+
+  return ret;
+}
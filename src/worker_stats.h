@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file worker_stats.h
+ * \brief Per-worker statistics of thread pool and dispatcher.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_WORKER_STATS_H
+#define VSUTILS_WORKER_STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "thread_stats.h"
+
+/**
+ * \def WORKER_STATS_PAD
+ * \brief Padding size to keep counters away from other data.
+ */
+#define WORKER_STATS_PAD 64
+
+/**
+ * \struct worker_stats_histogram
+ * \brief Log-linear histogram updated by one worker.
+ */
+struct worker_stats_histogram
+{
+  _Atomic uint64_t count; /**< Number of values. */
+  _Atomic uint64_t sum; /**< Sum of values. */
+  _Atomic uint64_t max; /**< Maximum value. */
+  _Atomic uint64_t buckets[THREAD_STATS_BUCKETS]; /**< Buckets. */
+};
+
+/**
+ * \struct worker_stats
+ * \brief Counters of one worker.
+ *
+ * Counters are only written by the worker that owns them, with plain
+ * relaxed loads and stores (no read-modify-write), and may be read at any
+ * time by other threads. Padding keeps them on cache lines that are not
+ * shared with other data.
+ */
+struct worker_stats
+{
+  char pad0[WORKER_STATS_PAD]; /**< Padding. */
+  _Atomic uint64_t tasks; /**< Number of tasks run. */
+  _Atomic uint64_t busy; /**< Time (ns) spent running tasks. */
+  _Atomic uint64_t idle; /**< Time (ns) spent waiting for tasks. */
+  _Atomic uint64_t steals; /**< Number of tasks stolen. */
+  _Atomic uint64_t wakeups; /**< Number of wake ups after parking. */
+  _Atomic uint64_t depth_max; /**< High-water mark of queue depth. */
+  struct worker_stats_histogram wait; /**< Enqueue-to-start latency. */
+  struct worker_stats_histogram run; /**< Run time. */
+  char pad1[WORKER_STATS_PAD]; /**< Padding. */
+};
+
+/**
+ * \brief Add a value to a counter.
+ * \param counter counter owned by the calling worker.
+ * \param value value to add.
+ */
+static inline void worker_stats_add(_Atomic uint64_t* counter, uint64_t value)
+{
+  atomic_store_explicit(counter,
+      atomic_load_explicit(counter, memory_order_relaxed) + value,
+      memory_order_relaxed);
+}
+
+/**
+ * \brief Raise a counter to a value.
+ * \param counter counter owned by the calling worker.
+ * \param value new value if greater than the current one.
+ */
+static inline void worker_stats_max(_Atomic uint64_t* counter, uint64_t value)
+{
+  if(value > atomic_load_explicit(counter, memory_order_relaxed))
+  {
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+  }
+}
+
+/**
+ * \brief Get monotonic time.
+ * \return time in nanoseconds.
+ */
+uint64_t worker_stats_now(void);
+
+/**
+ * \brief Initialize counters to zero.
+ * \param obj counters.
+ */
+void worker_stats_init(struct worker_stats* obj);
+
+/**
+ * \brief Record a value in a histogram.
+ * \param obj histogram owned by the calling worker.
+ * \param value value (ns).
+ */
+void worker_stats_record(struct worker_stats_histogram* obj, uint64_t value);
+
+/**
+ * \brief Read counters of a worker.
+ * \param obj counters.
+ * \param stats statistics that will be filled.
+ */
+void worker_stats_read(struct worker_stats* obj,
+    struct thread_stats_worker* stats);
+
+/**
+ * \brief Allocate a snapshot and fill it with counters of workers.
+ * \param workers first counters.
+ * \param stride size (in bytes) between counters of two workers.
+ * \param nb number of workers.
+ * \return snapshot or NULL if failure.
+ */
+struct thread_stats* worker_stats_snapshot(struct worker_stats* workers,
+    size_t stride, size_t nb);
+
+/**
+ * \brief Allocate a snapshot and fill it with counters of workers allocated
+ * separately.
+ * \param workers array of workers.
+ * \param offset offset (in bytes) of the counters in a worker.
+ * \param nb number of workers.
+ * \return snapshot or NULL if failure.
+ */
+struct thread_stats* worker_stats_snapshot_array(void* const* workers,
+    size_t offset, size_t nb);
+
+#endif /* VSUTILS_WORKER_STATS_H */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file worker_wait.c
+ * \brief Adaptive spin-then-park waiting for thread pool and dispatcher
+ * workers.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+
+#include "worker_wait.h"
+#include "util_sys.h"
+
+/**
+ * \def WORKER_WAIT_CHECK
+ * \brief Number of spins between two reads of the clock (power of two).
+ */
+#define WORKER_WAIT_CHECK 32
+
+/**
+ * \brief Get monotonic time.
+ * \return time in microseconds.
+ */
+static uint64_t worker_wait_now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * \brief Double the spin budget once waiting has found work.
+ * \param obj wait state.
+ */
+static void worker_wait_hit(struct worker_wait* obj)
+{
+  obj->budget = obj->budget < obj->max / 2 ? obj->budget * 2 : obj->max;
+
+  if(obj->budget == 0)
+  {
+    obj->budget = obj->max > 0 ? 1 : 0;
+  }
+}
+
+void worker_wait_init(struct worker_wait* obj, unsigned int spin,
+    unsigned int yield)
+{
+  /* the thread we wait for cannot run while we spin on its core */
+  obj->max = sys_get_cores() > 1 ? spin : 0;
+  obj->budget = obj->max;
+  obj->yield = yield;
+}
+
+int worker_wait_spin(struct worker_wait* obj, int (*ready)(void*),
+    void* data)
+{
+  if(obj->budget > 0)
+  {
+    uint64_t start = worker_wait_now_us();
+
+    for(unsigned int i = 1 ; ; i++)
+    {
+      if(ready(data))
+      {
+        worker_wait_hit(obj);
+        return 1;
+      }
+
+      worker_wait_relax();
+
+      if((i & (WORKER_WAIT_CHECK - 1)) == 0 &&
+          worker_wait_now_us() - start >= obj->budget)
+      {
+        break;
+      }
+    }
+  }
+
+  for(unsigned int i = 0 ; i <= obj->yield ; i++)
+  {
+    if(ready(data))
+    {
+      worker_wait_hit(obj);
+      return 1;
+    }
+
+    if(i < obj->yield)
+    {
+      sched_yield();
+    }
+  }
+
+  /* will park, spin less next time */
+  if(obj->budget > 1)
+  {
+    obj->budget /= 2;
+  }
+  else if(obj->max > 0)
+  {
+    obj->budget = 1;
+  }
+  return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2014-2016 Sebastien Vincent.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * \file worker_wait.h
+ * \brief Adaptive spin-then-park waiting for thread pool and dispatcher
+ * workers.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef VSUTILS_WORKER_WAIT_H
+#define VSUTILS_WORKER_WAIT_H
+
+/**
+ * \struct worker_wait
+ * \brief Per-worker state of the adaptive wait.
+ *
+ * An idle worker first spins for up to budget microseconds, then yields the
+ * processor yield times and finally parks. The budget doubles (up to max)
+ * each time spinning finds work and halves each time the worker has to
+ * park, so that workers stop burning CPU when the load is low. A worker
+ * must only use its own state.
+ */
+struct worker_wait
+{
+  unsigned int max; /**< Maximum spin time (us), 0 disables spinning. */
+  unsigned int budget; /**< Current spin time (us). */
+  unsigned int yield; /**< Number of yields before parking. */
+};
+
+/**
+ * \brief Hint the processor that the thread is spinning.
+ */
+static inline void worker_wait_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * \brief Initialize the adaptive wait of a worker.
+ * \param obj wait state.
+ * \param spin maximum spin time (us).
+ * \param yield number of yields before parking.
+ * \note Spinning is disabled on single core systems.
+ */
+void worker_wait_init(struct worker_wait* obj, unsigned int spin,
+    unsigned int yield);
+
+/**
+ * \brief Spin then yield until work is ready.
+ * \param obj wait state.
+ * \param ready function that returns non-zero when the worker does not have
+ * to wait anymore (work pending, stop requested, ...).
+ * \param data argument of ready function.
+ * \return 1 if ready, 0 if the worker has to park.
+ */
+int worker_wait_spin(struct worker_wait* obj, int (*ready)(void*),
+    void* data);
+
+#endif /* VSUTILS_WORKER_WAIT_H */
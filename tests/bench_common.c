@@ -0,0 +1,242 @@
+/**
+ * \file bench_common.c
+ * \brief Common functions for thread_pool and thread_dispatcher benchmarks.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+
+#include <pthread.h>
+
+#include "bench_common.h"
+
+/**
+ * \def BENCH_STEADY_INTERVAL
+ * \brief Time (ns) between two pushes of a producer with steady load.
+ */
+#define BENCH_STEADY_INTERVAL 10000
+
+/**
+ * \def BENCH_BURST_SIZE
+ * \brief Number of tasks of a burst.
+ */
+#define BENCH_BURST_SIZE 512
+
+/**
+ * \def BENCH_BURST_PAUSE
+ * \brief Time (ns) between two bursts.
+ */
+#define BENCH_BURST_PAUSE 2000000
+
+/**
+ * \struct bench_producer
+ * \brief Producer thread parameters.
+ */
+struct bench_producer
+{
+  pthread_t id; /**< Thread identifier. */
+  int (*push)(void*, size_t, size_t); /**< Push function. */
+  void* target; /**< First argument of push. */
+  size_t index; /**< Producer number. */
+  size_t nb; /**< Number of tasks to push. */
+  enum bench_load load; /**< Load pattern. */
+  atomic_int* go; /**< Start flag shared by the producers. */
+};
+
+/**
+ * \var bench_done
+ * \brief Number of completed tasks.
+ */
+static atomic_size_t bench_done = 0;
+
+uint64_t bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void bench_task_empty(void* data)
+{
+  (void)data;
+}
+
+void bench_task_work(void* data)
+{
+  size_t loops = ((uintptr_t)data % 8) == 0 ? 20000 : 200;
+
+  for(volatile size_t i = 0 ; i < loops ; i++)
+  {
+  }
+}
+
+void bench_task_done(void* data)
+{
+  (void)data;
+  atomic_fetch_add_explicit(&bench_done, 1, memory_order_relaxed);
+}
+
+/**
+ * \brief Producer thread.
+ * \param data producer parameters.
+ * \return NULL.
+ */
+static void* thr_producer(void* data)
+{
+  struct bench_producer* producer = data;
+  uint64_t next = 0;
+
+  while(!atomic_load(producer->go))
+  {
+    sched_yield();
+  }
+
+  next = bench_now();
+  for(size_t i = 0 ; i < producer->nb ; i++)
+  {
+    if(producer->load == BENCH_LOAD_STEADY)
+    {
+      next += BENCH_STEADY_INTERVAL;
+      while(bench_now() < next)
+      {
+        sched_yield();
+      }
+    }
+    else if(producer->load == BENCH_LOAD_BURST && i > 0 &&
+        (i % BENCH_BURST_SIZE) == 0)
+    {
+      struct timespec ts;
+
+      ts.tv_sec = 0;
+      ts.tv_nsec = BENCH_BURST_PAUSE;
+      nanosleep(&ts, NULL);
+    }
+
+    while(producer->push(producer->target, producer->index, i) != 0)
+    {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+int bench_produce(int (*push)(void*, size_t, size_t), void* target,
+    size_t producers, size_t nb, enum bench_load load,
+    struct bench_result* result)
+{
+  struct bench_producer* threads = NULL;
+  atomic_int go = 0;
+  uint64_t start = 0;
+
+  threads = malloc(sizeof(struct bench_producer) * producers);
+  if(!threads)
+  {
+    return -1;
+  }
+
+  atomic_store(&bench_done, 0);
+
+  for(size_t i = 0 ; i < producers ; i++)
+  {
+    threads[i].push = push;
+    threads[i].target = target;
+    threads[i].index = i;
+    threads[i].nb = nb;
+    threads[i].load = load;
+    threads[i].go = &go;
+    if(pthread_create(&threads[i].id, NULL, thr_producer, &threads[i]) != 0)
+    {
+      fprintf(stderr, "Failed to create producer\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  start = bench_now();
+  atomic_store(&go, 1);
+
+  for(size_t i = 0 ; i < producers ; i++)
+  {
+    pthread_join(threads[i].id, NULL);
+  }
+  result->push = bench_now() - start;
+
+  while(atomic_load(&bench_done) < producers * nb)
+  {
+    sched_yield();
+  }
+  result->total = bench_now() - start;
+
+  free(threads);
+  return 0;
+}
+
+const char* bench_load_name(enum bench_load load)
+{
+  switch(load)
+  {
+    case BENCH_LOAD_STEADY:
+      return "steady";
+    case BENCH_LOAD_BURST:
+      return "burst";
+    case BENCH_LOAD_FLOOD:
+    default:
+      return "flood";
+  }
+}
+
+void bench_print_header(void)
+{
+  fprintf(stdout, "suite,scenario,variant,workers,producers,tasks,"
+      "push_mtps,run_mtps,total_ms,wait_p50_us,wait_p99_us,wait_p999_us,"
+      "wait_max_us,tasks_min,tasks_max,depth_max\n");
+}
+
+void bench_print(const struct bench_result* result)
+{
+  const struct thread_stats* stats = result->stats;
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+
+  fprintf(stdout, "%s,%s,%s,%zu,%zu,%zu,%.3f,%.3f,%.3f,", result->suite,
+      result->scenario, result->variant, result->workers, result->producers,
+      result->tasks, (double)result->tasks * 1000.0 / (double)result->push,
+      (double)result->tasks * 1000.0 / (double)result->total,
+      (double)result->total / 1000000.0);
+
+  if(stats && result->latency)
+  {
+    fprintf(stdout, "%.3f,%.3f,%.3f,%.3f,",
+        (double)thread_stats_percentile(&stats->total.wait, 50.0) / 1000.0,
+        (double)thread_stats_percentile(&stats->total.wait, 99.0) / 1000.0,
+        (double)thread_stats_percentile(&stats->total.wait, 99.9) / 1000.0,
+        (double)stats->total.wait.max / 1000.0);
+  }
+  else
+  {
+    fprintf(stdout, ",,,,");
+  }
+
+  if(stats)
+  {
+    for(size_t i = 0 ; i < stats->nb_workers ; i++)
+    {
+      min = stats->workers[i].tasks < min ? stats->workers[i].tasks : min;
+      max = stats->workers[i].tasks > max ? stats->workers[i].tasks : max;
+    }
+    fprintf(stdout, "%llu,%llu,%llu\n", (unsigned long long)min,
+        (unsigned long long)max,
+        (unsigned long long)stats->total.depth_max);
+  }
+  else
+  {
+    fprintf(stdout, ",,\n");
+  }
+  fflush(stdout);
+}
@@ -0,0 +1,115 @@
+/**
+ * \file bench_common.h
+ * \brief Common functions for thread_pool and thread_dispatcher benchmarks.
+ *
+ * Benchmarks print one CSV line per run on the standard output so that
+ * results of several versions can be compared:
+ * - suite, scenario and variant name the run;
+ * - workers, producers and tasks give its size;
+ * - push_mtps is the push throughput and run_mtps the completion throughput
+ *   (millions of tasks per second), total_ms the time to complete all
+ *   tasks;
+ * - wait_p50_us, wait_p99_us, wait_p999_us and wait_max_us are push-to-run
+ *   latencies (empty if workers did not measure times);
+ * - tasks_min and tasks_max are the number of tasks run by the least and
+ *   the most loaded workers, depth_max the high-water mark of the queues.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "thread_stats.h"
+
+/**
+ * \enum bench_load
+ * \brief Load pattern of the producers.
+ */
+enum bench_load
+{
+  BENCH_LOAD_FLOOD, /**< Push as fast as possible. */
+  BENCH_LOAD_STEADY, /**< Push at a constant rate. */
+  BENCH_LOAD_BURST /**< Push bursts of tasks separated by pauses. */
+};
+
+/**
+ * \struct bench_result
+ * \brief Result of a run.
+ */
+struct bench_result
+{
+  const char* suite; /**< Name of the benchmark. */
+  const char* scenario; /**< Name of the scenario. */
+  const char* variant; /**< Variant of the scenario. */
+  size_t workers; /**< Number of workers. */
+  size_t producers; /**< Number of producers. */
+  size_t tasks; /**< Total number of tasks. */
+  uint64_t push; /**< Time (ns) for the producers to push all tasks. */
+  uint64_t total; /**< Time (ns) to complete all tasks. */
+  struct thread_stats* stats; /**< Statistics snapshot or NULL. */
+  int latency; /**< Whether or not statistics have latencies. */
+};
+
+/**
+ * \brief Get a monotonic time.
+ * \return time in nanoseconds.
+ */
+uint64_t bench_now(void);
+
+/**
+ * \brief Run function that does nothing.
+ * \param data task number.
+ */
+void bench_task_empty(void* data);
+
+/**
+ * \brief Run function, one task out of eight is much longer.
+ * \param data task number.
+ */
+void bench_task_work(void* data);
+
+/**
+ * \brief Cleanup function that counts completed tasks.
+ * \param data task number.
+ */
+void bench_task_done(void* data);
+
+/**
+ * \brief Push tasks from several producer threads and wait for completion.
+ * \param push function that pushes task number i of a producer, it returns
+ * 0 if success and -1 if the task has to be pushed again later.
+ * \param target first argument of push.
+ * \param producers number of producer threads.
+ * \param nb number of tasks per producer.
+ * \param load load pattern.
+ * \param result push and total members are filled.
+ * \return 0 if success, -1 otherwise.
+ * \note Tasks have to use bench_task_done() as cleanup function.
+ */
+int bench_produce(int (*push)(void*, size_t, size_t), void* target,
+    size_t producers, size_t nb, enum bench_load load,
+    struct bench_result* result);
+
+/**
+ * \brief Get name of a load pattern.
+ * \param load load pattern.
+ * \return name.
+ */
+const char* bench_load_name(enum bench_load load);
+
+/**
+ * \brief Print the CSV header.
+ */
+void bench_print_header(void);
+
+/**
+ * \brief Print a result as a CSV line.
+ * \param result result.
+ */
+void bench_print(const struct bench_result* result);
+
+#endif /* BENCH_COMMON_H */
@@ -0,0 +1,297 @@
+/**
+ * \file bench_thread_dispatcher.c
+ * \brief Benchmark of thread_dispatcher.
+ *
+ * The program measures the throughput of empty tasks versus the number of
+ * workers and versus the number of producers, then several producer threads
+ * push tasks of uneven cost with each worker selection policy of
+ * thread_dispatcher_push_random() and with one color per producer. It also
+ * measures the push-to-run latency with flood, steady and burst loads and
+ * the effect of skewed color distributions. Results are printed as CSV (see
+ * bench_common.h).\n
+ * Usage: bench_thread_dispatcher [workers] [producers] [tasks per producer]
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "thread_dispatcher.h"
+#include "bench_common.h"
+
+/**
+ * \def BENCH_COLORS
+ * \brief Number of colors of skewed distributions.
+ */
+#define BENCH_COLORS 1024
+
+/**
+ * \enum bench_colors
+ * \brief How producers choose the color of tasks.
+ */
+enum bench_colors
+{
+  BENCH_COLORS_RANDOM, /**< thread_dispatcher_push_random(). */
+  BENCH_COLORS_PRODUCER, /**< One color per producer. */
+  BENCH_COLORS_UNIFORM, /**< Uniform over BENCH_COLORS colors. */
+  BENCH_COLORS_ZIPF, /**< Zipf (s = 1) over BENCH_COLORS colors. */
+  BENCH_COLORS_HOT /**< 90% of tasks on one color, others uniform. */
+};
+
+/**
+ * \struct bench_target
+ * \brief Thread dispatcher and task used by producers.
+ */
+struct bench_target
+{
+  thread_dispatcher th; /**< Thread dispatcher. */
+  void (*run)(void*); /**< Run function of the tasks. */
+  enum bench_colors colors; /**< Color distribution. */
+};
+
+/**
+ * \var bench_zipf
+ * \brief Cumulative distribution of Zipf colors.
+ */
+static double bench_zipf[BENCH_COLORS];
+
+/**
+ * \brief Initialize the cumulative distribution of Zipf colors.
+ */
+static void bench_zipf_init(void)
+{
+  double sum = 0.0;
+
+  for(size_t i = 0 ; i < BENCH_COLORS ; i++)
+  {
+    sum += 1.0 / (double)(i + 1);
+    bench_zipf[i] = sum;
+  }
+
+  for(size_t i = 0 ; i < BENCH_COLORS ; i++)
+  {
+    bench_zipf[i] /= sum;
+  }
+}
+
+/**
+ * \brief Hash a task number (splitmix64 finalizer).
+ * \param value value to hash.
+ * \return hash.
+ */
+static uint64_t bench_hash(uint64_t value)
+{
+  value += 0x9e3779b97f4a7c15ULL;
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+  return value ^ (value >> 31);
+}
+
+/**
+ * \brief Get the color of a task.
+ * \param colors color distribution.
+ * \param producer producer number.
+ * \param i task number.
+ * \return color.
+ */
+static uint32_t bench_color(enum bench_colors colors, size_t producer,
+    size_t i)
+{
+  uint64_t hash = bench_hash(((uint64_t)producer << 32) ^ i);
+
+  switch(colors)
+  {
+    case BENCH_COLORS_ZIPF:
+    {
+      double u = (double)(hash >> 11) / 9007199254740992.0;
+      size_t low = 0;
+      size_t high = BENCH_COLORS - 1;
+
+      while(low < high)
+      {
+        size_t mid = (low + high) / 2;
+
+        if(bench_zipf[mid] < u)
+        {
+          low = mid + 1;
+        }
+        else
+        {
+          high = mid;
+        }
+      }
+      return (uint32_t)low;
+    }
+    case BENCH_COLORS_HOT:
+      return (hash % 10) < 9 ? 0 : (uint32_t)((hash >> 8) % BENCH_COLORS);
+    case BENCH_COLORS_PRODUCER:
+      return (uint32_t)producer;
+    case BENCH_COLORS_UNIFORM:
+    default:
+      return (uint32_t)(hash % BENCH_COLORS);
+  }
+}
+
+/**
+ * \brief Push a task to the thread dispatcher.
+ * \param data target.
+ * \param producer producer number.
+ * \param i task number.
+ * \return 0 if success, -1 otherwise.
+ */
+static int bench_push(void* data, size_t producer, size_t i)
+{
+  struct bench_target* target = data;
+  struct thread_dispatcher_task task;
+
+  task.data = (void*)(uintptr_t)i;
+  task.run = target->run;
+  task.cleanup = bench_task_done;
+
+  if(target->colors == BENCH_COLORS_RANDOM)
+  {
+    return thread_dispatcher_push_random(target->th, &task);
+  }
+  return thread_dispatcher_push(target->th, &task,
+      bench_color(target->colors, producer, i));
+}
+
+/**
+ * \brief Run the benchmark with one configuration.
+ * \param scenario name of the scenario.
+ * \param variant name of the variant.
+ * \param config dispatcher configuration.
+ * \param colors color distribution.
+ * \param producers number of producer threads.
+ * \param nb number of tasks per producer.
+ * \param load load pattern.
+ * \return 0 if success, -1 otherwise.
+ */
+static int bench(const char* scenario, const char* variant,
+    const struct thread_dispatcher_config* config, enum bench_colors colors,
+    size_t producers, size_t nb, enum bench_load load)
+{
+  struct bench_target target;
+  struct bench_result result;
+
+  target.th = thread_dispatcher_new_config(config);
+  target.run = config->stats ? bench_task_work : bench_task_empty;
+  target.colors = colors;
+  if(!target.th)
+  {
+    fprintf(stderr, "Failed to create dispatcher errno=%d\n", errno);
+    return -1;
+  }
+
+  result.suite = "thread_dispatcher";
+  result.scenario = scenario;
+  result.variant = variant;
+  result.workers = config->nb_threads;
+  result.producers = producers;
+  result.tasks = producers * nb;
+  result.latency = config->stats;
+
+  thread_dispatcher_start(target.th);
+  if(bench_produce(bench_push, &target, producers, nb, load, &result) != 0)
+  {
+    thread_dispatcher_free(&target.th);
+    return -1;
+  }
+
+  result.stats = thread_dispatcher_stats(target.th);
+  bench_print(&result);
+
+  if(result.stats)
+  {
+    thread_stats_free(&result.stats);
+  }
+  thread_dispatcher_stop(target.th);
+  thread_dispatcher_free(&target.th);
+  return 0;
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+  const enum bench_load loads[] = {BENCH_LOAD_FLOOD, BENCH_LOAD_STEADY,
+    BENCH_LOAD_BURST};
+  struct thread_dispatcher_config config;
+  size_t workers = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+  size_t producers = argc > 2 ? strtoul(argv[2], NULL, 10) : 16;
+  size_t nb = argc > 3 ? strtoul(argv[3], NULL, 10) : 50000;
+  int ret = 0;
+
+  if(workers == 0 || producers == 0 || nb == 0)
+  {
+    fprintf(stderr, "Usage: %s [workers] [producers] [tasks]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  bench_zipf_init();
+  bench_print_header();
+
+  /* empty tasks, one producer, workers doubled up to the maximum */
+  for(size_t w = 1 ; w < workers * 2 && ret == 0 ; w *= 2)
+  {
+    thread_dispatcher_config_init(&config, w < workers ? w : workers);
+    config.stats = 0;
+    ret = bench("throughput", "round-robin", &config, BENCH_COLORS_RANDOM, 1,
+        nb * producers, BENCH_LOAD_FLOOD);
+  }
+
+  /* empty tasks, one color per producer, producers doubled */
+  for(size_t p = 1 ; p < producers * 2 && ret == 0 ; p *= 2)
+  {
+    size_t n = p < producers ? p : producers;
+
+    thread_dispatcher_config_init(&config, workers);
+    config.stats = 0;
+    ret = bench("producers", "per-color", &config, BENCH_COLORS_PRODUCER, n,
+        nb * producers / n, BENCH_LOAD_FLOOD);
+  }
+
+  /* tasks of uneven cost with each worker selection policy */
+  thread_dispatcher_config_init(&config, workers);
+  config.spread = THREAD_DISPATCHER_SPREAD_ROUND_ROBIN;
+  ret = ret ? ret : bench("spread", "round-robin", &config,
+      BENCH_COLORS_RANDOM, producers, nb, BENCH_LOAD_FLOOD);
+  config.spread = THREAD_DISPATCHER_SPREAD_TWO_CHOICES;
+  ret = ret ? ret : bench("spread", "two-choices", &config,
+      BENCH_COLORS_RANDOM, producers, nb, BENCH_LOAD_FLOOD);
+  config.spread = THREAD_DISPATCHER_SPREAD_LEAST_LOADED;
+  ret = ret ? ret : bench("spread", "least-loaded", &config,
+      BENCH_COLORS_RANDOM, producers, nb, BENCH_LOAD_FLOOD);
+  ret = ret ? ret : bench("spread", "per-color", &config,
+      BENCH_COLORS_PRODUCER, producers, nb, BENCH_LOAD_FLOOD);
+
+  /* push-to-run latency of uniform colors */
+  thread_dispatcher_config_init(&config, workers);
+  for(size_t l = 0 ; l < sizeof(loads) / sizeof(loads[0]) && ret == 0 ; l++)
+  {
+    ret = bench("latency", bench_load_name(loads[l]), &config,
+        BENCH_COLORS_UNIFORM, 2, nb / 2, loads[l]);
+  }
+
+  /* color skew, with and without rebalancing of idle colors */
+  ret = ret ? ret : bench("skew", "uniform", &config, BENCH_COLORS_UNIFORM,
+      producers, nb, BENCH_LOAD_FLOOD);
+  ret = ret ? ret : bench("skew", "zipf", &config, BENCH_COLORS_ZIPF,
+      producers, nb, BENCH_LOAD_FLOOD);
+  ret = ret ? ret : bench("skew", "hot", &config, BENCH_COLORS_HOT,
+      producers, nb, BENCH_LOAD_FLOOD);
+  config.rebalance = 1;
+  ret = ret ? ret : bench("skew", "zipf-rebalance", &config,
+      BENCH_COLORS_ZIPF, producers, nb, BENCH_LOAD_FLOOD);
+  ret = ret ? ret : bench("skew", "hot-rebalance", &config,
+      BENCH_COLORS_HOT, producers, nb, BENCH_LOAD_FLOOD);
+
+  return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
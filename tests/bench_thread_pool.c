@@ -0,0 +1,163 @@
+/**
+ * \file bench_thread_pool.c
+ * \brief Benchmark of thread_pool.
+ *
+ * For each queue backend, the program measures the throughput of empty
+ * tasks versus the number of workers and versus the number of producers,
+ * then the push-to-run latency of tasks of uneven cost with flood, steady
+ * and burst loads. Results are printed as CSV (see bench_common.h).\n
+ * Usage: bench_thread_pool [workers] [producers] [tasks per producer]
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "thread_pool.h"
+#include "bench_common.h"
+
+/**
+ * \struct bench_target
+ * \brief Thread pool and task used by producers.
+ */
+struct bench_target
+{
+  thread_pool th; /**< Thread pool. */
+  void (*run)(void*); /**< Run function of the tasks. */
+};
+
+/**
+ * \brief Push a task to the thread pool.
+ * \param data target.
+ * \param producer producer number.
+ * \param i task number.
+ * \return 0 if success, -1 if the pool is full.
+ */
+static int bench_push(void* data, size_t producer, size_t i)
+{
+  struct bench_target* target = data;
+  struct thread_pool_task task;
+
+  (void)producer;
+  task.data = (void*)(uintptr_t)i;
+  task.run = target->run;
+  task.cleanup = bench_task_done;
+  return thread_pool_push(target->th, &task);
+}
+
+/**
+ * \brief Run the benchmark with one configuration.
+ * \param scenario name of the scenario.
+ * \param queue queue backend.
+ * \param workers number of workers.
+ * \param producers number of producer threads.
+ * \param nb number of tasks per producer.
+ * \param load load pattern.
+ * \param latency whether or not workers measure latencies.
+ * \return 0 if success, -1 otherwise.
+ */
+static int bench(const char* scenario, enum thread_pool_queue queue,
+    size_t workers, size_t producers, size_t nb, enum bench_load load,
+    int latency)
+{
+  const char* queues[] = {"list", "ring", "steal"};
+  struct thread_pool_config config;
+  struct bench_target target;
+  struct bench_result result;
+  char variant[64];
+
+  thread_pool_config_init(&config, workers);
+  config.queue = queue;
+  config.stats = latency;
+  target.th = thread_pool_new_config(&config);
+  target.run = latency ? bench_task_work : bench_task_empty;
+  if(!target.th)
+  {
+    fprintf(stderr, "Failed to create pool errno=%d\n", errno);
+    return -1;
+  }
+
+  snprintf(variant, sizeof(variant), "%s-%s", queues[queue],
+      bench_load_name(load));
+  result.suite = "thread_pool";
+  result.scenario = scenario;
+  result.variant = variant;
+  result.workers = workers;
+  result.producers = producers;
+  result.tasks = producers * nb;
+  result.latency = latency;
+
+  thread_pool_start(target.th);
+  if(bench_produce(bench_push, &target, producers, nb, load, &result) != 0)
+  {
+    thread_pool_free(&target.th);
+    return -1;
+  }
+
+  result.stats = thread_pool_stats(target.th);
+  bench_print(&result);
+
+  if(result.stats)
+  {
+    thread_stats_free(&result.stats);
+  }
+  thread_pool_stop(target.th);
+  thread_pool_free(&target.th);
+  return 0;
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+  const enum thread_pool_queue queues[] = {THREAD_POOL_QUEUE_LIST,
+    THREAD_POOL_QUEUE_RING, THREAD_POOL_QUEUE_STEAL};
+  const enum bench_load loads[] = {BENCH_LOAD_FLOOD, BENCH_LOAD_STEADY,
+    BENCH_LOAD_BURST};
+  size_t workers = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+  size_t producers = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+  size_t nb = argc > 3 ? strtoul(argv[3], NULL, 10) : 50000;
+  int ret = 0;
+
+  if(workers == 0 || producers == 0 || nb == 0)
+  {
+    fprintf(stderr, "Usage: %s [workers] [producers] [tasks]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  bench_print_header();
+
+  for(size_t q = 0 ; q < sizeof(queues) / sizeof(queues[0]) ; q++)
+  {
+    /* one producer, workers doubled up to the maximum */
+    for(size_t w = 1 ; w < workers * 2 && ret == 0 ; w *= 2)
+    {
+      ret = bench("throughput", queues[q], w < workers ? w : workers, 1,
+          nb * producers, BENCH_LOAD_FLOOD, 0);
+    }
+
+    /* all workers, producers doubled up to the maximum */
+    for(size_t p = 1 ; p < producers * 2 && ret == 0 ; p *= 2)
+    {
+      size_t n = p < producers ? p : producers;
+
+      ret = bench("producers", queues[q], workers, n, nb * producers / n,
+          BENCH_LOAD_FLOOD, 0);
+    }
+
+    for(size_t l = 0 ; l < sizeof(loads) / sizeof(loads[0]) && ret == 0 ;
+        l++)
+    {
+      ret = bench("latency", queues[q], workers, 2, nb / 2, loads[l], 1);
+    }
+  }
+
+  return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -9,10 +9,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
 
 #if !defined(_WIN32) && !defined(_WIN64)
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -49,6 +52,318 @@ static void signal_handler(int code)
   }
 }
 
+/**
+ * \brief Check event delivery of a method with a pair of sockets.
+ * \param method method to test.
+ * \return 0 if success, -1 otherwise.
+ */
+static int test_netevt_pair(enum netevt_method method)
+{
+  netevt nevt = NULL;
+  int fds[2];
+  struct netevt_event_ptr ptrs[4];
+  struct netevt_event evts[4];
+  int ret = -1;
+
+  if(!netevt_is_method_supported(method))
+  {
+    return 0;
+  }
+
+  nevt = netevt_new(method);
+  if(!nevt || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+  {
+    perror("netevt_new or socketpair");
+    if(nevt)
+    {
+      netevt_free(&nevt);
+    }
+    return -1;
+  }
+
+  if(netevt_add_socket(nevt, fds[0], NETEVT_STATE_READ, "first") == -1 ||
+      netevt_add_socket(nevt, fds[1], NETEVT_STATE_READ, "second") == -1 ||
+      send(fds[0], "x", 1, 0) != 1)
+  {
+    perror("netevt_add_socket or send");
+  }
+  /* only the second socket is readable */
+  else if(netevt_wait_ptr(nevt, 1, ptrs, 4) == 1 &&
+      ptrs[0].ptr->sock == fds[1] && ptrs[0].state == NETEVT_STATE_READ &&
+      strcmp(ptrs[0].ptr->data, "second") == 0 &&
+      netevt_wait(nevt, 1, evts, 4) == 1 && evts[0].socket.sock == fds[1] &&
+      evts[0].ptr == ptrs[0].ptr && evts[0].state == NETEVT_STATE_READ)
+  {
+    ret = 0;
+  }
+
+  fprintf(stdout, "Method %d: %s\n", method, ret == 0 ? "OK" : "failed");
+  netevt_free(&nevt);
+  close(fds[0]);
+  close(fds[1]);
+  return ret;
+}
+
+/**
+ * \brief Check that a method handles more sockets than FD_SETSIZE.
+ * \param method method to test.
+ * \return 0 if success, -1 otherwise.
+ */
+static int test_netevt_many(enum netevt_method method)
+{
+  const size_t nb_pairs = FD_SETSIZE + 100;
+  netevt nevt = NULL;
+  int* fds = NULL;
+  struct netevt_event_ptr* ptrs = NULL;
+  size_t nb = 0;
+  int ret = -1;
+  struct rlimit limit;
+
+  /* a descriptor above FD_SETSIZE is required */
+  if(!netevt_is_method_supported(method) ||
+      getrlimit(RLIMIT_NOFILE, &limit) == -1 ||
+      limit.rlim_max < nb_pairs * 2 + 16)
+  {
+    return 0;
+  }
+
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  nevt = netevt_new(method);
+  fds = malloc(sizeof(int) * nb_pairs * 2);
+  ptrs = malloc(sizeof(struct netevt_event_ptr) * nb_pairs);
+
+  while(nevt && fds && ptrs && nb < nb_pairs)
+  {
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[nb * 2]) == -1)
+    {
+      perror("socketpair");
+      break;
+    }
+
+    nb++;
+    if(netevt_add_socket(nevt, fds[nb * 2 - 1], NETEVT_STATE_READ,
+          &fds[nb * 2 - 1]) == -1)
+    {
+      perror("netevt_add_socket");
+      break;
+    }
+  }
+
+  /* first and last socket are readable */
+  if(nb == nb_pairs && netevt_get_nb_sockets(nevt) == nb_pairs &&
+      send(fds[0], "x", 1, 0) == 1 && send(fds[nb * 2 - 2], "x", 1, 0) == 1 &&
+      netevt_wait_ptr(nevt, 1, ptrs, nb_pairs) == 2 &&
+      ptrs[0].ptr->data != ptrs[1].ptr->data &&
+      (ptrs[0].ptr->sock == fds[nb * 2 - 1] ||
+       ptrs[1].ptr->sock == fds[nb * 2 - 1]))
+  {
+    ret = 0;
+  }
+
+  fprintf(stdout, "Method %d with %zu sockets: %s\n", method, nb,
+      ret == 0 ? "OK" : "failed");
+  if(nevt)
+  {
+    netevt_free(&nevt);
+  }
+  for(size_t i = 0 ; i < nb * 2 ; i++)
+  {
+    close(fds[i]);
+  }
+  free(fds);
+  free(ptrs);
+  return ret;
+}
+
+/**
+ * \brief Test removal in the middle of the sockets and lookup by descriptor.
+ * \param method netevt method to test.
+ * \return 0 if success, -1 otherwise.
+ */
+static int test_netevt_churn(enum netevt_method method)
+{
+  const size_t nb_pairs = 256;
+  netevt nevt = NULL;
+  int fds[nb_pairs * 2];
+  struct netevt_event_ptr ptrs[nb_pairs];
+  size_t nb = 0;
+  int ok = 1;
+  int ret = -1;
+
+  if(!netevt_is_method_supported(method))
+  {
+    return 0;
+  }
+
+  nevt = netevt_new(method);
+
+  while(nevt && nb < nb_pairs)
+  {
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[nb * 2]) == -1)
+    {
+      perror("socketpair");
+      break;
+    }
+
+    nb++;
+    if(netevt_add_socket(nevt, fds[nb * 2 - 1], NETEVT_STATE_READ,
+          &fds[nb * 2 - 1]) == -1)
+    {
+      perror("netevt_add_socket");
+      break;
+    }
+  }
+
+  ok = nevt && nb == nb_pairs;
+
+  /* same descriptor cannot be added twice */
+  if(ok && (netevt_add_socket(nevt, fds[1], NETEVT_STATE_READ, NULL) != -1 ||
+        errno != EEXIST))
+  {
+    ok = 0;
+  }
+
+  /* remove one socket out of two, from the middle of the array */
+  for(size_t i = 0 ; ok && i < nb ; i += 2)
+  {
+    if(netevt_remove_socket(nevt, fds[i * 2 + 1]) != 0 ||
+        netevt_get_socket(nevt, fds[i * 2 + 1]) != NULL)
+    {
+      ok = 0;
+    }
+  }
+
+  /* remaining sockets are found and reported with their data */
+  for(size_t i = 1 ; ok && i < nb ; i += 2)
+  {
+    struct netevt_socket* s = netevt_get_socket(nevt, fds[i * 2 + 1]);
+
+    if(!s || s->data != &fds[i * 2 + 1] || send(fds[i * 2], "x", 1, 0) != 1)
+    {
+      ok = 0;
+    }
+  }
+
+  if(ok && netevt_get_nb_sockets(nevt) == nb / 2 &&
+      netevt_wait_ptr(nevt, 1, ptrs, nb_pairs) == (int)(nb / 2))
+  {
+    ret = 0;
+    for(size_t i = 0 ; i < nb / 2 ; i++)
+    {
+      if(*(int*)ptrs[i].ptr->data != ptrs[i].ptr->sock)
+      {
+        ret = -1;
+      }
+    }
+  }
+
+  fprintf(stdout, "Method %d churn: %s\n", method,
+      ret == 0 ? "OK" : "failed");
+  if(nevt)
+  {
+    netevt_free(&nevt);
+  }
+  for(size_t i = 0 ; i < nb * 2 ; i++)
+  {
+    close(fds[i]);
+  }
+  return ret;
+}
+
+/**
+ * \brief Test one-shot and edge-triggered notifications.
+ * \param method netevt method to test.
+ * \return 0 if success, -1 otherwise.
+ */
+static int test_netevt_modes(enum netevt_method method)
+{
+  netevt nevt = NULL;
+  int fds[2] = {-1, -1};
+  struct netevt_event_ptr ptrs[2];
+  int ret = -1;
+
+  if(!netevt_is_method_supported(method))
+  {
+    return 0;
+  }
+
+  nevt = netevt_new(method);
+  if(!nevt || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+  {
+    perror("netevt_new/socketpair");
+  }
+  /* one-shot: notified once, then again only once rearmed */
+  else if(netevt_add_socket(nevt, fds[1],
+        NETEVT_STATE_READ | NETEVT_STATE_ONESHOT, NULL) == 0 &&
+      send(fds[0], "x", 1, 0) == 1 &&
+      netevt_wait_ptr(nevt, 1, ptrs, 2) == 1 &&
+      netevt_wait_ptr(nevt, 0, ptrs, 2) == 0 &&
+      netevt_set_socket(nevt, fds[1],
+        NETEVT_STATE_READ | NETEVT_STATE_ONESHOT) == 0 &&
+      netevt_wait_ptr(nevt, 1, ptrs, 2) == 1 &&
+      netevt_wait_ptr(nevt, 0, ptrs, 2) == 0)
+  {
+    ret = 0;
+  }
+
+  /* edge-triggered: pending data is not notified twice, poll and select are
+   * level-triggered
+   */
+  if(ret == 0 && (method == NETEVT_EPOLL || method == NETEVT_KQUEUE))
+  {
+    if(netevt_set_socket(nevt, fds[1],
+          NETEVT_STATE_READ | NETEVT_STATE_EDGE) != 0 ||
+        send(fds[0], "x", 1, 0) != 1 ||
+        netevt_wait_ptr(nevt, 1, ptrs, 2) != 1 ||
+        netevt_wait_ptr(nevt, 0, ptrs, 2) != 0 ||
+        send(fds[0], "x", 1, 0) != 1 ||
+        netevt_wait_ptr(nevt, 1, ptrs, 2) != 1)
+    {
+      ret = -1;
+    }
+  }
+
+  /* one-shot: a disabled socket stays silent when its peer hangs up */
+  if(ret == 0)
+  {
+    time_t start = 0;
+
+    if(netevt_set_socket(nevt, fds[1],
+          NETEVT_STATE_READ | NETEVT_STATE_ONESHOT) != 0 ||
+        netevt_wait_ptr(nevt, 1, ptrs, 2) != 1)
+    {
+      ret = -1;
+    }
+
+    close(fds[0]);
+    fds[0] = -1;
+    start = time(NULL);
+
+    if(ret == 0 && (netevt_wait_ptr(nevt, 2, ptrs, 2) != 0 ||
+          time(NULL) - start < 1))
+    {
+      ret = -1;
+    }
+  }
+
+  fprintf(stdout, "Method %d one-shot/edge: %s\n", method,
+      ret == 0 ? "OK" : "failed");
+  if(nevt)
+  {
+    netevt_free(&nevt);
+  }
+  for(unsigned int i = 0 ; i < 2 ; i++)
+  {
+    if(fds[i] != -1)
+    {
+      close(fds[i]);
+    }
+  }
+  return ret;
+}
+
 /**
  * \brief Entry point of the program.
  * \param argc number of arguments.
@@ -57,11 +372,45 @@ static void signal_handler(int code)
  */
 int main(int argc, char** argv)
 {
-  netevt nevt = netevt_new(NETEVT_AUTO);
+  enum netevt_method methods[] = {NETEVT_SELECT, NETEVT_POLL, NETEVT_EPOLL,
+    NETEVT_KQUEUE};
+  netevt nevt = NULL;
   int sock = -1;
+  int ret = 0;
 
-  (void)argc;
-  (void)argv;
+  fprintf(stdout, "Begin\n");
+
+  for(size_t i = 0 ; i < sizeof(methods) / sizeof(methods[0]) ; i++)
+  {
+    if(test_netevt_pair(methods[i]) != 0 ||
+        test_netevt_churn(methods[i]) != 0 ||
+        test_netevt_modes(methods[i]) != 0)
+    {
+      ret = -1;
+    }
+  }
+
+  /* select is limited to FD_SETSIZE descriptors */
+  if(test_netevt_many(NETEVT_POLL) != 0 ||
+      test_netevt_many(NETEVT_EPOLL) != 0)
+  {
+    ret = -1;
+  }
+
+  if(ret != 0)
+  {
+    fprintf(stderr, "Tests failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* interactive server, stopped with SIGINT or SIGTERM */
+  if(argc < 2 || strcmp(argv[1], "server") != 0)
+  {
+    fprintf(stdout, "End\n");
+    return EXIT_SUCCESS;
+  }
+
+  nevt = netevt_new(NETEVT_AUTO);
 
   if(signal(SIGINT, signal_handler) == SIG_ERR)
   {
@@ -73,14 +422,14 @@ int main(int argc, char** argv)
     fprintf(stderr, "Signal SIGTERM will not be catched\n");
   }
 
-  fprintf(stdout, "Begin\n");
   if(!nevt)
   {
     perror("netevt_new");
     exit(EXIT_FAILURE);
   }
 
-  sock = net_socket_create(AF_INET, NET_TCP, "127.0.0.1", 8022, 1, 1);
+  sock = net_socket_create(AF_INET, NET_TCP, "127.0.0.1", 8022, 1,
+      NET_REUSE_ADDR);
 
   if(sock == -1)
   {
@@ -111,24 +460,24 @@ int main(int argc, char** argv)
   {
     size_t nb_evt = 32;
     struct netevt_event evts[nb_evt];
-    int ret = -1;
+    int nb_ready = -1;
     ssize_t nb = 0;
     char buf[1500];
     unsigned int timeout = 2;
 
-    ret = netevt_wait(nevt, timeout, evts, nb_evt);
+    nb_ready = netevt_wait(nevt, timeout, evts, nb_evt);
 
-    if(ret == 0)
+    if(nb_ready == 0)
     {
       fprintf(stdout, "Timeout\n");
     }
-    else if(ret == -1)
+    else if(nb_ready == -1)
     {
       perror("Error");
     }
     else
     {
-      for(int i = 0 ; i < ret ; i++)
+      for(int i = 0 ; i < nb_ready ; i++)
       {
         if(evts[i].state & NETEVT_STATE_READ)
         {
@@ -0,0 +1,557 @@
+/**
+ * \file test_netevt_group.c
+ * \brief Tests for group of network event managers.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "netevt_group.h"
+#include "util_net.h"
+
+/**
+ * \def NB_SHARDS
+ * \brief Number of shards of the groups.
+ */
+#define NB_SHARDS 4
+
+/**
+ * \def NB_CLIENTS
+ * \brief Number of connections per test.
+ */
+#define NB_CLIENTS 16
+
+/**
+ * \brief Number of sockets given to the accept function of each shard.
+ */
+static atomic_uint accepted[NB_SHARDS];
+
+/**
+ * \brief Number of echoed messages.
+ */
+static atomic_uint echoed = 0;
+
+/**
+ * \brief Data of the sockets added by the accept function.
+ */
+static int client_tag = 0;
+
+/**
+ * \brief Accept function, monitors the new socket.
+ * \param nevt network event manager of the shard.
+ * \param shard index of the shard.
+ * \param sock socket descriptor.
+ * \param arg argument.
+ */
+static void fcn_accept(netevt nevt, size_t shard, int sock, void* arg)
+{
+  (void)arg;
+
+  atomic_fetch_add(&accepted[shard], 1);
+  if(netevt_add_socket(nevt, sock, NETEVT_STATE_READ, &client_tag) != 0)
+  {
+    close(sock);
+  }
+}
+
+/**
+ * \brief Event function, echoes what is received.
+ * \param nevt network event manager of the shard.
+ * \param shard index of the shard.
+ * \param sock notified socket.
+ * \param state notified states.
+ * \param arg argument.
+ */
+static void fcn_event(netevt nevt, size_t shard, struct netevt_socket* sock,
+    int state, void* arg)
+{
+  char buf[64];
+  ssize_t nb = 0;
+  int fd = sock->sock;
+
+  (void)shard;
+  (void)state;
+  (void)arg;
+
+  nb = recv(fd, buf, sizeof(buf), 0);
+  if(nb <= 0)
+  {
+    netevt_remove_socket(nevt, fd);
+    close(fd);
+    return;
+  }
+
+  if(send(fd, buf, (size_t)nb, 0) == nb)
+  {
+    atomic_fetch_add(&echoed, 1);
+  }
+}
+
+/**
+ * \brief Reset the counters.
+ */
+static void reset_counters(void)
+{
+  for(size_t i = 0 ; i < NB_SHARDS ; i++)
+  {
+    atomic_store(&accepted[i], 0);
+  }
+  atomic_store(&echoed, 0);
+}
+
+/**
+ * \brief Send a message on a socket and wait for its echo.
+ * \param sock socket descriptor.
+ * \return 0 if success, -1 otherwise.
+ */
+static int ping(int sock)
+{
+  struct timeval tv;
+  char buf[4];
+
+  tv.tv_sec = 2;
+  tv.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  if(send(sock, "ping", 4, 0) != 4 || recv(sock, buf, 4, MSG_WAITALL) != 4 ||
+      memcmp(buf, "ping", 4) != 0)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * \brief Connect clients one after the other and ping them.
+ * \param port port of the server on localhost.
+ * \return number of successful pings.
+ */
+static unsigned int run_clients(uint16_t port)
+{
+  struct sockaddr_in addr;
+  unsigned int ret = 0;
+
+  memset(&addr, 0x00, sizeof(struct sockaddr_in));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for(unsigned int i = 0 ; i < NB_CLIENTS ; i++)
+  {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(sock == -1)
+    {
+      continue;
+    }
+
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        ping(sock) == 0)
+    {
+      ret++;
+    }
+    close(sock);
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Close the sockets added by the accept function.
+ * \param group group of network event managers, it has to be stopped.
+ */
+static void close_clients(netevt_group group)
+{
+  for(size_t i = 0 ; i < netevt_group_size(group) ; i++)
+  {
+    netevt nevt = netevt_group_get(group, i);
+    struct list_head* pos = NULL;
+    struct list_head* tmp = NULL;
+
+    list_head_iterate_safe(netevt_get_sockets_list(nevt), pos, tmp)
+    {
+      struct netevt_socket* s = list_head_get(pos, struct netevt_socket,
+          list);
+      int fd = s->sock;
+
+      if(s->data == &client_tag)
+      {
+        netevt_remove_socket(nevt, fd);
+        close(fd);
+      }
+    }
+  }
+}
+
+/**
+ * \brief Test a listening socket shared by the shards.
+ * \param method netevt method to test.
+ * \param handler functions of shard threads.
+ * \return 0 if success, -1 otherwise.
+ */
+static int test_shared(enum netevt_method method,
+    const struct netevt_group_handler* handler)
+{
+  netevt_group group = netevt_group_new(method, NB_SHARDS);
+  struct sockaddr_in addr;
+  socklen_t addr_size = sizeof(addr);
+  unsigned int pings = 0;
+  int sock = -1;
+  int ret = 0;
+
+  if(!group)
+  {
+    fprintf(stderr, "Failed to create group errno=%d\n", errno);
+    return -1;
+  }
+
+  reset_counters();
+  sock = net_socket_create(NET_IPV4, NET_TCP, "127.0.0.1", 0, 0,
+      NET_REUSE_ADDR);
+  if(sock == -1 || listen(sock, NB_CLIENTS) == -1 ||
+      getsockname(sock, (struct sockaddr*)&addr, &addr_size) == -1 ||
+      netevt_group_listen(group, sock) != 0)
+  {
+    fprintf(stderr, "Failed to listen errno=%d\n", errno);
+    if(sock != -1)
+    {
+      close(sock);
+    }
+    netevt_group_free(&group);
+    return -1;
+  }
+
+  /* group owns the listening socket from now on */
+  if(netevt_group_start(group, handler, NULL) != 0)
+  {
+    fprintf(stderr, "Failed to start group errno=%d\n", errno);
+    netevt_group_free(&group);
+    return -1;
+  }
+
+  pings = run_clients(ntohs(addr.sin_port));
+  netevt_group_stop(group);
+
+  /* shard 0 accepts and hands off round-robin */
+  for(size_t i = 0 ; i < NB_SHARDS ; i++)
+  {
+    fprintf(stdout, "Shard %zu: %u connections\n", i,
+        atomic_load(&accepted[i]));
+    if(atomic_load(&accepted[i]) != NB_CLIENTS / NB_SHARDS)
+    {
+      ret = -1;
+    }
+  }
+
+  if(pings != NB_CLIENTS || atomic_load(&echoed) != NB_CLIENTS)
+  {
+    ret = -1;
+  }
+
+  fprintf(stdout, "Method %d shared listener: %s\n", method,
+      ret == 0 ? "OK" : "failed");
+  close_clients(group);
+  netevt_group_free(&group);
+  return ret;
+}
+
+/**
+ * \brief Test one SO_REUSEPORT listening socket per shard.
+ * \param method netevt method to test.
+ * \param handler functions of shard threads.
+ * \return 0 if success, -1 otherwise.
+ */
+static int test_reuseport(enum netevt_method method,
+    const struct netevt_group_handler* handler)
+{
+  netevt_group group = netevt_group_new(method, NB_SHARDS);
+  unsigned int pings = 0;
+  unsigned int total = 0;
+  int ret = 0;
+
+  if(!group)
+  {
+    fprintf(stderr, "Failed to create group errno=%d\n", errno);
+    return -1;
+  }
+
+  /* shards cannot share an ephemeral port */
+  if(netevt_group_listen_reuseport(group, NET_IPV4, "127.0.0.1", 0,
+        NB_CLIENTS) == 0 || errno != EINVAL)
+  {
+    fprintf(stderr, "Reuseport listen on port 0 not rejected\n");
+    netevt_group_free(&group);
+    return -1;
+  }
+
+  reset_counters();
+  if(netevt_group_listen_reuseport(group, NET_IPV4, "127.0.0.1", 8023,
+        NB_CLIENTS) != 0)
+  {
+    fprintf(stdout, "Method %d reuseport: %s\n", method,
+        errno == ENOSYS ? "not supported" : "failed");
+    netevt_group_free(&group);
+    return errno == ENOSYS ? 0 : -1;
+  }
+
+  if(netevt_group_start(group, handler, NULL) != 0)
+  {
+    fprintf(stderr, "Failed to start group errno=%d\n", errno);
+    netevt_group_free(&group);
+    return -1;
+  }
+
+  pings = run_clients(8023);
+  netevt_group_stop(group);
+
+  /* kernel balances connections by hash of the addresses */
+  for(size_t i = 0 ; i < NB_SHARDS ; i++)
+  {
+    fprintf(stdout, "Shard %zu: %u connections\n", i,
+        atomic_load(&accepted[i]));
+    total += atomic_load(&accepted[i]);
+  }
+
+  if(total != NB_CLIENTS || pings != NB_CLIENTS ||
+      atomic_load(&echoed) != NB_CLIENTS)
+  {
+    ret = -1;
+  }
+
+  fprintf(stdout, "Method %d reuseport: %s\n", method,
+      ret == 0 ? "OK" : "failed");
+  close_clients(group);
+  netevt_group_free(&group);
+  return ret;
+}
+
+/**
+ * \brief Test handoff of sockets from another thread.
+ * \param method netevt method to test.
+ * \param handler functions of shard threads.
+ * \return 0 if success, -1 otherwise.
+ */
+static int test_handoff(enum netevt_method method,
+    const struct netevt_group_handler* handler)
+{
+  netevt_group group = netevt_group_new(method, NB_SHARDS);
+  int fds[NB_CLIENTS][2];
+  size_t nb = 0;
+  int ret = 0;
+
+  if(!group)
+  {
+    fprintf(stderr, "Failed to create group errno=%d\n", errno);
+    return -1;
+  }
+
+  reset_counters();
+  if(netevt_group_start(group, handler, NULL) != 0)
+  {
+    fprintf(stderr, "Failed to start group errno=%d\n", errno);
+    netevt_group_free(&group);
+    return -1;
+  }
+
+  for(nb = 0 ; nb < NB_CLIENTS ; nb++)
+  {
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[nb]) == -1)
+    {
+      ret = -1;
+      break;
+    }
+
+    /* last one targets a given shard */
+    if(netevt_group_handoff(group,
+          nb == NB_CLIENTS - 1 ? 1 : NETEVT_GROUP_ANY, fds[nb][1]) == -1)
+    {
+      close(fds[nb][1]);
+      close(fds[nb][0]);
+      ret = -1;
+      break;
+    }
+  }
+
+  for(size_t i = 0 ; i < nb ; i++)
+  {
+    if(ping(fds[i][0]) != 0)
+    {
+      ret = -1;
+    }
+  }
+
+  netevt_group_stop(group);
+
+  if(nb != NB_CLIENTS || atomic_load(&accepted[1]) != NB_CLIENTS / NB_SHARDS
+      + 1 || netevt_group_handoff(group, NB_SHARDS, fds[0][0]) != -1)
+  {
+    ret = -1;
+  }
+
+  fprintf(stdout, "Method %d handoff: %s\n", method,
+      ret == 0 ? "OK" : "failed");
+  close_clients(group);
+  netevt_group_free(&group);
+  for(size_t i = 0 ; i < nb ; i++)
+  {
+    close(fds[i][0]);
+  }
+  return ret;
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+/**
+ * \brief Test that a shard drops connections when descriptors are lacking.
+ * \param method netevt method to test.
+ * \param handler functions of shard threads.
+ * \return 0 if success, -1 otherwise.
+ */
+static int test_descriptors(enum netevt_method method,
+    const struct netevt_group_handler* handler)
+{
+  netevt_group group = netevt_group_new(method, 1);
+  struct sockaddr_in addr;
+  socklen_t addr_size = sizeof(addr);
+  struct rlimit limit;
+  struct rlimit low;
+  int clients[NB_CLIENTS];
+  unsigned int dropped = 0;
+  int sock = -1;
+  int ret = 0;
+
+  if(!group)
+  {
+    fprintf(stderr, "Failed to create group errno=%d\n", errno);
+    return -1;
+  }
+
+  reset_counters();
+  sock = net_socket_create(NET_IPV4, NET_TCP, "127.0.0.1", 0, 0,
+      NET_REUSE_ADDR);
+  if(sock == -1 || listen(sock, NB_CLIENTS) == -1 ||
+      getsockname(sock, (struct sockaddr*)&addr, &addr_size) == -1 ||
+      netevt_group_listen(group, sock) != 0)
+  {
+    fprintf(stderr, "Failed to listen errno=%d\n", errno);
+    if(sock != -1)
+    {
+      close(sock);
+    }
+    netevt_group_free(&group);
+    return -1;
+  }
+
+  /* group owns the listening socket from now on */
+  if(netevt_group_start(group, handler, NULL) != 0)
+  {
+    fprintf(stderr, "Failed to start group errno=%d\n", errno);
+    netevt_group_free(&group);
+    return -1;
+  }
+
+  for(size_t i = 0 ; i < NB_CLIENTS ; i++)
+  {
+    clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+  }
+
+  /* no descriptor left for accept, connect does not need one */
+  sock = dup(0);
+  close(sock);
+  getrlimit(RLIMIT_NOFILE, &limit);
+  low = limit;
+  low.rlim_cur = (rlim_t)sock;
+  setrlimit(RLIMIT_NOFILE, &low);
+
+  for(size_t i = 0 ; i < NB_CLIENTS ; i++)
+  {
+    struct timeval tv;
+    char buf[4];
+
+    tv.tv_sec = 2;
+    tv.tv_usec = 0;
+    setsockopt(clients[i], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    /* shard has to close the connection instead of spinning on accept */
+    if(clients[i] != -1 &&
+        connect(clients[i], (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        (recv(clients[i], buf, sizeof(buf), 0) == 0 || errno == ECONNRESET))
+    {
+      dropped++;
+    }
+  }
+
+  setrlimit(RLIMIT_NOFILE, &limit);
+  netevt_group_stop(group);
+
+  for(size_t i = 0 ; i < NB_CLIENTS ; i++)
+  {
+    if(clients[i] != -1)
+    {
+      close(clients[i]);
+    }
+  }
+
+  if(dropped != NB_CLIENTS || atomic_load(&accepted[0]) != 0)
+  {
+    ret = -1;
+  }
+
+  fprintf(stdout, "Method %d no descriptors: %s\n", method,
+      ret == 0 ? "OK" : "failed");
+  close_clients(group);
+  netevt_group_free(&group);
+  return ret;
+}
+
+int main(int argc, char** argv)
+{
+  enum netevt_method methods[] = {NETEVT_POLL, NETEVT_EPOLL, NETEVT_KQUEUE};
+  struct netevt_group_handler handler;
+  int ret = EXIT_SUCCESS;
+
+  (void)argc;
+  (void)argv;
+
+  handler.accept = fcn_accept;
+  handler.event = fcn_event;
+  handler.arg = NULL;
+
+  fprintf(stdout, "Begin\n");
+
+  for(size_t i = 0 ; i < sizeof(methods) / sizeof(methods[0]) ; i++)
+  {
+    if(!netevt_is_method_supported(methods[i]))
+    {
+      continue;
+    }
+
+    if(test_shared(methods[i], &handler) != 0 ||
+        test_reuseport(methods[i], &handler) != 0 ||
+        test_handoff(methods[i], &handler) != 0 ||
+        test_descriptors(methods[i], &handler) != 0)
+    {
+      ret = EXIT_FAILURE;
+    }
+  }
+
+  fprintf(stdout, "End\n");
+  return ret;
+}
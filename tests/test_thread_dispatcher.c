@@ -30,6 +30,28 @@ static void fcn_cleanup(void* data)
   fprintf(stderr, "Task %p cleanup\n", data);
 }
 
+/**
+ * \brief Dispatcher of the tasks that yield.
+ */
+static thread_dispatcher yield_th = NULL;
+
+/**
+ * \brief Run function that runs in three slices.
+ * \param data pointer on the number of slices already run.
+ */
+static void fcn_slice(void* data)
+{
+  unsigned int* slices = data;
+
+  (*slices)++;
+  fprintf(stderr, "Task %p slice %u\n", data, *slices);
+
+  if(*slices < 3 && thread_dispatcher_yield(yield_th, NULL) != 0)
+  {
+    fprintf(stderr, "Failed to yield errno=%d\n", errno);
+  }
+}
+
 /**
  * \brief Entry point of the program.
  * \param argc number of arguments.
@@ -41,6 +63,10 @@ int main(int argc, char** argv)
   const size_t tasks_size = 20;
   thread_dispatcher th = NULL;
   struct thread_dispatcher_task tasks[tasks_size];
+  uint32_t colors[tasks_size];
+  struct thread_dispatcher_config config;
+  struct thread_stats* stats = NULL;
+  unsigned int slices[tasks_size];
 
   (void)argc;
   (void)argv;
@@ -71,12 +97,195 @@ int main(int argc, char** argv)
   thread_dispatcher_start(th);
   sleep(1);
 
+  /* same tasks again, one lock per worker */
+  for(unsigned int i = 0 ; i < tasks_size ; i++)
+  {
+    colors[i] = i;
+  }
+
+  if(thread_dispatcher_push_batch(th, tasks, colors, tasks_size) != 0)
+  {
+    fprintf(stderr, "Failed to add batch of tasks\n");
+  }
+  sleep(1);
+
+  fprintf(stdout, "Stop stuff\n");
+  thread_dispatcher_stop(th);
+  fprintf(stdout, "Free stuff\n");
+  thread_dispatcher_free(&th);
+  fprintf(stdout, "OK\n");
+
+  /* workers spread over NUMA nodes */
+  thread_dispatcher_config_init(&config, 4);
+  config.affinity.policy = THREAD_AFFINITY_NODES;
+  th = thread_dispatcher_new_config(&config);
+  fprintf(stdout, "Thread dispatcher (affinity): %p\n", (void*)th);
+
+  if(!th)
+  {
+    fprintf(stderr, "Failed to create dispatcher errno=%d\n",
+        errno);
+    exit(EXIT_FAILURE);
+  }
+
+  thread_dispatcher_start(th);
+
+  if(thread_dispatcher_push_batch(th, tasks, colors, tasks_size) != 0)
+  {
+    fprintf(stderr, "Failed to add batch of tasks\n");
+  }
+  sleep(1);
+
+  stats = thread_dispatcher_stats(th);
+  if(stats)
+  {
+    fprintf(stdout, "Tasks: %llu depth max: %llu wait p99: %llu ns\n",
+        (unsigned long long)stats->total.tasks,
+        (unsigned long long)stats->total.depth_max,
+        (unsigned long long)thread_stats_percentile(&stats->total.wait, 99));
+    thread_stats_free(&stats);
+  }
+
   fprintf(stdout, "Stop stuff\n");
   thread_dispatcher_stop(th);
   fprintf(stdout, "Free stuff\n");
   thread_dispatcher_free(&th);
   fprintf(stdout, "OK\n");
 
+  /* consistent hash mapping, idle colors move to less loaded workers */
+  thread_dispatcher_config_init(&config, 4);
+  config.map = thread_dispatcher_map_jump;
+  config.rebalance = 1;
+  th = thread_dispatcher_new_config(&config);
+  fprintf(stdout, "Thread dispatcher (rebalance): %p\n", (void*)th);
+
+  if(!th)
+  {
+    fprintf(stderr, "Failed to create dispatcher errno=%d\n",
+        errno);
+    exit(EXIT_FAILURE);
+  }
+
+  thread_dispatcher_start(th);
+
+  for(unsigned int i = 0 ; i < tasks_size ; i++)
+  {
+    /* colors sharing a stride with the number of workers */
+    colors[i] = (i % 5) * 4;
+  }
+
+  if(thread_dispatcher_push_batch(th, tasks, colors, tasks_size) != 0)
+  {
+    fprintf(stderr, "Failed to add batch of tasks\n");
+  }
+  sleep(1);
+
+  fprintf(stdout, "Stop stuff\n");
+  thread_dispatcher_stop(th);
+  fprintf(stdout, "Free stuff\n");
+  thread_dispatcher_free(&th);
+  fprintf(stdout, "OK\n");
+
+  /* tasks yield so that colors sharing a worker interleave, busy workers
+   * hand colors to idle ones after 1 ms
+   */
+  thread_dispatcher_config_init(&config, 4);
+  config.budget = 1000;
+  yield_th = thread_dispatcher_new_config(&config);
+  fprintf(stdout, "Thread dispatcher (yield): %p\n", (void*)yield_th);
+
+  if(!yield_th)
+  {
+    fprintf(stderr, "Failed to create dispatcher errno=%d\n",
+        errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if(thread_dispatcher_yield(yield_th, NULL) == 0)
+  {
+    fprintf(stderr, "Yield outside of a task should fail\n");
+  }
+
+  for(unsigned int i = 0 ; i < tasks_size ; i++)
+  {
+    slices[i] = 0;
+    tasks[i].data = &slices[i];
+    tasks[i].run = fcn_slice;
+    tasks[i].cleanup = fcn_cleanup;
+
+    /* all colors map to the first worker */
+    colors[i] = (i % 5) * 4;
+  }
+
+  if(thread_dispatcher_push_batch(yield_th, tasks, colors, tasks_size) != 0)
+  {
+    fprintf(stderr, "Failed to add batch of tasks\n");
+  }
+
+  thread_dispatcher_start(yield_th);
+  sleep(1);
+
+  fprintf(stdout, "Stop stuff\n");
+  thread_dispatcher_stop(yield_th);
+  fprintf(stdout, "Free stuff\n");
+  thread_dispatcher_free(&yield_th);
+
+  /* workers are joined */
+  for(unsigned int i = 0 ; i < tasks_size ; i++)
+  {
+    if(slices[i] != 3)
+    {
+      fprintf(stderr, "Task %u ran %u slices\n", i, slices[i]);
+    }
+  }
+  fprintf(stdout, "OK\n");
+
+  /* drain instead of sleeping before the shutdown */
+  th = thread_dispatcher_new(4);
+  fprintf(stdout, "Thread dispatcher (drain): %p\n", (void*)th);
+
+  if(!th)
+  {
+    fprintf(stderr, "Failed to create dispatcher errno=%d\n",
+        errno);
+    exit(EXIT_FAILURE);
+  }
+
+  for(unsigned int i = 0 ; i < tasks_size ; i++)
+  {
+    tasks[i].data = (void*)(uintptr_t)i;
+    tasks[i].run = fcn_run;
+    tasks[i].cleanup = fcn_cleanup;
+    colors[i] = i;
+  }
+
+  thread_dispatcher_start(th);
+
+  if(thread_dispatcher_push_batch(th, tasks, colors, tasks_size) != 0)
+  {
+    fprintf(stderr, "Failed to add batch of tasks\n");
+  }
+  fprintf(stdout, "Drain: %d remaining\n", thread_dispatcher_drain(th, -1));
+
+  if(thread_dispatcher_push(th, &tasks[0], 0) == 0 || errno != ESHUTDOWN)
+  {
+    fprintf(stderr, "Push should be refused while draining\n");
+  }
+
+  /* tasks of a stopped dispatcher are discarded with their cleanup called */
+  thread_dispatcher_start(th);
+  thread_dispatcher_stop(th);
+
+  if(thread_dispatcher_push_batch(th, tasks, colors, tasks_size) != 0)
+  {
+    fprintf(stderr, "Failed to add batch of tasks\n");
+  }
+  fprintf(stdout, "Drain: %d remaining\n", thread_dispatcher_drain(th, 0));
+
+  fprintf(stdout, "Free stuff\n");
+  thread_dispatcher_free(&th);
+  fprintf(stdout, "OK\n");
+
   fprintf(stdout, "End\n");
 
   return EXIT_SUCCESS;
@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sched.h>
 
 #include "thread_pool.h"
 
@@ -30,6 +31,61 @@ static void fcn_cleanup(void* data)
   fprintf(stderr, "Task %p cleanup\n", data);
 }
 
+/**
+ * \brief Continuation function.
+ * \param data user data.
+ */
+static void fcn_then(void* data)
+{
+  fprintf(stderr, "Task %p completed\n", data);
+}
+
+/**
+ * \brief Parallel loop body that squares indexes.
+ * \param first first index.
+ * \param last end of the chunk (excluded).
+ * \param ctx array of values.
+ */
+static void fcn_square(size_t first, size_t last, void* ctx)
+{
+  uint64_t* values = ctx;
+
+  for(size_t i = first ; i < last ; i++)
+  {
+    values[i] = (uint64_t)i * i;
+  }
+}
+
+/**
+ * \brief Parallel reduce body that sums values.
+ * \param first first index.
+ * \param last end of the chunk (excluded).
+ * \param ctx array of values.
+ * \param partial partial sum.
+ */
+static void fcn_sum(size_t first, size_t last, void* ctx, void* partial)
+{
+  const uint64_t* values = ctx;
+  uint64_t* sum = partial;
+
+  for(size_t i = first ; i < last ; i++)
+  {
+    *sum += values[i];
+  }
+}
+
+/**
+ * \brief Merge partial sums.
+ * \param result sum.
+ * \param partial partial sum.
+ * \param ctx unused.
+ */
+static void fcn_join(void* result, const void* partial, void* ctx)
+{
+  (void)ctx;
+  *(uint64_t*)result += *(const uint64_t*)partial;
+}
+
 /**
  * \brief Entry point of the program.
  * \param argc number of arguments.
@@ -41,6 +97,11 @@ int main(int argc, char** argv)
   const size_t tasks_size = 20;
   thread_pool th = NULL;
   struct thread_pool_task tasks[tasks_size];
+  struct thread_pool_config config;
+  thread_pool_future futures[tasks_size];
+  struct timespec timeout;
+  const unsigned int cpus[] = {0};
+  struct thread_stats* stats = NULL;
 
   (void)argc;
   (void)argv;
@@ -77,6 +138,341 @@ int main(int argc, char** argv)
   thread_pool_free(&th);
   fprintf(stdout, "OK\n");
 
+  /* queues too big to round up fail instead of hanging */
+  thread_pool_config_init(&config, 2);
+  config.queue = THREAD_POOL_QUEUE_RING;
+  config.ring_size = SIZE_MAX;
+  th = thread_pool_new_config(&config);
+  if(th)
+  {
+    fprintf(stderr, "Pool with oversized ring created\n");
+    exit(EXIT_FAILURE);
+  }
+
+  config.queue = THREAD_POOL_QUEUE_STEAL;
+  config.deque_size = SIZE_MAX;
+  th = thread_pool_new_config(&config);
+  if(th)
+  {
+    fprintf(stderr, "Pool with oversized deques created\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for(unsigned int q = 0 ; q < 3 ; q++)
+  {
+    const char* names[] = {"ring", "steal", "list batch"};
+
+    thread_pool_config_init(&config, 10);
+    config.queue = (q == 0) ? THREAD_POOL_QUEUE_RING :
+      (q == 1) ? THREAD_POOL_QUEUE_STEAL : THREAD_POOL_QUEUE_LIST;
+    config.ring_size = 16;
+    config.pop_batch = 8;
+    th = thread_pool_new_config(&config);
+    fprintf(stdout, "Thread pool (%s): %p\n", names[q], (void*)th);
+
+    if(!th)
+    {
+      fprintf(stderr, "Failed to create pool errno=%d\n",
+          errno);
+      exit(EXIT_FAILURE);
+    }
+
+    thread_pool_start(th);
+
+    if(q == 2)
+    {
+      if(thread_pool_push_batch(th, tasks, tasks_size) != (int)tasks_size)
+      {
+        fprintf(stderr, "Failed to add batch of tasks\n");
+      }
+    }
+
+    for(unsigned int i = 0 ; q < 2 && i < tasks_size ; i++)
+    {
+      /* steal mode: caller owns task storage, no copy is made */
+      while((q == 0 ? thread_pool_push(th, &tasks[i]) :
+            thread_pool_push_task(th, &tasks[i])) != 0)
+      {
+        /* ring full, let workers make progress */
+        sched_yield();
+      }
+    }
+
+    sleep(1);
+
+    fprintf(stdout, "Stop stuff\n");
+    thread_pool_stop(th);
+    fprintf(stdout, "Free stuff\n");
+    thread_pool_free(&th);
+    fprintf(stdout, "OK\n");
+  }
+
+  th = thread_pool_new(4);
+  fprintf(stdout, "Thread pool (future): %p\n", (void*)th);
+
+  if(!th)
+  {
+    fprintf(stderr, "Failed to create pool errno=%d\n",
+        errno);
+    exit(EXIT_FAILURE);
+  }
+
+  thread_pool_start(th);
+
+  for(unsigned int i = 0 ; i < tasks_size ; i++)
+  {
+    futures[i] = thread_pool_push_future(th, &tasks[i]);
+    if(!futures[i])
+    {
+      fprintf(stderr, "Failed to add task %u\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  thread_pool_future_then(futures[0], fcn_then, tasks[0].data);
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_sec += 5;
+
+  for(unsigned int i = 0 ; i < tasks_size ; i++)
+  {
+    int ret = (i % 2) ? thread_pool_future_wait(futures[i]) :
+      thread_pool_future_timedwait(futures[i], &timeout);
+
+    if(ret != 0 || thread_pool_future_poll(futures[i]) != 1)
+    {
+      fprintf(stderr, "Task %u not completed\n", i);
+    }
+    thread_pool_future_free(&futures[i]);
+  }
+
+  /* tasks discarded before being run are cancelled */
+  thread_pool_stop(th);
+  futures[0] = thread_pool_push_future(th, &tasks[0]);
+  thread_pool_clean(th);
+
+  if(!futures[0] || thread_pool_future_wait(futures[0]) != -1 ||
+      errno != ECANCELED)
+  {
+    fprintf(stderr, "Task not cancelled\n");
+  }
+  else
+  {
+    fprintf(stdout, "Task cancelled\n");
+    thread_pool_future_free(&futures[0]);
+  }
+
+  fprintf(stdout, "Free stuff\n");
+  thread_pool_free(&th);
+  fprintf(stdout, "OK\n");
+
+  /* elastic pool: 1 to 4 workers, extra ones exit after 100 ms idle */
+  thread_pool_config_init(&config, 1);
+  config.max_threads = 4;
+  config.spawn_depth = 2;
+  config.keepalive = 100;
+  th = thread_pool_new_config(&config);
+  fprintf(stdout, "Thread pool (elastic): %p\n", (void*)th);
+
+  if(!th)
+  {
+    fprintf(stderr, "Failed to create pool errno=%d\n",
+        errno);
+    exit(EXIT_FAILURE);
+  }
+
+  thread_pool_start(th);
+
+  for(unsigned int r = 0 ; r < 2 ; r++)
+  {
+    if(thread_pool_push_batch(th, tasks, tasks_size) != (int)tasks_size)
+    {
+      fprintf(stderr, "Failed to add batch of tasks\n");
+    }
+    sleep(1);
+  }
+
+  fprintf(stdout, "Stop stuff\n");
+  thread_pool_stop(th);
+  fprintf(stdout, "Free stuff\n");
+  thread_pool_free(&th);
+  fprintf(stdout, "OK\n");
+
+  /* one worker: 0 (expired deadline) and 1 first, then 3, 2 and 6, 5, 4 */
+  th = thread_pool_new(1);
+  fprintf(stdout, "Thread pool (priority): %p\n", (void*)th);
+
+  if(!th)
+  {
+    fprintf(stderr, "Failed to create pool errno=%d\n",
+        errno);
+    exit(EXIT_FAILURE);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &timeout);
+
+  for(unsigned int i = 7 ; i > 0 ; i--)
+  {
+    enum thread_pool_priority priority = (i > 4) ?
+      THREAD_POOL_PRIORITY_BACKGROUND : (i > 2) ? THREAD_POOL_PRIORITY_NORMAL :
+      THREAD_POOL_PRIORITY_HIGH;
+
+    if(thread_pool_push_priority(th, &tasks[i - 1], priority,
+          (i == 1) ? &timeout : NULL) != 0)
+    {
+      fprintf(stderr, "Failed to add task %u\n", i - 1);
+    }
+  }
+
+  thread_pool_start(th);
+  sleep(1);
+
+  fprintf(stdout, "Stop stuff\n");
+  thread_pool_stop(th);
+  fprintf(stdout, "Free stuff\n");
+  thread_pool_free(&th);
+  fprintf(stdout, "OK\n");
+
+  /* work-stealing workers pinned on CPU 0 */
+  thread_pool_config_init(&config, 2);
+  config.queue = THREAD_POOL_QUEUE_STEAL;
+  config.affinity.policy = THREAD_AFFINITY_CPUS;
+  config.affinity.cpus = cpus;
+  config.affinity.nb_cpus = 1;
+  th = thread_pool_new_config(&config);
+  fprintf(stdout, "Thread pool (affinity): %p\n", (void*)th);
+
+  if(!th)
+  {
+    fprintf(stderr, "Failed to create pool errno=%d\n",
+        errno);
+    exit(EXIT_FAILURE);
+  }
+
+  thread_pool_start(th);
+
+  if(thread_pool_push_batch(th, tasks, tasks_size) != (int)tasks_size)
+  {
+    fprintf(stderr, "Failed to add batch of tasks\n");
+  }
+  sleep(1);
+
+  stats = thread_pool_stats(th);
+  if(stats)
+  {
+    fprintf(stdout, "Tasks: %llu steals: %llu wait p99: %llu ns\n",
+        (unsigned long long)stats->total.tasks,
+        (unsigned long long)stats->total.steals,
+        (unsigned long long)thread_stats_percentile(&stats->total.wait, 99));
+    thread_stats_free(&stats);
+  }
+
+  fprintf(stdout, "Stop stuff\n");
+  thread_pool_stop(th);
+  fprintf(stdout, "Free stuff\n");
+  thread_pool_free(&th);
+  fprintf(stdout, "OK\n");
+
+  /* drain instead of sleeping before the shutdown */
+  th = thread_pool_new(4);
+  fprintf(stdout, "Thread pool (drain): %p\n", (void*)th);
+
+  if(!th)
+  {
+    fprintf(stderr, "Failed to create pool errno=%d\n",
+        errno);
+    exit(EXIT_FAILURE);
+  }
+
+  for(unsigned int i = 0 ; i < tasks_size ; i++)
+  {
+    tasks[i].data = (void*)(uintptr_t)i;
+    tasks[i].run = fcn_run;
+    tasks[i].cleanup = fcn_cleanup;
+  }
+
+  thread_pool_start(th);
+
+  if(thread_pool_push_batch(th, tasks, tasks_size) != (int)tasks_size)
+  {
+    fprintf(stderr, "Failed to add batch of tasks\n");
+  }
+  fprintf(stdout, "Drain: %d remaining\n", thread_pool_drain(th, -1));
+
+  if(thread_pool_push(th, &tasks[0]) == 0 || errno != ESHUTDOWN)
+  {
+    fprintf(stderr, "Push should be refused while draining\n");
+  }
+
+  /* tasks of a stopped pool are discarded with their cleanup called */
+  if(thread_pool_push_batch(th, tasks, tasks_size) == (int)tasks_size)
+  {
+    fprintf(stderr, "Batch should be refused while draining\n");
+  }
+  thread_pool_start(th);
+  thread_pool_stop(th);
+
+  if(thread_pool_push_batch(th, tasks, tasks_size) != (int)tasks_size)
+  {
+    fprintf(stderr, "Failed to add batch of tasks\n");
+  }
+  fprintf(stdout, "Drain: %d remaining\n", thread_pool_drain(th, 0));
+
+  fprintf(stdout, "Free stuff\n");
+  thread_pool_free(&th);
+  fprintf(stdout, "OK\n");
+
+  /* parallel for and reduce, the caller runs chunks too */
+  for(unsigned int q = 0 ; q < 3 ; q++)
+  {
+    const size_t values_size = 100000;
+    uint64_t* values = malloc(sizeof(uint64_t) * values_size);
+    uint64_t sum = 0;
+    uint64_t expected = 0;
+
+    thread_pool_config_init(&config, 4);
+    config.queue = (q == 0) ? THREAD_POOL_QUEUE_RING :
+      (q == 1) ? THREAD_POOL_QUEUE_STEAL : THREAD_POOL_QUEUE_LIST;
+    th = thread_pool_new_config(&config);
+
+    if(!th || !values)
+    {
+      fprintf(stderr, "Failed to create pool errno=%d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+
+    thread_pool_start(th);
+
+    if(thread_pool_parallel_for(th, 0, values_size, 64, fcn_square,
+          values) != 0)
+    {
+      fprintf(stderr, "Failed to run parallel for\n");
+    }
+
+    if(thread_pool_parallel_reduce(th, 0, values_size, 64, fcn_sum, fcn_join,
+          values, &sum, sizeof(uint64_t)) != 0)
+    {
+      fprintf(stderr, "Failed to run parallel reduce\n");
+    }
+
+    for(size_t i = 0 ; i < values_size ; i++)
+    {
+      expected += (uint64_t)i * i;
+    }
+    fprintf(stdout, "Parallel reduce: %s\n", sum == expected ? "ok" : "bad");
+
+    /* stopped pool: the caller runs the whole range */
+    thread_pool_stop(th);
+    sum = 0;
+    thread_pool_parallel_reduce(th, 0, values_size, 1000, fcn_sum, fcn_join,
+        values, &sum, sizeof(uint64_t));
+    fprintf(stdout, "Parallel reduce (stopped): %s\n",
+        sum == expected ? "ok" : "bad");
+
+    thread_pool_free(&th);
+    free(values);
+  }
+  fprintf(stdout, "OK\n");
+
   fprintf(stdout, "End\n");
 
   return EXIT_SUCCESS;
@@ -0,0 +1,280 @@
+/**
+ * \file test_timer_wheel.c
+ * \brief Tests for timer wheel.
+ * \author Sebastien Vincent
+ * \date 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "timer_wheel.h"
+
+/**
+ * \brief Number of expired timers.
+ */
+static atomic_uint fired = 0;
+
+/**
+ * \brief Number of cleanups.
+ */
+static atomic_uint cleaned = 0;
+
+/**
+ * \brief Number of periodic expirations.
+ */
+static atomic_uint periods = 0;
+
+/**
+ * \brief Get monotonic time.
+ * \return time in milliseconds.
+ */
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Run function.
+ * \param data user data.
+ */
+static void fcn_run(void* data)
+{
+  fprintf(stderr, "Timer %p expired\n", data);
+  atomic_fetch_add(&fired, 1);
+}
+
+/**
+ * \brief Run function that checks the expiration is not early.
+ * \param data expected time in milliseconds.
+ */
+static void fcn_deadline(void* data)
+{
+  if(now_ms() < (uint64_t)(uintptr_t)data)
+  {
+    fprintf(stderr, "Timer expired too early\n");
+  }
+  atomic_fetch_add(&fired, 1);
+}
+
+/**
+ * \brief Run function of periodic timer.
+ * \param data user data.
+ */
+static void fcn_periodic(void* data)
+{
+  (void)data;
+  atomic_fetch_add(&periods, 1);
+}
+
+/**
+ * \brief Cleanup function.
+ * \param data user data.
+ */
+static void fcn_cleanup(void* data)
+{
+  (void)data;
+  atomic_fetch_add(&cleaned, 1);
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+  const size_t timers_size = 20;
+  const size_t many_size = 1000000;
+  timer_wheel wheel = NULL;
+  struct timer_wheel_timer timers[timers_size];
+  struct timer_wheel_timer* many = NULL;
+  struct timer_wheel_timer periodic;
+  thread_pool th = NULL;
+  thread_dispatcher disp = NULL;
+  uint64_t start = 0;
+  uint64_t end = 0;
+
+  (void)argc;
+  (void)argv;
+
+  fprintf(stdout, "Begin\n");
+  wheel = timer_wheel_new();
+  fprintf(stdout, "Timer wheel: %p\n", (void*)wheel);
+
+  if(!wheel)
+  {
+    fprintf(stderr, "Failed to create timer wheel errno=%d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if(timer_wheel_start(wheel) != 0)
+  {
+    fprintf(stderr, "Failed to start timer wheel errno=%d\n", errno);
+  }
+
+  /* one-shot timers run by the timer thread, the last one is cancelled */
+  for(unsigned int i = 0 ; i < timers_size ; i++)
+  {
+    timer_wheel_timer_init(&timers[i], (void*)(uintptr_t)i, fcn_run,
+        fcn_cleanup);
+
+    if(timer_wheel_add(wheel, &timers[i], i * 37, 0) != 0)
+    {
+      fprintf(stderr, "Failed to add timer %u\n", i);
+    }
+  }
+
+  if(timer_wheel_add(wheel, &timers[timers_size - 1], 10, 0) == 0 ||
+      errno != EBUSY)
+  {
+    fprintf(stderr, "Timer should not be added twice\n");
+  }
+
+  if(timer_wheel_cancel(wheel, &timers[timers_size - 1]) != 0)
+  {
+    fprintf(stderr, "Failed to cancel timer\n");
+  }
+
+  /* periodic timer */
+  timer_wheel_timer_init(&periodic, NULL, fcn_periodic, NULL);
+  timer_wheel_add(wheel, &periodic, 100, 100);
+
+  sleep(1);
+  timer_wheel_cancel(wheel, &periodic);
+
+  fprintf(stdout, "Expired: %u, cleanup: %u, pending: %zu\n",
+      atomic_load(&fired), atomic_load(&cleaned), timer_wheel_size(wheel));
+  fprintf(stdout, "Periodic: %s\n", atomic_load(&periods) >= 8 ? "ok" : "late");
+
+  if(timer_wheel_cancel(wheel, &timers[0]) == 0 || errno != ENOENT)
+  {
+    fprintf(stderr, "Expired timer should not be cancelled\n");
+  }
+  fprintf(stdout, "OK\n");
+
+  /* timers fired into a pool and onto a dispatcher color */
+  atomic_store(&fired, 0);
+  atomic_store(&cleaned, 0);
+  th = thread_pool_new(2);
+  disp = thread_dispatcher_new(2);
+
+  if(!th || !disp)
+  {
+    fprintf(stderr, "Failed to create pool or dispatcher errno=%d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  thread_pool_start(th);
+  thread_dispatcher_start(disp);
+
+  for(unsigned int i = 0 ; i < timers_size ; i++)
+  {
+    timer_wheel_timer_init(&timers[i], (void*)(uintptr_t)i, fcn_run,
+        fcn_cleanup);
+
+    if(i % 2)
+    {
+      timers[i].pool = th;
+    }
+    else
+    {
+      timers[i].dispatcher = disp;
+      timers[i].color = i;
+    }
+    timer_wheel_add(wheel, &timers[i], 10 + i, 0);
+  }
+
+  sleep(1);
+  fprintf(stdout, "Stop stuff\n");
+  timer_wheel_stop(wheel);
+  thread_pool_stop(th);
+  thread_dispatcher_stop(disp);
+  fprintf(stdout, "Free stuff\n");
+  timer_wheel_free(&wheel);
+  thread_pool_free(&th);
+  thread_dispatcher_free(&disp);
+  fprintf(stdout, "Expired: %u, cleanup: %u\n", atomic_load(&fired),
+      atomic_load(&cleaned));
+  fprintf(stdout, "OK\n");
+
+  /* wheel driven by a loop as with netevt_wait() */
+  atomic_store(&fired, 0);
+  wheel = timer_wheel_new();
+
+  if(!wheel)
+  {
+    fprintf(stderr, "Failed to create timer wheel errno=%d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  start = now_ms();
+  for(unsigned int i = 0 ; i < timers_size ; i++)
+  {
+    unsigned int delay = (i * 7919) % 300;
+
+    timer_wheel_timer_init(&timers[i], (void*)(uintptr_t)(start + delay),
+        fcn_deadline, NULL);
+    timer_wheel_add(wheel, &timers[i], delay, 0);
+  }
+
+  while(timer_wheel_size(wheel) > 0)
+  {
+    int timeout = timer_wheel_timeout(wheel);
+    struct timespec ts;
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+    timer_wheel_expire(wheel);
+  }
+  end = now_ms();
+
+  fprintf(stdout, "Expired: %u, loop %s\n", atomic_load(&fired),
+      end - start < 400 ? "in time" : "late");
+  timer_wheel_free(&wheel);
+  fprintf(stdout, "OK\n");
+
+  /* lots of timers */
+  wheel = timer_wheel_new();
+  many = malloc(sizeof(struct timer_wheel_timer) * many_size);
+
+  if(!wheel || !many)
+  {
+    fprintf(stderr, "Failed to create timers errno=%d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  start = now_ms();
+  for(size_t i = 0 ; i < many_size ; i++)
+  {
+    timer_wheel_timer_init(&many[i], NULL, fcn_run, NULL);
+    timer_wheel_add(wheel, &many[i], 1000 + (unsigned int)(i * 2654435761U %
+          3600000), 0);
+  }
+
+  for(size_t i = 0 ; i < many_size ; i += 2)
+  {
+    timer_wheel_cancel(wheel, &many[i]);
+  }
+  end = now_ms();
+
+  fprintf(stdout, "Timers: %zu pending (%llu ms)\n", timer_wheel_size(wheel),
+      (unsigned long long)(end - start));
+  timer_wheel_free(&wheel);
+  free(many);
+  fprintf(stdout, "OK\n");
+
+  fprintf(stdout, "End\n");
+
+  return EXIT_SUCCESS;
+}